@@ -1,6 +1,9 @@
 #include "master.h"
 #include "mprobe.h"
 
+// MProbe依赖MasterMap,在这里注册
+REGISTER_MESSAGE(MProbe, MSG_PROBE);
+
 Master::Master(Messenger* msgr, MasterMap* mmap, uint32_t rank) : _msgr(msgr), _master_map(mmap), _rank(rank), _op_pool(30), _op_wq(&_op_pool)
 {
 
@@ -126,11 +129,15 @@ void Master::boot()
     
     DEBUG_LOG("probing other master");
     
+    std::vector<entity_inst_t> peers;
     for (uint32_t i = 0; i < _master_map->size(); i++)
     {
         if ((int)i != _rank)
         {
-            _msgr->send_message(new MProbe(MProbe::OP_PROBE, _rank, _has_ever_joined), _master_map->get_entity(i));
+            peers.push_back(_master_map->get_entity(i));
         }
     }
+
+    // 探测消息只编码一次,各master共享
+    _msgr->send_multicast(new MProbe(MProbe::OP_PROBE, _rank, _has_ever_joined), peers);
 }
\ No newline at end of file
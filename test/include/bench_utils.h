@@ -0,0 +1,42 @@
+#ifndef _BENCH_UTILS_H_
+#define _BENCH_UTILS_H_
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "msg_types.h"
+
+/**
+ * 在回环地址的随机端口上监听,监听地址写入addr
+ * 只监听不accept,由调用者决定是否accept及握手
+ *
+ */
+static inline int listen_peer(entity_addr_t& addr)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (0 > fd)
+    {
+        return -1;
+    }
+
+    sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (0 > ::bind(fd, (sockaddr*)&sin, sizeof(sin)) || 0 > ::listen(fd, 128))
+    {
+        ::close(fd);
+        return -1;
+    }
+
+    // 用sockaddr_storage接收地址,set_sockaddr按任一地址族拷贝都不会越界读
+    sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    ::getsockname(fd, (sockaddr*)&ss, &len);
+    addr.set_sockaddr((sockaddr*)&ss);
+
+    return fd;
+}
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+#include "time_utils.h"
+#include "mutex.h"
+#include "cond.h"
+#include "buffer.h"
+
+#define LOOP_NUM 200000
+// 每批交给释放线程的缓冲数
+#define BATCH 64
+
+// 与接收路径一致,缓冲在读线程申请,在转发线程释放
+class Handoff
+{
+public:
+    Handoff() : _done(false) {}
+
+    void put(std::vector<ptr>& batch)
+    {
+        Mutex::Locker locker(_lock);
+        _batches.push_back(std::vector<ptr>());
+        _batches.back().swap(batch);
+        _cond.signal();
+    }
+
+    void finish()
+    {
+        Mutex::Locker locker(_lock);
+        _done = true;
+        _cond.signal();
+    }
+
+    void release_loop()
+    {
+        Mutex::Locker locker(_lock);
+        while (true)
+        {
+            while (!_batches.empty())
+            {
+                std::vector<ptr> batch;
+                batch.swap(_batches.front());
+                _batches.pop_front();
+                _lock.unlock();
+                batch.clear();
+                _lock.lock();
+            }
+
+            if (_done)
+            {
+                break;
+            }
+
+            _cond.wait(_lock);
+        }
+    }
+
+private:
+    Mutex _lock;
+    Cond _cond;
+    bool _done;
+    std::list<std::vector<ptr> > _batches;
+};
+
+static double run(BufferPool* pool, uint32_t len, int n)
+{
+    Handoff handoff;
+    std::thread releaser(&Handoff::release_loop, &handoff);
+
+    utime_t start = clock_now();
+    std::vector<ptr> batch;
+    for (int i = 0; i < n; i++)
+    {
+        batch.push_back(ptr(pool ? pool->create(len) : create(len)));
+        batch.back().c_str()[0] = 1;
+        if (BATCH == batch.size())
+        {
+            handoff.put(batch);
+        }
+    }
+
+    handoff.put(batch);
+    handoff.finish();
+    releaser.join();
+
+    return (double)(clock_now() - start) * 1000000000 / n;
+}
+
+int main(int argc, char* argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : LOOP_NUM;
+
+    BufferPool* pool = new BufferPool();
+
+    uint32_t sizes[] = {256, 1024, 4096, 65536, 1 << 20};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        int loops = (sizes[i] >= (1 << 20)) ? n / 10 : n;
+        double direct = run(NULL, sizes[i], loops);
+        double pooled = run(pool, sizes[i], loops);
+        printf("%8u bytes  create %8.1f ns  pool %8.1f ns\n", sizes[i], direct, pooled);
+    }
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    pool->get_stats(hits, misses);
+    printf("pool hits %lu misses %lu\n", hits, misses);
+
+    pool->dec();
+
+    return 0;
+}
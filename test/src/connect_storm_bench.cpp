@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+#include <vector>
+#include "time_utils.h"
+#include "mutex.h"
+#include "cond.h"
+#include "message.h"
+#include "mping.h"
+#include "dispatcher.h"
+#include "simple_messenger.h"
+
+// 单轮测试的最长时间,单位秒
+#define RUN_TIMEOUT 60
+
+struct BenchConfig
+{
+    int clients;
+    int listeners;
+    int backlog;
+};
+
+// 收到PING后立即回复PONG
+class PingServer : public Dispatcher
+{
+public:
+    bool ms_dispatch(Message* m)
+    {
+        MPing* ping = static_cast<MPing*>(m);
+        if (MPing::OP_PING == ping->_op)
+        {
+            MPing* pong = new MPing(MPing::OP_PONG, ping->_seq, ping->_stamp);
+            ping->get_connection()->send_message(pong);
+        }
+
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+};
+
+// 记录从发出第一个PING到收到PONG的时间,包含建立连接的时间
+class PingClient : public Dispatcher
+{
+public:
+    PingClient(Mutex* done_lock, Cond* done_cond, int* done, std::vector<uint64_t>* latency)
+        : _done_lock(done_lock), _done_cond(done_cond), _done(done), _latency(latency)
+    {}
+
+    bool ms_dispatch(Message* m)
+    {
+        MPing* pong = static_cast<MPing*>(m);
+        uint64_t now = clock_now().to_nsec();
+
+        Mutex::Locker locker(*_done_lock);
+        _latency->push_back(now - pong->_stamp);
+        (*_done)++;
+        _done_cond->signal();
+
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+
+private:
+    Mutex* _done_lock;
+    Cond* _done_cond;
+    int* _done;
+    std::vector<uint64_t>* _latency;
+};
+
+static double percentile(const std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+
+    size_t i = (size_t)(p * (sorted.size() - 1));
+    return sorted[i] / 1000.0;
+}
+
+static void bench(const BenchConfig& cfg)
+{
+    PingServer server_dispatcher;
+    SimpleMessenger* server = new SimpleMessenger(entity_name_t::SVR(0), "storm_server");
+    server->set_default_policy(Messenger::Policy::stateless_server());
+    server->set_accept_threads(cfg.listeners);
+    server->set_listen_backlog(cfg.backlog);
+    if (server->bind(entity_addr_t("127.0.0.1:0")))
+    {
+        printf("server bind failed\n");
+        delete server;
+        return;
+    }
+
+    server->add_dispatcher_head(&server_dispatcher);
+    server->start();
+
+    entity_inst_t server_inst(server->get_entity_name(), server->get_entity_addr());
+
+    Mutex done_lock;
+    Cond done_cond;
+    int done = 0;
+    std::vector<uint64_t> latency;
+    latency.reserve(cfg.clients);
+
+    std::vector<SimpleMessenger*> clients;
+    std::vector<PingClient*> dispatchers;
+    for (int i = 0; i < cfg.clients; i++)
+    {
+        SimpleMessenger* client = new SimpleMessenger(entity_name_t::CLI(i + 1), "storm_client");
+        client->set_default_policy(Messenger::Policy::lossy_client());
+        // 服务端按地址区分连接,各客户端需要绑定不同的端口
+        if (client->bind(entity_addr_t("127.0.0.1:0")))
+        {
+            printf("client bind failed\n");
+            delete client;
+            break;
+        }
+
+        PingClient* dispatcher = new PingClient(&done_lock, &done_cond, &done, &latency);
+        client->add_dispatcher_head(dispatcher);
+        client->start();
+
+        clients.push_back(client);
+        dispatchers.push_back(dispatcher);
+    }
+
+    // 所有客户端同时发起连接
+    utime_t start = clock_now();
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        MPing* ping = new MPing(MPing::OP_PING, 0, clock_now().to_nsec());
+        clients[i]->send_message(ping, server_inst);
+    }
+
+    utime_t deadline = start + utime_t(RUN_TIMEOUT, 0);
+    bool ok = true;
+    done_lock.lock();
+    while (done < (int)clients.size())
+    {
+        if (clock_now() > deadline)
+        {
+            ok = false;
+            break;
+        }
+
+        done_cond.timed_wait(done_lock, 1000);
+    }
+
+    double elapsed = (double)(clock_now() - start);
+
+    if (ok)
+    {
+        std::sort(latency.begin(), latency.end());
+        printf("%7d %9d %7d  %10.1f %10.0f  %9.1f %9.1f %9.1f\n",
+               (int)clients.size(), cfg.listeners, cfg.backlog, elapsed * 1000, clients.size() / elapsed,
+               percentile(latency, 0.5), percentile(latency, 0.99), percentile(latency, 1));
+    }
+    else
+    {
+        printf("%7d %9d %7d  timeout, %d done\n", (int)clients.size(), cfg.listeners, cfg.backlog, done);
+    }
+
+    done_lock.unlock();
+    fflush(stdout);
+
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        clients[i]->shutdown();
+        clients[i]->wait();
+        delete clients[i];
+        delete dispatchers[i];
+    }
+
+    server->shutdown();
+    server->wait();
+    delete server;
+}
+
+static std::vector<int> parse_list(const char* arg)
+{
+    std::vector<int> v;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        v.push_back(atoi(item.c_str()));
+    }
+
+    return v;
+}
+
+static void usage(const char* name)
+{
+    printf("usage: %s [-c clients] [-l listeners] [-b backlogs]\n", name);
+    printf("  lists are comma separated, every combination is run\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<int> clients = parse_list("64,256");
+    std::vector<int> listeners = parse_list("1,4");
+    std::vector<int> backlogs(1, ACCEPTER_BACKLOG);
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "c:l:b:h")))
+    {
+        switch (opt)
+        {
+            case 'c': clients = parse_list(optarg); break;
+            case 'l': listeners = parse_list(optarg); break;
+            case 'b': backlogs = parse_list(optarg); break;
+            default: usage(argv[0]); return 0;
+        }
+    }
+
+    printf("%7s %9s %7s  %10s %10s  %9s %9s %9s\n",
+           "clients", "listeners", "backlog", "total(ms)", "conns/s", "p50(us)", "p99(us)", "max(us)");
+
+    for (size_t c = 0; c < clients.size(); c++)
+    {
+        for (size_t b = 0; b < backlogs.size(); b++)
+        {
+            for (size_t l = 0; l < listeners.size(); l++)
+            {
+                BenchConfig cfg;
+                cfg.clients = clients[c];
+                cfg.listeners = listeners[l];
+                cfg.backlog = backlogs[b];
+                bench(cfg);
+            }
+        }
+    }
+
+    return 0;
+}
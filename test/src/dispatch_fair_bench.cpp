@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+#include <vector>
+#include "time_utils.h"
+#include "mutex.h"
+#include "cond.h"
+#include "message.h"
+#include "mping.h"
+#include "dispatcher.h"
+#include "thread.h"
+#include "simple_messenger.h"
+
+// 轻载客户端的往返次数
+#define PING_NUM 500
+// 重载客户端每秒发送的消息数
+#define FLOOD_RATE 4000
+// 单轮测试的最长时间,单位秒
+#define RUN_TIMEOUT 120
+
+struct BenchConfig
+{
+    // 转发节流总配额,为0时不限制
+    uint64_t budget;
+    // 重载客户端的消息大小
+    uint32_t flood_size;
+    // 服务端处理一个重载消息的时间,单位微秒
+    int flood_cost;
+    // 重载客户端的权重
+    uint32_t flood_weight;
+    // 重载客户端每秒发送的消息数,超过服务端的处理能力
+    int flood_rate;
+    int pings;
+};
+
+// 重载消息模拟耗时处理,PING立即回复,同时记录各连接占用的转发配额
+class FairServer : public Dispatcher
+{
+public:
+    FairServer(const BenchConfig& cfg) : _cfg(cfg), _flood_max(0), _ping_max(0) {}
+
+    bool ms_dispatch(Message* m)
+    {
+        MPing* ping = static_cast<MPing*>(m);
+        int64_t used = ping->get_connection()->get_dispatch_throttle_used();
+        if (MPing::OP_PING == ping->_op)
+        {
+            _ping_max = std::max(_ping_max, used);
+            MPing* pong = new MPing(MPing::OP_PONG, ping->_seq, ping->_stamp);
+            ping->get_connection()->send_message(pong);
+        }
+        else
+        {
+            _flood_max = std::max(_flood_max, used);
+            usleep(_cfg.flood_cost);
+        }
+
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+
+    BenchConfig _cfg;
+    // 转发时观察到的最大占用
+    int64_t _flood_max;
+    int64_t _ping_max;
+};
+
+// 轻载客户端,每次只有一个PING在途
+class PingClient : public Dispatcher
+{
+public:
+    PingClient(Messenger* msgr, const entity_inst_t& server)
+        : _msgr(msgr), _server(server), _total(0), _received(0), _done(false)
+    {
+    }
+
+    void run(int total)
+    {
+        Mutex::Locker locker(_lock);
+        _total = total;
+        _received = 0;
+        _done = false;
+        _latency.clear();
+        send_ping(0);
+    }
+
+    bool ms_dispatch(Message* m)
+    {
+        MPing* pong = static_cast<MPing*>(m);
+        uint64_t now = clock_now().to_nsec();
+
+        Mutex::Locker locker(_lock);
+        _latency.push_back(now - pong->_stamp);
+        if (++_received < _total)
+        {
+            send_ping(_received);
+        }
+        else
+        {
+            _done = true;
+            _cond.signal();
+        }
+
+        m->dec();
+        return true;
+    }
+
+    bool wait()
+    {
+        utime_t deadline = clock_now() + utime_t(RUN_TIMEOUT, 0);
+        Mutex::Locker locker(_lock);
+        while (!_done)
+        {
+            if (clock_now() > deadline)
+            {
+                return false;
+            }
+
+            _cond.timed_wait(_lock, 1000);
+        }
+
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+
+    std::vector<uint64_t> _latency;
+
+private:
+    void send_ping(uint64_t seq)
+    {
+        _msgr->send_message(new MPing(MPing::OP_PING, seq, clock_now().to_nsec()), _server);
+    }
+
+    Messenger* _msgr;
+    entity_inst_t _server;
+    Mutex _lock;
+    Cond _cond;
+    int _total;
+    int _received;
+    bool _done;
+};
+
+// 按固定速率发送重载消息,直到停止
+class FloodThread : public Thread
+{
+public:
+    FloodThread(Messenger* msgr, const entity_inst_t& server, const BenchConfig& cfg)
+        : _msgr(msgr), _server(server), _interval(1000000 / std::max(cfg.flood_rate, 1)), _done(false)
+    {
+        _data.push_back(ptr(cfg.flood_size));
+        memset(_data.c_str(), 'f', cfg.flood_size);
+    }
+
+    void entry()
+    {
+        utime_t next = clock_now();
+        for (uint64_t seq = 0; !_done; seq++)
+        {
+            MPing* m = new MPing(MPing::OP_PONG, seq, 0);
+            m->set_data(_data);
+            _msgr->send_message(m, _server);
+
+            // 按累计时间补偿usleep的误差
+            next += utime_t(0, _interval * 1000);
+            utime_t now = clock_now();
+            if (next > now)
+            {
+                usleep((next - now).to_nsec() / 1000);
+            }
+        }
+    }
+
+    void finish()
+    {
+        _done = true;
+        join();
+    }
+
+private:
+    Messenger* _msgr;
+    entity_inst_t _server;
+    buffer _data;
+    // 发送间隔,单位微秒
+    int _interval;
+    volatile bool _done;
+};
+
+// 重载客户端只发送不接收
+class NullDispatcher : public Dispatcher
+{
+public:
+    bool ms_dispatch(Message* m)
+    {
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+};
+
+static double percentile(const std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+
+    size_t i = (size_t)(p * (sorted.size() - 1));
+    return sorted[i] / 1000.0;
+}
+
+static void bench(const BenchConfig& cfg)
+{
+    FairServer server_dispatcher(cfg);
+    SimpleMessenger* server = new SimpleMessenger(entity_name_t::SVR(0), "fair_server");
+    server->set_dispatch_throttle_bytes(cfg.budget);
+    server->set_default_policy(Messenger::Policy::stateless_server());
+    // 重载客户端以CLI(1)连接,使用单独的权重
+    Messenger::Policy flood_policy = Messenger::Policy::stateless_server();
+    flood_policy._dispatch_weight = cfg.flood_weight;
+    server->set_policy(entity_name_t::TYPE_CLIENT, flood_policy);
+    if (server->bind(entity_addr_t("127.0.0.1:0")))
+    {
+        printf("server bind failed\n");
+        delete server;
+        return;
+    }
+
+    server->add_dispatcher_head(&server_dispatcher);
+    server->start();
+
+    entity_inst_t server_inst(server->get_entity_name(), server->get_entity_addr());
+
+    NullDispatcher flood_dispatcher;
+    Messenger* flood = new SimpleMessenger(entity_name_t::CLI(1), "fair_flood");
+    flood->set_default_policy(Messenger::Policy::lossy_client());
+    flood->bind(entity_addr_t("127.0.0.1:0"));
+    flood->add_dispatcher_head(&flood_dispatcher);
+    flood->start();
+
+    Messenger* light = new SimpleMessenger(entity_name_t::SVR(1), "fair_light");
+    light->set_default_policy(Messenger::Policy::lossy_client());
+    light->bind(entity_addr_t("127.0.0.1:0"));
+    PingClient ping_client(light, server_inst);
+    light->add_dispatcher_head(&ping_client);
+    light->start();
+
+    // 建立连接
+    ping_client.run(1);
+    ping_client.wait();
+
+    // 重载客户端的发送速率超过服务端的处理能力,先发送一段时间使积压形成
+    FloodThread flood_thread(flood, server_inst, cfg);
+    flood_thread.create();
+    usleep(200000);
+
+    utime_t start = clock_now();
+    ping_client.run(cfg.pings);
+    bool ok = ping_client.wait();
+    double elapsed = (double)(clock_now() - start);
+
+    flood_thread.finish();
+
+    if (ok)
+    {
+        std::sort(ping_client._latency.begin(), ping_client._latency.end());
+        printf("%8lu %8u %6d %6u  %9.1f %9.1f %9.1f  %8.1f  %10ld %10ld\n",
+               (unsigned long)(cfg.budget >> 20), cfg.flood_size >> 10, cfg.flood_cost, cfg.flood_weight,
+               percentile(ping_client._latency, 0.5), percentile(ping_client._latency, 0.99),
+               percentile(ping_client._latency, 0.999), cfg.pings / elapsed,
+               (long)(server_dispatcher._flood_max >> 10), (long)server_dispatcher._ping_max);
+    }
+    else
+    {
+        printf("%8lu %8u %6d %6u  timeout\n", (unsigned long)(cfg.budget >> 20), cfg.flood_size >> 10,
+               cfg.flood_cost, cfg.flood_weight);
+    }
+
+    fflush(stdout);
+
+    flood->shutdown();
+    light->shutdown();
+    server->shutdown();
+    flood->wait();
+    light->wait();
+    server->wait();
+    delete flood;
+    delete light;
+    delete server;
+}
+
+static std::vector<int> parse_list(const char* arg)
+{
+    std::vector<int> v;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        v.push_back(atoi(item.c_str()));
+    }
+
+    return v;
+}
+
+static void usage(const char* name)
+{
+    printf("usage: %s [-b budgets(MB)] [-s flood sizes(KB)] [-c flood costs(us)] [-w flood weights] [-r flood rate] [-n pings]\n", name);
+    printf("  lists are comma separated, every combination is run, budget 0 means unlimited\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<int> budgets = parse_list("0,4");
+    std::vector<int> sizes = parse_list("64");
+    std::vector<int> costs = parse_list("500");
+    std::vector<int> weights = parse_list("1");
+    int rate = FLOOD_RATE;
+    int pings = PING_NUM;
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "b:s:c:w:r:n:h")))
+    {
+        switch (opt)
+        {
+            case 'b': budgets = parse_list(optarg); break;
+            case 's': sizes = parse_list(optarg); break;
+            case 'c': costs = parse_list(optarg); break;
+            case 'w': weights = parse_list(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 'n': pings = atoi(optarg); break;
+            default: usage(argv[0]); return 0;
+        }
+    }
+
+    printf("%8s %8s %6s %6s  %9s %9s %9s  %8s  %10s %10s\n",
+           "budget", "flood", "cost", "weight", "p50(us)", "p99(us)", "p999(us)", "pings/s",
+           "flood(KB)", "ping(B)");
+
+    for (size_t b = 0; b < budgets.size(); b++)
+    {
+        for (size_t s = 0; s < sizes.size(); s++)
+        {
+            for (size_t c = 0; c < costs.size(); c++)
+            {
+                for (size_t w = 0; w < weights.size(); w++)
+                {
+                    BenchConfig cfg;
+                    cfg.budget = (uint64_t)budgets[b] << 20;
+                    cfg.flood_size = sizes[s] << 10;
+                    cfg.flood_cost = costs[c];
+                    cfg.flood_weight = weights[w];
+                    cfg.flood_rate = rate;
+                    cfg.pings = pings;
+                    bench(cfg);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <set>
+#include <map>
+#include <vector>
+#include "time_utils.h"
+#include "message.h"
+#include "message_queue.h"
+#include "simple_messenger.h"
+#include "dispatch_queue.h"
+
+#define MSG_NUM 1000000
+#define CONN_NUM 64
+
+class MBench : public Message
+{
+public:
+    MBench() : Message(0xffff) {}
+
+    void encode_payload() {}
+    void decode_payload() {}
+    const char* get_type_name() const { return "bench"; }
+};
+
+// 原先的到达时间记录方式,每个消息两次树插入两次树删除
+class LegacyArrival
+{
+public:
+    void add(Message* m)
+    {
+        _map.insert(std::make_pair(m, _set.insert(std::make_pair(m->get_recv_stamp(), m)).first));
+    }
+
+    void remove(Message* m)
+    {
+        std::map<Message*, std::set<std::pair<double, Message*> >::iterator>::iterator i = _map.find(m);
+        _set.erase(i->second);
+        _map.erase(i);
+    }
+
+    double oldest() const { return _set.begin()->first; }
+
+private:
+    std::set<std::pair<double, Message*> > _set;
+    std::map<Message*, std::set<std::pair<double, Message*> >::iterator> _map;
+};
+
+// 防止查询最早到达时间被编译器优化掉
+static volatile double oldest_sink = 0;
+
+static double ns_per_op(const utime_t& start, int n)
+{
+    return (double)(clock_now() - start) * 1000000000 / n;
+}
+
+static void bench_legacy(std::vector<Message*>& msgs)
+{
+    LegacyArrival arrival;
+    int n = msgs.size();
+
+    utime_t start = clock_now();
+    for (int i = 0; i < n; i++)
+    {
+        arrival.add(msgs[i]);
+    }
+    double add = ns_per_op(start, n);
+
+    start = clock_now();
+    for (int i = 0; i < n; i++)
+    {
+        oldest_sink = arrival.oldest();
+        arrival.remove(msgs[i]);
+    }
+    double remove = ns_per_op(start, n);
+
+    printf("legacy set/map  enqueue %8.1f ns  dequeue %8.1f ns  (%d msgs)\n", add, remove, n);
+}
+
+static void bench_intrusive(std::vector<Message*>& msgs)
+{
+    ArrivalList arrival;
+    int n = msgs.size();
+
+    utime_t start = clock_now();
+    for (int i = 0; i < n; i++)
+    {
+        arrival.push_back(msgs[i]);
+    }
+    double add = ns_per_op(start, n);
+
+    start = clock_now();
+    for (int i = 0; i < n; i++)
+    {
+        oldest_sink = arrival.front()->get_recv_stamp();
+        arrival.remove(msgs[i]);
+    }
+    double remove = ns_per_op(start, n);
+
+    printf("intrusive list  enqueue %8.1f ns  dequeue %8.1f ns  (%d msgs)\n", add, remove, n);
+}
+
+// 通过DispatchQueue完整的入队与按连接丢弃路径,不启动转发线程
+static void bench_dispatch_queue(std::vector<Message*>& msgs)
+{
+    std::string name("bench");
+    SimpleMessenger msgr(entity_name_t::MASTER(1), name);
+    DispatchQueue dq(&msgr, name);
+    int n = msgs.size();
+
+    utime_t start = clock_now();
+    for (int i = 0; i < n; i++)
+    {
+        msgs[i]->get();
+        dq.enqueue(msgs[i], MSG_PRIO_DEFAULT, i % CONN_NUM + 1);
+    }
+    double add = ns_per_op(start, n);
+
+    start = clock_now();
+    double age = dq.get_max_age(clock_now());
+    for (int i = 0; i < CONN_NUM; i++)
+    {
+        dq.discard_queue(i + 1);
+    }
+    double remove = ns_per_op(start, n);
+
+    printf("DispatchQueue   enqueue %8.1f ns  discard %8.1f ns  (%d msgs, max age %f s)\n", add, remove, n, age);
+}
+
+int main(int argc, char* argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : MSG_NUM;
+
+    std::vector<Message*> msgs;
+    msgs.reserve(n);
+    for (int i = 0; i < n; i++)
+    {
+        Message* m = new MBench();
+        m->set_recv_stamp(clock_now());
+        msgs.push_back(m);
+    }
+
+    bench_legacy(msgs);
+    bench_intrusive(msgs);
+    bench_dispatch_queue(msgs);
+
+    for (int i = 0; i < n; i++)
+    {
+        msgs[i]->dec();
+    }
+
+    return 0;
+}
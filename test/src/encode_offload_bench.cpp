@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "time_utils.h"
+#include "mutex.h"
+#include "cond.h"
+#include "message.h"
+#include "mping.h"
+#include "dispatcher.h"
+#include "simple_messenger.h"
+
+#define MSG_NUM 20000
+#define SEND_THREADS 2
+// 所有发送线程共享的在途消息数上限
+#define WINDOW 64
+// 单轮测试的最长时间,单位秒
+#define RUN_TIMEOUT 120
+
+struct BenchConfig
+{
+    bool encode_on_submit;
+    uint32_t size;
+    int threads;
+    int msgs;
+};
+
+// 运行在子进程中,每收到一个PING回复一个不带数据的PONG
+class PongServer : public Dispatcher
+{
+public:
+    bool ms_dispatch(Message* m)
+    {
+        MPing* ping = static_cast<MPing*>(m);
+        ping->get_connection()->send_message(new MPing(MPing::OP_PONG, ping->_seq, 0));
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+};
+
+// 发送线程按窗口限制在途消息数,收到PONG后释放
+class WindowClient : public Dispatcher
+{
+public:
+    WindowClient() : _sent(0), _received(0) {}
+
+    // 获取一个发送配额,超时返回false
+    bool acquire()
+    {
+        utime_t deadline = clock_now() + utime_t(RUN_TIMEOUT, 0);
+        Mutex::Locker locker(_lock);
+        while (_sent - _received >= WINDOW)
+        {
+            if (clock_now() > deadline)
+            {
+                return false;
+            }
+
+            _cond.timed_wait(_lock, 1000);
+        }
+
+        _sent++;
+        return true;
+    }
+
+    bool wait(int total)
+    {
+        utime_t deadline = clock_now() + utime_t(RUN_TIMEOUT, 0);
+        Mutex::Locker locker(_lock);
+        while (_received < total)
+        {
+            if (clock_now() > deadline)
+            {
+                return false;
+            }
+
+            _cond.timed_wait(_lock, 1000);
+        }
+
+        return true;
+    }
+
+    bool ms_dispatch(Message* m)
+    {
+        Mutex::Locker locker(_lock);
+        _received++;
+        _cond.broadcast();
+
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+
+private:
+    Mutex _lock;
+    Cond _cond;
+    int _sent;
+    int _received;
+};
+
+static double cpu_now(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 子进程中启动服务端,把地址写入管道后一直运行到被杀死
+static pid_t fork_server(entity_addr_t* addr)
+{
+    int fds[2];
+    if (pipe(fds))
+    {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (0 == pid)
+    {
+        close(fds[0]);
+
+        PongServer dispatcher;
+        SimpleMessenger* server = new SimpleMessenger(entity_name_t::SVR(0), "offload_server");
+        server->set_default_policy(Messenger::Policy::stateless_server());
+        if (server->bind(entity_addr_t("127.0.0.1:0")))
+        {
+            _exit(1);
+        }
+
+        server->add_dispatcher_head(&dispatcher);
+        server->start();
+
+        entity_addr_t a = server->get_entity_addr();
+        if (sizeof(a) != write(fds[1], &a, sizeof(a)))
+        {
+            _exit(1);
+        }
+
+        while (true)
+        {
+            pause();
+        }
+    }
+
+    close(fds[1]);
+    bool ok = (0 < pid && sizeof(*addr) == read(fds[0], addr, sizeof(*addr)));
+    close(fds[0]);
+
+    if (!ok && 0 < pid)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+
+    return ok ? pid : -1;
+}
+
+// 每个消息使用新的数据缓冲,crc不会命中缓存
+static void send_func(Messenger* msgr, WindowClient* client, const entity_inst_t* server, const BenchConfig* cfg,
+                      int num, double* submit_cpu, double* thread_cpu)
+{
+    double start = cpu_now(CLOCK_THREAD_CPUTIME_ID);
+    double submit = 0;
+
+    for (int i = 0; i < num; i++)
+    {
+        if (!client->acquire())
+        {
+            break;
+        }
+
+        MPing* m = new MPing(MPing::OP_PING, i, 0);
+        if (cfg->size)
+        {
+            buffer data;
+            data.push_back(ptr(cfg->size));
+            memset(data.c_str(), i, cfg->size);
+            m->set_data(data);
+        }
+
+        double t = cpu_now(CLOCK_THREAD_CPUTIME_ID);
+        msgr->send_message(m, *server);
+        submit += cpu_now(CLOCK_THREAD_CPUTIME_ID) - t;
+    }
+
+    *submit_cpu = submit;
+    *thread_cpu = cpu_now(CLOCK_THREAD_CPUTIME_ID) - start;
+}
+
+static void bench(const BenchConfig& cfg)
+{
+    entity_inst_t server;
+    server._name = entity_name_t::SVR(0);
+    pid_t pid = fork_server(&server._addr);
+    if (0 > pid)
+    {
+        printf("start server failed\n");
+        return;
+    }
+
+    WindowClient dispatcher;
+    SimpleMessenger* client = new SimpleMessenger(entity_name_t::CLI(0), "offload_client");
+    client->set_default_policy(Messenger::Policy::lossless_client());
+    client->set_encode_on_submit(cfg.encode_on_submit);
+    client->bind(entity_addr_t("127.0.0.1:0"));
+    client->add_dispatcher_head(&dispatcher);
+    client->start();
+
+    int per_thread = cfg.msgs / cfg.threads;
+    int total = per_thread * cfg.threads;
+    std::vector<double> submit_cpu(cfg.threads, 0);
+    std::vector<double> thread_cpu(cfg.threads, 0);
+
+    utime_t start = clock_now();
+    double cpu_start = cpu_now(CLOCK_PROCESS_CPUTIME_ID);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < cfg.threads; i++)
+    {
+        threads.push_back(std::thread(send_func, client, &dispatcher, &server, &cfg, per_thread, &submit_cpu[i], &thread_cpu[i]));
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    bool ok = dispatcher.wait(total);
+    double elapsed = (double)(clock_now() - start);
+    double cpu = cpu_now(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+
+    double submit = 0;
+    double senders = 0;
+    for (int i = 0; i < cfg.threads; i++)
+    {
+        submit += submit_cpu[i];
+        senders += thread_cpu[i];
+    }
+
+    if (ok)
+    {
+        printf("%6s %8u %7d  %10.0f %8.1f  %10.2f %10.2f\n", cfg.encode_on_submit ? "submit" : "writer", cfg.size,
+               cfg.threads, total / elapsed, (double)total * cfg.size / elapsed / (1 << 20),
+               submit * 1e6 / total, (cpu - senders) * 1e6 / total);
+    }
+    else
+    {
+        printf("%6s %8u %7d  timeout\n", cfg.encode_on_submit ? "submit" : "writer", cfg.size, cfg.threads);
+    }
+
+    fflush(stdout);
+
+    client->shutdown();
+    client->wait();
+    delete client;
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+static std::vector<int> parse_list(const char* arg)
+{
+    std::vector<int> v;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        v.push_back(atoi(item.c_str()));
+    }
+
+    return v;
+}
+
+static void usage(const char* name)
+{
+    printf("usage: %s [-s sizes] [-t send threads] [-n msgs]\n", name);
+    printf("  lists are comma separated, every combination is run with encoding in the writer and in send_message\n");
+    printf("  submit: cpu inside send_message per msg, other: client cpu outside the send threads (writer, reader) per msg\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<int> sizes = parse_list("0,4096,65536");
+    std::vector<int> threads(1, SEND_THREADS);
+    int msgs = MSG_NUM;
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "s:t:n:h")))
+    {
+        switch (opt)
+        {
+            case 's': sizes = parse_list(optarg); break;
+            case 't': threads = parse_list(optarg); break;
+            case 'n': msgs = atoi(optarg); break;
+            default: usage(argv[0]); return 0;
+        }
+    }
+
+    printf("%6s %8s %7s  %10s %8s  %10s %10s\n", "encode", "size", "threads", "msgs/s", "MB/s", "submit(us)", "other(us)");
+
+    for (size_t s = 0; s < sizes.size(); s++)
+    {
+        for (size_t t = 0; t < threads.size(); t++)
+        {
+            for (int on = 0; on < 2; on++)
+            {
+                BenchConfig cfg;
+                cfg.encode_on_submit = on;
+                cfg.size = sizes[s];
+                cfg.threads = threads[t];
+                cfg.msgs = msgs;
+                bench(cfg);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <vector>
+#include "time_utils.h"
+#include "mutex.h"
+#include "cond.h"
+#include "message.h"
+#include "mping.h"
+#include "dispatcher.h"
+#include "simple_messenger.h"
+
+#define MSG_NUM 40000
+// 单轮测试的最长时间,单位秒
+#define RUN_TIMEOUT 120
+
+struct BenchConfig
+{
+    // 服务端快速转发线程数,为0时在读线程中直接转发
+    int threads;
+    int conns;
+    int window;
+    // 服务端处理一个PING的时间,单位微秒
+    int cost;
+    // 服务端对客户端消息的延迟投递时间,单位毫秒,为0时不经过延迟投递线程
+    int delay;
+    int msgs;
+};
+
+// 所有PING都走快速转发,检查每个连接内的顺序
+class FastServer : public Dispatcher
+{
+public:
+    explicit FastServer(int cost) : _cost(cost), _misordered(0), _running(0), _max_running(0) {}
+
+    bool ms_can_fast_dispatch_any() const { return true; }
+
+    bool ms_can_fast_dispatch(const Message* m) const { return MSG_PING == m->get_type(); }
+
+    void ms_fast_dispatch(Message* m)
+    {
+        MPing* ping = static_cast<MPing*>(m);
+        Connection* con = ping->get_connection();
+
+        {
+            Mutex::Locker locker(_lock);
+            std::map<Connection*, uint64_t>::iterator iter = _next_seq.find(con);
+            if (iter != _next_seq.end() && ping->_seq != iter->second)
+            {
+                _misordered++;
+            }
+
+            _next_seq[con] = ping->_seq + 1;
+        }
+
+        // 记录同时运行的处理函数数,确认快速转发线程并行处理不同连接
+        int running = __atomic_add_fetch(&_running, 1, __ATOMIC_RELAXED);
+        int max = __atomic_load_n(&_max_running, __ATOMIC_RELAXED);
+        while (running > max && !__atomic_compare_exchange_n(&_max_running, &max, running, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+        }
+
+        if (_cost)
+        {
+            usleep(_cost);
+        }
+
+        __atomic_sub_fetch(&_running, 1, __ATOMIC_RELAXED);
+
+        con->send_message(new MPing(MPing::OP_PONG, ping->_seq, ping->_stamp));
+        m->dec();
+    }
+
+    bool ms_dispatch(Message* m)
+    {
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+
+    uint64_t get_misordered()
+    {
+        Mutex::Locker locker(_lock);
+        return _misordered;
+    }
+
+    int get_max_running() const { return __atomic_load_n(&_max_running, __ATOMIC_RELAXED); }
+
+private:
+    int _cost;
+    Mutex _lock;
+    // 每个连接下一个PING的序号
+    std::map<Connection*, uint64_t> _next_seq;
+    uint64_t _misordered;
+    int _running;
+    int _max_running;
+};
+
+// 保持window个PING在途,每收到一个PONG记录往返时间并补发一个
+class PingClient : public Dispatcher
+{
+public:
+    PingClient(Messenger* msgr, const entity_inst_t& server, const BenchConfig& cfg, Mutex* done_lock, Cond* done_cond, int* done)
+        : _msgr(msgr), _server(server), _cfg(cfg), _total(0), _sent(0), _received(0), _seq(0),
+          _done_lock(done_lock), _done_cond(done_cond), _done(done)
+    {
+    }
+
+    void run(int total)
+    {
+        Mutex::Locker locker(_lock);
+        _total = total;
+        _sent = 0;
+        _received = 0;
+        _latency.clear();
+        _latency.reserve(total);
+
+        while (_sent < _total && _sent < _cfg.window)
+        {
+            send_ping();
+        }
+    }
+
+    bool ms_dispatch(Message* m)
+    {
+        MPing* pong = static_cast<MPing*>(m);
+        uint64_t now = clock_now().to_nsec();
+
+        Mutex::Locker locker(_lock);
+        _latency.push_back(now - pong->_stamp);
+        _received++;
+
+        if (_sent < _total)
+        {
+            send_ping();
+        }
+
+        if (_received == _total)
+        {
+            Mutex::Locker done_locker(*_done_lock);
+            (*_done)++;
+            _done_cond->signal();
+        }
+
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+
+    const std::vector<uint64_t>& latency() const { return _latency; }
+
+private:
+    void send_ping()
+    {
+        // 序号在连接内连续,服务端据此检查顺序
+        _msgr->send_message(new MPing(MPing::OP_PING, _seq++, clock_now().to_nsec()), _server);
+        _sent++;
+    }
+
+    Messenger* _msgr;
+    entity_inst_t _server;
+    BenchConfig _cfg;
+
+    Mutex _lock;
+    int _total;
+    int _sent;
+    int _received;
+    uint64_t _seq;
+    std::vector<uint64_t> _latency;
+
+    Mutex* _done_lock;
+    Cond* _done_cond;
+    int* _done;
+};
+
+static double percentile(const std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+
+    size_t i = (size_t)(p * (sorted.size() - 1));
+    return sorted[i] / 1000.0;
+}
+
+// 等待所有客户端完成,超时返回false
+static bool wait_done(Mutex& lock, Cond& cond, int& done, int conns)
+{
+    utime_t deadline = clock_now() + utime_t(RUN_TIMEOUT, 0);
+
+    Mutex::Locker locker(lock);
+    while (done < conns)
+    {
+        if (clock_now() > deadline)
+        {
+            return false;
+        }
+
+        cond.timed_wait(lock, 1000);
+    }
+
+    return true;
+}
+
+static void bench(const BenchConfig& cfg)
+{
+    FastServer server_dispatcher(cfg.cost);
+    SimpleMessenger* server = new SimpleMessenger(entity_name_t::SVR(0), "fast_server");
+    server->set_default_policy(Messenger::Policy::stateless_server());
+    server->set_fast_dispatch_threads(cfg.threads);
+    server->set_delayed_delivery(entity_name_t::TYPE_CLIENT, cfg.delay);
+    if (server->bind(entity_addr_t("127.0.0.1:0")))
+    {
+        printf("server bind failed\n");
+        delete server;
+        return;
+    }
+
+    server->add_dispatcher_head(&server_dispatcher);
+    server->start();
+
+    entity_inst_t server_inst(server->get_entity_name(), server->get_entity_addr());
+
+    Mutex done_lock;
+    Cond done_cond;
+    int done = 0;
+
+    std::vector<SimpleMessenger*> clients;
+    std::vector<PingClient*> dispatchers;
+    for (int i = 0; i < cfg.conns; i++)
+    {
+        SimpleMessenger* client = new SimpleMessenger(entity_name_t::CLI(i + 1), "fast_client");
+        client->set_default_policy(Messenger::Policy::lossless_client());
+        client->bind(entity_addr_t("127.0.0.1:0"));
+
+        PingClient* dispatcher = new PingClient(client, server_inst, cfg, &done_lock, &done_cond, &done);
+        client->add_dispatcher_head(dispatcher);
+        client->start();
+
+        clients.push_back(client);
+        dispatchers.push_back(dispatcher);
+    }
+
+    // 先完成一次往返建立连接,不计入结果
+    for (int i = 0; i < cfg.conns; i++)
+    {
+        dispatchers[i]->run(1);
+    }
+
+    bool ok = wait_done(done_lock, done_cond, done, cfg.conns);
+    int per_conn = cfg.msgs / cfg.conns;
+
+    utime_t start = clock_now();
+    if (ok)
+    {
+        done_lock.lock();
+        done = 0;
+        done_lock.unlock();
+
+        for (int i = 0; i < cfg.conns; i++)
+        {
+            dispatchers[i]->run(per_conn);
+        }
+
+        ok = wait_done(done_lock, done_cond, done, cfg.conns);
+    }
+
+    double elapsed = (double)(clock_now() - start);
+
+    if (ok)
+    {
+        std::vector<uint64_t> latency;
+        for (int i = 0; i < cfg.conns; i++)
+        {
+            latency.insert(latency.end(), dispatchers[i]->latency().begin(), dispatchers[i]->latency().end());
+        }
+
+        std::sort(latency.begin(), latency.end());
+
+        uint64_t total = (uint64_t)per_conn * cfg.conns;
+        printf("%7d %5d %6d %6d %5d  %10.0f %9.1f %9.1f %9.1f  %9lu %8d\n", cfg.threads, cfg.conns, cfg.window,
+               cfg.cost, cfg.delay, total / elapsed, percentile(latency, 0.5), percentile(latency, 0.99),
+               percentile(latency, 0.999), (unsigned long)server_dispatcher.get_misordered(),
+               server_dispatcher.get_max_running());
+    }
+    else
+    {
+        printf("%7d %5d %6d %6d %5d  timeout\n", cfg.threads, cfg.conns, cfg.window, cfg.cost, cfg.delay);
+    }
+
+    fflush(stdout);
+
+    for (int i = 0; i < cfg.conns; i++)
+    {
+        clients[i]->shutdown();
+        clients[i]->wait();
+        delete clients[i];
+        delete dispatchers[i];
+    }
+
+    server->shutdown();
+    server->wait();
+    delete server;
+}
+
+static std::vector<int> parse_list(const char* arg)
+{
+    std::vector<int> v;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        v.push_back(atoi(item.c_str()));
+    }
+
+    return v;
+}
+
+static void usage(const char* name)
+{
+    printf("usage: %s [-t fast threads] [-c conns] [-w windows] [-d server costs(us)] [-D server delays(ms)] [-n msgs]\n", name);
+    printf("  lists are comma separated, every combination is run, 0 fast threads dispatches in the reader\n");
+    printf("  misorder: pings dispatched out of order within a connection, must be 0\n");
+    printf("  parallel: most handlers seen running at the same time\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<int> threads = parse_list("0,1,2,4");
+    std::vector<int> conns = parse_list("1,8");
+    std::vector<int> windows = parse_list("32");
+    std::vector<int> costs = parse_list("0,20");
+    std::vector<int> delays = parse_list("0");
+    int msgs = MSG_NUM;
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "t:c:w:d:D:n:h")))
+    {
+        switch (opt)
+        {
+            case 't': threads = parse_list(optarg); break;
+            case 'c': conns = parse_list(optarg); break;
+            case 'w': windows = parse_list(optarg); break;
+            case 'd': costs = parse_list(optarg); break;
+            case 'D': delays = parse_list(optarg); break;
+            case 'n': msgs = atoi(optarg); break;
+            default: usage(argv[0]); return 0;
+        }
+    }
+
+    printf("%7s %5s %6s %6s %5s  %10s %9s %9s %9s  %9s %8s\n", "threads", "conns", "window", "cost", "delay",
+           "msgs/s", "p50(us)", "p99(us)", "p999(us)", "misorder", "parallel");
+
+    for (size_t c = 0; c < conns.size(); c++)
+    {
+        for (size_t w = 0; w < windows.size(); w++)
+        {
+            for (size_t d = 0; d < costs.size(); d++)
+            {
+                for (size_t e = 0; e < delays.size(); e++)
+                {
+                    for (size_t t = 0; t < threads.size(); t++)
+                    {
+                        BenchConfig cfg;
+                        cfg.threads = threads[t];
+                        cfg.conns = conns[c];
+                        cfg.window = windows[w];
+                        cfg.cost = costs[d];
+                        cfg.delay = delays[e];
+                        cfg.msgs = msgs;
+                        bench(cfg);
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "message.h"
+#include "socket.h"
+
+static int failed = 0;
+
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++failed; \
+        } \
+    } while(0)
+
+static msg_header make_header(uint64_t seq, uint8_t src_type, uint64_t src_num)
+{
+    msg_header h;
+    memset(&h, 0, sizeof(h));
+    h.seq = seq;
+    h.type = 0x10;
+    h.priority = 127;
+    h.version = 1;
+    h.front_len = 32;
+    h.src.type = src_type;
+    h.src.num = src_num;
+
+    return h;
+}
+
+static msg_footer make_footer()
+{
+    msg_footer f;
+    memset(&f, 0, sizeof(f));
+
+    return f;
+}
+
+// 只比较v2帧中编码的字段,header.crc和reserved不在帧中传输
+static bool same_header(const msg_header& a, const msg_header& b)
+{
+    return (uint64_t)a.seq == (uint64_t)b.seq && (uint64_t)a.tid == (uint64_t)b.tid &&
+        (uint16_t)a.type == (uint16_t)b.type && (uint16_t)a.priority == (uint16_t)b.priority &&
+        (uint16_t)a.version == (uint16_t)b.version && (uint16_t)a.compat_version == (uint16_t)b.compat_version &&
+        (uint32_t)a.front_len == (uint32_t)b.front_len && (uint32_t)a.middle_len == (uint32_t)b.middle_len &&
+        (uint32_t)a.data_len == (uint32_t)b.data_len && (uint16_t)a.data_off == (uint16_t)b.data_off &&
+        a.src.type == b.src.type && (uint64_t)a.src.num == (uint64_t)b.src.num;
+}
+
+static bool same_state(const frame_state& a, const frame_state& b)
+{
+    return a.last_seq == b.last_seq && a.last_ack == b.last_ack && !memcmp(&a.last_src, &b.last_src, sizeof(a.last_src));
+}
+
+// 编码后立即解码,检查还原的头部,标志和确认序号
+static uint8_t round_trip(frame_state& out, frame_state& in, const msg_header& h, const msg_footer& f, int crc_flag, uint64_t ack)
+{
+    char head[SM_FRAME_HEAD_MAX];
+    uint32_t len = encode_frame_v2_head(out, h, f, crc_flag, ack, head);
+    CHECK(0 < len && SM_FRAME_HEAD_MAX - 1 >= len);
+
+    msg_header d;
+    uint8_t flags = 0;
+    uint64_t d_ack = 0;
+    CHECK(0 == decode_frame_v2_head(in, head, len, crc_flag, d, flags, d_ack));
+    CHECK(same_header(h, d));
+    CHECK(ack == d_ack);
+    CHECK(!!(flags & MSG_FRAME_ACK) == !!ack);
+
+    return flags;
+}
+
+static void test_fields(int crc_flag)
+{
+    frame_state out, in;
+
+    msg_header h = make_header(1, 1, 7);
+    msg_footer f = make_footer();
+    round_trip(out, in, h, f, crc_flag, 0);
+
+    h.seq = 2;
+    h.tid = 0x123456789ULL;
+    h.middle_len = 100;
+    h.data_len = 1 << 20;
+    h.data_off = 4096;
+    h.compat_version = 3;
+    uint8_t flags = round_trip(out, in, h, f, crc_flag, 0);
+    CHECK(flags & MSG_FRAME_TID);
+    CHECK(flags & MSG_FRAME_MIDDLE);
+    CHECK(flags & MSG_FRAME_DATA);
+    CHECK(flags & MSG_FRAME_DATA_CRC);
+    CHECK(!!(flags & MSG_FRAME_CRC) == !!(crc_flag & MSG_CRC_HEADER));
+
+    f.flags = MSG_FOOTER_NOCRC;
+    h.seq = 3;
+    flags = round_trip(out, in, h, f, crc_flag, 0);
+    CHECK(!(flags & MSG_FRAME_DATA_CRC));
+
+    // 各字段取最大值时不超过帧头部长度
+    memset(&h, 0xff, sizeof(h));
+    round_trip(out, in, h, f, crc_flag, UINT64_MAX);
+}
+
+static void test_seq_wrap()
+{
+    frame_state out, in;
+    msg_footer f = make_footer();
+
+    uint64_t seqs[] = { UINT64_MAX - 2, UINT64_MAX - 1, UINT64_MAX, 0, 1, 2, UINT64_MAX, 5, 1ULL << 63, 3 };
+    for (size_t i = 0; i < sizeof(seqs) / sizeof(seqs[0]); i++)
+    {
+        round_trip(out, in, make_header(seqs[i], 1, 7), f, MSG_CRC_ALL, 0);
+    }
+
+    CHECK(same_state(out, in));
+}
+
+static void test_absent_src()
+{
+    frame_state out, in;
+    msg_footer f = make_footer();
+
+    // 第一个帧总是携带发送方
+    uint8_t flags = round_trip(out, in, make_header(1, 1, 7), f, MSG_CRC_ALL, 0);
+    CHECK(flags & MSG_FRAME_SRC);
+
+    flags = round_trip(out, in, make_header(2, 1, 7), f, MSG_CRC_ALL, 0);
+    CHECK(!(flags & MSG_FRAME_SRC));
+
+    flags = round_trip(out, in, make_header(3, 2, 7), f, MSG_CRC_ALL, 0);
+    CHECK(flags & MSG_FRAME_SRC);
+
+    flags = round_trip(out, in, make_header(4, 2, 7), f, MSG_CRC_ALL, 0);
+    CHECK(!(flags & MSG_FRAME_SRC));
+
+    flags = round_trip(out, in, make_header(5, 2, 1ULL << 40), f, MSG_CRC_ALL, 0);
+    CHECK(flags & MSG_FRAME_SRC);
+
+    // 发送方为全0时与初始状态相同,同样省略
+    frame_state out2, in2;
+    flags = round_trip(out2, in2, make_header(1, 0, 0), f, MSG_CRC_ALL, 0);
+    CHECK(!(flags & MSG_FRAME_SRC));
+}
+
+static void test_ack()
+{
+    frame_state out, in;
+    msg_footer f = make_footer();
+
+    // 只携带确认的空消息,以及确认序号递增,缺省,回绕
+    msg_header h = make_header(1, 1, 7);
+    h.front_len = 0;
+    uint64_t acks[] = { 1, 0, 64, 65, 0, 0, 1000, UINT64_MAX, 0, 2 };
+    for (size_t i = 0; i < sizeof(acks) / sizeof(acks[0]); i++)
+    {
+        h.seq = i + 1;
+        round_trip(out, in, h, f, MSG_CRC_ALL, acks[i]);
+    }
+
+    CHECK(same_state(out, in));
+    CHECK(2 == in.last_ack);
+}
+
+static void test_truncated(int crc_flag)
+{
+    frame_state out, in;
+    msg_footer f = make_footer();
+    round_trip(out, in, make_header(1, 1, 7), f, crc_flag, 5);
+
+    msg_header h = make_header(300, 2, 1ULL << 33);
+    h.tid = 99;
+    h.middle_len = 10;
+    h.data_len = 70000;
+    char head[SM_FRAME_HEAD_MAX];
+    uint32_t len = encode_frame_v2_head(out, h, f, crc_flag, 1000, head);
+
+    frame_state saved = in;
+    for (uint32_t i = 0; i < len; i++)
+    {
+        msg_header d;
+        uint8_t flags = 0;
+        uint64_t ack = 0;
+        CHECK(0 > decode_frame_v2_head(in, head, i, crc_flag, d, flags, ack));
+        CHECK(same_state(saved, in));
+    }
+
+    // 多出的字节同样拒绝
+    char longer[SM_FRAME_HEAD_MAX + 1];
+    memcpy(longer, head, len);
+    longer[len] = 0;
+    msg_header d;
+    uint8_t flags = 0;
+    uint64_t ack = 0;
+    if (!(crc_flag & MSG_CRC_HEADER))
+    {
+        CHECK(0 > decode_frame_v2_head(in, longer, len + 1, crc_flag, d, flags, ack));
+        CHECK(same_state(saved, in));
+    }
+
+    // 被拒绝的帧不影响后续解码
+    CHECK(0 == decode_frame_v2_head(in, head, len, crc_flag, d, flags, ack));
+    CHECK(same_header(h, d));
+    CHECK(1000 == ack);
+}
+
+static void test_corrupted()
+{
+    frame_state out, in;
+    msg_footer f = make_footer();
+    round_trip(out, in, make_header(1, 1, 7), f, MSG_CRC_ALL, 0);
+
+    msg_header h = make_header(2, 3, 12345);
+    h.data_len = 8192;
+    char head[SM_FRAME_HEAD_MAX];
+    uint32_t len = encode_frame_v2_head(out, h, f, MSG_CRC_ALL, 17, head);
+
+    frame_state saved = in;
+    msg_header d;
+    uint8_t flags = 0;
+    uint64_t ack = 0;
+    for (uint32_t i = 0; i < len; i++)
+    {
+        for (int bit = 0; bit < 8; bit++)
+        {
+            head[i] ^= (char)(1 << bit);
+            CHECK(0 > decode_frame_v2_head(in, head, len, MSG_CRC_ALL, d, flags, ack));
+            CHECK(same_state(saved, in));
+            head[i] ^= (char)(1 << bit);
+        }
+    }
+
+    CHECK(0 == decode_frame_v2_head(in, head, len, MSG_CRC_ALL, d, flags, ack));
+    CHECK(same_header(h, d));
+    CHECK(17 == ack);
+
+    // 要求校验头部时拒绝不带校验的帧
+    frame_state out2, in2;
+    len = encode_frame_v2_head(out2, h, f, MSG_CRC_DATA, 0, head);
+    CHECK(0 > decode_frame_v2_head(in2, head, len, MSG_CRC_ALL, d, flags, ack));
+}
+
+int main(int argc, char* argv[])
+{
+    test_fields(MSG_CRC_ALL);
+    test_fields(0);
+    test_seq_wrap();
+    test_absent_src();
+    test_ack();
+    test_truncated(MSG_CRC_ALL);
+    test_truncated(0);
+    test_corrupted();
+
+    if (failed)
+    {
+        printf("frame_v2_test: %d checks failed\n", failed);
+        return 1;
+    }
+
+    printf("frame_v2_test: ok\n");
+
+    return 0;
+}
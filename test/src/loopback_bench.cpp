@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+#include <vector>
+#include "time_utils.h"
+#include "mutex.h"
+#include "cond.h"
+#include "thread.h"
+#include "message.h"
+#include "mping.h"
+#include "dispatcher.h"
+#include "simple_messenger.h"
+
+#define MSG_NUM 1000000
+// 单轮测试的最长时间,单位秒
+#define RUN_TIMEOUT 60
+
+struct BenchConfig
+{
+    int producers;
+    int fast;
+    int inline_fast;
+    int msgs;
+};
+
+// 统计收到的本地消息及从发送到处理的时间
+class LoopbackDispatcher : public Dispatcher
+{
+public:
+    LoopbackDispatcher(bool fast, int total) : _fast(fast), _total(total), _received(0)
+    {
+        _latency.reserve(total);
+    }
+
+    bool ms_can_fast_dispatch_any() const { return _fast; }
+
+    bool ms_can_fast_dispatch(const Message* m) const { return _fast; }
+
+    void ms_fast_dispatch(Message* m)
+    {
+        ms_dispatch(m);
+    }
+
+    bool ms_dispatch(Message* m)
+    {
+        MPing* ping = static_cast<MPing*>(m);
+        uint64_t now = clock_now().to_nsec();
+
+        Mutex::Locker locker(_lock);
+        _latency.push_back(now - ping->_stamp);
+        if (++_received == _total)
+        {
+            _cond.signal();
+        }
+
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+
+    // 等待所有消息处理完,超时返回false
+    bool wait_done()
+    {
+        utime_t deadline = clock_now() + utime_t(RUN_TIMEOUT, 0);
+
+        Mutex::Locker locker(_lock);
+        while (_received < _total)
+        {
+            if (clock_now() > deadline)
+            {
+                return false;
+            }
+
+            _cond.timed_wait(_lock, 1000);
+        }
+
+        return true;
+    }
+
+    std::vector<uint64_t>& latency() { return _latency; }
+
+private:
+    bool _fast;
+    int _total;
+    int _received;
+    Mutex _lock;
+    Cond _cond;
+    std::vector<uint64_t> _latency;
+};
+
+// 通过本地连接发送消息的线程
+class Producer : public Thread
+{
+public:
+    Producer(Messenger* msgr, int msgs) : _msgr(msgr), _msgs(msgs) {}
+
+    void entry()
+    {
+        Connection* con = _msgr->get_loopback_connection();
+        for (int i = 0; i < _msgs; i++)
+        {
+            con->send_message(new MPing(MPing::OP_PING, i, clock_now().to_nsec()));
+        }
+    }
+
+private:
+    Messenger* _msgr;
+    int _msgs;
+};
+
+static double percentile(const std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+
+    size_t i = (size_t)(p * (sorted.size() - 1));
+    return sorted[i] / 1000.0;
+}
+
+static void bench(const BenchConfig& cfg)
+{
+    int per_producer = cfg.msgs / cfg.producers;
+    int total = per_producer * cfg.producers;
+
+    LoopbackDispatcher dispatcher(cfg.fast, total);
+    SimpleMessenger* msgr = new SimpleMessenger(entity_name_t::SVR(0), "loopback");
+    msgr->set_local_fast_dispatch(cfg.inline_fast);
+    msgr->add_dispatcher_head(&dispatcher);
+    msgr->start();
+
+    std::vector<Producer*> producers;
+    for (int i = 0; i < cfg.producers; i++)
+    {
+        producers.push_back(new Producer(msgr, per_producer));
+    }
+
+    utime_t start = clock_now();
+    for (int i = 0; i < cfg.producers; i++)
+    {
+        producers[i]->create();
+    }
+
+    bool ok = dispatcher.wait_done();
+    double elapsed = (double)(clock_now() - start);
+
+    for (int i = 0; i < cfg.producers; i++)
+    {
+        producers[i]->join();
+        delete producers[i];
+    }
+
+    if (ok)
+    {
+        std::vector<uint64_t>& latency = dispatcher.latency();
+        std::sort(latency.begin(), latency.end());
+        printf("%9d %4d %6d  %10.0f  %9.1f %9.1f %9.1f\n",
+               cfg.producers, cfg.fast, cfg.inline_fast, total / elapsed,
+               percentile(latency, 0.5), percentile(latency, 0.99), percentile(latency, 0.999));
+    }
+    else
+    {
+        printf("%9d %4d %6d  timeout\n", cfg.producers, cfg.fast, cfg.inline_fast);
+    }
+
+    fflush(stdout);
+
+    msgr->shutdown();
+    msgr->wait();
+    delete msgr;
+}
+
+static std::vector<int> parse_list(const char* arg)
+{
+    std::vector<int> v;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        v.push_back(atoi(item.c_str()));
+    }
+
+    return v;
+}
+
+static void usage(const char* name)
+{
+    printf("usage: %s [-p producers] [-f fasts] [-i inlines] [-n msgs]\n", name);
+    printf("  lists are comma separated, every combination is run\n");
+    printf("  fast: dispatcher supports fast dispatch, inline: fast dispatch on the sender thread\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<int> producers = parse_list("1,4");
+    std::vector<int> fasts = parse_list("0,1");
+    std::vector<int> inlines = parse_list("0,1");
+    int msgs = MSG_NUM;
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "p:f:i:n:h")))
+    {
+        switch (opt)
+        {
+            case 'p': producers = parse_list(optarg); break;
+            case 'f': fasts = parse_list(optarg); break;
+            case 'i': inlines = parse_list(optarg); break;
+            case 'n': msgs = atoi(optarg); break;
+            default: usage(argv[0]); return 0;
+        }
+    }
+
+    printf("%9s %4s %6s  %10s  %9s %9s %9s\n",
+           "producers", "fast", "inline", "msgs/s", "p50(us)", "p99(us)", "p999(us)");
+
+    for (size_t p = 0; p < producers.size(); p++)
+    {
+        for (size_t f = 0; f < fasts.size(); f++)
+        {
+            for (size_t i = 0; i < inlines.size(); i++)
+            {
+                // 不支持快速转发时内联模式没有区别
+                if (!fasts[f] && inlines[i])
+                {
+                    continue;
+                }
+
+                BenchConfig cfg;
+                cfg.producers = producers[p];
+                cfg.fast = fasts[f];
+                cfg.inline_fast = inlines[i];
+                cfg.msgs = msgs;
+                bench(cfg);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sstream>
+#include <vector>
+#include "time_utils.h"
+#include "mutex.h"
+#include "cond.h"
+#include "message.h"
+#include "mping.h"
+#include "dispatcher.h"
+#include "simple_messenger.h"
+
+#define MSG_NUM 50000
+// 单轮测试的最长时间,单位秒
+#define RUN_TIMEOUT 60
+
+struct BenchConfig
+{
+    // 采样间隔,为0时不统计
+    uint32_t sample_every;
+    uint32_t size;
+    int window;
+    // 服务端处理一个PING的时间,单位微秒
+    int cost;
+    int msgs;
+};
+
+// 收到PING后按设置的时间处理,然后回复PONG
+class PingServer : public Dispatcher
+{
+public:
+    explicit PingServer(int cost) : _cost(cost) {}
+
+    bool ms_dispatch(Message* m)
+    {
+        MPing* ping = static_cast<MPing*>(m);
+        if (MPing::OP_PING == ping->_op)
+        {
+            if (_cost)
+            {
+                usleep(_cost);
+            }
+
+            ping->get_connection()->send_message(new MPing(MPing::OP_PONG, ping->_seq, ping->_stamp));
+        }
+
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+
+private:
+    int _cost;
+};
+
+// 保持window个PING在途,收到PONG后补发
+class PingClient : public Dispatcher
+{
+public:
+    PingClient(Messenger* msgr, const entity_inst_t& server, const BenchConfig& cfg)
+        : _msgr(msgr), _server(server), _cfg(cfg), _sent(0), _received(0)
+    {
+        _data.push_back(ptr(cfg.size));
+        memset(_data.c_str(), 'p', cfg.size);
+    }
+
+    void run()
+    {
+        Mutex::Locker locker(_lock);
+        for (int i = 0; i < _cfg.window && _sent < _cfg.msgs; i++)
+        {
+            send_ping();
+        }
+    }
+
+    bool ms_dispatch(Message* m)
+    {
+        Mutex::Locker locker(_lock);
+        if (_cfg.msgs <= ++_received)
+        {
+            _cond.signal();
+        }
+        else if (_sent < _cfg.msgs)
+        {
+            send_ping();
+        }
+
+        m->dec();
+        return true;
+    }
+
+    bool wait()
+    {
+        utime_t deadline = clock_now() + utime_t(RUN_TIMEOUT, 0);
+        Mutex::Locker locker(_lock);
+        while (_cfg.msgs > _received)
+        {
+            if (clock_now() > deadline)
+            {
+                return false;
+            }
+
+            _cond.timed_wait(_lock, 1000);
+        }
+
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+
+private:
+    void send_ping()
+    {
+        MPing* ping = new MPing(MPing::OP_PING, _sent++, 0);
+        if (_cfg.size)
+        {
+            ping->set_data(_data);
+        }
+
+        _msgr->send_message(ping, _server);
+    }
+
+    Messenger* _msgr;
+    entity_inst_t _server;
+    BenchConfig _cfg;
+    buffer _data;
+    Mutex _lock;
+    Cond _cond;
+    int _sent;
+    int _received;
+};
+
+static void print_stats(const char* side, std::map<uint32_t, MessageLatencyStats>& stats)
+{
+    for (std::map<uint32_t, MessageLatencyStats>::iterator iter = stats.begin(); iter != stats.end(); ++iter)
+    {
+        for (int i = 0; i < MessageLatencyStats::STAGE_MAX; i++)
+        {
+            const LatencyHistogram& h = iter->second._stages[i];
+            if (!h.get_count())
+            {
+                continue;
+            }
+
+            printf("    %-6s type %-4u %-8s %8lu  %9.1f %9.1f %9.1f %9.1f %9.1f\n", side, iter->first,
+                   MessageLatencyStats::get_stage_name(i), (unsigned long)h.get_count(), h.get_avg() / 1000.0,
+                   h.get_percentile(0.5) / 1000.0, h.get_percentile(0.99) / 1000.0,
+                   h.get_percentile(0.999) / 1000.0, h.get_max() / 1000.0);
+        }
+    }
+}
+
+static void bench(const BenchConfig& cfg)
+{
+    PingServer server_dispatcher(cfg.cost);
+    SimpleMessenger* server = new SimpleMessenger(entity_name_t::SVR(0), "latency_server");
+    server->set_default_policy(Messenger::Policy::stateless_server());
+    server->set_latency_sample_every(cfg.sample_every);
+    if (server->bind(entity_addr_t("127.0.0.1:0")))
+    {
+        printf("server bind failed\n");
+        delete server;
+        return;
+    }
+
+    server->add_dispatcher_head(&server_dispatcher);
+    server->start();
+
+    entity_inst_t server_inst(server->get_entity_name(), server->get_entity_addr());
+
+    Messenger* client = new SimpleMessenger(entity_name_t::CLI(0), "latency_client");
+    client->set_default_policy(Messenger::Policy::lossy_client());
+    client->set_latency_sample_every(cfg.sample_every);
+    client->bind(entity_addr_t("127.0.0.1:0"));
+    PingClient ping_client(client, server_inst, cfg);
+    client->add_dispatcher_head(&ping_client);
+    client->start();
+
+    utime_t start = clock_now();
+    ping_client.run();
+    bool ok = ping_client.wait();
+    double elapsed = (double)(clock_now() - start);
+
+    if (ok)
+    {
+        printf("%8u %8u %6d %6d  %10.0f\n", cfg.sample_every, cfg.size, cfg.window, cfg.cost, cfg.msgs / elapsed);
+
+        std::map<uint32_t, MessageLatencyStats> stats;
+        server->dump_latency(stats);
+        print_stats("server", stats);
+        stats.clear();
+        client->dump_latency(stats);
+        print_stats("client", stats);
+    }
+    else
+    {
+        printf("%8u %8u %6d %6d  timeout\n", cfg.sample_every, cfg.size, cfg.window, cfg.cost);
+    }
+
+    fflush(stdout);
+
+    client->shutdown();
+    server->shutdown();
+    client->wait();
+    server->wait();
+    delete client;
+    delete server;
+}
+
+static std::vector<int> parse_list(const char* arg)
+{
+    std::vector<int> v;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        v.push_back(atoi(item.c_str()));
+    }
+
+    return v;
+}
+
+static void usage(const char* name)
+{
+    printf("usage: %s [-e sample every] [-s sizes] [-w windows] [-c server costs(us)] [-n msgs]\n", name);
+    printf("  lists are comma separated, every combination is run, sample every 0 disables the statistics\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<int> everys = parse_list("0,32,1");
+    std::vector<int> sizes = parse_list("0,4096");
+    std::vector<int> windows = parse_list("16");
+    std::vector<int> costs = parse_list("0");
+    int msgs = MSG_NUM;
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "e:s:w:c:n:h")))
+    {
+        switch (opt)
+        {
+            case 'e': everys = parse_list(optarg); break;
+            case 's': sizes = parse_list(optarg); break;
+            case 'w': windows = parse_list(optarg); break;
+            case 'c': costs = parse_list(optarg); break;
+            case 'n': msgs = atoi(optarg); break;
+            default: usage(argv[0]); return 0;
+        }
+    }
+
+    printf("%8s %8s %6s %6s  %10s\n", "every", "size", "window", "cost", "msgs/s");
+    printf("    %-6s %-9s %-8s %8s  %9s %9s %9s %9s %9s\n", "side", "type", "stage", "count",
+           "avg(us)", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+
+    for (size_t s = 0; s < sizes.size(); s++)
+    {
+        for (size_t w = 0; w < windows.size(); w++)
+        {
+            for (size_t c = 0; c < costs.size(); c++)
+            {
+                for (size_t e = 0; e < everys.size(); e++)
+                {
+                    BenchConfig cfg;
+                    cfg.sample_every = everys[e];
+                    cfg.size = sizes[s];
+                    cfg.window = windows[w];
+                    cfg.cost = costs[c];
+                    cfg.msgs = msgs;
+                    bench(cfg);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
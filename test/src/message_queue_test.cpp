@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <deque>
+#include <vector>
+#include "message.h"
+#include "message_queue.h"
+#include "mping.h"
+
+#define MSG_NUM 512
+#define OP_NUM 200000
+
+static int failed = 0;
+
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++failed; \
+        } \
+    } while(0)
+
+// 与MessageQueue行为相同的参照实现,每个优先级一个deque
+class ModelQueue
+{
+public:
+    ModelQueue() : _size(0) {}
+
+    static unsigned clamp(unsigned prio)
+    {
+        return prio > MSG_PRIO_HIGHEST ? MSG_PRIO_HIGHEST : prio;
+    }
+
+    void push_back(Message* m, unsigned prio)
+    {
+        _buckets[clamp(prio)].push_back(m);
+        _size++;
+    }
+
+    void push_front(Message* m, unsigned prio)
+    {
+        _buckets[clamp(prio)].push_front(m);
+        _size++;
+    }
+
+    Message* pop_front()
+    {
+        for (int prio = MSG_PRIO_HIGHEST; prio >= 0; prio--)
+        {
+            if (!_buckets[prio].empty())
+            {
+                return pop_front(prio);
+            }
+        }
+
+        return NULL;
+    }
+
+    Message* pop_front(unsigned prio)
+    {
+        std::deque<Message*>& b = _buckets[clamp(prio)];
+        if (b.empty())
+        {
+            return NULL;
+        }
+
+        Message* m = b.front();
+        b.pop_front();
+        _size--;
+
+        return m;
+    }
+
+    Message* front(unsigned prio) const
+    {
+        const std::deque<Message*>& b = _buckets[clamp(prio)];
+        return b.empty() ? NULL : b.front();
+    }
+
+    void splice_front(ModelQueue& other)
+    {
+        for (unsigned prio = 0; prio < MessageQueue::NUM_PRIORITIES; prio++)
+        {
+            std::deque<Message*>& ob = other._buckets[prio];
+            _buckets[prio].insert(_buckets[prio].begin(), ob.begin(), ob.end());
+            ob.clear();
+        }
+
+        _size += other._size;
+        other._size = 0;
+    }
+
+    uint64_t size() const { return _size; }
+
+private:
+    std::deque<Message*> _buckets[MessageQueue::NUM_PRIORITIES];
+    uint64_t _size;
+};
+
+// 每个优先级放入多个消息,按优先级从高到低,同优先级先进先出取出
+static void test_order(std::vector<Message*>& msgs)
+{
+    MessageQueue q;
+    CHECK(q.empty());
+    CHECK(NULL == q.pop_front());
+
+    for (size_t i = 0; i < msgs.size(); i++)
+    {
+        msgs[i]->set_priority((i * 37) % MessageQueue::NUM_PRIORITIES);
+        q.push_back(msgs[i]);
+    }
+
+    CHECK(msgs.size() == q.size());
+
+    int last_prio = MSG_PRIO_HIGHEST + 1;
+    size_t last_index = 0;
+    for (size_t n = 0; n < msgs.size(); n++)
+    {
+        Message* m = q.pop_front();
+        CHECK(NULL != m);
+        if (!m)
+        {
+            return;
+        }
+
+        size_t index = static_cast<MPing*>(m)->_seq;
+        int prio = m->get_priority();
+        CHECK(prio <= last_prio);
+        CHECK(prio < last_prio || index > last_index);
+        last_prio = prio;
+        last_index = index;
+    }
+
+    CHECK(q.empty());
+    CHECK(0 == q.size());
+    CHECK(NULL == q.pop_front());
+
+    // 超出范围的优先级按最高优先级处理
+    q.push_back(msgs[0], 0);
+    q.push_back(msgs[1], 1000);
+    q.push_back(msgs[2], MSG_PRIO_HIGHEST);
+    CHECK(msgs[1] == q.front(MSG_PRIO_HIGHEST));
+    CHECK(msgs[1] == q.pop_front());
+    CHECK(msgs[2] == q.pop_front(1000));
+    CHECK(msgs[0] == q.pop_front());
+    CHECK(q.empty());
+}
+
+static void test_push_front(std::vector<Message*>& msgs)
+{
+    MessageQueue q;
+    q.push_back(msgs[0], 10);
+    q.push_front(msgs[1], 10);
+    q.push_front(msgs[2], 10);
+    q.push_back(msgs[3], 10);
+    q.push_front(msgs[4], 200);
+
+    CHECK(5 == q.size());
+    CHECK(msgs[4] == q.pop_front());
+    CHECK(msgs[2] == q.pop_front());
+    CHECK(msgs[1] == q.pop_front());
+    CHECK(msgs[0] == q.pop_front());
+    CHECK(msgs[3] == q.pop_front());
+    CHECK(q.empty());
+
+    // 放回空桶的队首
+    q.push_front(msgs[5], 64);
+    CHECK(msgs[5] == q.front(64));
+    CHECK(msgs[5] == q.pop_front());
+    CHECK(q.empty());
+}
+
+static void test_splice_front(std::vector<Message*>& msgs)
+{
+    MessageQueue q, other;
+    q.push_back(msgs[0], 5);
+    q.push_back(msgs[1], 5);
+    q.push_back(msgs[2], 130);
+    other.push_back(msgs[3], 5);
+    other.push_back(msgs[4], 5);
+    other.push_back(msgs[5], 63);
+    other.push_back(msgs[6], 255);
+
+    q.splice_front(other);
+    CHECK(other.empty());
+    CHECK(0 == other.size());
+    CHECK(NULL == other.pop_front());
+    CHECK(7 == q.size());
+
+    Message* expect[] = { msgs[6], msgs[2], msgs[5], msgs[3], msgs[4], msgs[0], msgs[1] };
+    for (size_t i = 0; i < sizeof(expect) / sizeof(expect[0]); i++)
+    {
+        CHECK(expect[i] == q.pop_front());
+    }
+
+    CHECK(q.empty());
+
+    // 清空后的other可以继续使用
+    other.push_back(msgs[7], 1);
+    q.splice_front(other);
+    CHECK(msgs[7] == q.pop_front());
+    CHECK(q.empty());
+}
+
+// 随机操作,与参照实现比较
+static void test_random(std::vector<Message*>& msgs)
+{
+    MessageQueue q, other;
+    ModelQueue model, other_model;
+    std::vector<Message*> free_msgs(msgs);
+
+    srand(1);
+    for (int n = 0; n < OP_NUM; n++)
+    {
+        unsigned prio = rand() % (MessageQueue::NUM_PRIORITIES + 16);
+        // 集中在少数优先级上,让同一个桶中有多个消息
+        if (rand() % 2)
+        {
+            prio = prio % 8 * 32 + 3;
+        }
+
+        switch (rand() % 8)
+        {
+            case 0:
+            case 1:
+                if (!free_msgs.empty())
+                {
+                    q.push_back(free_msgs.back(), prio);
+                    model.push_back(free_msgs.back(), prio);
+                    free_msgs.pop_back();
+                }
+                break;
+            case 2:
+                if (!free_msgs.empty())
+                {
+                    q.push_front(free_msgs.back(), prio);
+                    model.push_front(free_msgs.back(), prio);
+                    free_msgs.pop_back();
+                }
+                break;
+            case 3:
+                if (!free_msgs.empty())
+                {
+                    other.push_back(free_msgs.back(), prio);
+                    other_model.push_back(free_msgs.back(), prio);
+                    free_msgs.pop_back();
+                }
+                break;
+            case 4:
+            case 5:
+            {
+                Message* m = q.pop_front();
+                CHECK(model.pop_front() == m);
+                if (m)
+                {
+                    free_msgs.push_back(m);
+                }
+                break;
+            }
+            case 6:
+            {
+                CHECK(model.front(prio) == q.front(prio));
+                Message* m = q.pop_front(prio);
+                CHECK(model.pop_front(prio) == m);
+                if (m)
+                {
+                    free_msgs.push_back(m);
+                }
+                break;
+            }
+            default:
+                if (0 == rand() % 4)
+                {
+                    q.splice_front(other);
+                    model.splice_front(other_model);
+                }
+                break;
+        }
+
+        CHECK(model.size() == q.size());
+        CHECK((0 == model.size()) == q.empty());
+        CHECK(other_model.size() == other.size());
+        if (failed)
+        {
+            return;
+        }
+    }
+
+    q.splice_front(other);
+    model.splice_front(other_model);
+    while (!q.empty())
+    {
+        CHECK(model.pop_front() == q.pop_front());
+    }
+
+    CHECK(0 == model.size());
+}
+
+// 到达链表按入队顺序排列,任意位置删除后其余消息顺序不变
+static void test_arrival_list(std::vector<Message*>& msgs)
+{
+    ArrivalList l;
+    std::deque<Message*> model;
+    CHECK(l.empty());
+    CHECK(NULL == l.front());
+
+    for (size_t i = 0; i < msgs.size(); i++)
+    {
+        l.push_back(msgs[i]);
+        model.push_back(msgs[i]);
+    }
+
+    CHECK(msgs.size() == l.size());
+
+    // 依次删除队首,队尾和中间的消息
+    srand(2);
+    while (!model.empty())
+    {
+        size_t i = 0;
+        switch (rand() % 3)
+        {
+            case 0: i = 0; break;
+            case 1: i = model.size() - 1; break;
+            default: i = rand() % model.size(); break;
+        }
+
+        l.remove(model[i]);
+        model.erase(model.begin() + i);
+        CHECK(model.size() == l.size());
+        CHECK((model.empty() ? NULL : model.front()) == l.front());
+
+        // 被删除的消息可以重新入队尾
+        if (0 == rand() % 4 && !model.empty())
+        {
+            Message* m = model.front();
+            l.remove(m);
+            l.push_back(m);
+            model.pop_front();
+            model.push_back(m);
+            CHECK(model.front() == l.front());
+        }
+    }
+
+    CHECK(l.empty());
+    CHECK(0 == l.size());
+    CHECK(NULL == l.front());
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<Message*> msgs;
+    for (int i = 0; i < MSG_NUM; i++)
+    {
+        msgs.push_back(new MPing(MPing::OP_PING, i, 0));
+    }
+
+    test_order(msgs);
+    test_push_front(msgs);
+    test_splice_front(msgs);
+    test_random(msgs);
+    test_arrival_list(msgs);
+
+    for (size_t i = 0; i < msgs.size(); i++)
+    {
+        msgs[i]->dec();
+    }
+
+    if (failed)
+    {
+        printf("message_queue_test: %d checks failed\n", failed);
+        return 1;
+    }
+
+    printf("message_queue_test: ok\n");
+
+    return 0;
+}
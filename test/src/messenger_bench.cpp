@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+#include <vector>
+#include "time_utils.h"
+#include "mutex.h"
+#include "cond.h"
+#include "message.h"
+#include "mping.h"
+#include "dispatcher.h"
+#include "simple_messenger.h"
+
+#define MSG_NUM 20000
+// 单轮测试的最长时间,单位秒
+#define RUN_TIMEOUT 60
+
+struct BenchConfig
+{
+    uint32_t size;
+    int conns;
+    int window;
+    int prio;
+    int crc;
+    int proto;
+    int local;
+    int sockbuf;
+    int ack_delay;
+    int msgs;
+};
+
+// 收到PING后立即回复PONG
+class PingServer : public Dispatcher
+{
+public:
+    bool ms_dispatch(Message* m)
+    {
+        MPing* ping = static_cast<MPing*>(m);
+        if (MPing::OP_PING == ping->_op)
+        {
+            MPing* pong = new MPing(MPing::OP_PONG, ping->_seq, ping->_stamp);
+            pong->set_priority(ping->get_priority());
+            ping->get_connection()->send_message(pong);
+        }
+
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+};
+
+// 保持window个PING在途,每收到一个PONG记录往返时间并补发一个
+class PingClient : public Dispatcher
+{
+public:
+    PingClient(Messenger* msgr, const entity_inst_t& server, const BenchConfig& cfg, Mutex* done_lock, Cond* done_cond, int* done)
+        : _msgr(msgr), _server(server), _cfg(cfg), _total(0), _sent(0), _received(0),
+          _done_lock(done_lock), _done_cond(done_cond), _done(done)
+    {
+        if (cfg.size)
+        {
+            _data.push_back(ptr(cfg.size));
+            memset(_data.c_str(), 'p', cfg.size);
+        }
+    }
+
+    void run(int total)
+    {
+        Mutex::Locker locker(_lock);
+        _total = total;
+        _sent = 0;
+        _received = 0;
+        _latency.clear();
+        _latency.reserve(total);
+
+        while (_sent < _total && _sent < _cfg.window)
+        {
+            send_ping();
+        }
+    }
+
+    bool ms_dispatch(Message* m)
+    {
+        MPing* pong = static_cast<MPing*>(m);
+        uint64_t now = clock_now().to_nsec();
+
+        Mutex::Locker locker(_lock);
+        _latency.push_back(now - pong->_stamp);
+        _received++;
+
+        if (_sent < _total)
+        {
+            send_ping();
+        }
+
+        if (_received == _total)
+        {
+            Mutex::Locker done_locker(*_done_lock);
+            (*_done)++;
+            _done_cond->signal();
+        }
+
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+
+    const std::vector<uint64_t>& latency() const { return _latency; }
+
+private:
+    void send_ping()
+    {
+        MPing* ping = new MPing(MPing::OP_PING, _sent++, clock_now().to_nsec());
+        ping->set_priority(_cfg.prio);
+        ping->set_data(_data);
+        _msgr->send_message(ping, _server);
+    }
+
+    Messenger* _msgr;
+    entity_inst_t _server;
+    BenchConfig _cfg;
+    buffer _data;
+
+    Mutex _lock;
+    int _total;
+    int _sent;
+    int _received;
+    std::vector<uint64_t> _latency;
+
+    Mutex* _done_lock;
+    Cond* _done_cond;
+    int* _done;
+};
+
+static double percentile(const std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+
+    size_t i = (size_t)(p * (sorted.size() - 1));
+    return sorted[i] / 1000.0;
+}
+
+// 等待所有客户端完成,超时返回false
+static bool wait_done(Mutex& lock, Cond& cond, int& done, int conns)
+{
+    utime_t deadline = clock_now() + utime_t(RUN_TIMEOUT, 0);
+
+    Mutex::Locker locker(lock);
+    while (done < conns)
+    {
+        if (clock_now() > deadline)
+        {
+            return false;
+        }
+
+        cond.timed_wait(lock, 1000);
+    }
+
+    return true;
+}
+
+// 服务端及所有客户端的sendmsg调用次数
+static uint64_t count_syscalls(SimpleMessenger* server, const std::vector<SimpleMessenger*>& clients)
+{
+    uint64_t msgs = 0;
+    uint64_t syscalls = 0;
+    uint64_t total = 0;
+
+    server->get_send_stats(msgs, syscalls);
+    total += syscalls;
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        clients[i]->get_send_stats(msgs, syscalls);
+        total += syscalls;
+    }
+
+    return total;
+}
+
+static void bench(const BenchConfig& cfg)
+{
+    PingServer server_dispatcher;
+    SimpleMessenger* server = new SimpleMessenger(entity_name_t::SVR(0), "bench_server");
+    server->set_default_policy(Messenger::Policy::stateless_server());
+    server->_crc_flag = cfg.crc;
+    server->set_protocol_version(cfg.proto);
+    server->set_socket_buffers(cfg.sockbuf, cfg.sockbuf);
+    server->set_ack_delay(cfg.ack_delay);
+    entity_addr_t addr("127.0.0.1:0");
+    if (cfg.local)
+    {
+        addr.set_type(entity_addr_t::TYPE_LOCAL);
+    }
+
+    if (server->bind(addr))
+    {
+        printf("server bind failed\n");
+        delete server;
+        return;
+    }
+
+    server->add_dispatcher_head(&server_dispatcher);
+    server->start();
+
+    entity_inst_t server_inst(server->get_entity_name(), server->get_entity_addr());
+
+    Mutex done_lock;
+    Cond done_cond;
+    int done = 0;
+
+    std::vector<SimpleMessenger*> clients;
+    std::vector<PingClient*> dispatchers;
+    for (int i = 0; i < cfg.conns; i++)
+    {
+        SimpleMessenger* client = new SimpleMessenger(entity_name_t::CLI(i + 1), "bench_client");
+        client->set_default_policy(Messenger::Policy::lossless_client());
+        client->_crc_flag = cfg.crc;
+        client->set_protocol_version(cfg.proto);
+        client->set_socket_buffers(cfg.sockbuf, cfg.sockbuf);
+        client->set_ack_delay(cfg.ack_delay);
+        // 各客户端使用不同的端口,服务端按地址区分连接
+        client->bind(entity_addr_t("127.0.0.1:0"));
+
+        PingClient* dispatcher = new PingClient(client, server_inst, cfg, &done_lock, &done_cond, &done);
+        client->add_dispatcher_head(dispatcher);
+        client->start();
+
+        clients.push_back(client);
+        dispatchers.push_back(dispatcher);
+    }
+
+    // 先完成一次往返建立连接,不计入结果
+    for (int i = 0; i < cfg.conns; i++)
+    {
+        dispatchers[i]->run(1);
+    }
+
+    bool ok = wait_done(done_lock, done_cond, done, cfg.conns);
+    int per_conn = cfg.msgs / cfg.conns;
+    uint64_t syscalls_before = count_syscalls(server, clients);
+
+    utime_t start = clock_now();
+    if (ok)
+    {
+        done_lock.lock();
+        done = 0;
+        done_lock.unlock();
+
+        for (int i = 0; i < cfg.conns; i++)
+        {
+            dispatchers[i]->run(per_conn);
+        }
+
+        ok = wait_done(done_lock, done_cond, done, cfg.conns);
+    }
+
+    double elapsed = (double)(clock_now() - start);
+    uint64_t syscalls = count_syscalls(server, clients) - syscalls_before;
+
+    if (ok)
+    {
+        std::vector<uint64_t> latency;
+        for (int i = 0; i < cfg.conns; i++)
+        {
+            latency.insert(latency.end(), dispatchers[i]->latency().begin(), dispatchers[i]->latency().end());
+        }
+
+        std::sort(latency.begin(), latency.end());
+
+        uint64_t total = (uint64_t)per_conn * cfg.conns;
+        printf("%8u %5d %6d %4d %3d %5d %5d %7d %3d  %10.0f %9.1f %7.2f  %9.1f %9.1f %9.1f\n",
+               cfg.size, cfg.conns, cfg.window, cfg.prio, cfg.crc, cfg.proto, cfg.local, cfg.sockbuf, cfg.ack_delay,
+               total / elapsed, total * cfg.size / elapsed / (1 << 20), (double)syscalls / (total * 2),
+               percentile(latency, 0.5), percentile(latency, 0.99), percentile(latency, 0.999));
+    }
+    else
+    {
+        printf("%8u %5d %6d %4d %3d %5d %5d %7d %3d  timeout\n", cfg.size, cfg.conns, cfg.window, cfg.prio, cfg.crc, cfg.proto, cfg.local, cfg.sockbuf, cfg.ack_delay);
+    }
+
+    fflush(stdout);
+
+    for (int i = 0; i < cfg.conns; i++)
+    {
+        clients[i]->shutdown();
+        clients[i]->wait();
+        delete clients[i];
+        delete dispatchers[i];
+    }
+
+    server->shutdown();
+    server->wait();
+    delete server;
+}
+
+static std::vector<int> parse_list(const char* arg)
+{
+    std::vector<int> v;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        v.push_back(atoi(item.c_str()));
+    }
+
+    return v;
+}
+
+static void usage(const char* name)
+{
+    printf("usage: %s [-s sizes] [-c conns] [-w windows] [-p prios] [-r crcs] [-v protos] [-u locals] [-b sockbufs] [-a ackdelays] [-n msgs]\n", name);
+    printf("  lists are comma separated, every combination is run\n");
+    printf("  crc: 0 none, %d data, %d header, %d all\n", MSG_CRC_DATA, MSG_CRC_HEADER, MSG_CRC_ALL);
+    printf("  proto: %d v1, %d v2\n", MSGR_PROTOCOL_V1, MSGR_PROTOCOL_V2);
+    printf("  local: 0 tcp, 1 unix socket\n");
+    printf("  sockbuf: socket buffer bytes, 0 kernel auto tuning\n");
+    printf("  ackdelay: delayed ack in ms, 0 ack immediately\n");
+    printf("  sys/msg: sendmsg calls per ping or pong\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<int> sizes = parse_list("64,4096,65536");
+    std::vector<int> conns = parse_list("1,4");
+    std::vector<int> windows = parse_list("1,32");
+    std::vector<int> prios(1, MSG_PRIO_DEFAULT);
+    std::vector<int> crcs(1, MSG_CRC_ALL);
+    std::vector<int> protos(1, MSGR_PROTOCOL_V2);
+    std::vector<int> locals(1, 0);
+    std::vector<int> sockbufs(1, 0);
+    std::vector<int> ack_delays(1, SM_ACK_DELAY_MS);
+    int msgs = MSG_NUM;
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "s:c:w:p:r:v:u:b:a:n:h")))
+    {
+        switch (opt)
+        {
+            case 's': sizes = parse_list(optarg); break;
+            case 'c': conns = parse_list(optarg); break;
+            case 'w': windows = parse_list(optarg); break;
+            case 'p': prios = parse_list(optarg); break;
+            case 'r': crcs = parse_list(optarg); break;
+            case 'v': protos = parse_list(optarg); break;
+            case 'u': locals = parse_list(optarg); break;
+            case 'b': sockbufs = parse_list(optarg); break;
+            case 'a': ack_delays = parse_list(optarg); break;
+            case 'n': msgs = atoi(optarg); break;
+            default: usage(argv[0]); return 0;
+        }
+    }
+
+    printf("%8s %5s %6s %4s %3s %5s %5s %7s %3s  %10s %9s %7s  %9s %9s %9s\n",
+           "size", "conns", "window", "prio", "crc", "proto", "local", "sockbuf", "ack", "msgs/s", "MB/s", "sys/msg", "p50(us)", "p99(us)", "p999(us)");
+
+    for (size_t s = 0; s < sizes.size(); s++)
+    {
+        for (size_t c = 0; c < conns.size(); c++)
+        {
+            for (size_t w = 0; w < windows.size(); w++)
+            {
+                for (size_t p = 0; p < prios.size(); p++)
+                {
+                    for (size_t r = 0; r < crcs.size(); r++)
+                    {
+                        for (size_t v = 0; v < protos.size(); v++)
+                        {
+                            for (size_t u = 0; u < locals.size(); u++)
+                            {
+                                for (size_t b = 0; b < sockbufs.size(); b++)
+                                {
+                                    for (size_t a = 0; a < ack_delays.size(); a++)
+                                    {
+                                        BenchConfig cfg;
+                                        cfg.size = sizes[s];
+                                        cfg.conns = conns[c];
+                                        cfg.window = windows[w];
+                                        cfg.prio = prios[p];
+                                        cfg.crc = crcs[r];
+                                        cfg.proto = protos[v];
+                                        cfg.local = locals[u];
+                                        cfg.sockbuf = sockbufs[b];
+                                        cfg.ack_delay = ack_delays[a];
+                                        cfg.msgs = msgs;
+                                        bench(cfg);
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+#include "time_utils.h"
+#include "message.h"
+#include "simple_messenger.h"
+#include "bench_utils.h"
+
+#define THREAD_NUM 8
+#define PEER_NUM 64
+#define THREAD_SEND_NUM 100000
+
+class MBench : public Message
+{
+public:
+    MBench() : Message(0xffff) {}
+
+    void encode_payload() {}
+    void decode_payload() {}
+    const char* get_type_name() const { return "bench"; }
+};
+
+static void send_func(Messenger* msgr, std::vector<entity_inst_t>* peers, int thread_id, int num, int batch)
+{
+    if (1 >= batch)
+    {
+        for (int i = 0; i < num; i++)
+        {
+            msgr->send_message(new MBench(), (*peers)[(thread_id + i) % peers->size()]);
+        }
+
+        return;
+    }
+
+    // 每次向同一对端发送batch个消息
+    std::vector<Message*> ms;
+    ms.reserve(batch);
+    for (int i = 0; i < num; i += batch)
+    {
+        for (int j = 0; j < batch && i + j < num; j++)
+        {
+            ms.push_back(new MBench());
+        }
+
+        msgr->send_messages(ms, (*peers)[(thread_id + i / batch) % peers->size()]);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int thread_num = argc > 1 ? atoi(argv[1]) : THREAD_NUM;
+    int peer_num = argc > 2 ? atoi(argv[2]) : PEER_NUM;
+    int send_num = argc > 3 ? atoi(argv[3]) : THREAD_SEND_NUM;
+    // 大于1时使用send_messages批量发送
+    int batch = argc > 4 ? atoi(argv[4]) : 1;
+
+    std::vector<int> fds;
+    std::vector<entity_inst_t> peers;
+    for (int i = 0; i < peer_num; i++)
+    {
+        entity_inst_t inst;
+        inst._name = entity_name_t::MASTER(i + 100);
+        // 对端只监听不accept,连接建立后握手阻塞,消息停留在发送队列中
+        // 测试结果只反映send_message查找对端和入队的开销
+        int fd = listen_peer(inst._addr);
+        if (0 > fd)
+        {
+            printf("listen peer failed, errno %d\n", errno);
+            return -1;
+        }
+
+        fds.push_back(fd);
+        peers.push_back(inst);
+    }
+
+    Messenger* msgr = Messenger::create("simple", entity_name_t::MASTER(1), "bench");
+    msgr->set_default_policy(Messenger::Policy::lossless_peer());
+    msgr->start();
+
+    utime_t start = clock_now();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_num; i++)
+    {
+        threads.push_back(std::thread(send_func, msgr, &peers, i, send_num, batch));
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    double elapsed = (double)(clock_now() - start);
+    uint64_t total = (uint64_t)thread_num * send_num;
+
+    printf("threads %d peers %d msgs %lu batch %d: %.3f s, %.0f sends/s, %.1f ns/send\n",
+           thread_num, peer_num, total, batch, elapsed, total / elapsed, elapsed * 1000000000 / total);
+
+    msgr->shutdown();
+    msgr->wait();
+    delete msgr;
+
+    for (size_t i = 0; i < fds.size(); i++)
+    {
+        ::close(fds[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <vector>
+#include "time_utils.h"
+#include "mutex.h"
+#include "cond.h"
+#include "thread.h"
+#include "mpsc_ring.h"
+#include "message.h"
+#include "mping.h"
+#include "dispatcher.h"
+#include "simple_messenger.h"
+
+#define PRODUCER_NUM 4
+#define RING_MSG_NUM 100000
+// 本地消息数远大于DQ_LOCAL_RING_SIZE,保证消费者阻塞时会进入暂存链表
+#define LOCAL_MSG_NUM 5000
+// 等待本地消息处理完的最长时间,单位秒
+#define RUN_TIMEOUT 60
+
+static int failed = 0;
+
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++failed; \
+        } \
+    } while(0)
+
+// 单线程反复放满取空,位置序号多次越过环的大小
+static void test_wraparound()
+{
+    MpscRing<uint64_t> ring(8);
+    uint64_t v = 0;
+    CHECK(ring.empty());
+    CHECK(!ring.pop(v));
+
+    uint64_t next_push = 0;
+    uint64_t next_pop = 0;
+    int held = 0;
+    for (int round = 0; round < 1000; round++)
+    {
+        int n = round % 8 + 1;
+        if (n > 8 - held)
+        {
+            n = 8 - held;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            CHECK(ring.push(next_push++));
+        }
+
+        held += n;
+        CHECK(!ring.empty());
+
+        // 放满后再放入失败
+        if (8 == held)
+        {
+            CHECK(!ring.push(next_push));
+        }
+
+        // 部分轮次留下一个,下一轮从环的中间开始
+        int m = (round % 3) ? held : held - 1;
+        for (int i = 0; i < m; i++)
+        {
+            CHECK(ring.pop(v));
+            CHECK(next_pop++ == v);
+        }
+
+        held -= m;
+    }
+
+    while (ring.pop(v))
+    {
+        CHECK(next_pop++ == v);
+    }
+
+    CHECK(next_push == next_pop);
+    CHECK(ring.empty());
+}
+
+class RingProducer : public Thread
+{
+public:
+    RingProducer(MpscRing<uint64_t>* ring, uint64_t id) : _ring(ring), _id(id) {}
+
+    void entry()
+    {
+        for (uint64_t i = 0; i < RING_MSG_NUM; i++)
+        {
+            // 队列满时等待消费者
+            while (!_ring->push((_id << 32) | i))
+            {
+                sched_yield();
+            }
+        }
+    }
+
+private:
+    MpscRing<uint64_t>* _ring;
+    uint64_t _id;
+};
+
+// 多个生产者同时写入小队列,每个生产者的元素不丢失,不重复且保持顺序
+static void test_producers()
+{
+    MpscRing<uint64_t> ring(64);
+    std::vector<RingProducer*> producers;
+    for (int i = 0; i < PRODUCER_NUM; i++)
+    {
+        producers.push_back(new RingProducer(&ring, i));
+    }
+
+    for (int i = 0; i < PRODUCER_NUM; i++)
+    {
+        producers[i]->create();
+    }
+
+    std::vector<uint64_t> next(PRODUCER_NUM, 0);
+    uint64_t received = 0;
+    utime_t deadline = clock_now() + utime_t(RUN_TIMEOUT, 0);
+    while (received < (uint64_t)PRODUCER_NUM * RING_MSG_NUM && clock_now() < deadline)
+    {
+        uint64_t v = 0;
+        if (!ring.pop(v))
+        {
+            sched_yield();
+            continue;
+        }
+
+        uint64_t id = v >> 32;
+        CHECK(PRODUCER_NUM > id);
+        if (PRODUCER_NUM > id)
+        {
+            CHECK(next[id] == (v & 0xffffffff));
+            next[id] = (v & 0xffffffff) + 1;
+        }
+
+        received++;
+    }
+
+    for (int i = 0; i < PRODUCER_NUM; i++)
+    {
+        producers[i]->join();
+        delete producers[i];
+        CHECK(RING_MSG_NUM == next[i]);
+    }
+
+    uint64_t v = 0;
+    CHECK(!ring.pop(v));
+    CHECK(ring.empty());
+}
+
+// 记录每个发送线程的本地消息,open之前第一个消息阻塞本地消息线程
+class GateDispatcher : public Dispatcher
+{
+public:
+    explicit GateDispatcher(int total) : _total(total), _received(0), _open(false), _next(PRODUCER_NUM, 0), _errors(0) {}
+
+    bool ms_can_fast_dispatch_any() const { return true; }
+
+    bool ms_can_fast_dispatch(const Message* m) const { return true; }
+
+    void ms_fast_dispatch(Message* m)
+    {
+        MPing* ping = static_cast<MPing*>(m);
+
+        Mutex::Locker locker(_lock);
+        while (!_open)
+        {
+            _cond.wait(_lock);
+        }
+
+        if (PRODUCER_NUM <= ping->_stamp || _next[ping->_stamp] != ping->_seq)
+        {
+            _errors++;
+        }
+        else
+        {
+            _next[ping->_stamp]++;
+        }
+
+        if (++_received == _total)
+        {
+            _cond.signal();
+        }
+
+        m->dec();
+    }
+
+    bool ms_dispatch(Message* m)
+    {
+        ms_fast_dispatch(m);
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+
+    void open()
+    {
+        Mutex::Locker locker(_lock);
+        _open = true;
+        _cond.broadcast();
+    }
+
+    // 等待所有消息处理完,超时返回false
+    bool wait_done()
+    {
+        utime_t deadline = clock_now() + utime_t(RUN_TIMEOUT, 0);
+
+        Mutex::Locker locker(_lock);
+        while (_received < _total)
+        {
+            if (clock_now() > deadline)
+            {
+                return false;
+            }
+
+            _cond.timed_wait(_lock, 1000);
+        }
+
+        return true;
+    }
+
+    int _total;
+    int _received;
+    bool _open;
+    std::vector<uint64_t> _next;
+    int _errors;
+    Mutex _lock;
+    Cond _cond;
+};
+
+class LocalProducer : public Thread
+{
+public:
+    LocalProducer(Messenger* msgr, int id, int msgs) : _msgr(msgr), _id(id), _msgs(msgs) {}
+
+    void entry()
+    {
+        Connection* con = _msgr->get_loopback_connection();
+        for (int i = 0; i < _msgs; i++)
+        {
+            con->send_message(new MPing(MPing::OP_PING, i, _id));
+        }
+    }
+
+private:
+    Messenger* _msgr;
+    int _id;
+    int _msgs;
+};
+
+// 本地消息线程阻塞时环形队列被放满,其余消息进入暂存链表,放开后所有消息按发送线程内的顺序各处理一次
+static void test_overflow(bool gated)
+{
+    int total = PRODUCER_NUM * LOCAL_MSG_NUM;
+    GateDispatcher dispatcher(total);
+    if (!gated)
+    {
+        dispatcher.open();
+    }
+
+    SimpleMessenger* msgr = new SimpleMessenger(entity_name_t::SVR(0), "mpsc_ring_test");
+    msgr->add_dispatcher_head(&dispatcher);
+    msgr->start();
+
+    std::vector<LocalProducer*> producers;
+    for (int i = 0; i < PRODUCER_NUM; i++)
+    {
+        producers.push_back(new LocalProducer(msgr, i, LOCAL_MSG_NUM));
+    }
+
+    for (int i = 0; i < PRODUCER_NUM; i++)
+    {
+        producers[i]->create();
+    }
+
+    // 发送不会阻塞,全部发送完后才放开本地消息线程
+    for (int i = 0; i < PRODUCER_NUM; i++)
+    {
+        producers[i]->join();
+        delete producers[i];
+    }
+
+    dispatcher.open();
+    CHECK(dispatcher.wait_done());
+
+    {
+        Mutex::Locker locker(dispatcher._lock);
+        CHECK(total == dispatcher._received);
+        CHECK(0 == dispatcher._errors);
+        for (int i = 0; i < PRODUCER_NUM; i++)
+        {
+            CHECK(LOCAL_MSG_NUM == dispatcher._next[i]);
+        }
+    }
+
+    msgr->shutdown();
+    msgr->wait();
+    delete msgr;
+
+    // 关闭后没有多处理的消息
+    CHECK(total == dispatcher._received);
+}
+
+int main(int argc, char* argv[])
+{
+    test_wraparound();
+    test_producers();
+    test_overflow(true);
+    test_overflow(false);
+
+    if (failed)
+    {
+        printf("mpsc_ring_test: %d checks failed\n", failed);
+        return 1;
+    }
+
+    printf("mpsc_ring_test: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sstream>
+#include <vector>
+#include "time_utils.h"
+#include "mutex.h"
+#include "cond.h"
+#include "message.h"
+#include "mping.h"
+#include "dispatcher.h"
+#include "simple_messenger.h"
+
+#define ROUND_NUM 200
+// 单轮测试的最长时间,单位秒
+#define RUN_TIMEOUT 120
+
+struct BenchConfig
+{
+    bool multicast;
+    int peers;
+    uint32_t size;
+    int rounds;
+};
+
+// 统计编码次数的PING,对端按PING解码
+class CountPing : public MPing
+{
+public:
+    CountPing(uint64_t seq) : MPing(MPing::OP_PING, seq, 0) {}
+
+    void encode_payload()
+    {
+        __atomic_fetch_add(&_encodes, 1, __ATOMIC_RELAXED);
+        MPing::encode_payload();
+    }
+
+    static uint64_t _encodes;
+};
+
+uint64_t CountPing::_encodes = 0;
+
+// 所有对端共享接收计数
+class CountServer : public Dispatcher
+{
+public:
+    CountServer(Mutex* lock, Cond* cond, int* received) : _lock(lock), _cond(cond), _received(received) {}
+
+    bool ms_dispatch(Message* m)
+    {
+        Mutex::Locker locker(*_lock);
+        (*_received)++;
+        _cond->signal();
+
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+
+private:
+    Mutex* _lock;
+    Cond* _cond;
+    int* _received;
+};
+
+class NullDispatcher : public Dispatcher
+{
+public:
+    bool ms_dispatch(Message* m)
+    {
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+};
+
+static double cpu_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 等待收到expect个消息,超时返回false
+static bool wait_received(Mutex& lock, Cond& cond, int& received, int expect)
+{
+    utime_t deadline = clock_now() + utime_t(RUN_TIMEOUT, 0);
+
+    Mutex::Locker locker(lock);
+    while (received < expect)
+    {
+        if (clock_now() > deadline)
+        {
+            return false;
+        }
+
+        cond.timed_wait(lock, 1000);
+    }
+
+    return true;
+}
+
+static void send_round(Messenger* msgr, const std::vector<entity_inst_t>& peers, const buffer& data, uint64_t seq, bool multicast)
+{
+    if (multicast)
+    {
+        CountPing* m = new CountPing(seq);
+        m->set_data(data);
+        msgr->send_multicast(m, peers);
+        return;
+    }
+
+    for (size_t i = 0; i < peers.size(); i++)
+    {
+        CountPing* m = new CountPing(seq);
+        m->set_data(data);
+        msgr->send_message(m, peers[i]);
+    }
+}
+
+static void bench(const BenchConfig& cfg)
+{
+    Mutex lock;
+    Cond cond;
+    int received = 0;
+    CountServer server_dispatcher(&lock, &cond, &received);
+
+    std::vector<SimpleMessenger*> servers;
+    std::vector<entity_inst_t> peers;
+    for (int i = 0; i < cfg.peers; i++)
+    {
+        SimpleMessenger* server = new SimpleMessenger(entity_name_t::SVR(i), "multicast_server");
+        server->set_default_policy(Messenger::Policy::stateless_server());
+        if (server->bind(entity_addr_t("127.0.0.1:0")))
+        {
+            printf("server bind failed\n");
+            delete server;
+            break;
+        }
+
+        server->add_dispatcher_head(&server_dispatcher);
+        server->start();
+
+        servers.push_back(server);
+        peers.push_back(entity_inst_t(server->get_entity_name(), server->get_entity_addr()));
+    }
+
+    NullDispatcher client_dispatcher;
+    SimpleMessenger* client = new SimpleMessenger(entity_name_t::CLI(0), "multicast_client");
+    client->set_default_policy(Messenger::Policy::lossy_client());
+    client->bind(entity_addr_t("127.0.0.1:0"));
+    client->add_dispatcher_head(&client_dispatcher);
+    client->start();
+
+    buffer data;
+    if (cfg.size)
+    {
+        data.push_back(ptr(cfg.size));
+        memset(data.c_str(), 'm', cfg.size);
+    }
+
+    // 先发送一轮建立连接,不计入结果
+    send_round(client, peers, data, 0, cfg.multicast);
+    bool ok = wait_received(lock, cond, received, peers.size());
+
+    lock.lock();
+    received = 0;
+    lock.unlock();
+    __atomic_store_n(&CountPing::_encodes, 0, __ATOMIC_RELAXED);
+
+    utime_t start = clock_now();
+    double cpu_start = cpu_now();
+    double send_time = 0;
+    for (int r = 0; ok && r < cfg.rounds; r++)
+    {
+        utime_t send_start = clock_now();
+        send_round(client, peers, data, r + 1, cfg.multicast);
+        send_time += (double)(clock_now() - send_start);
+    }
+
+    ok = ok && wait_received(lock, cond, received, cfg.rounds * peers.size());
+    double elapsed = (double)(clock_now() - start);
+    double cpu = cpu_now() - cpu_start;
+
+    if (ok)
+    {
+        printf("%9s %5d %8u  %9.1f %9.1f %9.1f  %8lu\n", cfg.multicast ? "multicast" : "unicast",
+               (int)peers.size(), cfg.size, send_time * 1e6 / cfg.rounds, elapsed * 1e6 / cfg.rounds,
+               cpu * 1e6 / cfg.rounds, (unsigned long)CountPing::_encodes);
+    }
+    else
+    {
+        printf("%9s %5d %8u  timeout\n", cfg.multicast ? "multicast" : "unicast", (int)peers.size(), cfg.size);
+    }
+
+    fflush(stdout);
+
+    client->shutdown();
+    client->wait();
+    delete client;
+
+    for (size_t i = 0; i < servers.size(); i++)
+    {
+        servers[i]->shutdown();
+        servers[i]->wait();
+        delete servers[i];
+    }
+}
+
+static std::vector<int> parse_list(const char* arg)
+{
+    std::vector<int> v;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        v.push_back(atoi(item.c_str()));
+    }
+
+    return v;
+}
+
+static void usage(const char* name)
+{
+    printf("usage: %s [-p peers] [-s sizes] [-n rounds]\n", name);
+    printf("  lists are comma separated, every combination is run with unicast and multicast\n");
+    printf("  send: time in the send calls per round, round: time until every peer received, cpu: process cpu per round\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<int> peers = parse_list("8,50");
+    std::vector<int> sizes = parse_list("0,65536");
+    int rounds = ROUND_NUM;
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "p:s:n:h")))
+    {
+        switch (opt)
+        {
+            case 'p': peers = parse_list(optarg); break;
+            case 's': sizes = parse_list(optarg); break;
+            case 'n': rounds = atoi(optarg); break;
+            default: usage(argv[0]); return 0;
+        }
+    }
+
+    printf("%9s %5s %8s  %9s %9s %9s  %8s\n", "mode", "peers", "size", "send(us)", "round(us)", "cpu(us)", "encodes");
+
+    for (size_t p = 0; p < peers.size(); p++)
+    {
+        for (size_t s = 0; s < sizes.size(); s++)
+        {
+            for (int multicast = 0; multicast < 2; multicast++)
+            {
+                BenchConfig cfg;
+                cfg.multicast = multicast;
+                cfg.peers = peers[p];
+                cfg.size = sizes[s];
+                cfg.rounds = rounds;
+                bench(cfg);
+            }
+        }
+    }
+
+    return 0;
+}
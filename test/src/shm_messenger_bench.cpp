@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+#include <vector>
+#include "time_utils.h"
+#include "mutex.h"
+#include "cond.h"
+#include "message.h"
+#include "mping.h"
+#include "dispatcher.h"
+#include "simple_messenger.h"
+#include "shm_messenger.h"
+
+#define MSG_NUM 20000
+// 单轮测试的最长时间,单位秒
+#define RUN_TIMEOUT 60
+
+enum
+{
+    TRANSPORT_TCP,
+    TRANSPORT_LOCAL,
+    TRANSPORT_SHM
+};
+
+static const char* transport_names[] = {"tcp", "local", "shm"};
+
+struct BenchConfig
+{
+    uint32_t size;
+    int conns;
+    int window;
+    int transport;
+    int msgs;
+};
+
+// 收到PING后立即回复PONG
+class PingServer : public Dispatcher
+{
+public:
+    bool ms_dispatch(Message* m)
+    {
+        MPing* ping = static_cast<MPing*>(m);
+        if (MPing::OP_PING == ping->_op)
+        {
+            MPing* pong = new MPing(MPing::OP_PONG, ping->_seq, ping->_stamp);
+            ping->get_connection()->send_message(pong);
+        }
+
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+};
+
+// 保持window个PING在途,每收到一个PONG记录往返时间并补发一个
+class PingClient : public Dispatcher
+{
+public:
+    PingClient(Messenger* msgr, const entity_inst_t& server, const BenchConfig& cfg, Mutex* done_lock, Cond* done_cond, int* done)
+        : _msgr(msgr), _server(server), _cfg(cfg), _total(0), _sent(0), _received(0),
+          _done_lock(done_lock), _done_cond(done_cond), _done(done)
+    {
+        if (cfg.size)
+        {
+            _data.push_back(ptr(cfg.size));
+            memset(_data.c_str(), 'p', cfg.size);
+        }
+    }
+
+    void run(int total)
+    {
+        Mutex::Locker locker(_lock);
+        _total = total;
+        _sent = 0;
+        _received = 0;
+        _latency.clear();
+        _latency.reserve(total);
+
+        while (_sent < _total && _sent < _cfg.window)
+        {
+            send_ping();
+        }
+    }
+
+    bool ms_dispatch(Message* m)
+    {
+        MPing* pong = static_cast<MPing*>(m);
+        uint64_t now = clock_now().to_nsec();
+
+        Mutex::Locker locker(_lock);
+        _latency.push_back(now - pong->_stamp);
+        _received++;
+
+        if (_sent < _total)
+        {
+            send_ping();
+        }
+
+        if (_received == _total)
+        {
+            Mutex::Locker done_locker(*_done_lock);
+            (*_done)++;
+            _done_cond->signal();
+        }
+
+        m->dec();
+        return true;
+    }
+
+    bool ms_handle_reset(Connection* con) { return true; }
+    void ms_handle_remote_reset(Connection* con) {}
+    bool ms_handle_refused(Connection* con) { return true; }
+
+    const std::vector<uint64_t>& latency() const { return _latency; }
+
+private:
+    void send_ping()
+    {
+        MPing* ping = new MPing(MPing::OP_PING, _sent++, clock_now().to_nsec());
+        ping->set_data(_data);
+        _msgr->send_message(ping, _server);
+    }
+
+    Messenger* _msgr;
+    entity_inst_t _server;
+    BenchConfig _cfg;
+    buffer _data;
+
+    Mutex _lock;
+    int _total;
+    int _sent;
+    int _received;
+    std::vector<uint64_t> _latency;
+
+    Mutex* _done_lock;
+    Cond* _done_cond;
+    int* _done;
+};
+
+static Messenger* create_messenger(int transport, entity_name_t name, const char* mname)
+{
+    if (TRANSPORT_SHM == transport)
+    {
+        return new ShmMessenger(name, mname);
+    }
+
+    return new SimpleMessenger(name, mname);
+}
+
+static entity_addr_t bench_addr(int transport)
+{
+    entity_addr_t addr("127.0.0.1:0");
+    if (TRANSPORT_LOCAL == transport)
+    {
+        addr.set_type(entity_addr_t::TYPE_LOCAL);
+    }
+
+    return addr;
+}
+
+static double percentile(const std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+
+    size_t i = (size_t)(p * (sorted.size() - 1));
+    return sorted[i] / 1000.0;
+}
+
+// 等待所有客户端完成,超时返回false
+static bool wait_done(Mutex& lock, Cond& cond, int& done, int conns)
+{
+    utime_t deadline = clock_now() + utime_t(RUN_TIMEOUT, 0);
+
+    Mutex::Locker locker(lock);
+    while (done < conns)
+    {
+        if (clock_now() > deadline)
+        {
+            return false;
+        }
+
+        cond.timed_wait(lock, 1000);
+    }
+
+    return true;
+}
+
+static void bench(const BenchConfig& cfg)
+{
+    PingServer server_dispatcher;
+    Messenger* server = create_messenger(cfg.transport, entity_name_t::SVR(0), "bench_server");
+    server->set_default_policy(Messenger::Policy::stateless_server());
+    if (server->bind(bench_addr(cfg.transport)))
+    {
+        printf("server bind failed\n");
+        delete server;
+        return;
+    }
+
+    server->add_dispatcher_head(&server_dispatcher);
+    server->start();
+
+    entity_inst_t server_inst(server->get_entity_name(), server->get_entity_addr());
+
+    Mutex done_lock;
+    Cond done_cond;
+    int done = 0;
+
+    std::vector<Messenger*> clients;
+    std::vector<PingClient*> dispatchers;
+    for (int i = 0; i < cfg.conns; i++)
+    {
+        Messenger* client = create_messenger(cfg.transport, entity_name_t::CLI(i + 1), "bench_client");
+        client->set_default_policy(Messenger::Policy::lossy_client());
+        // 各客户端使用不同的端口,服务端按地址区分连接
+        client->bind(bench_addr(cfg.transport));
+
+        PingClient* dispatcher = new PingClient(client, server_inst, cfg, &done_lock, &done_cond, &done);
+        client->add_dispatcher_head(dispatcher);
+        client->start();
+
+        clients.push_back(client);
+        dispatchers.push_back(dispatcher);
+    }
+
+    // 先完成一次往返建立连接,不计入结果
+    for (int i = 0; i < cfg.conns; i++)
+    {
+        dispatchers[i]->run(1);
+    }
+
+    bool ok = wait_done(done_lock, done_cond, done, cfg.conns);
+    int per_conn = cfg.msgs / cfg.conns;
+
+    utime_t start = clock_now();
+    if (ok)
+    {
+        done_lock.lock();
+        done = 0;
+        done_lock.unlock();
+
+        for (int i = 0; i < cfg.conns; i++)
+        {
+            dispatchers[i]->run(per_conn);
+        }
+
+        ok = wait_done(done_lock, done_cond, done, cfg.conns);
+    }
+
+    double elapsed = (double)(clock_now() - start);
+
+    if (ok)
+    {
+        std::vector<uint64_t> latency;
+        for (int i = 0; i < cfg.conns; i++)
+        {
+            latency.insert(latency.end(), dispatchers[i]->latency().begin(), dispatchers[i]->latency().end());
+        }
+
+        std::sort(latency.begin(), latency.end());
+
+        uint64_t total = (uint64_t)per_conn * cfg.conns;
+        printf("%-9s %8u %5d %6d  %10.0f %9.1f  %9.1f %9.1f %9.1f\n",
+               transport_names[cfg.transport], cfg.size, cfg.conns, cfg.window,
+               total / elapsed, total * cfg.size / elapsed / (1 << 20),
+               percentile(latency, 0.5), percentile(latency, 0.99), percentile(latency, 0.999));
+    }
+    else
+    {
+        printf("%-9s %8u %5d %6d  timeout\n", transport_names[cfg.transport], cfg.size, cfg.conns, cfg.window);
+    }
+
+    fflush(stdout);
+
+    for (int i = 0; i < cfg.conns; i++)
+    {
+        clients[i]->shutdown();
+        clients[i]->wait();
+        delete clients[i];
+        delete dispatchers[i];
+    }
+
+    server->shutdown();
+    server->wait();
+    delete server;
+}
+
+static std::vector<int> parse_list(const char* arg)
+{
+    std::vector<int> v;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        v.push_back(atoi(item.c_str()));
+    }
+
+    return v;
+}
+
+static void usage(const char* name)
+{
+    printf("usage: %s [-t transports] [-s sizes] [-c conns] [-w windows] [-n msgs]\n", name);
+    printf("  lists are comma separated, every combination is run\n");
+    printf("  transport: %d tcp loopback, %d unix socket, %d shared memory\n", TRANSPORT_TCP, TRANSPORT_LOCAL, TRANSPORT_SHM);
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<int> transports = parse_list("0,2");
+    std::vector<int> sizes = parse_list("64,4096,65536,1048576");
+    std::vector<int> conns = parse_list("1");
+    std::vector<int> windows = parse_list("1,32");
+    int msgs = MSG_NUM;
+
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "t:s:c:w:n:h")))
+    {
+        switch (opt)
+        {
+            case 't': transports = parse_list(optarg); break;
+            case 's': sizes = parse_list(optarg); break;
+            case 'c': conns = parse_list(optarg); break;
+            case 'w': windows = parse_list(optarg); break;
+            case 'n': msgs = atoi(optarg); break;
+            default: usage(argv[0]); return 0;
+        }
+    }
+
+    printf("%-9s %8s %5s %6s  %10s %9s  %9s %9s %9s\n",
+           "transport", "size", "conns", "window", "msgs/s", "MB/s", "p50(us)", "p99(us)", "p999(us)");
+
+    for (size_t s = 0; s < sizes.size(); s++)
+    {
+        for (size_t c = 0; c < conns.size(); c++)
+        {
+            for (size_t w = 0; w < windows.size(); w++)
+            {
+                for (size_t t = 0; t < transports.size(); t++)
+                {
+                    if (TRANSPORT_TCP > transports[t] || TRANSPORT_SHM < transports[t])
+                    {
+                        continue;
+                    }
+
+                    BenchConfig cfg;
+                    cfg.size = sizes[s];
+                    cfg.conns = conns[c];
+                    cfg.window = windows[w];
+                    cfg.transport = transports[t];
+                    cfg.msgs = msgs;
+                    bench(cfg);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
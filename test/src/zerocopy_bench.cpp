@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <thread>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "time_utils.h"
+#include "message.h"
+#include "msgr.h"
+#include "simple_messenger.h"
+#include "bench_utils.h"
+
+#define MSG_NUM 1000
+#define DATA_LEN (1 << 20)
+#define ZEROCOPY_THRESHOLD (64 << 10)
+
+class MBench : public Message
+{
+public:
+    MBench() : Message(0xffff) {}
+
+    void encode_payload() {}
+    void decode_payload() {}
+    const char* get_type_name() const { return "bench"; }
+};
+
+static bool read_full(int fd, char* buf, size_t len)
+{
+    while (0 < len)
+    {
+        ssize_t r = ::read(fd, buf, len);
+        if (0 >= r)
+        {
+            return false;
+        }
+
+        buf += r;
+        len -= r;
+    }
+
+    return true;
+}
+
+// 模拟接收端,按accept的流程完成握手后只读取并丢弃数据,不解码也不回ack
+// 读完total字节后记录结束时间
+static void sink_func(int lfd, entity_addr_t addr, uint64_t total, utime_t* end)
+{
+    sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    int fd = ::accept(lfd, (sockaddr*)&ss, &len);
+    if (0 > fd)
+    {
+        return;
+    }
+
+    entity_addr_t peer_addr;
+    peer_addr.set_sockaddr((sockaddr*)&ss);
+
+    buffer bl;
+    bl.append(MSGR_BANNER, strlen(MSGR_BANNER));
+    ::encode(addr, bl);
+    ::encode(peer_addr, bl);
+    if ((ssize_t)bl.length() != ::write(fd, bl.c_str(), bl.length()))
+    {
+        ::close(fd);
+        return;
+    }
+
+    char hello[strlen(MSGR_BANNER) + sizeof(entity_addr_t) + sizeof(msg_connect)];
+    if (!read_full(fd, hello, sizeof(hello)))
+    {
+        ::close(fd);
+        return;
+    }
+
+    msg_connect_reply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.tag = MSGR_TAG_READY;
+    reply.flags = MSG_CONNECT_LOSSY;
+    if ((ssize_t)sizeof(reply) != ::write(fd, &reply, sizeof(reply)))
+    {
+        ::close(fd);
+        return;
+    }
+
+    char buf[256 << 10];
+    while (0 < total)
+    {
+        ssize_t r = ::read(fd, buf, total < sizeof(buf) ? total : sizeof(buf));
+        if (0 >= r)
+        {
+            break;
+        }
+
+        total -= r;
+    }
+
+    *end = clock_now();
+    ::close(fd);
+}
+
+// 通过本地回环发送num个数据长度为data_len的消息,threshold为0时使用普通拷贝发送
+static void bench(int num, uint32_t data_len, uint32_t threshold)
+{
+    entity_inst_t inst;
+    inst._name = entity_name_t::MASTER(100);
+    int lfd = listen_peer(inst._addr);
+    if (0 > lfd)
+    {
+        printf("listen peer failed, errno %d\n", errno);
+        return;
+    }
+
+    SimpleMessenger* msgr = new SimpleMessenger(entity_name_t::MASTER(1), "bench");
+    msgr->set_default_policy(Messenger::Policy::lossy_client());
+    msgr->set_zerocopy(threshold);
+    // 只校验头部,避免数据crc掩盖拷贝的开销
+    msgr->_crc_flag = MSG_CRC_HEADER;
+    msgr->start();
+
+    // 所有消息共享同一块数据
+    buffer data;
+    data.push_back(ptr(data_len));
+    memset(data.c_str(), 'z', data_len);
+
+    uint64_t total = (uint64_t)num * (1 + sizeof(msg_header) + data_len + sizeof(msg_footer));
+    utime_t end;
+    std::thread sink(sink_func, lfd, inst._addr, total, &end);
+
+    utime_t start = clock_now();
+    for (int i = 0; i < num; i++)
+    {
+        MBench* m = new MBench();
+        m->set_data(data);
+        msgr->send_message(m, inst);
+    }
+
+    sink.join();
+
+    double elapsed = (double)(end - start);
+    uint64_t sends = 0;
+    uint64_t copied = 0;
+    msgr->get_zerocopy_stats(sends, copied);
+
+    printf("%-8s msgs %d x %u bytes: %.3f s, %.1f MB/s, zerocopy sends %lu copied %lu\n",
+           threshold ? "zerocopy" : "copy", num, data_len, elapsed,
+           (double)num * data_len / elapsed / (1 << 20), sends, copied);
+
+    msgr->shutdown();
+    msgr->wait();
+    delete msgr;
+
+    ::close(lfd);
+}
+
+int main(int argc, char* argv[])
+{
+    int num = argc > 1 ? atoi(argv[1]) : MSG_NUM;
+    uint32_t data_len = argc > 2 ? atoi(argv[2]) : DATA_LEN;
+    uint32_t threshold = argc > 3 ? atoi(argv[3]) : ZEROCOPY_THRESHOLD;
+
+    bench(num, data_len, 0);
+    bench(num, data_len, threshold);
+
+    return 0;
+}
@@ -55,7 +55,10 @@ public:
 
         ~ShmRLocker()
         {
-            _rwlock->un_rlock();
+            if (NULL != _rwlock)
+            {
+                _rwlock->un_rlock();
+            }
         }
     private:
         ShmRWLock* _rwlock;
@@ -1,6 +1,7 @@
 #ifndef _SHM_QUEUE_H_
 #define _SHM_QUEUE_H_
 
+#include <sys/uio.h>
 #include "shm_lock.h"
 #include "share_memory.h"
 
@@ -53,6 +54,14 @@ public:
      */
     int send(char* msg, uint32_t length);
 
+    /**
+     * 将多段数据作为一个消息写入共享内存
+     * @param iov 数据段
+     * @param iovcnt 数据段个数
+     * @return 空间不足时返回-1
+     */
+    int sendv(const struct iovec* iov, int iovcnt);
+
     /**
      * 读共享内存
      * @param msg 从共享内存中读取的数据
@@ -78,6 +87,27 @@ public:
      * 输出queue里的内容
      */
     void dump();
+
+    /**
+     * 队列是否为空
+     */
+    bool empty() { return 0 == get_data_size(); }
+
+    /**
+     * 队列剩余空间是否能写入length长度的消息
+     */
+    bool has_space(uint32_t length) { return length + sizeof(uint32_t) < get_free_size(); }
+
+    /**
+     * 读端等待写端通知,有数据、被通知或超时后返回
+     * @param timeout_ms 超时时间,单位毫秒
+     */
+    void wait(uint32_t timeout_ms);
+
+    /**
+     * 写端通知读端有新数据,读端没有等待时不做系统调用
+     */
+    void notify();
     
 private:
     // 获取共享内存queue剩余大小
@@ -115,6 +145,11 @@ private:
         uint32_t _queue_size;
         char __cache_padding5__[CACHE_LINE_SIZE];
         QueueMode _queue_mode;
+        char __cache_padding6__[CACHE_LINE_SIZE];
+        // 读端等待时使用的futex,写端通知时加1
+        volatile uint32_t _doorbell;
+        // 正在等待的读端个数
+        volatile uint32_t _waiters;
     };
 
 private:
@@ -16,6 +16,9 @@
 #include <stdlib.h> // size_t ssize_t
 
 #include "page.h"
+#include "spinlock.h"
+#include "ref_countable.h"
+#include "intarith.h"
 
 class raw;
 
@@ -31,6 +34,72 @@ raw* create_page_aligned(uint32_t len);
 raw* copy(const char* c, uint32_t len);
 
 
+/**
+ * 按大小分级缓存的缓冲池,从256B到1MB共13级
+ * 不小于一页的级别按页对齐申请,raw的最后一个ptr释放时内存自动归还缓冲池
+ * 尚未归还的raw持有缓冲池的引用,缓冲池在最后一个引用释放时销毁
+ */
+class BufferPool : public RefCountable
+{
+public:
+    static const uint32_t MIN_SHIFT = 8;
+    static const uint32_t MAX_SHIFT = 20;
+    static const uint32_t NUM_CLASSES = MAX_SHIFT - MIN_SHIFT + 1;
+
+    /**
+     * 构造函数
+     *
+     * @param max_bytes: 每一级最多缓存的内存大小
+     */
+    explicit BufferPool(uint32_t max_bytes = 4 << 20);
+
+    /**
+     * 申请内存,超过最大级别时直接申请不经过缓冲池
+     *
+     */
+    raw* create(uint32_t len);
+
+    raw* create_page_aligned(uint32_t len);
+
+    /**
+     * 获取命中及未命中次数
+     *
+     */
+    void get_stats(uint64_t& hits, uint64_t& misses) const
+    {
+        hits = atomic_read(&_hits);
+        misses = atomic_read(&_misses);
+    }
+
+protected:
+    virtual ~BufferPool();
+
+private:
+    friend class raw_pooled;
+
+    struct SizeClass
+    {
+        SpinLock _lock;
+        std::vector<char*> _free;
+    };
+
+    static uint32_t size_class(uint32_t len)
+    {
+        return (len <= (1U << MIN_SHIFT)) ? 0 : cbits(len - 1) - MIN_SHIFT;
+    }
+
+    raw* create_class(uint32_t cls, uint32_t len);
+
+    // raw释放时归还内存
+    void put(uint32_t cls, char* chunk);
+
+    uint32_t _max_bytes;
+    SizeClass _classes[NUM_CLASSES];
+    atomic_t _hits;
+    atomic_t _misses;
+};
+
+
 // raw部分数据段
 class ptr
 {
@@ -0,0 +1,118 @@
+#ifndef _MPSC_RING_H_
+#define _MPSC_RING_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// 多生产者单消费者的无锁有界环形队列
+// 每个位置带一个序号,生产者通过CAS占用位置,写完数据后更新序号发布
+// 消费者只能有一个,按占用顺序读出
+template <typename T>
+class MpscRing
+{
+public:
+    /**
+     * size需为2的幂
+     *
+     */
+    explicit MpscRing(uint32_t size) : _mask(size - 1), _head(0), _tail(0)
+    {
+        _cells = new Cell[size];
+        for (uint32_t i = 0; i < size; i++)
+        {
+            _cells[i]._seq = i;
+        }
+    }
+
+    ~MpscRing()
+    {
+        delete [] _cells;
+    }
+
+    /**
+     * 放入一个元素,队列满时返回false,可在多个线程中同时调用
+     *
+     */
+    bool push(const T& v)
+    {
+        Cell* cell;
+        uint64_t pos = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+        while (true)
+        {
+            cell = &_cells[pos & _mask];
+            int64_t dif = (int64_t)__atomic_load_n(&cell->_seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+            if (0 == dif)
+            {
+                // 失败时pos被更新为最新的_tail
+                if (__atomic_compare_exchange_n(&_tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                {
+                    break;
+                }
+            }
+            // 该位置还未被消费者读出,队列已满
+            else if (0 > dif)
+            {
+                return false;
+            }
+            else
+            {
+                pos = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+            }
+        }
+
+        cell->_data = v;
+        __atomic_store_n(&cell->_seq, pos + 1, __ATOMIC_RELEASE);
+
+        return true;
+    }
+
+    /**
+     * 取出一个元素,没有已发布的元素时返回false,只能在消费者线程中调用
+     *
+     */
+    bool pop(T& v)
+    {
+        Cell* cell = &_cells[_head & _mask];
+        if (__atomic_load_n(&cell->_seq, __ATOMIC_ACQUIRE) != _head + 1)
+        {
+            return false;
+        }
+
+        v = cell->_data;
+        // 位置留给下一轮的生产者
+        __atomic_store_n(&cell->_seq, _head + _mask + 1, __ATOMIC_RELEASE);
+        _head++;
+
+        return true;
+    }
+
+    /**
+     * 是否为空,生产者已占用但还未发布的位置也算作非空,只能在消费者线程中调用
+     *
+     */
+    bool empty() const
+    {
+        return __atomic_load_n(&_tail, __ATOMIC_ACQUIRE) == _head;
+    }
+
+private:
+    struct Cell
+    {
+        uint64_t _seq;
+        T _data;
+    };
+
+    MpscRing(const MpscRing& other);
+    MpscRing& operator=(const MpscRing& other);
+
+    Cell* _cells;
+    uint64_t _mask;
+    // 消费者和生产者的位置放在不同的cache line上
+    char __cache_padding1__[64];
+    uint64_t _head;
+    char __cache_padding2__[64];
+    uint64_t _tail;
+    char __cache_padding3__[64];
+};
+
+#endif
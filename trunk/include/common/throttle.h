@@ -73,4 +73,116 @@ private:
     std::list<Cond*> _conds;
 };
 
+// FairThrottle为占用少的连接预留的配额比例,为总配额的1/N
+// config
+#define FAIR_THROTTLE_RESERVE_DIV 8
+
+// 按连接加权公平分享的节流器
+// 总配额由当前占用或等待配额的连接按权重分享,份额内的请求只受总配额限制
+// 超出份额的请求只有在没有份额内的请求等待时才能借用空闲配额,总配额紧张时先被节流
+// 另外预留一小部分配额给占用少的连接,使其不会因重载连接占满配额而阻塞读线程
+class FairThrottle
+{
+public:
+    // 单个连接的配额,由连接持有
+    struct Account
+    {
+        Account() : _weight(1), _used(0), _waiting(0) {}
+
+        // 权重,份额为总配额 * 权重 / 活跃连接的权重和
+        uint32_t _weight;
+        // 已占用的配额
+        int64_t _used;
+        // 等待配额的请求数
+        int _waiting;
+    };
+
+    FairThrottle(const std::string& n, int64_t m = 0);
+    ~FairThrottle() {}
+
+    /**
+     * 获取配额,不足时等待,返回是否等待过
+     *
+     */
+    bool get(Account* a, int64_t c);
+
+    /**
+     * 获取配额,不足时返回false
+     *
+     */
+    bool get_or_fail(Account* a, int64_t c);
+
+    void put(Account* a, int64_t c);
+
+    /**
+     * 修改连接的权重
+     *
+     */
+    void set_weight(Account* a, uint32_t weight);
+
+    void reset_max(int64_t m);
+
+    int64_t get_current() const
+    {
+        Mutex::Locker locker(_lock);
+        return _count;
+    }
+
+    int64_t get_max() const
+    {
+        Mutex::Locker locker(_lock);
+        return _max;
+    }
+
+    /**
+     * 获取连接当前的份额
+     *
+     */
+    int64_t get_share(const Account* a) const
+    {
+        Mutex::Locker locker(_lock);
+        return _share(a);
+    }
+
+    /**
+     * 获取连接已占用的配额,不加锁
+     *
+     */
+    static int64_t get_used(const Account* a)
+    {
+        return __atomic_load_n(&a->_used, __ATOMIC_RELAXED);
+    }
+
+private:
+    static bool _active(const Account* a)
+    {
+        return a->_used || a->_waiting;
+    }
+
+    int64_t _share(const Account* a) const;
+
+    // 请求是否在份额内
+    bool _within_share(const Account* a, int64_t c) const
+    {
+        return 0 == a->_used || a->_used + c <= _share(a);
+    }
+
+    bool _can_take(const Account* a, int64_t c) const;
+
+    // 修改占用及等待数,同时维护活跃连接的权重和
+    void _update(Account* a, int64_t used, int waiting);
+
+    const std::string _name;
+    mutable Mutex _lock;
+    Cond _cond;
+    int64_t _max;
+    int64_t _count;
+    // 活跃连接的权重和
+    uint64_t _active_weight;
+    // 等待的请求数
+    int _waiters;
+    // 份额内等待的请求数
+    int _fair_waiters;
+};
+
 #endif
@@ -1,3 +1,6 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
 #include <map>
 #include <set>
 #include "mutex.h"
@@ -76,7 +79,7 @@ public:
     
     void shutdown();
     
-    // 延迟执行
+    // 延迟执行,以下接口都可以在回调函数中调用
     void add_event_after(int64_t seconds, Callback* cb);
     
     void add_event_at(utime_t when, Callback* cb);
@@ -110,3 +113,5 @@ private:
     typedef std::multimap<utime_t, Callback*>::iterator schedule_iter;
     typedef std::map<Callback*, schedule_iter>::iterator event_iter;
 };
+
+#endif
@@ -2,37 +2,126 @@
 #define _ACCEPTER_H_
 
 #include <set>
+#include <vector>
+#include <string>
 #include "thread.h"
+#include "mutex.h"
+#include "cond.h"
 #include "msg_types.h"
 
+// 监听队列长度,实际值受内核somaxconn限制
+// config
+#define ACCEPTER_BACKLOG 1024
+// 监听线程单次唤醒后最多accept的连接数
+#define ACCEPTER_BATCH 64
+// 连续accept失败的次数超过该值时监听线程退出
+#define ACCEPTER_MAX_ERRORS 4
+
 class SimpleMessenger;
 
-class Accepter : public Thread
+// 负责监听的accepter
+// 每个监听线程一个监听socket,多于一个时使用SO_REUSEPORT由内核在各监听socket之间分配连接
+// 监听线程只负责accept,创建socket及启动读线程在单独的线程中完成,握手在读线程中完成
+class Accepter
 {
 private:
+    // 监听线程
+    class Listener : public Thread
+    {
+    public:
+        Listener(Accepter* a, int fd) : _accepter(a), _fd(fd) {}
+
+        void entry()
+        {
+            _accepter->listen_entry(_fd);
+        }
+
+    private:
+        Accepter* _accepter;
+        int _fd;
+    };
+
+    // 将accept到的fd交给messenger的线程
+    class Handoff : public Thread
+    {
+    public:
+        explicit Handoff(Accepter* a) : _accepter(a) {}
+
+        void entry()
+        {
+            _accepter->handoff_entry();
+        }
+
+    private:
+        Accepter* _accepter;
+    } _handoff;
+
     SimpleMessenger* _msgr;
     // 是否停止
-    bool _done;
-    // 本地监听的文件描述符
-    int _listen_fd;
+    volatile bool _done;
+    // 监听线程数
+    unsigned _num_listeners;
+    // 监听队列长度
+    int _backlog;
+    // 本地监听的文件描述符,每个监听线程一个
+    std::vector<int> _listen_fds;
+    // unix socket监听的文件描述符及路径,地址类型为TYPE_LOCAL时使用
+    int _local_fd;
+    std::string _local_path;
+
+    std::vector<Listener*> _listeners;
+
+    // 保护_pending
+    Mutex _pending_lock;
+    Cond _pending_cond;
+    // 已accept,等待交给messenger的fd
+    std::vector<int> _pending;
 
     // 管道的读\写描述符
     int _shutdown_rd_fd;
     int _shutdown_wr_fd;
-    
+
     int create_socket(int* rd, int* wr);
 
+    /**
+     * 在指定地址上创建全部监听socket,失败时关闭已创建的socket
+     *
+     */
+    int open_listeners(const entity_addr_t& addr, bool reuse_addr);
+
+    void close_listeners();
+
+    int bind_local(const entity_addr_t& addr);
+
+    void close_local();
+
+    void listen_entry(int listen_fd);
+
+    void handoff_entry();
+
 public:
-    Accepter(SimpleMessenger* r) : _msgr(r), _done(false), _listen_fd(-1),
-                _shutdown_rd_fd(-1), _shutdown_wr_fd(-1)
+    Accepter(SimpleMessenger* r) : _handoff(this), _msgr(r), _done(false), _num_listeners(1),
+                _backlog(ACCEPTER_BACKLOG), _local_fd(-1), _shutdown_rd_fd(-1), _shutdown_wr_fd(-1)
     {}
-    
+
     /**
-     * 线程入口
+     * 设置监听线程数,需要在bind之前调用
      *
      */
-    void entry();
-                
+    void set_listeners(unsigned num)
+    {
+        _num_listeners = num ? num : 1;
+    }
+
+    /**
+     * 设置监听队列长度,需要在bind之前调用
+     *
+     */
+    void set_backlog(int backlog)
+    {
+        _backlog = backlog;
+    }
+
     /**
      * 停止线程
      *
@@ -44,7 +133,7 @@ public:
      *
      */
     int bind(const entity_addr_t& bind_addr, const std::set<int>& avoid_ports);
- 
+
     /**
      * 重新绑定
      *
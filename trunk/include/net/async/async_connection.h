@@ -0,0 +1,297 @@
+#ifndef _ASYNC_CONNECTION_H_
+#define _ASYNC_CONNECTION_H_
+
+#include <map>
+#include <list>
+#include <deque>
+#include "atomic.h"
+#include "buffer.h"
+#include "msgr.h"
+#include "message.h"
+#include "message_queue.h"
+#include "messenger.h"
+#include "connection.h"
+#include "netstack.h"
+
+class AsyncMessenger;
+
+// 基于epoll事件驱动的连接,读写及握手均在所属worker线程内以状态机方式完成
+// 与Socket的线路格式完全一致,可以和SimpleMessenger互通
+class AsyncConnection : public Connection, public EventHandler
+{
+public:
+    enum
+    {
+        STATE_NONE,
+        // 主动连接
+        STATE_CONNECTING,
+        STATE_CONNECTING_BANNER,
+        STATE_CONNECTING_ADDRS,
+        STATE_CONNECTING_REPLY,
+        // 被动连接
+        STATE_ACCEPTING_BANNER,
+        STATE_ACCEPTING_ADDR,
+        STATE_ACCEPTING_CONNECT,
+        // 连接建立,读取消息
+        STATE_OPEN,
+        STATE_OPEN_MESSAGE_HEADER,
+        STATE_OPEN_MESSAGE_THROTTLE,
+        STATE_OPEN_MESSAGE_FRONT,
+        STATE_OPEN_MESSAGE_MIDDLE,
+        STATE_OPEN_MESSAGE_DATA,
+        STATE_OPEN_MESSAGE_FOOTER,
+        STATE_OPEN_ACK,
+        STATE_OPEN_KEEPALIVE2,
+        STATE_OPEN_KEEPALIVE2_ACK,
+        // 连接空闲,有消息时再重连
+        STATE_STANDBY,
+        // 等待对端连接过来
+        STATE_WAIT,
+        STATE_CLOSED
+    };
+
+    AsyncConnection(AsyncMessenger* msgr, Worker* w);
+
+    virtual ~AsyncConnection();
+
+    /**
+     * 发起连接,可在任意线程调用
+     *
+     */
+    void connect(const entity_addr_t& addr, int type);
+
+    /**
+     * 处理accept到的fd,可在任意线程调用
+     *
+     */
+    void accept(int fd);
+
+    /**
+     * 将消息放入发送队列
+     *
+     */
+    void send(Message* m);
+
+    /**
+     * 关闭连接,可在任意线程调用
+     *
+     */
+    void queue_stop(bool queue_reset);
+
+    bool is_connected();
+
+    int send_message(Message* m);
+
+    void send_keepalive();
+
+    void mark_disposable();
+
+    void mark_down();
+
+    void handle_read();
+
+    void handle_write();
+
+    Worker* get_worker() { return _worker; }
+
+    bool is_closed() const { return atomic_read(&_closed); }
+
+    bool is_connecting() const { return STATE_CONNECTING <= _state && STATE_CONNECTING_REPLY >= _state; }
+
+    Messenger::Policy _policy;
+
+private:
+    // 投递到worker线程执行的回调
+    class HandleConnect;
+    class HandleAccept;
+    class HandleWrite;
+    class HandleStop;
+    class HandleReset;
+    class HandleReplace;
+    class HandleRelease;
+    class HandleReconnect;
+    class HandleThrottle;
+
+    void do_connect();
+
+    void do_accept(int fd);
+
+    void stop(bool queue_reset);
+
+    /**
+     * 读取len字节到buf,不足时返回1等待下一次可读事件
+     *
+     */
+    int read_until(char* buf, uint32_t len);
+
+    /**
+     * 处理读事件的状态机
+     *
+     */
+    void process();
+
+    /**
+     * 处理被动连接的connect请求
+     *
+     */
+    int handle_connect_msg(msg_connect& connect);
+
+    /**
+     * 处理主动连接的connect应答
+     *
+     */
+    int handle_connect_reply(msg_connect_reply& reply);
+
+    /**
+     * 接管另一个连接accept到的fd
+     *
+     */
+    void replace_fd(int fd, const msg_connect& connect);
+
+    /**
+     * 连接建立
+     *
+     */
+    void open(const msg_connect& connect);
+
+    /**
+     * 读取完整消息后分发
+     *
+     */
+    void handle_message();
+
+    /**
+     * 释放当前消息的节流
+     *
+     */
+    void release_throttle();
+
+    /**
+     * 出错处理,按策略重连或关闭
+     *
+     */
+    void fault();
+
+    /**
+     * 会话被对端重置
+     *
+     */
+    void was_session_reset();
+
+    /**
+     * 将未确认的消息重新放入发送队列
+     *
+     */
+    void requeue_sent();
+
+    void discard_out_queue();
+
+    void handle_ack(uint64_t seq);
+
+    bool is_queued() const { return !_out_q.empty() || _send_keepalive || _send_keepalive_ack; }
+
+    /**
+     * 获取下一个待发送的消息
+     *
+     */
+    Message* get_next_outgoing();
+
+    /**
+     * 将待发数据追加到发送缓冲
+     *
+     */
+    void append_out(const char* buf, uint32_t len);
+
+    void append_out(const buffer& bl);
+
+    /**
+     * 编码待发送的ack、心跳及消息
+     *
+     */
+    void prepare_send();
+
+    /**
+     * 将发送缓冲写入fd,返回0表示全部写完,1表示需要等待可写
+     *
+     */
+    int flush();
+
+    /**
+     * 在worker线程中触发一次写
+     *
+     */
+    void schedule_write();
+
+    /**
+     * 根据当前是否需要读写更新epoll事件
+     *
+     */
+    void update_event();
+
+    void close_fd();
+
+    void set_socket_options();
+
+    bool is_open_state() const { return STATE_OPEN <= _state && STATE_OPEN_KEEPALIVE2_ACK >= _state; }
+
+private:
+    AsyncMessenger* _async_msgr;
+    Worker* _worker;
+    int _fd;
+    int _state;
+    atomic_t _closed;
+
+    uint64_t _conn_id;
+
+    uint32_t _connect_seq;
+    uint32_t _peer_global_seq;
+
+    // 已接收的最大序号及已确认的序号
+    uint64_t _in_seq;
+    uint64_t _in_seq_acked;
+
+    // 当前状态已读取的字节数
+    uint32_t _state_offset;
+    char _banner[sizeof(MSGR_BANNER)];
+    char _addrs[sizeof(entity_addr_t) * 2];
+    msg_connect _connect_msg;
+    msg_connect_reply _connect_reply;
+    char _tag;
+    le64 _ack_seq;
+    struct timespec _keepalive_stamp;
+
+    // 正在读取的消息
+    msg_header _header;
+    msg_footer _footer;
+    ptr _front;
+    ptr _middle;
+    ptr _data;
+    uint64_t _message_size;
+    utime_t _recv_stamp;
+    utime_t _throttle_stamp;
+    uint32_t _throttle_stage;
+    bool _throttle_scheduled;
+
+    // 重连退避时间
+    utime_t _backoff;
+    bool _want_write;
+    uint32_t _events;
+
+    // 以下成员由_write_lock保护,发送线程与worker线程共享
+    Mutex _write_lock;
+    MessageQueue _out_q;
+    std::list<Message*> _sent;
+    uint64_t _out_seq;
+    bool _send_keepalive;
+    bool _send_keepalive_ack;
+    utime_t _keepalive_ack_stamp;
+    bool _write_scheduled;
+
+    // 只在worker线程中访问
+    std::deque<ptr> _out_ptrs;
+    uint32_t _out_ofs;
+
+    friend class AsyncMessenger;
+};
+
+#endif
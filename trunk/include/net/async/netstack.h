@@ -1,22 +1,158 @@
 #ifndef _NET_STACK_H_
 #define _NET_STACK_H_
 
-class Worker
+#include <vector>
+#include <deque>
+#include <map>
+#include <sys/epoll.h>
+#include "atomic.h"
+#include "mutex.h"
+#include "thread.h"
+#include "callback.h"
+#include "time_utils.h"
+
+// fd事件处理接口,由worker线程回调
+class EventHandler
 {
+public:
+    virtual ~EventHandler() {}
+
+    // fd可读
+    virtual void handle_read() = 0;
+
+    // fd可写
+    virtual void handle_write() = 0;
+};
+
+// 网络工作线程,每个worker拥有独立的epoll事件循环
+// 连接的所有读写及状态迁移都在其所属worker线程内完成
+class Worker : public Thread
+{
+public:
+    explicit Worker(unsigned id);
+
+    virtual ~Worker();
+
+    /**
+     * 创建epoll及唤醒用的eventfd
+     *
+     */
+    int init();
+
+    /**
+     * 事件循环
+     *
+     */
+    void entry();
+
+    /**
+     * 停止事件循环并等待线程退出
+     *
+     */
+    void shutdown();
+
+    /**
+     * 注册fd事件
+     *
+     */
+    int add_event(int fd, EventHandler* h, uint32_t events);
+
+    /**
+     * 修改fd关注的事件
+     *
+     */
+    int modify_event(int fd, EventHandler* h, uint32_t events);
+
+    /**
+     * 取消fd事件
+     *
+     */
+    int del_event(int fd);
+
+    /**
+     * 投递回调到worker线程执行,可在任意线程调用
+     *
+     */
+    void dispatch_external(Callback* cb);
+
+    /**
+     * 添加定时回调,到期后在worker线程执行
+     *
+     */
+    void add_timer(utime_t when, Callback* cb);
+
+    /**
+     * 当前线程是否为该worker
+     *
+     */
+    bool in_thread() const { return is_started() && am_self(); }
+
+    unsigned get_id() const { return _id; }
+
+    // 该worker上的连接数,用于负载均衡
+    atomic_t _references;
+
+private:
+    void wakeup();
+
+    void process_external();
+
+    // 执行到期的定时回调,返回下一个定时器的等待毫秒数,没有则返回-1
+    int process_timers();
+
+private:
+    unsigned _id;
+    int _epfd;
+    int _notify_fd;
+    volatile bool _done;
+
+    Mutex _external_lock;
+    std::deque<Callback*> _external_events;
+    std::multimap<utime_t, Callback*> _timers;
+
+    // 每次epoll_wait最多返回的事件数
+    static const int MAX_EVENTS = 128;
 };
 
+// 网络协议栈,管理固定数目的worker线程
 class NetworkStack
 {
 public:
-    NetworkStack();
+    explicit NetworkStack(unsigned num_workers);
+
     virtual ~NetworkStack();
 
+    /**
+     * 启动所有worker
+     *
+     */
+    int start();
+
+    /**
+     * 停止所有worker
+     *
+     */
+    void stop();
+
+    /**
+     * 选取连接数最少的worker
+     *
+     */
+    Worker* get_worker();
+
+    Worker* get_worker(unsigned i) { return _workers[i]; }
+
+    unsigned get_num_workers() const { return _num_workers; }
+
+    bool is_started() const { return _started; }
+
 protected:
-    std::vector
+    std::vector<Worker*> _workers;
+
 private:
     unsigned _num_workers = 0;
     bool _started = false;
-    SpinLock _spinlock;
+    Mutex _lock;
 };
 
-#endif
\ No newline at end of file
+#endif
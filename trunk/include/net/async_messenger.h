@@ -1,15 +1,278 @@
 #ifndef _ASYNC_MESSENGER_H_
 #define _ASYNC_MESSENGER_H_
 
+#include <set>
+#include <map>
+#include "log.h"
+#include "messenger.h"
+#include "dispatch_queue.h"
+#include "async/netstack.h"
+#include "async/async_connection.h"
+
+// 默认网络worker线程数
+#define ASYNC_MSGR_DEFAULT_WORKERS 3
+
+// 基于epoll的messenger
+// 固定数目的worker线程处理所有连接的读写,连接数增加不会增加线程数
 class AsyncMessenger : public PolicyMessenger
 {
 public:
     AsyncMessenger(entity_name_t name, std::string mname);
-    
+
     virtual ~AsyncMessenger();
-    
+
+    /**
+     * 设置worker线程数,需要在start之前调用
+     *
+     */
+    void set_worker_num(unsigned num);
+
+    /**
+     * 获取消息转发队列大小
+     *
+     */
+    int get_dispatch_queue_len()
+    {
+        return _dispatch_queue.get_queue_len();
+    }
+
+    /**
+     * 获取消息转发队列中最大时间
+     *
+     */
+    double get_dispatch_queue_max_age(utime_t now)
+    {
+        return _dispatch_queue.get_max_age(now);
+    }
+
+    /**
+     * 设置消息转发线程数,需要在start之前调用
+     *
+     */
+    void set_dispatch_threads(unsigned num)
+    {
+        _dispatch_queue.set_num_threads(num);
+    }
+
+    /**
+     * 设置快速转发线程数,需要在start之前调用
+     *
+     */
+    void set_fast_dispatch_threads(unsigned num)
+    {
+        _dispatch_queue.set_fast_threads(num);
+    }
+
+    /**
+     * 设置可以快速转发的本地消息是否直接在发送线程中转发
+     *
+     */
+    void set_local_fast_dispatch(bool on)
+    {
+        _dispatch_queue.set_local_inline(on);
+    }
+
+    /**
+     * 设置转发节流器的总配额,单位字节,为0时不限制
+     *
+     */
+    void set_dispatch_throttle_bytes(uint64_t bytes)
+    {
+        _dispatch_queue._dispatch_throttler.reset_max(bytes);
+    }
+
+    /**
+     * 设置消息延迟统计的采样间隔,为0时不统计
+     *
+     */
+    void set_latency_sample_every(uint32_t every)
+    {
+        _dispatch_queue._latency.set_sample_every(every);
+    }
+
+    /**
+     * 获取按消息类型统计的各阶段延迟直方图
+     *
+     */
+    void dump_latency(std::map<uint32_t, MessageLatencyStats>& stats)
+    {
+        _dispatch_queue._latency.dump(stats);
+    }
+
+    void reset_latency()
+    {
+        _dispatch_queue._latency.reset();
+    }
+
+    /**
+     * 绑定端口
+     *
+     */
+    int bind(const entity_addr_t& bind_addr);
+
+    /**
+     * 启动messenger
+     *
+     */
+    int start();
+
+    /**
+     * 等待messenger停止
+     *
+     */
+    void wait();
+
+    /**
+     * 停止messenger
+     *
+     */
+    int shutdown();
+
+    /**
+     * 根据地址信息发送消息
+     *
+     */
+    int send_message(Message* m, const entity_inst_t& dest);
+
+    /**
+     * 根据已有连接发送消息
+     *
+     */
+    int send_message(Message* m, Connection* con);
+
+    /**
+     * 根据地址获取连接
+     *
+     */
+    Connection* get_connection(const entity_inst_t& dest);
+
+    /**
+     * 获取本地连接
+     *
+     */
+    Connection* get_loopback_connection()
+    {
+        return _local_connection;
+    }
+
+    /**
+     * 根据地址信息停止连接
+     *
+     */
+    void mark_down(const entity_addr_t& addr);
+
+    /**
+     * 关闭所有连接
+     *
+     */
+    void mark_down_all();
+
+    /**
+     * 获取sequence
+     *
+     */
+    uint32_t get_global_seq(uint32_t old = 0)
+    {
+        Mutex::Locker locker(_global_seq_lock);
+
+        if (old > _global_seq)
+        {
+            _global_seq = old;
+        }
+
+        return ++_global_seq;
+    }
+
+protected:
+    void ready();
+
 private:
+    // 监听fd的事件处理
+    class Processor : public EventHandler
+    {
+    public:
+        explicit Processor(AsyncMessenger* m) : _msgr(m) {}
+
+        void handle_read();
+
+        void handle_write() {}
+
+    private:
+        AsyncMessenger* _msgr;
+    } _processor;
+
+    /**
+     * 创建主动连接
+     *
+     */
+    AsyncConnection* connect_rank(const entity_addr_t& addr, int type);
+
+    /**
+     * 处理accept到的fd
+     *
+     */
+    void add_accept(int fd);
+
+    void submit_message(Message* m, AsyncConnection* con, const entity_addr_t& dest_addr, int dest_type);
+
+    void init_local_connection();
+
+    /**
+     * 查找已有的连接
+     *
+     */
+    AsyncConnection* lookup_conn(const entity_addr_t& k)
+    {
+        std::map<entity_addr_t, AsyncConnection*>::iterator iter = _conns.find(k);
+        if (iter == _conns.end() || iter->second->is_closed())
+        {
+            return NULL;
+        }
+
+        return iter->second;
+    }
+
+    /**
+     * 注册连接,需持有_lock
+     *
+     */
+    void register_conn(AsyncConnection* con);
+
+    /**
+     * 注销连接,需持有_lock,返回连接是否由本messenger持有
+     *
+     */
+    bool unregister_conn(AsyncConnection* con);
+
+public:
+    // 消息转发队列
     DispatchQueue _dispatch_queue;
+
+    Mutex _lock;
+
+private:
+    NetworkStack* _stack;
+    unsigned _num_workers;
+
+    // 是否已绑定
+    bool _did_bind;
+    int _listen_fd;
+
+    uint32_t _global_seq;
+    Mutex _global_seq_lock;
+
+    // 已注册的连接
+    std::map<entity_addr_t, AsyncConnection*> _conns;
+
+    // 正在握手的被动连接
+    std::set<AsyncConnection*> _accepting_conns;
+
+    Cond _stop_cond;
+    bool _stopped;
+
+    Connection* _local_connection;
+
+    friend class AsyncConnection;
 };
 
-#endif
\ No newline at end of file
+#endif
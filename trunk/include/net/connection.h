@@ -4,6 +4,7 @@
 #include "time_utils.h"
 #include "ref_countable.h"
 #include "mutex.h"
+#include "throttle.h"
 
 class Messenger;
 class Message;
@@ -12,7 +13,8 @@ class Message;
 class Connection : public RefCountable
 {
 public:
-    Connection(Messenger* m) : _lock(), _msgr(m), _priv(NULL), _peer_type(-1), _failed(false), _rx_buffers_version(0)
+    Connection(Messenger* m) : _lock(), _msgr(m), _priv(NULL), _peer_type(-1), _srtt(0), _rttvar(0),
+                _rtt_samples(0), _last_seen_ns(0), _failed(false), _rx_buffers_version(0)
     {
     }
 
@@ -139,6 +141,85 @@ public:
         _last_keepalive_ack = t;
     }
 
+    /**
+     * 根据一次心跳的往返时间更新平滑往返时间及其偏差,算法同TCP(RFC 6298)
+     *
+     */
+    void update_rtt(const utime_t& sample)
+    {
+        Mutex::Locker locker(_lock);
+        double r = (double)sample;
+        if (0 == _rtt_samples++)
+        {
+            _srtt = r;
+            _rttvar = r / 2;
+        }
+        else
+        {
+            double err = r - _srtt;
+            _rttvar += ((err < 0 ? -err : err) - _rttvar) / 4;
+            _srtt += err / 8;
+        }
+    }
+
+    /**
+     * 获取平滑后的往返时间,单位秒,还没有测量过时为0
+     *
+     */
+    double get_rtt() const
+    {
+        Mutex::Locker locker(_lock);
+        return _srtt;
+    }
+
+    /**
+     * 获取往返时间的平均偏差,单位秒
+     *
+     */
+    double get_rtt_var() const
+    {
+        Mutex::Locker locker(_lock);
+        return _rttvar;
+    }
+
+    /**
+     * 获取已测量的往返时间次数
+     *
+     */
+    uint64_t get_rtt_samples() const
+    {
+        Mutex::Locker locker(_lock);
+        return _rtt_samples;
+    }
+
+    /**
+     * 获取最近一次收到对端数据的时间
+     *
+     */
+    utime_t get_last_seen() const
+    {
+        uint64_t ns = __atomic_load_n(&_last_seen_ns, __ATOMIC_RELAXED);
+        return utime_t(ns / 1000000000, ns % 1000000000);
+    }
+
+    /**
+     * 设置最近一次收到对端数据的时间,每个消息都会调用,不加锁
+     *
+     */
+    void set_last_seen(const utime_t& t)
+    {
+        __atomic_store_n(&_last_seen_ns, t.to_nsec(), __ATOMIC_RELAXED);
+    }
+
+    /**
+     * 获取该连接已收到但还未转发完成的消息字节数
+     *
+     */
+    int64_t get_dispatch_throttle_used() const
+    {
+        return FairThrottle::get_used(&_dispatch_account);
+    }
+
 public:
     mutable Mutex _lock;
     Messenger* _msgr;
@@ -152,6 +233,14 @@ public:
     utime_t _last_keepalive;
     // 最新的心跳ack时间
     utime_t _last_keepalive_ack;
+    // 平滑往返时间及其偏差,单位秒
+    double _srtt;
+    double _rttvar;
+    uint64_t _rtt_samples;
+    // 最近一次收到对端数据的时间,单位纳秒
+    uint64_t _last_seen_ns;
+    // 在转发节流器中的配额
+    FairThrottle::Account _dispatch_account;
 
     // 连接状态
     bool _failed;
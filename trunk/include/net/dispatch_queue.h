@@ -1,10 +1,20 @@
 #ifndef _DISPATCH_QUEUE_H
 #define _DISPATCH_QUEUE_H
 
+#include <vector>
 #include "thread.h"
 #include "messenger.h"
 #include "connection.h"
 #include "prioritizedqueue.h"
+#include "message_queue.h"
+#include "mpsc_ring.h"
+#include "message_latency.h"
+
+// 本地消息环形队列的长度,需为2的幂
+// config
+#define DQ_LOCAL_RING_SIZE 4096
+// 本地消息线程单次批量取出的消息数
+#define DQ_LOCAL_BATCH 64
 
 class Message;
 class Connection;
@@ -31,9 +41,10 @@ class DispatchQueue
             return _type;
         }
         
+        // 队列持有消息的引用,出队后由调用者负责释放
         Message* get_message()
         {
-            return _msg->get();
+            return _msg;
         }
         
         Connection* get_connection()
@@ -48,48 +59,136 @@ class DispatchQueue
     };
     
     Messenger* _msgr;
-    mutable Mutex _lock;
-    Cond _cond;
 
-    // 优先级队列
-    PrioritizedQueue<QueueItem, uint64_t> _mqueue;
+    // 转发分片,每个分片有独立的锁、优先级队列和转发线程
+    // 消息按连接id路由到分片,同一连接的消息始终由同一线程处理,保证连接内有序
+    class Shard
+    {
+    public:
+        // config
+        explicit Shard(DispatchQueue* dq) : _dq(dq), _lock(), _mqueue(16777216, 65536), _dispatch_thread(this)
+        {}
 
-    std::set< std::pair<double, Message*> > _marrival;
-    std::map<Message*, std::set< std::pair<double, Message*> >::iterator> _marrival_map;
-    
-    void add_arrival(Message* m)
+        DispatchQueue* _dq;
+        mutable Mutex _lock;
+        Cond _cond;
+
+        // 优先级队列
+        PrioritizedQueue<QueueItem, uint64_t> _mqueue;
+
+        // 按到达顺序记录队列中的消息,用于计算最大等待时间
+        ArrivalList _marrival;
+
+        void add_arrival(Message* m)
+        {
+            _marrival.push_back(m);
+        }
+
+        void remove_arrival(Message* m)
+        {
+            _marrival.remove(m);
+        }
+
+        // 发送线程,处理队列_mqueue中的消息
+        class DispatchThread : public Thread
+        {
+        private:
+            Shard* _shard;
+        public:
+            explicit DispatchThread(Shard* shard) : _shard(shard) {}
+            void entry()
+            {
+                _shard->_dq->entry(_shard);
+            }
+        } _dispatch_thread;
+    };
+
+    std::vector<Shard*> _shards;
+
+    // 等待快速转发的消息
+    struct FastItem
     {
-        _marrival_map.insert(std::make_pair(m, _marrival.insert(std::make_pair(m->get_recv_stamp(), m)).first));
+        uint64_t _id;
+        Message* _msg;
+    };
+
+    // 快速转发分片,消息按连接id路由,同一连接的消息由同一线程按提交顺序转发
+    // 开启后读线程只负责提交,dispatcher的ms_fast_dispatch在这些线程中调用
+    class FastShard
+    {
+    public:
+        explicit FastShard(DispatchQueue* dq) : _dq(dq), _lock(), _fast_thread(this)
+        {}
+
+        DispatchQueue* _dq;
+        Mutex _lock;
+        Cond _cond;
+        std::vector<FastItem> _queue;
+
+        class FastDispatchThread : public Thread
+        {
+        private:
+            FastShard* _shard;
+        public:
+            explicit FastDispatchThread(FastShard* shard) : _shard(shard) {}
+            void entry()
+            {
+                _shard->_dq->fast_entry(_shard);
+            }
+        } _fast_thread;
+    };
+
+    // 为空时快速转发直接在读线程中进行
+    std::vector<FastShard*> _fast_shards;
+
+    // 本地消息的id为0,由第一个分片处理
+    Shard* get_shard(uint64_t id)
+    {
+        return _shards[id % _shards.size()];
     }
-    
-    void remove_arrival(Message* m)
+
+    // 连接事件与该连接的消息由同一分片处理,id为连接的conn_id
+    // 事件固定放在类别0中,discard_queue(conn_id)不会把它当作消息丢弃
+    void queue_code(int code, Connection* con, uint64_t id)
     {
-        std::map<Message*, std::set<std::pair<double, Message*> >::iterator>::iterator i = _marrival_map.find(m);
-        _marrival.erase(i->second);
-        _marrival_map.erase(i);
+        Shard* shard = get_shard(id);
+        Mutex::Locker locker(shard->_lock);
+        if (_stop)
+        {
+            return;
+        }
+
+        shard->_mqueue.enqueue_strict(0, MSG_PRIO_HIGHEST, QueueItem(code, con));
+        shard->_cond.signal();
     }
 
     atomic_t _next_id;
     
     enum { D_CONNECT = 1, D_ACCEPT, D_BAD_REMOTE_RESET, D_BAD_RESET, D_CONN_REFUSED, D_NUM_CODES };
 
-    // 发送线程,处理队列_mqueue中的消息
-    class DispatchThread : public Thread
+    // 本地消息
+    struct LocalItem
     {
-    private:
-        DispatchQueue* _dq;
-    public:
-        explicit DispatchThread(DispatchQueue* dq) : _dq(dq) {}
-        void entry()
-        {
-            _dq->entry();
-        }
-    } _dispatch_thread;
+        Message* _msg;
+        int _priority;
+        // 是否已在发送线程中调用过fast_preprocess
+        bool _preprocessed;
+    };
+
+    // 本地消息的无锁队列,发送线程写入,本地消息线程批量取出
+    MpscRing<LocalItem> _local_ring;
 
+    // 保护_local_messages,本地消息线程在该锁上等待
     Mutex _local_delivery_lock;
     Cond _local_delivery_cond;
-    bool _stop_local_delivery;
-    std::list< std::pair<Message*, int> > _local_messages;
+    volatile bool _stop_local_delivery;
+    // 环形队列满时暂存的本地消息,不为空时后续消息都放入其中以保证顺序
+    std::list<LocalItem> _local_messages;
+    atomic_t _local_overflow;
+    // 本地消息线程是否在等待,发送线程据此决定是否需要唤醒
+    atomic_t _local_sleeping;
+    // 可以快速转发的本地消息是否直接在发送线程中处理
+    bool _local_inline;
 
     // 处理本地消息线程
     class LocalDeliveryThread : public Thread
@@ -104,85 +203,98 @@ class DispatchQueue
         }
     } _local_delivery_thread;
 
-    uint64_t pre_dispatch(Message* m);
-    void post_dispatch(Message* m, uint64_t msize);
+    void wake_local_delivery();
+
+    void deliver_local(LocalItem& item);
+
+    /**
+     * 转发前取出消息占用的节流配额,有配额时con返回消息所属连接并持有引用
+     * 转发后消息可能已释放,由post_dispatch通过连接归还配额
+     *
+     */
+    uint64_t pre_dispatch(Message* m, Connection** con);
+    void post_dispatch(Connection* con, uint64_t msize);
+
+    // 调用dispatcher转发,按采样间隔记录各阶段延迟
+    void deliver(Message* m, bool fast);
 
 public:
 
-    Throttle _dispatch_throttler;
+    // 所有连接共享的转发节流器,各连接按Policy中的权重分享
+    FairThrottle _dispatch_throttler;
+
+    // 按消息类型统计的各阶段延迟
+    MessageLatency _latency;
 
     bool _stop;
     void local_delivery(Message* m, int priority);
     void run_local_delivery();
 
-    double get_max_age(utime_t now) const;
-
-    int get_queue_len() const
+    /**
+     * 设置可以快速转发的本地消息是否直接在发送线程中转发
+     * 开启后dispatcher的ms_fast_dispatch可能在调用send_message的线程中被调用,发送时不能持有dispatcher需要的锁
+     *
+     */
+    void set_local_inline(bool on)
     {
-        Mutex::Locker locker(_lock);
-        return _mqueue.length();
+        _local_inline = on;
     }
 
-    void dispatch_throttle_release(uint64_t msize);
+    double get_max_age(utime_t now) const;
+
+    int get_queue_len() const;
 
-    void queue_connect(Connection* con)
+    /**
+     * 为连接收到的消息获取转发配额,不足时等待
+     *
+     */
+    void dispatch_throttle_get(Connection* con, uint64_t msize)
     {
-        Mutex::Locker locker(_lock);
-        if (_stop)
+        if (msize)
         {
-            return;
+            _dispatch_throttler.get(&con->_dispatch_account, msize);
         }
-        
-        _mqueue.enqueue_strict(0, MSG_PRIO_HIGHEST, QueueItem(D_CONNECT, con));
-        _cond.signal();
+    }
+
+    bool dispatch_throttle_get_or_fail(Connection* con, uint64_t msize)
+    {
+        return !msize || _dispatch_throttler.get_or_fail(&con->_dispatch_account, msize);
+    }
+
+    void dispatch_throttle_release(Connection* con, uint64_t msize);
+
+    /**
+     * 设置连接分享转发配额的权重
+     *
+     */
+    void set_dispatch_weight(Connection* con, uint32_t weight)
+    {
+        _dispatch_throttler.set_weight(&con->_dispatch_account, weight);
+    }
+
+    void queue_connect(Connection* con, uint64_t id)
+    {
+        queue_code(D_CONNECT, con, id);
     }
     
-    void queue_accept(Connection* con)
+    void queue_accept(Connection* con, uint64_t id)
     {
-        Mutex::Locker locker(_lock);
-        if (_stop)
-        {
-            return;
-        }
-        
-        _mqueue.enqueue_strict(0, MSG_PRIO_HIGHEST, QueueItem(D_ACCEPT, con));
-        _cond.signal();
+        queue_code(D_ACCEPT, con, id);
     }
     
-    void queue_remote_reset(Connection* con)
+    void queue_remote_reset(Connection* con, uint64_t id)
     {
-        Mutex::Locker locker(_lock);
-        if (_stop)
-        {
-            return;
-        }
-        
-        _mqueue.enqueue_strict(0, MSG_PRIO_HIGHEST, QueueItem(D_BAD_REMOTE_RESET, con));
-        _cond.signal();
+        queue_code(D_BAD_REMOTE_RESET, con, id);
     }
     
-    void queue_reset(Connection* con)
+    void queue_reset(Connection* con, uint64_t id)
     {
-        Mutex::Locker locker(_lock);
-        if (_stop)
-        {
-            return;
-        }
-        
-        _mqueue.enqueue_strict(0, MSG_PRIO_HIGHEST, QueueItem(D_BAD_RESET, con));
-        _cond.signal();
+        queue_code(D_BAD_RESET, con, id);
     }
     
-    void queue_refused(Connection* con)
+    void queue_refused(Connection* con, uint64_t id)
     {
-        Mutex::Locker locker(_lock);
-        if (_stop)
-        {
-            return;
-        }
-        
-        _mqueue.enqueue_strict(0, MSG_PRIO_HIGHEST, QueueItem(D_CONN_REFUSED, con));
-        _cond.signal();
+        queue_code(D_CONN_REFUSED, con, id);
     }
 
     bool can_fast_dispatch(Message* m) const;
@@ -202,26 +314,66 @@ public:
         return _next_id++;
     }
 
+    /**
+     * 设置转发线程数,大于1时按连接id分片转发,需要在start之前调用
+     *
+     */
+    void set_num_threads(unsigned num);
+
+    /**
+     * 设置快速转发线程数,为0时在读线程中直接快速转发,需要在start之前调用
+     *
+     */
+    void set_fast_threads(unsigned num);
+
+    bool has_fast_threads() const { return !_fast_shards.empty(); }
+
+    /**
+     * 将一批可以快速转发的消息交给快速转发线程,只加一次锁,ms会被清空
+     * 消息需已经过fast_preprocess,id为所属连接的id
+     *
+     */
+    void queue_fast_dispatch(std::vector<Message*>& ms, uint64_t id);
+
+    void queue_fast_dispatch(Message* m, uint64_t id);
+
+    void fast_entry(FastShard* shard);
+
+    unsigned get_num_threads() const { return _shards.size(); }
+
     // 启动发送消息线程和本地消息发送线程
     void start();
     
-    void entry();
+    void entry(Shard* shard);
     
     void wait();
     
     void shutdown();
     
-    bool is_started() const {return _dispatch_thread.is_started();}
+    bool is_started() const {return _shards[0]->_dispatch_thread.is_started();}
 
     // config
-    DispatchQueue(Messenger* msgr, std::string& name) : _msgr(msgr), _lock(), _mqueue(16777216, 65536),
-                _next_id(1), _dispatch_thread(this), _local_delivery_lock(), _stop_local_delivery(false),
-                _local_delivery_thread(this), _dispatch_throttler(std::string("msgr_dispatch_throttler-") + name, 100 << 20),
+    DispatchQueue(Messenger* msgr, std::string& name) : _msgr(msgr),
+                _next_id(1), _local_ring(DQ_LOCAL_RING_SIZE), _local_delivery_lock(), _stop_local_delivery(false),
+                _local_inline(false), _local_delivery_thread(this), _dispatch_throttler(std::string("msgr_dispatch_throttler-") + name, 100 << 20),
                 _stop(false)
-    {}
+    {
+        atomic_set(&_local_overflow, 0);
+        atomic_set(&_local_sleeping, 0);
+        _shards.push_back(new Shard(this));
+    }
     
     virtual ~DispatchQueue()
     {
+        for (std::vector<Shard*>::iterator iter = _shards.begin(); iter != _shards.end(); ++iter)
+        {
+            DELETE_P(*iter);
+        }
+
+        for (std::vector<FastShard*>::iterator iter = _fast_shards.begin(); iter != _fast_shards.end(); ++iter)
+        {
+            DELETE_P(*iter);
+        }
     }
 };
 
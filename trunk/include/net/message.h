@@ -14,18 +14,26 @@
 #define MSG_CRC_ALL            (MSG_CRC_DATA | MSG_CRC_HEADER)
 
 #define MSG_PROBE            0x00000001
+#define MSG_PING            0x00000002
+
+// 消息类型上限,注册的类型需小于该值
+#define MSG_TYPE_MAX        1024
 
 
 class Message : public RefCountable
 {
 public:
-    Message()
+    Message() : _connection(NULL), _magic(0), _completion_hook(NULL), _byte_throttler(NULL),
+                _msg_throttler(NULL), _dispatch_throttle_size(0), _queue_next(NULL),
+                _arrival_prev(NULL), _arrival_next(NULL), _body_crc_flags(-1)
     {
         memset(&_header, 0, sizeof(_header));
         memset(&_footer, 0, sizeof(_footer));
     }
 
-    Message(int t)
+    Message(int t) : _connection(NULL), _magic(0), _completion_hook(NULL), _byte_throttler(NULL),
+                     _msg_throttler(NULL), _dispatch_throttle_size(0), _queue_next(NULL),
+                _arrival_prev(NULL), _arrival_next(NULL), _body_crc_flags(-1)
     {
         memset(&_header, 0, sizeof(_header));
         _header.type = t;
@@ -73,6 +81,7 @@ public:
 
 public:
     const Connection* get_connection() const { return _connection; }
+    Connection* get_connection() { return _connection; }
     void set_connection(Connection* c)
     {
         _connection = c;
@@ -113,6 +122,7 @@ public:
         
         _payload.clear();
         _middle.clear();
+        _body_crc_flags = -1;
     }
     
     virtual void clear_buffers() {}
@@ -125,6 +135,7 @@ public:
         }
         
         _data.clear();
+        _body_crc_flags = -1;
         clear_buffers();
     }
     
@@ -150,6 +161,7 @@ public:
         }
         
         _payload.claim(buf, buffer::CLAIM_ALLOW_NONSHAREABLE);
+        _body_crc_flags = -1;
         
         if (_byte_throttler)
         {
@@ -165,6 +177,7 @@ public:
         }
         
         _middle.claim(buf, buffer::CLAIM_ALLOW_NONSHAREABLE);
+        _body_crc_flags = -1;
         
         if (_byte_throttler)
         {
@@ -182,6 +195,7 @@ public:
         }
         
         _data.share(buf);
+        _body_crc_flags = -1;
         
         if (_byte_throttler)
         {
@@ -291,6 +305,13 @@ public:
     
     void encode(int crcflags);
 
+    /**
+     * 编码负载,设置各部分长度并计算负载的crc,不计算头部crc
+     * 负载不再修改时之后的encode不再重复计算
+     *
+     */
+    void encode_body(int crcflags);
+
 protected:
     msg_header _header;
     msg_footer  _footer;
@@ -313,7 +334,39 @@ protected:
     Throttle* _msg_throttler;
     uint64_t _dispatch_throttle_size;
 
+    // 发送队列中的后继节点
+    Message* _queue_next;
+
+    // 转发队列到达链表中的前驱和后继节点
+    Message* _arrival_prev;
+    Message* _arrival_next;
+
+    // 负载及其crc已按该标志计算,再次编码(如重发)时只需计算头部crc,修改负载后重置为-1
+    int _body_crc_flags;
+
     friend class Messenger;
+    friend class MessageQueue;
+    friend class ArrivalList;
+};
+
+// 共享另一个消息已编码的负载及crc,用于组播
+// 各连接的发送只修改序号等头部字段并计算头部crc,负载按引用计数共享不拷贝
+// 没有具体的消息类型,不能直接转发给本地的dispatcher
+class SharedMessage : public Message
+{
+public:
+    /**
+     * m需已按crcflags调用过encode_body
+     *
+     */
+    SharedMessage(Message* m, int crcflags);
+
+    void encode_payload() {}
+    void decode_payload() {}
+    const char* get_type_name() const { return _type_name; }
+
+private:
+    const char* _type_name;
 };
 
 extern Message* decode_message(int crcflags, msg_header& header, msg_footer& footer, buffer& front, buffer& middle, buffer& data);
@@ -0,0 +1,227 @@
+#ifndef _MESSAGE_LATENCY_H_
+#define _MESSAGE_LATENCY_H_
+
+#include <map>
+#include "time_utils.h"
+#include "message.h"
+
+// 每个2的幂区间等分的桶数为2^MSG_LATENCY_SUB_BITS,桶宽不超过区间下限的1/8
+#define MSG_LATENCY_SUB_BITS 3
+#define MSG_LATENCY_SUB_BUCKETS (1 << MSG_LATENCY_SUB_BITS)
+// 可区分的最大延迟为2^MSG_LATENCY_MAX_BITS纳秒,约18分钟,更大的值计入最后一个桶
+#define MSG_LATENCY_MAX_BITS 40
+#define MSG_LATENCY_BUCKETS ((MSG_LATENCY_MAX_BITS - MSG_LATENCY_SUB_BITS + 1) * MSG_LATENCY_SUB_BUCKETS)
+// 默认采样间隔,每个转发线程每转发该数量的消息记录一个
+// config
+#define MSG_LATENCY_SAMPLE_EVERY 32
+
+// 对数线性分桶的延迟直方图,单位纳秒
+// 小于2^MSG_LATENCY_SUB_BITS的值每个值一个桶,之后每个2的幂区间等分为MSG_LATENCY_SUB_BUCKETS个桶
+// 记录只做几次原子加,不加锁
+class LatencyHistogram
+{
+public:
+    LatencyHistogram()
+    {
+        clear();
+    }
+
+    void add(uint64_t ns)
+    {
+        __atomic_fetch_add(&_buckets[bucket_index(ns)], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&_count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&_sum, ns, __ATOMIC_RELAXED);
+
+        uint64_t max = __atomic_load_n(&_max, __ATOMIC_RELAXED);
+        while (ns > max && !__atomic_compare_exchange_n(&_max, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+        }
+    }
+
+    void clear();
+
+    /**
+     * 复制当前的统计值,可以与add同时调用,各计数之间不保证一致
+     *
+     */
+    void snapshot(LatencyHistogram* out) const;
+
+    uint64_t get_count() const { return _count; }
+
+    uint64_t get_sum() const { return _sum; }
+
+    uint64_t get_max() const { return _max; }
+
+    uint64_t get_bucket(uint32_t i) const { return _buckets[i]; }
+
+    double get_avg() const
+    {
+        return _count ? (double)_sum / _count : 0;
+    }
+
+    /**
+     * 获取百分位数,p取值[0, 1],返回所在桶的上限,不超过记录到的最大值
+     *
+     */
+    uint64_t get_percentile(double p) const;
+
+    static uint32_t bucket_index(uint64_t ns)
+    {
+        if (MSG_LATENCY_SUB_BUCKETS > ns)
+        {
+            return ns;
+        }
+
+        uint32_t msb = 63 - __builtin_clzll(ns);
+        if (MSG_LATENCY_MAX_BITS <= msb)
+        {
+            return MSG_LATENCY_BUCKETS - 1;
+        }
+
+        uint32_t shift = msb - MSG_LATENCY_SUB_BITS;
+        return ((shift + 1) << MSG_LATENCY_SUB_BITS) + ((ns >> shift) & (MSG_LATENCY_SUB_BUCKETS - 1));
+    }
+
+    /**
+     * 桶的下限,包含
+     *
+     */
+    static uint64_t bucket_lower(uint32_t i)
+    {
+        if (MSG_LATENCY_SUB_BUCKETS > i)
+        {
+            return i;
+        }
+
+        uint32_t shift = (i >> MSG_LATENCY_SUB_BITS) - 1;
+        return (uint64_t)(MSG_LATENCY_SUB_BUCKETS + (i & (MSG_LATENCY_SUB_BUCKETS - 1))) << shift;
+    }
+
+    /**
+     * 桶的上限,不包含
+     *
+     */
+    static uint64_t bucket_upper(uint32_t i)
+    {
+        return (MSG_LATENCY_BUCKETS - 1 == i) ? (uint64_t)-1 : bucket_lower(i + 1);
+    }
+
+private:
+    uint64_t _buckets[MSG_LATENCY_BUCKETS];
+    uint64_t _count;
+    uint64_t _sum;
+    uint64_t _max;
+};
+
+// 单个消息类型在接收和转发各阶段的延迟
+struct MessageLatencyStats
+{
+    enum
+    {
+        // 开始读消息头到获取到节流配额,包括等待节流的时间
+        STAGE_THROTTLE = 0,
+        // 获取到节流配额到消息读完并解码
+        STAGE_READ,
+        // 放入转发队列到开始转发
+        STAGE_QUEUE,
+        // dispatcher处理消息
+        STAGE_DISPATCH,
+        // 开始读消息头到转发结束
+        STAGE_TOTAL,
+        STAGE_MAX
+    };
+
+    static const char* get_stage_name(int stage);
+
+    LatencyHistogram _stages[STAGE_MAX];
+};
+
+// 按消息类型统计接收到转发结束各阶段的延迟,由DispatchQueue在转发时记录
+// 各阶段的起止时间来自消息上已有的时间戳,只有被采样的消息才额外读取一次时钟
+class MessageLatency
+{
+public:
+    // 被采样消息在转发前记录的时间戳,转发后消息可能已释放
+    struct Sample
+    {
+        uint32_t _type;
+        utime_t _recv_stamp;
+        utime_t _throttle_stamp;
+        utime_t _recv_complete_stamp;
+        utime_t _dispatch_stamp;
+    };
+
+    MessageLatency();
+
+    ~MessageLatency();
+
+    /**
+     * 设置采样间隔,每个转发线程每转发every个消息记录一个,为0时不记录
+     *
+     */
+    void set_sample_every(uint32_t every)
+    {
+        __atomic_store_n(&_sample_every, every, __ATOMIC_RELAXED);
+    }
+
+    uint32_t get_sample_every() const
+    {
+        return __atomic_load_n(&_sample_every, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * 转发前调用,消息需要采样时填充sample并返回true
+     *
+     */
+    bool start(Message* m, Sample* sample)
+    {
+        uint32_t every = get_sample_every();
+        if (!every || every > ++_tick)
+        {
+            return false;
+        }
+
+        _tick = 0;
+        return prepare(m, sample);
+    }
+
+    /**
+     * 转发结束后调用,记录start采样的消息
+     *
+     */
+    void finish(const Sample& sample);
+
+    /**
+     * 获取各消息类型的统计,以消息类型为key
+     *
+     */
+    void dump(std::map<uint32_t, MessageLatencyStats>& stats) const;
+
+    void reset();
+
+private:
+    MessageLatency(const MessageLatency& other);
+    MessageLatency& operator=(const MessageLatency& other);
+
+    bool prepare(Message* m, Sample* sample);
+
+    // 第一次记录该类型时创建
+    MessageLatencyStats* get_stats(uint32_t type);
+
+    static void add(LatencyHistogram& h, const utime_t& from, const utime_t& to)
+    {
+        if (!from.is_zero() && !to.is_zero())
+        {
+            h.add((to > from) ? (to - from).to_nsec() : 0);
+        }
+    }
+
+    volatile uint32_t _sample_every;
+    // 按消息类型索引
+    MessageLatencyStats* _types[MSG_TYPE_MAX];
+
+    // 各转发线程自己计数,不需要同步
+    static __thread uint32_t _tick;
+};
+
+#endif
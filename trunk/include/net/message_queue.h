@@ -0,0 +1,230 @@
+#ifndef _MESSAGE_QUEUE_H_
+#define _MESSAGE_QUEUE_H_
+
+#include "intarith.h"
+#include "message.h"
+
+/**
+ * 发送队列,按消息优先级分为256个桶
+ * 每个桶为以Message::_queue_next串起的侵入式单链表,入队出队不分配内存
+ * 用位图记录非空桶,出队时取最高置位即为当前最高优先级
+ * 同一时刻一个消息只能位于一个队列中
+ */
+class MessageQueue
+{
+public:
+    static const unsigned NUM_PRIORITIES = MSG_PRIO_HIGHEST + 1;
+
+    MessageQueue() : _size(0)
+    {
+        memset(_bitmap, 0, sizeof(_bitmap));
+        memset(_buckets, 0, sizeof(_buckets));
+    }
+
+    bool empty() const { return 0 == _size; }
+
+    uint64_t size() const { return _size; }
+
+    /**
+     * 按消息自身的优先级入队尾
+     */
+    void push_back(Message* m)
+    {
+        push_back(m, m->get_priority());
+    }
+
+    void push_back(Message* m, unsigned prio)
+    {
+        Bucket& b = _buckets[clamp(prio)];
+        m->_queue_next = NULL;
+        if (b.tail)
+        {
+            b.tail->_queue_next = m;
+        }
+        else
+        {
+            b.head = m;
+            set_bit(clamp(prio));
+        }
+
+        b.tail = m;
+        _size++;
+    }
+
+    void push_front(Message* m, unsigned prio)
+    {
+        Bucket& b = _buckets[clamp(prio)];
+        m->_queue_next = b.head;
+        if (!b.head)
+        {
+            b.tail = m;
+            set_bit(clamp(prio));
+        }
+
+        b.head = m;
+        _size++;
+    }
+
+    /**
+     * 取出优先级最高的消息,队列为空时返回NULL
+     */
+    Message* pop_front()
+    {
+        for (int i = BITMAP_WORDS - 1; i >= 0; i--)
+        {
+            if (_bitmap[i])
+            {
+                return pop_front(i * 64 + 63 - clzll(_bitmap[i]));
+            }
+        }
+
+        return NULL;
+    }
+
+    /**
+     * 取出指定优先级的队首消息
+     */
+    Message* pop_front(unsigned prio)
+    {
+        prio = clamp(prio);
+        Bucket& b = _buckets[prio];
+        Message* m = b.head;
+        if (!m)
+        {
+            return NULL;
+        }
+
+        b.head = m->_queue_next;
+        if (!b.head)
+        {
+            b.tail = NULL;
+            clear_bit(prio);
+        }
+
+        m->_queue_next = NULL;
+        _size--;
+
+        return m;
+    }
+
+    Message* front(unsigned prio) const
+    {
+        return _buckets[clamp(prio)].head;
+    }
+
+    /**
+     * 将other中各优先级的消息整体移到本队列对应桶的队首,other被清空
+     */
+    void splice_front(MessageQueue& other)
+    {
+        for (unsigned prio = 0; prio < NUM_PRIORITIES; prio++)
+        {
+            Bucket& ob = other._buckets[prio];
+            if (!ob.head)
+            {
+                continue;
+            }
+
+            Bucket& b = _buckets[prio];
+            ob.tail->_queue_next = b.head;
+            if (!b.head)
+            {
+                b.tail = ob.tail;
+                set_bit(prio);
+            }
+
+            b.head = ob.head;
+            ob.head = ob.tail = NULL;
+        }
+
+        _size += other._size;
+        other._size = 0;
+        memset(other._bitmap, 0, sizeof(other._bitmap));
+    }
+
+private:
+    static const int BITMAP_WORDS = NUM_PRIORITIES / 64;
+
+    struct Bucket
+    {
+        Message* head;
+        Message* tail;
+    };
+
+    static unsigned clamp(unsigned prio)
+    {
+        return prio > MSG_PRIO_HIGHEST ? MSG_PRIO_HIGHEST : prio;
+    }
+
+    void set_bit(unsigned prio) { _bitmap[prio / 64] |= (1ULL << (prio % 64)); }
+
+    void clear_bit(unsigned prio) { _bitmap[prio / 64] &= ~(1ULL << (prio % 64)); }
+
+    uint64_t _bitmap[BITMAP_WORDS];
+    Bucket _buckets[NUM_PRIORITIES];
+    uint64_t _size;
+};
+
+/**
+ * 转发队列的到达链表,按入队顺序以Message::_arrival_prev/_arrival_next串起
+ * 入队时间与接收时间同序,链表头即为等待最久的消息,增删均为O(1)且不分配内存
+ */
+class ArrivalList
+{
+public:
+    ArrivalList() : _head(NULL), _tail(NULL), _size(0) {}
+
+    bool empty() const { return NULL == _head; }
+
+    uint64_t size() const { return _size; }
+
+    const Message* front() const { return _head; }
+
+    void push_back(Message* m)
+    {
+        m->_arrival_prev = _tail;
+        m->_arrival_next = NULL;
+        if (_tail)
+        {
+            _tail->_arrival_next = m;
+        }
+        else
+        {
+            _head = m;
+        }
+
+        _tail = m;
+        _size++;
+    }
+
+    void remove(Message* m)
+    {
+        if (m->_arrival_prev)
+        {
+            m->_arrival_prev->_arrival_next = m->_arrival_next;
+        }
+        else
+        {
+            _head = m->_arrival_next;
+        }
+
+        if (m->_arrival_next)
+        {
+            m->_arrival_next->_arrival_prev = m->_arrival_prev;
+        }
+        else
+        {
+            _tail = m->_arrival_prev;
+        }
+
+        m->_arrival_prev = m->_arrival_next = NULL;
+        _size--;
+    }
+
+private:
+    Message* _head;
+    Message* _tail;
+    uint64_t _size;
+};
+
+#endif
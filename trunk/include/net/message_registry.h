@@ -0,0 +1,224 @@
+#ifndef _MESSAGE_REGISTRY_H_
+#define _MESSAGE_REGISTRY_H_
+
+#include <vector>
+#include "atomic.h"
+#include "spinlock.h"
+#include "message.h"
+
+// 每个消息类型的共享空闲链表最多缓存的消息数
+// config
+#define MSG_FREELIST_MAX 1024
+// 线程本地缓存与共享缓存之间每次交换的消息数
+#define MSG_FREELIST_BATCH 32
+
+typedef Message* (*message_factory_t)();
+
+// 按消息类型索引的构造函数表,解码时直接按类型取出构造函数
+// 表在静态初始化阶段由REGISTER_MESSAGE填充,之后只读
+class MessageRegistry
+{
+public:
+    /**
+     * 注册消息类型,类型超出范围或已注册时返回false
+     *
+     */
+    static bool add(uint32_t type, message_factory_t factory)
+    {
+        if (MSG_TYPE_MAX <= type || _factories[type])
+        {
+            return false;
+        }
+
+        _factories[type] = factory;
+        return true;
+    }
+
+    /**
+     * 按类型创建消息,未注册的类型返回NULL
+     *
+     */
+    static Message* create(uint32_t type)
+    {
+        if (MSG_TYPE_MAX <= type || !_factories[type])
+        {
+            return NULL;
+        }
+
+        return _factories[type]();
+    }
+
+private:
+    // 零初始化,先于任何注册完成
+    static message_factory_t _factories[MSG_TYPE_MAX];
+};
+
+template <typename T>
+class MessageRegister
+{
+public:
+    explicit MessageRegister(uint32_t type)
+    {
+        MessageRegistry::add(type, &MessageRegister<T>::create);
+    }
+
+    static Message* create()
+    {
+        return new T();
+    }
+};
+
+// 在源文件中注册消息类型,同一类型只能注册一次
+#define REGISTER_MESSAGE(T, type) \
+    static MessageRegister<T> __message_register_##T(type)
+
+
+// 单个消息类型的空闲链表,释放的消息内存缓存起来供下一次构造使用
+// 每个线程先使用本地缓存,不加锁,本地缓存过多或为空时按批与共享缓存交换
+// 消息常在读线程构造、在转发线程释放,批量交换使两边都不需要每次加锁
+template <typename T>
+class MessageFreelist
+{
+public:
+    static void* alloc(size_t size)
+    {
+        if (!_local_head)
+        {
+            refill();
+        }
+
+        if (_local_head)
+        {
+            Node* n = _local_head;
+            _local_head = n->_next;
+            _local_count--;
+            return n;
+        }
+
+        MessageFreelist& fl = instance();
+        atomic_inc(&fl._misses);
+
+        return ::operator new(size);
+    }
+
+    static void free(void* p)
+    {
+        Node* n = static_cast<Node*>(p);
+        n->_next = _local_head;
+        _local_head = n;
+        if (2 * MSG_FREELIST_BATCH <= ++_local_count)
+        {
+            release();
+        }
+    }
+
+    /**
+     * 获取从堆上申请内存的次数
+     *
+     */
+    static uint64_t get_misses()
+    {
+        return atomic_read(&instance()._misses);
+    }
+
+private:
+    struct Node
+    {
+        Node* _next;
+    };
+
+    MessageFreelist()
+    {
+        atomic_set(&_misses, 0);
+    }
+
+    // 第一次使用时构造,静态初始化阶段也可以安全使用
+    // 不析构,进程退出时仍可能有消息被释放
+    static MessageFreelist& instance()
+    {
+        static MessageFreelist* fl = new MessageFreelist();
+        return *fl;
+    }
+
+    // 从共享缓存取一批到本地
+    static void refill()
+    {
+        MessageFreelist& fl = instance();
+        SpinLock::Locker locker(fl._lock);
+        if (!fl._batches.empty())
+        {
+            _local_head = fl._batches.back();
+            _local_count = MSG_FREELIST_BATCH;
+            fl._batches.pop_back();
+        }
+    }
+
+    // 本地缓存的前一批交给共享缓存,共享缓存已满时直接释放
+    static void release()
+    {
+        Node* batch = _local_head;
+        Node* tail = batch;
+        for (uint32_t i = 1; i < MSG_FREELIST_BATCH; i++)
+        {
+            tail = tail->_next;
+        }
+
+        _local_head = tail->_next;
+        _local_count -= MSG_FREELIST_BATCH;
+        tail->_next = NULL;
+
+        MessageFreelist& fl = instance();
+        {
+            SpinLock::Locker locker(fl._lock);
+            if (fl._batches.size() * MSG_FREELIST_BATCH < MSG_FREELIST_MAX)
+            {
+                fl._batches.push_back(batch);
+                return;
+            }
+        }
+
+        while (batch)
+        {
+            Node* n = batch;
+            batch = batch->_next;
+            ::operator delete(n);
+        }
+    }
+
+    // 线程退出时本地缓存的内存不回收,每个线程最多2 * MSG_FREELIST_BATCH个
+    static __thread Node* _local_head;
+    static __thread uint32_t _local_count;
+
+    SpinLock _lock;
+    // 共享缓存,每批MSG_FREELIST_BATCH个
+    std::vector<Node*> _batches;
+    atomic_t _misses;
+};
+
+template <typename T>
+__thread typename MessageFreelist<T>::Node* MessageFreelist<T>::_local_head = NULL;
+
+template <typename T>
+__thread uint32_t MessageFreelist<T>::_local_count = 0;
+
+// 在消息类中使用,该类型的new/delete都经过空闲链表
+// 派生类的大小不同,需要自己声明
+#define DECLARE_MESSAGE_FREELIST(T) \
+public: \
+    static void* operator new(size_t size) \
+    { \
+        return (sizeof(T) == size) ? MessageFreelist<T>::alloc(size) : ::operator new(size); \
+    } \
+    static void operator delete(void* p, size_t size) \
+    { \
+        if (sizeof(T) == size) \
+        { \
+            MessageFreelist<T>::free(p); \
+        } \
+        else \
+        { \
+            ::operator delete(p); \
+        } \
+    }
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef _MPING_H_
+#define _MPING_H_
+
+#include "message.h"
+#include "message_registry.h"
+
+// 连通性及性能测试消息,PING的数据段原样计入带宽,PONG回带PING的序号和发送时间
+class MPing : public Message
+{
+    DECLARE_MESSAGE_FREELIST(MPing)
+
+public:
+    enum
+    {
+        OP_PING = 1,
+        OP_PONG
+    };
+
+    MPing() : Message(MSG_PING), _op(0), _seq(0), _stamp(0)
+    {
+    }
+
+    MPing(int op, uint64_t seq, uint64_t stamp) : Message(MSG_PING), _op(op), _seq(seq), _stamp(stamp)
+    {
+    }
+
+    ~MPing()
+    {
+    }
+
+    void encode_payload()
+    {
+        ::encode(_op, _payload);
+        ::encode(_seq, _payload);
+        ::encode(_stamp, _payload);
+    }
+
+    void decode_payload()
+    {
+        buffer::iterator p = _payload.begin();
+        ::decode(_op, p);
+        ::decode(_seq, p);
+        ::decode(_stamp, p);
+    }
+
+    const char* get_type_name() const { return "mping"; }
+
+    int32_t _op;
+    uint64_t _seq;
+    // 发送时间,单位纳秒
+    uint64_t _stamp;
+};
+
+#endif
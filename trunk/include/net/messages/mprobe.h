@@ -2,9 +2,12 @@
 #define _MPROBE_H_
 
 #include "message.h"
+#include "message_registry.h"
 
 class MProbe : public Message
 {
+    DECLARE_MESSAGE_FREELIST(MProbe)
+
 public:
     enum
     {
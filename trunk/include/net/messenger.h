@@ -4,8 +4,10 @@
 #include <list>
 #include <set>
 #include <map>
+#include <vector>
 #include "message.h"
 #include "dispatcher.h"
+#include "message_latency.h"
 
 // 通信基类
 class Messenger
@@ -13,7 +15,8 @@ class Messenger
 public:
     Messenger();
 
-    Messenger(entity_name_t entityname) : _entity(), _started(false), _magic(0)
+    Messenger(entity_name_t entityname) : _crc_flag(get_default_crc_flags()), _entity(), _started(false), _magic(0),
+                                          _default_send_priority(MSG_PRIO_DEFAULT), _socket_priority(-1)
     {
         _entity._name = entityname;
     }
@@ -36,15 +39,17 @@ public:
         Throttle* _throttler_bytes;
         // 按消息数节流
         Throttle* _throttler_messages;
+        // 分享转发节流器总配额时的权重,配额紧张时超出份额的连接先被节流
+        uint32_t _dispatch_weight;
 
         Policy() : _lossy(false), _server(false), _standby(false), _resetcheck(true),
-                   _throttler_bytes(NULL), _throttler_messages(NULL)
+                   _throttler_bytes(NULL), _throttler_messages(NULL), _dispatch_weight(1)
         {
             
         }
         
         Policy(bool l, bool s, bool st, bool r) : _lossy(l), _server(s), _standby(st), 
-                    _resetcheck(r), _throttler_bytes(NULL), _throttler_messages(NULL)
+                    _resetcheck(r), _throttler_bytes(NULL), _throttler_messages(NULL), _dispatch_weight(1)
         {
             
         }
@@ -98,6 +103,13 @@ public:
     virtual void wait() = 0;
     // 发送消息
     virtual int send_message(Message* msg, const entity_inst_t& dest) = 0;
+    // 向同一对端按顺序发送一批消息,消息的所有权交给messenger,ms被清空
+    virtual int send_messages(std::vector<Message*>& ms, const entity_inst_t& dest);
+    // 通过已有连接按顺序发送一批消息,消息的所有权交给messenger,ms被清空
+    virtual int send_messages(std::vector<Message*>& ms, Connection* con);
+    // 向多个对端发送同一消息,负载只编码、计算crc一次,各连接共享编码结果
+    int send_multicast(Message* m, const std::vector<entity_inst_t>& dests);
+    int send_multicast(Message* m, const std::vector<Connection*>& cons);
     // 关闭socket连接
     virtual void mark_down(const entity_addr_t& addr) = 0;
     // 关闭所有socket连接
@@ -106,6 +118,20 @@ public:
     virtual int get_dispatch_queue_len() = 0;
     // 获取消息转发队列中最大时间
     virtual double get_dispatch_queue_max_age(utime_t now) = 0;
+    // 设置消息转发线程数,需要在start之前调用,同一连接的消息总是由同一线程转发
+    virtual void set_dispatch_threads(unsigned num) {}
+    // 设置快速转发线程数,需要在start之前调用,为0时在读线程中直接快速转发,同一连接的消息总是由同一线程转发
+    virtual void set_fast_dispatch_threads(unsigned num) {}
+    // 设置可以快速转发的本地消息是否直接在发送线程中转发,不经过本地消息线程
+    virtual void set_local_fast_dispatch(bool on) {}
+    // 设置所有连接共享的转发节流总配额,各连接按Policy中的_dispatch_weight分享
+    virtual void set_dispatch_throttle_bytes(uint64_t bytes) {}
+    // 设置消息延迟统计的采样间隔,每个转发线程每转发every个消息记录一个,为0时不统计
+    virtual void set_latency_sample_every(uint32_t every) {}
+    // 获取按消息类型统计的接收、节流、排队、转发各阶段的延迟直方图
+    virtual void dump_latency(std::map<uint32_t, MessageLatencyStats>& stats) {}
+    // 清空消息延迟统计
+    virtual void reset_latency() {}
     // 设置messenger默认策略
     virtual void set_default_policy(Policy p) = 0;
     // 获取messenger默认策略
@@ -311,6 +337,12 @@ public:
     }
 
 protected:
+    // 组播前设置源地址和优先级并编码负载
+    void prepare_multicast(Message* m);
+
+    // 本端在目的列表中重复出现时,把组播消息解码成新的具体类型消息,类型未注册时返回NULL
+    Message* decode_multicast(Message* m);
+
     // 设置本地通信实体地址
     virtual void set_entity_addr(const entity_addr_t& a) { _entity._addr = a; }
 
@@ -1,13 +1,30 @@
 #ifndef _MSG_TYPES_H_
 #define _MSG_TYPES_H_
 
+#include <functional>
+#include <stdio.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include "int_types.h"
 #include "encoding.h"
 #include "msgr.h"
 
 extern const char * entity_type_name(int type);
 
+/**
+ * 本地传输的私有目录MSGR_LOCAL_SOCKET_DIR/moth-<euid>,create为true时不存在则以0700创建
+ * 目录不是本用户所有、是符号链接或其它用户可访问时返回false,调用方不应使用该目录
+ *
+ */
+extern bool get_local_dir(char* dir, size_t len, bool create);
+
+/**
+ * 绑定unix socket前清理之前进程残留的socket文件
+ * 路径上不是本用户的socket或仍有进程在监听时不删除,返回负的错误码
+ *
+ */
+extern int unlink_stale_local_path(const char* path);
+
 // 通信实体名
 struct entity_name_t
 {
@@ -152,6 +169,11 @@ public:
         sockaddr_in6 _addr6;
     };
 
+    // 默认只通过TCP通信
+    static const int32_t TYPE_DEFAULT = 0;
+    // 同时在unix socket上监听,同一主机上的对端通过unix socket连接
+    static const int32_t TYPE_LOCAL = 1;
+
     entity_addr_t() : _type(0)
     { 
         memset(this, 0, sizeof(*this));
@@ -206,6 +228,8 @@ public:
     }
 
     int get_family() const { return _addr.ss_family; }
+    bool is_local() const { return TYPE_LOCAL == _type; }
+    void set_type(int32_t t) { _type = t; }
     void set_family(int f) { _addr.ss_family = f; }
 
     sockaddr_storage& sock_addr() { return _addr; }
@@ -300,6 +324,37 @@ public:
         return 0;
     }
 
+    /**
+     * 根据类型、协议族、IP和端口计算hash,不必对整个sockaddr_storage做计算
+     *
+     */
+    size_t hash() const
+    {
+        uint64_t h = ((uint64_t)_type << 32) | ((uint64_t)_addr.ss_family << 16) | (uint16_t)get_port();
+        switch (_addr.ss_family)
+        {
+            case AF_INET:
+            {
+                h ^= (uint64_t)_addr4.sin_addr.s_addr * 0x9e3779b97f4a7c15ULL;
+                break;
+            }
+            case AF_INET6:
+            {
+                const uint64_t* p = (const uint64_t*)_addr6.sin6_addr.s6_addr;
+                h ^= p[0] * 0x9e3779b97f4a7c15ULL;
+                h ^= p[1] * 0xc2b2ae3d27d4eb4fULL;
+                break;
+            }
+        }
+
+        // 混合高低位,使低位也能用于分片
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+
+        return h;
+    }
+
     bool probably_equals(const entity_addr_t& other) const 
     {
         if (get_port() != other.get_port())
@@ -340,6 +395,51 @@ public:
         return false;
     }
 
+    bool is_loopback_ip() const
+    {
+        switch (_addr.ss_family)
+        {
+            case AF_INET:
+            {
+                return (IN_LOOPBACKNET == (ntohl(_addr4.sin_addr.s_addr) >> IN_CLASSA_NSHIFT));
+            }
+            case AF_INET6:
+            {
+                return IN6_IS_ADDR_LOOPBACK(&_addr6.sin6_addr);
+            }
+            default:
+            {
+                return false;
+            }
+        }
+    }
+
+    /**
+     * 本地传输的unix socket路径,位于本用户的私有目录中,由端口和传输方式决定
+     * 不含IP,绑定通配地址时对端按回环地址或主机IP连接都能算出同一路径
+     * create为true时创建私有目录,用于监听端
+     *
+     */
+    bool get_local_path(sockaddr_un& sun, const char* kind = "sock", bool create = false) const
+    {
+        if (AF_INET != _addr.ss_family && AF_INET6 != _addr.ss_family)
+        {
+            return false;
+        }
+
+        char dir[sizeof(sun.sun_path)];
+        if (!get_local_dir(dir, sizeof(dir), create))
+        {
+            return false;
+        }
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        int n = snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/moth-%d.%s", dir, get_port(), kind);
+
+        return 0 < n && sizeof(sun.sun_path) > (size_t)n;
+    }
+
     bool is_blank_ip() const
     {
         
@@ -487,6 +587,17 @@ inline bool operator<= (const entity_addr_t& a, const entity_addr_t& b) { return
 inline bool operator> (const entity_addr_t& a, const entity_addr_t& b) { return memcmp(&a, &b, sizeof(a)) > 0; }
 inline bool operator>= (const entity_addr_t& a, const entity_addr_t& b) { return memcmp(&a, &b, sizeof(a)) >= 0; }
 
+namespace std
+{
+    template<> struct hash<entity_addr_t>
+    {
+        size_t operator()(const entity_addr_t& addr) const
+        {
+            return addr.hash();
+        }
+    };
+}
+
 // 通信实体
 struct entity_inst_t
 {
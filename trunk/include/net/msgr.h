@@ -6,6 +6,13 @@
 #endif
 #include "byteorder.h"
 
+// 握手时双方交换的banner
+#define MSGR_BANNER "banner"
+
+// 本地传输的unix socket放在该目录下各用户的私有目录moth-<euid>中
+// config
+#define MSGR_LOCAL_SOCKET_DIR "/tmp"
+
 #define ENTITY_TYPE_CLIENT    0x01
 #define ENTITY_TYPE_SERVER    0x02
 #define ENTITY_TYPE_MASTER    0x03
@@ -43,6 +50,23 @@
 #define MSG_CONNECT_LOSSY  1
 
 
+// 消息帧格式,握手时通过msg_connect::protocol_version协商
+// v1为原有的定长帧,值为0以兼容旧版本
+#define MSGR_PROTOCOL_V1    0
+// v2为紧凑帧,头部变长编码,同意v2的一方以MSGR_TAG_FEATURES代替MSGR_TAG_READY回复
+#define MSGR_PROTOCOL_V2    1
+
+// v2帧头部标志
+#define MSG_FRAME_TID       (1<<0)
+#define MSG_FRAME_MIDDLE    (1<<1)
+#define MSG_FRAME_DATA      (1<<2)
+#define MSG_FRAME_SRC       (1<<3)
+#define MSG_FRAME_CRC       (1<<4)
+#define MSG_FRAME_DATA_CRC  (1<<5)
+// 帧头部携带对端消息的确认序号
+#define MSG_FRAME_ACK       (1<<6)
+
+
 struct entity_name
 {
     uint8_t type;
@@ -0,0 +1,502 @@
+#ifndef _SHM_MESSENGER_H_
+#define _SHM_MESSENGER_H_
+
+#include <set>
+#include <map>
+#include <list>
+#include <sys/uio.h>
+#include "buffer.h"
+#include "thread.h"
+#include "cond.h"
+#include "msgr.h"
+#include "message.h"
+#include "messenger.h"
+#include "connection.h"
+#include "dispatch_queue.h"
+#include "shm_queue.h"
+
+// 每个方向的共享内存大小
+// config
+#define SHM_MSGR_RING_SIZE (8 << 20)
+// 单条记录的最大长度,更大的消息拆成多条记录写入
+#define SHM_MSGR_RECORD_MAX (256 << 10)
+// 单条记录最多包含的数据段数
+#define SHM_MSGR_RECORD_IOV 64
+// 队列为空或写满时,进入等待前让出cpu的次数
+// config
+#define SHM_MSGR_SPIN_ROUNDS 2000
+// 读线程单次等待的超时,超时后检查对端是否还在,单位毫秒
+#define SHM_MSGR_WAIT_MS 100
+// 握手超时,单位毫秒
+// config
+#define SHM_MSGR_HANDSHAKE_MS 1000
+
+// 握手时主动方告知被动方的信息,两个方向的共享内存都由主动方创建
+struct shm_connect
+{
+    le32 host_type;
+    le32 ring_size;
+    // [0]为主动方到被动方,[1]为被动方到主动方,被动方通过路径打开共享内存
+    char paths[2][108];
+} __attr_packed__;
+
+
+class ShmMessenger;
+
+// 基于一对共享内存队列的连接,每个方向一个队列,读写双方各一个进程
+// unix socket只用于握手,之后用来感知对端退出
+// 连接是lossy的,出错即关闭,不重传
+class ShmConnection : public Connection
+{
+public:
+    enum
+    {
+        STATE_NONE,
+        STATE_CONNECTING,
+        STATE_ACCEPTING,
+        STATE_OPEN,
+        STATE_CLOSED
+    };
+
+    explicit ShmConnection(ShmMessenger* msgr);
+
+    virtual ~ShmConnection();
+
+    bool is_connected();
+
+    int send_message(Message* m);
+
+    void send_keepalive() {}
+
+    void mark_disposable() {}
+
+    void mark_down();
+
+    /**
+     * 发起连接,握手在读线程中完成,握手完成前发送的消息由写线程在握手后写入
+     *
+     */
+    void connect(const entity_addr_t& addr, int type);
+
+    /**
+     * 处理accept到的fd,握手在读线程中完成
+     *
+     */
+    void accept(int fd);
+
+    /**
+     * 队列空间足够时在调用线程中直接将消息写入共享内存
+     * 握手未完成、队列空间不足或前面还有未写入的消息时交给写线程,不等待对端
+     *
+     */
+    void send(Message* m);
+
+    /**
+     * 关闭连接,可在任意线程调用
+     *
+     */
+    void stop(bool queue_reset);
+
+    /**
+     * 等待读线程退出
+     *
+     */
+    void join();
+
+    bool is_closed() const { return STATE_CLOSED == _state; }
+
+    /**
+     * 读线程是否已经退出
+     *
+     */
+    bool is_done() const { return _done; }
+
+private:
+    class Reader : public Thread
+    {
+    public:
+        explicit Reader(ShmConnection* con) : _con(con) {}
+
+        void entry()
+        {
+            _con->reader();
+        }
+
+    private:
+        ShmConnection* _con;
+    } _reader_thread;
+
+    class Writer : public Thread
+    {
+    public:
+        explicit Writer(ShmConnection* con) : _con(con) {}
+
+        void entry()
+        {
+            _con->writer();
+        }
+
+    private:
+        ShmConnection* _con;
+    } _writer_thread;
+
+    void reader();
+
+    /**
+     * 写入_out_q中的消息,等待队列空间时不持有_write_lock
+     *
+     */
+    void writer();
+
+    int handshake_connect();
+
+    int handshake_accept();
+
+    /**
+     * 创建一个方向的共享内存,路径由临时文件产生
+     *
+     */
+    ShmQueue* create_ring(ShareMemory& shm, char* path, size_t len);
+
+    ShmQueue* open_ring(ShareMemory& shm, const char* path);
+
+    /**
+     * 握手结束后删除共享内存标识和临时文件,双方已经attach,共享内存在双方detach后释放
+     *
+     */
+    void remove_rings(char paths[2][108]);
+
+    void close_rings();
+
+    void read_loop();
+
+    /**
+     * 处理一条记录,返回-1表示数据错误
+     *
+     */
+    int handle_record(const char* rec, uint32_t len);
+
+    int handle_message();
+
+    /**
+     * 按策略节流,连接关闭时返回-1
+     *
+     */
+    int get_throttle(uint64_t size);
+
+    /**
+     * 对端关闭了unix socket
+     *
+     */
+    bool peer_gone();
+
+    void fault();
+
+    /**
+     * 按push_segment拆分记录的规则,计算消息写入队列需要的空间
+     *
+     */
+    uint32_t get_record_space(Message* m);
+
+    /**
+     * 将已编码的消息写入队列,空间不足时等待,连接关闭时返回-1
+     *
+     */
+    int write_message(Message* m);
+
+    int push_segment(const char* p, uint32_t len);
+
+    int push_buffer(const buffer& bl);
+
+    int flush_record();
+
+private:
+    ShmMessenger* _shm_msgr;
+    int _fd;
+    volatile int _state;
+    volatile bool _stop;
+    volatile bool _done;
+
+    // [0]为发送方向,[1]为接收方向
+    ShareMemory _shm[2];
+    ShmQueue* _tx;
+    ShmQueue* _rx;
+
+    // 保护发送和连接状态
+    Mutex _write_lock;
+    Cond _write_cond;
+    // 等待写线程写入的消息,已分配序号并编码
+    std::list<Message*> _out_q;
+    // 写线程正在写入,期间发送线程不能直接写共享内存
+    bool _writing;
+
+    uint64_t _conn_id;
+    uint64_t _out_seq;
+    uint64_t _in_seq;
+    Messenger::Policy _policy;
+
+    // 正在组装的记录
+    struct iovec _iov[SHM_MSGR_RECORD_IOV];
+    int _iovcnt;
+    uint32_t _iovlen;
+
+    // 从队列中读出的记录
+    ptr _record;
+    // 正在接收的消息,_frame依次存放front、middle、data和footer
+    msg_header _header;
+    ptr _frame;
+    uint32_t _frame_off;
+    uint32_t _frame_left;
+    utime_t _recv_stamp;
+
+    friend class ShmMessenger;
+};
+
+// 同一主机上进程之间通过共享内存通信的messenger
+// 每个连接一对共享内存队列,每个连接一个读线程和一个写线程
+// 队列空间足够时发送在调用线程中直接写共享内存,否则交给写线程,发送不会等待对端
+// 读线程空闲时先让出cpu,一段时间没有数据后在futex上等待,由写端唤醒
+class ShmMessenger : public PolicyMessenger
+{
+public:
+    ShmMessenger(entity_name_t name, std::string mname);
+
+    virtual ~ShmMessenger();
+
+    /**
+     * 获取消息转发队列大小
+     *
+     */
+    int get_dispatch_queue_len()
+    {
+        return _dispatch_queue.get_queue_len();
+    }
+
+    /**
+     * 获取消息转发队列中最大时间
+     *
+     */
+    double get_dispatch_queue_max_age(utime_t now)
+    {
+        return _dispatch_queue.get_max_age(now);
+    }
+
+    /**
+     * 设置消息转发线程数,需要在start之前调用
+     *
+     */
+    void set_dispatch_threads(unsigned num)
+    {
+        _dispatch_queue.set_num_threads(num);
+    }
+
+    /**
+     * 设置快速转发线程数,需要在start之前调用
+     *
+     */
+    void set_fast_dispatch_threads(unsigned num)
+    {
+        _dispatch_queue.set_fast_threads(num);
+    }
+
+    /**
+     * 设置可以快速转发的本地消息是否直接在发送线程中转发
+     *
+     */
+    void set_local_fast_dispatch(bool on)
+    {
+        _dispatch_queue.set_local_inline(on);
+    }
+
+    /**
+     * 设置转发节流器的总配额,单位字节,为0时不限制
+     *
+     */
+    void set_dispatch_throttle_bytes(uint64_t bytes)
+    {
+        _dispatch_queue._dispatch_throttler.reset_max(bytes);
+    }
+
+    /**
+     * 设置消息延迟统计的采样间隔,为0时不统计
+     *
+     */
+    void set_latency_sample_every(uint32_t every)
+    {
+        _dispatch_queue._latency.set_sample_every(every);
+    }
+
+    /**
+     * 获取按消息类型统计的各阶段延迟直方图
+     *
+     */
+    void dump_latency(std::map<uint32_t, MessageLatencyStats>& stats)
+    {
+        _dispatch_queue._latency.dump(stats);
+    }
+
+    void reset_latency()
+    {
+        _dispatch_queue._latency.reset();
+    }
+
+    /**
+     * 绑定地址,占用IP和端口后在对应的unix socket路径上监听
+     *
+     */
+    int bind(const entity_addr_t& bind_addr);
+
+    /**
+     * 启动messenger
+     *
+     */
+    int start();
+
+    /**
+     * 等待messenger停止
+     *
+     */
+    void wait();
+
+    /**
+     * 停止messenger
+     *
+     */
+    int shutdown();
+
+    /**
+     * 根据地址信息发送消息
+     *
+     */
+    int send_message(Message* m, const entity_inst_t& dest);
+
+    /**
+     * 根据已有连接发送消息
+     *
+     */
+    int send_message(Message* m, Connection* con);
+
+    /**
+     * 根据地址获取连接
+     *
+     */
+    Connection* get_connection(const entity_inst_t& dest);
+
+    /**
+     * 获取本地连接
+     *
+     */
+    Connection* get_loopback_connection()
+    {
+        return _local_connection;
+    }
+
+    /**
+     * 根据地址信息停止连接
+     *
+     */
+    void mark_down(const entity_addr_t& addr);
+
+    /**
+     * 关闭所有连接
+     *
+     */
+    void mark_down_all();
+
+protected:
+    void ready();
+
+private:
+    class Accepter : public Thread
+    {
+    public:
+        explicit Accepter(ShmMessenger* msgr) : _msgr(msgr) {}
+
+        void entry()
+        {
+            _msgr->accept_entry();
+        }
+
+    private:
+        ShmMessenger* _msgr;
+    } _accepter;
+
+    void accept_entry();
+
+    void stop_accepter();
+
+    void close_listen();
+
+    /**
+     * 创建主动连接,需持有_lock
+     *
+     */
+    ShmConnection* connect_rank(const entity_addr_t& addr, int type);
+
+    /**
+     * 处理accept到的fd
+     *
+     */
+    void add_accept(int fd);
+
+    void submit_message(Message* m, ShmConnection* con, const entity_addr_t& dest_addr, int dest_type);
+
+    void init_local_connection();
+
+    /**
+     * 查找已有的连接,需持有_lock
+     *
+     */
+    ShmConnection* lookup_conn(const entity_addr_t& k)
+    {
+        std::map<entity_addr_t, ShmConnection*>::iterator iter = _conns.find(k);
+        if (iter == _conns.end() || iter->second->is_closed())
+        {
+            return NULL;
+        }
+
+        return iter->second;
+    }
+
+    /**
+     * 回收读线程已经退出的连接,需持有_lock
+     *
+     */
+    void reap_conns();
+
+public:
+    // 消息转发队列
+    DispatchQueue _dispatch_queue;
+
+    Mutex _lock;
+
+    // 接收消息使用的缓冲池,由所有连接共享
+    BufferPool* _recv_pool;
+
+private:
+    // 是否已绑定
+    bool _did_bind;
+    // 占用IP和端口的socket,不监听
+    int _reserve_fd;
+    // 监听的unix socket
+    int _listen_fd;
+    std::string _listen_path;
+    int _shutdown_rd_fd;
+    int _shutdown_wr_fd;
+
+    // 主动发起的连接
+    std::map<entity_addr_t, ShmConnection*> _conns;
+    // 被动接受的连接
+    std::set<ShmConnection*> _accepted;
+    // 已被替换,等待回收的连接
+    std::list<ShmConnection*> _closed_conns;
+
+    Cond _stop_cond;
+    bool _stopped;
+
+    ShmConnection* _local_connection;
+
+    friend class ShmConnection;
+};
+
+#endif
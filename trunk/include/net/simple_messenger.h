@@ -7,11 +7,18 @@
 #include <unordered_map>
 #include "log.h"
 #include "spinlock.h"
+#include "timer.h"
 #include "messenger.h"
 #include "socket.h"
 #include "accepter.h"
 #include "dispatch_queue.h"
 
+// 对端socket表分片数
+// config
+#define SM_PEER_SHARDS 32
+// keepalive2发送间隔,单位毫秒
+// config
+#define SM_KEEPALIVE_INTERVAL_MS 1000
 
 class SimpleMessenger : public PolicyMessenger
 {
@@ -40,6 +47,65 @@ public:
         return _dispatch_queue.get_max_age(now);
     }
 
+    /**
+     * 设置消息转发线程数,需要在start之前调用
+     *
+     */
+    void set_dispatch_threads(unsigned num)
+    {
+        _dispatch_queue.set_num_threads(num);
+    }
+
+    /**
+     * 设置快速转发线程数,需要在start之前调用
+     *
+     */
+    void set_fast_dispatch_threads(unsigned num)
+    {
+        _dispatch_queue.set_fast_threads(num);
+    }
+
+    /**
+     * 设置可以快速转发的本地消息是否直接在发送线程中转发
+     *
+     */
+    void set_local_fast_dispatch(bool on)
+    {
+        _dispatch_queue.set_local_inline(on);
+    }
+
+    /**
+     * 设置转发节流器的总配额,单位字节,为0时不限制
+     *
+     */
+    void set_dispatch_throttle_bytes(uint64_t bytes)
+    {
+        _dispatch_queue._dispatch_throttler.reset_max(bytes);
+    }
+
+    /**
+     * 设置消息延迟统计的采样间隔,为0时不统计
+     *
+     */
+    void set_latency_sample_every(uint32_t every)
+    {
+        _dispatch_queue._latency.set_sample_every(every);
+    }
+
+    /**
+     * 获取按消息类型统计的各阶段延迟直方图
+     *
+     */
+    void dump_latency(std::map<uint32_t, MessageLatencyStats>& stats)
+    {
+        _dispatch_queue._latency.dump(stats);
+    }
+
+    void reset_latency()
+    {
+        _dispatch_queue._latency.reset();
+    }
+
     /**
      * 绑定端口
      *
@@ -81,6 +147,18 @@ public:
      *
      */
     int send_message(Message* m, Connection* con);
+
+    /**
+     * 根据地址信息批量发送消息,只查找一次对端、加一次锁、唤醒一次写线程
+     *
+     */
+    int send_messages(std::vector<Message*>& ms, const entity_inst_t& dest);
+
+    /**
+     * 根据已有连接批量发送消息
+     *
+     */
+    int send_messages(std::vector<Message*>& ms, Connection* con);
     
     /**
      * 根据地址获取连接
@@ -116,6 +194,145 @@ public:
     void mark_down(Connection* con);
     
     void mark_disposable(Connection* con);
+
+    /**
+     * 设置写线程是否合并发送消息
+     *
+     */
+    void set_batch_send(bool batch)
+    {
+        _batch_send = batch;
+    }
+
+    /**
+     * 设置是否在调用send_message的线程中编码消息并计算负载的crc
+     * 开启后socket的写线程只需设置序号、计算头部crc并发送
+     *
+     */
+    void set_encode_on_submit(bool on)
+    {
+        _encode_on_submit = on;
+    }
+
+    /**
+     * 获取已发送的消息数及sendmsg调用次数
+     *
+     */
+    void get_send_stats(uint64_t& msgs, uint64_t& syscalls)
+    {
+        msgs = atomic_read(&_send_msgs);
+        syscalls = atomic_read(&_send_syscalls);
+    }
+
+    /**
+     * 设置零拷贝发送阈值,消息数据不小于该值时使用MSG_ZEROCOPY发送
+     * 为0时关闭,不为0时最小为SM_ZEROCOPY_MIN_BYTES,需要在建立连接之前调用
+     *
+     */
+    void set_zerocopy(uint32_t threshold)
+    {
+        if (threshold && SM_ZEROCOPY_MIN_BYTES > threshold)
+        {
+            threshold = SM_ZEROCOPY_MIN_BYTES;
+        }
+
+        _zerocopy_threshold = threshold;
+    }
+
+    /**
+     * 设置本端支持的最高协议版本,建立连接时与对端协商取较小值
+     * 默认为MSGR_PROTOCOL_V2,需要在建立连接之前调用
+     *
+     */
+    void set_protocol_version(uint32_t version)
+    {
+        _protocol_version = MIN(version, (uint32_t)MSGR_PROTOCOL_V2);
+    }
+
+    /**
+     * 设置监听线程数,大于1时每个线程一个SO_REUSEPORT监听socket,需要在bind之前调用
+     *
+     */
+    void set_accept_threads(unsigned num)
+    {
+        _accepter.set_listeners(num);
+    }
+
+    /**
+     * 设置监听队列长度,需要在bind之前调用
+     *
+     */
+    void set_listen_backlog(int backlog)
+    {
+        _accepter.set_backlog(backlog);
+    }
+
+    /**
+     * 设置TCP连接的收发缓冲大小,为0时由内核自动调整
+     * 需要在bind及建立连接之前调用
+     *
+     */
+    void set_socket_buffers(int rcvbuf, int sndbuf)
+    {
+        _sock_rcvbuf = rcvbuf;
+        _sock_sndbuf = sndbuf;
+    }
+
+    /**
+     * 设置延迟确认时间,单位毫秒,为0时收到消息后立即发送确认
+     * 延迟期间有消息要发送时确认随消息帧一起发送
+     *
+     */
+    void set_ack_delay(uint32_t msec)
+    {
+        _ack_delay_ms = msec;
+    }
+
+    /**
+     * 设置来自某类对端的消息延迟投递的时间,单位毫秒,为0时不延迟,需要在start之前调用
+     * 默认不延迟任何对端,只有配置了延迟的对端的连接才使用延迟投递线程
+     *
+     */
+    void set_delayed_delivery(int peer_type, uint32_t msec)
+    {
+        if (msec)
+        {
+            _delay_peer_types[peer_type] = msec;
+        }
+        else
+        {
+            _delay_peer_types.erase(peer_type);
+        }
+    }
+
+    /**
+     * 设置keepalive2发送间隔,单位毫秒,为0时不发送,需要在start之前调用
+     * 每次收到对端的回复都会更新连接的往返时间
+     *
+     */
+    void set_keepalive_interval(uint32_t msec)
+    {
+        _keepalive_interval_ms = msec;
+    }
+
+    /**
+     * 获取零拷贝sendmsg次数及被内核退化为拷贝的次数
+     *
+     */
+    void get_zerocopy_stats(uint64_t& sends, uint64_t& copied)
+    {
+        sends = atomic_read(&_zerocopy_sends);
+        copied = atomic_read(&_zerocopy_copied);
+    }
+
+    /**
+     * 获取接收缓冲池的命中及未命中次数
+     *
+     */
+    void get_recv_pool_stats(uint64_t& hits, uint64_t& misses)
+    {
+        _recv_pool->get_stats(hits, misses);
+    }
     
     /**
      * 关闭所有连接
@@ -140,6 +357,12 @@ public:
      */
     Socket* add_accept_socket(int fd);
 
+    /**
+     * 按配置设置fd的收发缓冲大小
+     *
+     */
+    int apply_socket_buffers(int fd);
+
 private:
     // 负责关闭socket的线程
     class ReaperThread : public Thread
@@ -155,7 +378,42 @@ private:
 
     Socket* connect_rank(const entity_addr_t& addr, int type, SocketConnection* con, Message* first);
 
+    /**
+     * 对端是否监听了unix socket且与本端在同一主机上
+     * 本端需要已绑定端口,对端以本端的地址区分unix socket上的连接
+     *
+     */
+    bool is_local_peer(const entity_addr_t& addr);
+
+    // 只有一个消息的submit_messages
     void submit_message(Message* m, SocketConnection* con, const entity_addr_t& addr, int dest_type, bool already_locked);
+
+    /**
+     * 整批消息按顺序发往同一对端,ms被清空
+     * con不为空时优先使用其socket,本端地址直接本地转发,否则按策略建立连接
+     *
+     */
+    void submit_messages(std::vector<Message*>& ms, SocketConnection* con, const entity_addr_t& addr, int dest_type, bool already_locked);
+
+    // 设置消息的源地址和默认优先级
+    void prepare_message(Message* m)
+    {
+        m->get_header().src = get_entity_name();
+
+        if (!m->get_priority())
+        {
+            m->set_priority(get_default_send_priority());
+        }
+    }
+
+    // 开启_encode_on_submit时在当前线程编码发往其他实体的消息,本地消息直接转发不需要编码
+    void encode_outgoing(Message* m, const entity_addr_t& dest_addr)
+    {
+        if (_encode_on_submit && !(_entity._addr == dest_addr))
+        {
+            m->encode_body(_crc_flag);
+        }
+    }
     
     // 关闭socket
     void reaper();
@@ -173,8 +431,20 @@ private:
     // _global_seq锁
     SpinLock _global_seq_lock;
 
-    // std::unordered_map<entity_addr_t, Socket*> _rank_socket;
-    std::map<entity_addr_t, Socket*> _rank_socket;
+    // 对端socket表的一个分片
+    struct PeerShard
+    {
+        // 保护_rank_socket及对应对端的建连、替换过程
+        Mutex _lock;
+        std::unordered_map<entity_addr_t, Socket*> _rank_socket;
+    };
+
+    // 按对端地址hash分片,发往不同对端的消息不会竞争同一把锁
+    // 加锁顺序: 分片锁 -> Socket::_lock -> _lock
+    PeerShard _peer_shards[SM_PEER_SHARDS];
+
+    // 保护_accepting_sockets,持有该锁时不再获取其他锁
+    Mutex _accepting_lock;
 
     // 正在连接的socket.状态为SOCKET_ACCEPTING
     std::set<Socket*> _accepting_sockets;
@@ -188,7 +458,6 @@ private:
     Cond _stop_cond;
     // messenger是否已停止
     bool _stopped = true;
-    Throttle _dispatch_throttler;
 
     // 回收socket线程是否已启动
     bool _reaper_started;
@@ -197,20 +466,62 @@ private:
     bool _reaper_stop;
 
     Cond _reaper_cond;
+    // 写线程是否合并发送
+    bool _batch_send;
+    // 是否在发送线程中编码消息
+    bool _encode_on_submit;
+    // 发送统计
+    atomic_t _send_msgs;
+    atomic_t _send_syscalls;
+    // 零拷贝发送阈值,为0时不使用零拷贝
+    uint32_t _zerocopy_threshold;
+    // TCP连接的收发缓冲大小,为0时由内核自动调整
+    int _sock_rcvbuf;
+    int _sock_sndbuf;
+    atomic_t _zerocopy_sends;
+    atomic_t _zerocopy_copied;
+    // 本端支持的最高协议版本
+    uint32_t _protocol_version;
+    // 延迟确认时间,单位毫秒
+    uint32_t _ack_delay_ms;
+    // 所有连接共用一个延迟投递线程
+    DelayedDelivery _delayed_delivery;
+    // 需要延迟投递的对端类型及延迟时间,单位毫秒
+    // config
+    std::map<int, uint32_t> _delay_peer_types;
+    // 所有连接共用一个定时器发送keepalive2
+    Timer _keepalive_timer;
+    uint32_t _keepalive_interval_ms;
+
+    // 接收消息使用的缓冲池,由所有连接共享
+    BufferPool* _recv_pool;
 
     Cond  _wait_cond;
 
     friend class Socket;
 
+    class C_KeepaliveTick;
+
+    /**
+     * 通知所有已建立的连接发送keepalive2,由定时器线程调用
+     *
+     */
+    void keepalive_tick();
+
+    PeerShard& get_peer_shard(const entity_addr_t& k)
+    {
+        return _peer_shards[k.hash() % SM_PEER_SHARDS];
+    }
+
     /**
-     * 查找已有的连接
+     * 查找已有的连接,调用时需持有对应分片的锁
      *
      */
     Socket* lookup_socket(const entity_addr_t& k)
     {
-        // std::unordered_map<entity_addr_t, Socket*>::iterator iter = _rank_socket.find(k);
-        std::map<entity_addr_t, Socket*>::iterator iter = _rank_socket.find(k);
-        if (iter == _rank_socket.end())
+        PeerShard& shard = get_peer_shard(k);
+        std::unordered_map<entity_addr_t, Socket*>::iterator iter = shard._rank_socket.find(k);
+        if (iter == shard._rank_socket.end())
         {
             return NULL;
         }
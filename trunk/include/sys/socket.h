@@ -3,7 +3,8 @@
 
 #include <deque>
 // #include <list>
-// #include <map>
+#include <map>
+#include <vector>
 // #include <unordered_map>
 #include <time.h>
 #include <errno.h>
@@ -16,6 +17,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#endif
 #include "utils.h"
 #include "time_utils.h"
 #include "cond.h"
@@ -24,13 +28,178 @@
 #include "msg_types.h"
 #include "messenger.h"
 #include "socketconnection.h"
+#include "message_queue.h"
 
 // SYS_NS_BEGIN
 
 static const int SM_IOV_MAX = (IOV_MAX >= 1024 ? IOV_MAX / 4 : IOV_MAX);
 
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_MSG_ZEROCOPY
+#endif
+
+// 合并发送时单批最多发送的字节数
+// config
+static const uint32_t SM_BATCH_MAX_BYTES = 64 << 10;
+
+// 接收消息时单次recvmsg最多使用的iovec数
+static const int SM_RECV_IOV_MAX = 8;
+
+// 编码后消息帧头尾的最大长度
+static const uint32_t SM_FRAME_HEAD_MAX = 96;
+static const uint32_t SM_FRAME_TAIL_MAX = 32;
+
+// 收到消息后延迟发送确认的时间,期间有消息要发送时确认随消息帧一起发送,单位毫秒
+// config
+static const uint32_t SM_ACK_DELAY_MS = 1;
+
+// 未确认的消息数达到该值时立即发送确认
+// config
+static const uint64_t SM_ACK_WINDOW = 64;
+
+// 开启快速转发线程时读线程单次最多攒批提交的消息数
+// config
+static const uint32_t SM_FAST_DISPATCH_BATCH = 32;
+
+// 零拷贝发送的最小数据长度,过小的消息锁定页面及处理完成通知的开销大于拷贝
+// config
+static const uint32_t SM_ZEROCOPY_MIN_BYTES = 16 << 10;
+
+// v2帧头部中按连接差分编码的状态,收发两个方向各一份
+struct frame_state
+{
+    uint64_t last_seq;
+    entity_name last_src;
+    uint64_t last_ack;
+
+    frame_state()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        last_seq = 0;
+        memset(&last_src, 0, sizeof(last_src));
+        last_ack = 0;
+    }
+};
+
+/**
+ * 编码v2帧头部,不包括tag和长度字节
+ *
+ * @param ack: 不为0时携带该确认序号
+ * @param p: 至少SM_FRAME_HEAD_MAX字节
+ * @return: 编码后的长度
+ */
+extern uint32_t encode_frame_v2_head(frame_state& st, const msg_header& h, const msg_footer& f, int crc_flag, uint64_t ack, char* p);
+
+/**
+ * 解码v2帧头部,头部不完整或校验失败时返回-1且不改变状态
+ *
+ * @param ack: 帧携带的确认序号,没有携带时为0
+ */
+extern int decode_frame_v2_head(frame_state& st, const char* head, uint32_t len, int crc_flag, msg_header& h, uint8_t& flags, uint64_t& ack);
+
 class SimpleMessenger;
 class DispatchQueue;
+class Socket;
+
+// 延迟投递消息的调度线程,由messenger的所有连接共享
+// 每个连接的消息按接收顺序排队,各连接队首消息按投递时间排序,到期后放入转发队列
+class DelayedDelivery : public Thread
+{
+public:
+    // 单个连接的延迟消息,socket被替换时随连接转移到新的socket
+    struct Queue
+    {
+        explicit Queue(Socket* s) : _socket(s), _flush_count(0), _active(false),
+                    _scheduled(false), _stopped(false), _stop_fast_dispatching(false)
+        {}
+
+        Socket* _socket;
+        std::deque<std::pair<utime_t, Message*> > _messages;
+        // 需要立即投递的消息数
+        int _flush_count;
+        // 正在投递该队列的消息
+        bool _active;
+        // 是否在调度表中
+        bool _scheduled;
+        std::multimap<utime_t, Queue*>::iterator _sched;
+        // 队列正在释放,不再投递
+        bool _stopped;
+        bool _stop_fast_dispatching;
+    };
+
+    DelayedDelivery() : _lock(), _cond(), _started(false), _stop(false) {}
+
+    virtual ~DelayedDelivery() {}
+
+    /**
+     * 为socket创建延迟队列,第一次调用时启动调度线程
+     *
+     */
+    Queue* create_queue(Socket* s);
+
+    /**
+     * 丢弃剩余消息并释放队列,正在投递时等待投递完成
+     *
+     */
+    void remove_queue(Queue* q);
+
+    void queue(Queue* q, const utime_t& release, Message* m);
+
+    /**
+     * 丢弃队列中的消息
+     *
+     */
+    void discard(Queue* q);
+
+    /**
+     * 队列中当前的消息不再等待,立即投递
+     *
+     */
+    void flush(Queue* q);
+
+    bool is_flushing(Queue* q);
+
+    void wait_for_flush(Queue* q);
+
+    /**
+     * 队列转移给替换的socket
+     *
+     */
+    void steal_for_socket(Queue* q, Socket* s);
+
+    /**
+     * 停止快速转发,等待正在进行的快速转发完成
+     *
+     */
+    void stop_fast_dispatching(Queue* q);
+
+    /**
+     * 停止调度线程
+     *
+     */
+    void shutdown();
+
+    void entry();
+
+private:
+    // 调用时需持有_lock
+    void schedule(Queue* q);
+
+    void unschedule(Queue* q);
+
+    void discard_messages(Queue* q);
+
+    Mutex _lock;
+    Cond _cond;
+    // 按投递时间排序的队列,每个有消息的队列只出现一次
+    std::multimap<utime_t, Queue*> _schedule;
+    bool _started;
+    bool _stop;
+};
 
 
 class Socket : public RefCountable
@@ -72,73 +241,8 @@ public:
         void entry() { _socket->writer(); }
     } _writer_thread;
 
-    // 延迟发送消息线程
-    class DelayedDelivery : public Thread
-    {
-    private:
-        Socket* _socket;
-        // 待发送队列
-        std::deque< std::pair<utime_t, Message*> > _delay_queue;
-        Mutex _delay_lock;
-        Cond _delay_cond;
-        int _flush_count;
-        // 线程已激活
-        bool _active_flush;
-        // 是否停止发送线程
-        bool _stop_delayed_delivery;
-        bool _delay_dispatching;
-        bool _stop_fast_dispatching_flag;
-
-    public:
-        explicit DelayedDelivery(Socket* s) : _socket(s), _delay_lock(), _flush_count(0),
-                    _active_flush(false), _stop_delayed_delivery(false), _delay_dispatching(false),
-                    _stop_fast_dispatching_flag(false)
-        {}
-        
-        virtual ~DelayedDelivery()
-        {
-            discard();
-        }
-        
-        void entry();
-        void queue(utime_t release, Message* m)
-        {
-            Mutex::Locker locker(_delay_lock);
-            _delay_queue.push_back(std::make_pair(release, m));
-            _delay_cond.signal();
-        }
-        void discard();
-        void flush();
-        bool is_flushing()
-        {
-            Mutex::Locker locker(_delay_lock);
-            return _flush_count > 0 || _active_flush;
-        }
-        
-        void wait_for_flush()
-        {
-            Mutex::Locker locker(_delay_lock);
-            while (_flush_count > 0 || _active_flush)
-            {
-                _delay_cond.wait(_delay_lock);
-            }
-        }
-        
-        void stop()
-        {
-            Mutex::Locker locker(_delay_lock);
-            _stop_delayed_delivery = true;
-            _delay_cond.signal();
-        }
-        
-        void steal_for_socket(Socket* s)
-        {
-            Mutex::Locker locker(_delay_lock);
-            _socket= s;
-        }
-        
-        void stop_fast_dispatching();
-    } *_delay_thread;
+    // 延迟投递的消息,没有需要延迟投递的消息类型时为NULL
+    DelayedDelivery::Queue* _delay_queue;
 
     /**
      * 获取socket句柄
@@ -179,11 +283,11 @@ public:
         return get_state_name(_state);
     }
 
-    int create_socket();
+    int create_socket(int family);
 
     // close函数会关闭套接字ID
     // 如果有其他的进程共享着这个套接字,那么它仍然是打开的
-    int close_socket()
+    void close_socket()
     {
         recv_reset();
     
@@ -221,13 +325,16 @@ public:
     // 启动写线程
     void start_writer();
     
-    void start_delay_thread();
+    void start_delayed_delivery();
+
+    // 来自该对端的消息的延迟投递时间,单位毫秒,为0时不延迟
+    uint32_t get_delivery_delay();
     
     void join_reader();
 
     uint64_t get_out_seq() { return _out_seq; }
 
-    bool is_queued() { return !_out_q.empty() || _send_keepalive || _send_keepalive_ack; }
+    bool is_queued() { return !_out_q.empty() || _send_keepalive || _send_keepalive2 || _send_keepalive_ack; }
 
     entity_addr_t& get_peer_addr() { return _peer_addr; }
 
@@ -259,7 +366,22 @@ public:
 
     void send(Message* m)
     {
-        _out_q[m->get_priority()].push_back(m);
+        _out_q.push_back(m);
+        _cond.signal();
+    }
+
+    /**
+     * 一批消息全部入队后只唤醒一次写线程,由写线程合并发送,需持有_lock
+     *
+     */
+    void send(std::vector<Message*>& ms)
+    {
+        for (std::vector<Message*>::iterator iter = ms.begin(); iter != ms.end(); ++iter)
+        {
+            _out_q.push_back(*iter);
+        }
+
+        ms.clear();
         _cond.signal();
     }
 
@@ -269,25 +391,20 @@ public:
         _cond.signal();
     }
 
+    /**
+     * 发送带时间戳的keepalive,对端回复后据此计算往返时间,需持有_lock
+     *
+     */
+    void send_keepalive2(const utime_t& stamp)
+    {
+        _send_keepalive2 = true;
+        _keepalive2_stamp = stamp;
+        _cond.signal();
+    }
+
     Message* get_next_outgoing()
     {
-        Message* m = NULL;
-        while (!m && !_out_q.empty())
-        {
-            std::map<int, std::list<Message*> >::reverse_iterator iter = _out_q.rbegin();
-            if (!iter->second.empty())
-            {
-                m = iter->second.front();
-                iter->second.pop_front();
-            }
-            
-            if (iter->second.empty())
-            {
-                _out_q.erase(iter->first);
-            }
-        }
-        
-        return m;
+        return _out_q.pop_front();
     }
 
     void requeue_sent();
@@ -308,15 +425,38 @@ public:
 
     bool has_pending_data() { return _recv_len > _recv_ofs; }
 
+    /**
+     * 根据最近接收的消息大小调整预读长度
+     * 小消息一次预读多个,大消息只预读下一个消息的tag和头部,使消息体直接读入目标缓冲
+     *
+     */
+    void adjust_prefetch(uint64_t msg_size);
+
     int tcp_read(char* buf, uint32_t len);
 
+    /**
+     * 分散读,数据直接读入iov指向的缓冲,末尾附加预读缓冲接收后续数据
+     * iov会被修改,cnt不能超过SM_RECV_IOV_MAX - 1
+     *
+     */
+    int tcp_readv(struct iovec* iov, int cnt);
+
     int tcp_read_wait();
 
+    /**
+     * 开启快速转发线程时,读线程攒批后一次提交可以快速转发的消息
+     * 读线程在预读缓冲中还有数据时继续解析,即将阻塞或批满时提交
+     *
+     */
+    void batch_fast_dispatch(Message* m);
+
+    void flush_fast_dispatch();
+
     ssize_t tcp_read_nonblocking(char* buf, uint32_t len);
 
     int tcp_write(const char* buf, uint32_t len);
     
-    inline size_t getfd() {return _fd;}
+    inline int getfd() {return _fd;}
 
 public:
     
@@ -340,9 +480,12 @@ public:
     size_t _recv_max_prefetch;
     size_t _recv_ofs;
     size_t _recv_len;
+    // 接收消息大小的滑动平均
+    uint64_t _recv_msg_avg;
 
 protected:
     friend class SimpleMessenger;
+    friend class DelayedDelivery;
     SocketConnection* _connection_state;
     utime_t _backoff;
     // 读线程是否启动
@@ -352,20 +495,37 @@ protected:
     bool _reader_dispatching;
     // 消息是否发送完成
     bool _notify_on_dispatch_done;
+    // 等待提交给快速转发线程的消息,只在读线程中访问,不为空时_reader_dispatching为true
+    std::vector<Message*> _fast_batch;
     bool _writer_running;
     // 是否替换socket
     bool _replaced;
     bool _is_reset_from_peer;
 
-    std::map<int, std::list<Message*> > _out_q;
+    // 待发送队列
+    MessageQueue _out_q;
 
     DispatchQueue* _in_q;
 
     // 发送队列
     std::list<Message*> _sent;
 
+    // 是否已开启SO_ZEROCOPY
+    bool _zerocopy;
+    // 下一次零拷贝sendmsg对应的通知序号,只由写线程修改
+    uint32_t _zc_next;
+    // 小于该序号的零拷贝发送都已完成
+    uint32_t _zc_done;
+    // 乱序到达的完成通知区间
+    std::map<uint32_t, uint32_t> _zc_ranges;
+    // 等待内核完成零拷贝的消息,及其最后一次sendmsg的通知序号
+    std::deque<std::pair<uint32_t, Message*> > _zc_pending;
+
     Cond _cond;
     bool _send_keepalive;
+    bool _send_keepalive2;
+    // 待发送keepalive2的时间戳
+    utime_t _keepalive2_stamp;
     bool _send_keepalive_ack;
     utime_t _keepalive_ack_stamp;
     bool _halt_delivery;
@@ -375,6 +535,23 @@ protected:
     uint64_t _out_seq;
     uint64_t _in_seq;
     uint64_t _in_seq_acked;
+    // 最早的未确认消息到达后,最晚在该时间发送确认
+    utime_t _ack_deadline;
+
+    // 对端在本机,连接时优先使用unix socket
+    bool _prefer_local;
+    // 当前连接是否为unix socket
+    bool _local;
+
+    // 当前连接协商的帧格式
+    uint32_t _protocol;
+    // 对端拒绝过v2,重连时只提供v1
+    bool _peer_v1;
+    // v2帧中序号和确认序号按连接差分编码,发送方与上一个消息相同时省略
+    frame_state _out_frame;
+    frame_state _in_frame;
+    // 读线程最近一个帧携带的确认序号,为0表示没有
+    uint64_t _in_frame_ack;
 
     int accept();    
     
@@ -395,10 +572,98 @@ protected:
     void unlock_maybe_reap();
     
     int read_message(Message** pm);
+
+    /**
+     * 连接建立时重置v2帧的差分编码状态
+     *
+     */
+    void reset_frame_state(uint32_t protocol);
+
+    /**
+     * 按协商的帧格式编码消息头,包括tag
+     *
+     * @param p: 至少SM_FRAME_HEAD_MAX字节
+     * @param ack: 不为0时v2帧携带该确认序号
+     * @return: 编码后的长度
+     */
+    uint32_t encode_frame_head(const msg_header& h, const msg_footer& f, char* p, uint64_t ack = 0);
+
+    /**
+     * 按协商的帧格式编码消息尾
+     *
+     * @param p: 至少SM_FRAME_TAIL_MAX字节
+     * @return: 编码后的长度
+     */
+    uint32_t encode_frame_tail(const msg_header& h, const msg_footer& f, char* p);
+
+    /**
+     * 读取v2帧头部并还原为msg_header
+     *
+     */
+    int read_frame_head(msg_header& h, uint8_t& flags);
+
+    /**
+     * 解码v2帧尾部
+     *
+     */
+    void decode_frame_tail(const char* p, uint8_t flags, msg_footer& f);
     
-    int write_message(const msg_header& h, const msg_footer& f, buffer& body);
+    /**
+     * 发送消息,zerocopy为true时消息数据以MSG_ZEROCOPY发送,头尾仍然拷贝
+     *
+     */
+    int write_message(const msg_header& h, const msg_footer& f, buffer& body, bool zerocopy = false, uint64_t ack = 0);
+
+    /**
+     * 是否需要发送确认,延迟确认未到期且未确认的消息数未达到窗口时返回false
+     *
+     */
+    bool ack_due(const utime_t& now) const;
+
+    /**
+     * 确认能否随消息帧一起发送
+     *
+     */
+    bool can_piggyback_ack() const { return MSGR_PROTOCOL_V2 == _protocol; }
+
+    /**
+     * 消息是否需要零拷贝发送
+     *
+     */
+    bool want_zerocopy(Message* m);
+
+    /**
+     * 持有零拷贝发送的消息直到内核发送完成,调用时需持有_lock
+     *
+     */
+    void hold_zerocopy(Message* m, uint32_t first_seq);
+
+    /**
+     * 读取错误队列中的零拷贝完成通知,释放已完成的消息
+     *
+     */
+    void reap_zerocopy();
+
+    /**
+     * 释放已完成零拷贝的消息,all为true时全部释放
+     *
+     */
+    void release_zerocopy(bool all);
+
+    /**
+     * 合并发送,将ack、心跳及多个消息编码后通过一次sendmsg发出
+     * 调用时需持有_lock
+     *
+     */
+    int write_batch();
+
+    /**
+     * 将buffer中的数据发出,超过SM_IOV_MAX时分多次发送
+     *
+     */
+    int write_buffer(const buffer& bl, bool more, bool zerocopy = false);
     
-    int do_sendmsg(struct msghdr* msg, unsigned len, bool more = false);
+    int do_sendmsg(struct msghdr* msg, unsigned len, bool more = false, bool zerocopy = false);
     
     int write_ack(uint64_t s);
     
@@ -432,7 +697,7 @@ private:
 
 
 private:
-    size_t _fd;
+    int _fd;
     struct iovec _msgvec[SM_IOV_MAX];
 #if !defined(MSG_NOSIGNAL) && !defined(SO_NOSIGPIPE)
     sigset_t _sigpipe_mask;
@@ -37,9 +37,9 @@ public:
 private:
     
 #ifdef HAVE_PTHREAD_SPINLOCK
-    pthread_spinlock_t _lock;
+    mutable pthread_spinlock_t _lock;
 #else
-    pthread_mutex_t _lock;
+    mutable pthread_mutex_t _lock;
 #endif
 };
 
@@ -1,8 +1,12 @@
+#include <limits.h>
+#include <unistd.h>
 #include <sys/shm.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "shm_queue.h"
 #include "intarith.h"
 
-ShmQueue::ShmQueue(ShareMemory* shm, QueueMode mode) : _shm(shm)
+ShmQueue::ShmQueue(ShareMemory* shm, QueueMode mode) : _shm(shm), _rLock(NULL), _wLock(NULL)
 {
     _queue_addr = (char*)_shm->get_shm_address();
     // 共享内存头部存放ShmTrunk信息
@@ -23,10 +27,8 @@ ShmQueue::ShmQueue(ShareMemory* shm, QueueMode mode) : _shm(shm)
         // _shm_trunk->_shm_size = _shm->get_shmsize();
         _shm_trunk->_queue_size = _shm->get_shmsize() - sizeof(ShmTrunk);
         _shm_trunk->_queue_mode = mode;
-    }
-    else
-    {
-        dump();
+        _shm_trunk->_doorbell = 0;
+        _shm_trunk->_waiters = 0;
     }
     
     init_lock();
@@ -36,7 +38,15 @@ ShmQueue::~ShmQueue()
 {
     if (_shm_trunk)
     {
-        _shm->close();
+        // 另一端可能已经删除了共享内存,析构中不能抛出异常
+        try
+        {
+            _shm->close();
+        }
+        catch (...)
+        {
+        }
+
         // delete _shm_trunk;
         _shm_trunk->~ShmTrunk();
     }
@@ -61,6 +71,26 @@ int ShmQueue::send(char* message, uint32_t length)
         return -1;
     }
 
+    struct iovec iov;
+    iov.iov_base = message;
+    iov.iov_len = length;
+
+    return sendv(&iov, 1);
+}
+
+int ShmQueue::sendv(const struct iovec* iov, int iovcnt)
+{
+    uint32_t length = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        length += iov[i].iov_len;
+    }
+
+    if (0 >= length)
+    {
+        return -1;
+    }
+
     ShmRWLock::ShmWLocker wLocker;
     // 尝试获取写锁
     if (wlock() && _wLock)
@@ -69,18 +99,11 @@ int ShmQueue::send(char* message, uint32_t length)
     }
 
     // 首先判断是否队列已满
-    int freesize = get_free_size();
-    // printf("queue size is %d\n", size);
-    if (0 >= freesize)
-    {
-        printf("queue size not enough, %d\n", freesize);
-        return -1;
-    }
+    uint32_t freesize = get_free_size();
 
-    // 空间不足
-    if ((length + sizeof(uint32_t)) > freesize)
+    // 空间不足,写满后头尾索引相等,与队列为空无法区分,所以至少保留1个字节
+    if ((length + sizeof(uint32_t)) >= freesize)
     {
-        printf("queue size not enough\n");
         return -1;
     }
 
@@ -99,21 +122,26 @@ int ShmQueue::send(char* message, uint32_t length)
         // end = (end + 1) & (_shm_trunk->_queue_size - 1);
     }
 
-    uint32_t minlen = MIN(len, _shm_trunk->_queue_size - end);
-    memcpy((void *)(&dst[end]), (const void *) message, (size_t) minlen);
-    size_t lastLen = length - minlen;
-    if (0 < lastLen)
+    for (int i = 0; i < iovcnt; i++)
     {
-        memcpy(&dst[0], message + minlen, lastLen);
+        const char* message = (const char*)iov[i].iov_base;
+        uint32_t seglen = iov[i].iov_len;
+        uint32_t minlen = MIN(seglen, _shm_trunk->_queue_size - end);
+        memcpy((void *)(&dst[end]), (const void *) message, (size_t) minlen);
+        size_t lastLen = seglen - minlen;
+        if (0 < lastLen)
+        {
+            memcpy(&dst[0], message + minlen, lastLen);
+        }
+
+        end = (end + seglen) % _shm_trunk->_queue_size;
     }
 
     __WRITE_BARRIER__;
 
     // 需要保证共享内存size是2的倍数，不然不能使用下列方法取余
-    _shm_trunk->_tail = (end  + len) % _shm_trunk->_queue_size;
+    _shm_trunk->_tail = end;
     // _shm_trunk->_tail = (end + len) & (_shm_trunk->_queue_size - 1);
-
-    printf("write message %s\n", message);
     
     return 0;
 }
@@ -182,8 +210,6 @@ int ShmQueue::recv(char* message)
     // 需要保证共享内存size是2的倍数，不然不能使用下列方法取余
     _shm_trunk->_head = (begin + dstlen) % _shm_trunk->_queue_size;
     // _shm_trunk->_head = (begin + dstlen) & (_shm_trunk->_queue_size - 1);
-
-    printf("read message %s\n", message);
     
     return dstlen;
 }
@@ -336,6 +362,36 @@ uint32_t ShmQueue::get_data_size()
     }
 }
 
+void ShmQueue::wait(uint32_t timeout_ms)
+{
+    uint32_t seq = _shm_trunk->_doorbell;
+    // 原子操作同时是内存屏障,保证写端看到等待者后再检查数据
+    __sync_fetch_and_add(&_shm_trunk->_waiters, 1);
+
+    if (empty())
+    {
+        struct timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        // 共享内存在不同进程中地址不同,不能使用FUTEX_PRIVATE_FLAG
+        syscall(SYS_futex, &_shm_trunk->_doorbell, FUTEX_WAIT, seq, &ts, NULL, 0);
+    }
+
+    __sync_fetch_and_sub(&_shm_trunk->_waiters, 1);
+}
+
+void ShmQueue::notify()
+{
+    // 保证写入的尾索引先于读取等待者个数
+    __MEM_BARRIER;
+
+    if (_shm_trunk->_waiters)
+    {
+        __sync_fetch_and_add(&_shm_trunk->_doorbell, 1);
+        syscall(SYS_futex, &_shm_trunk->_doorbell, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
 uint32_t ShmQueue::get_queue_length()
 {
     return _shm_trunk->_queue_size;
@@ -330,6 +330,138 @@ raw* copy(const char* c, uint32_t len)
     return r;
 }
 
+// 来自BufferPool的内存,raw对象放在数据段之后,释放时内存归还缓冲池
+class raw_pooled : public raw
+{
+public:
+    raw_pooled(char* data, uint32_t len, BufferPool* pool, uint32_t cls) : raw(data, len), _pool(pool), _cls(cls)
+    {
+    }
+
+    virtual ~raw_pooled()
+    {
+    }
+
+    static raw_pooled* create(char* chunk, uint32_t len, BufferPool* pool, uint32_t cls)
+    {
+        return new (chunk + (1U << (cls + BufferPool::MIN_SHIFT))) raw_pooled(chunk, len, pool, cls);
+    }
+
+    static size_t chunk_size(uint32_t cls)
+    {
+        return (1U << (cls + BufferPool::MIN_SHIFT)) + ROUND_UP_TO(sizeof(raw_pooled), alignof(raw_pooled));
+    }
+
+    static void operator delete(void* p)
+    {
+        raw_pooled* raw = (raw_pooled*)p;
+        raw->_pool->put(raw->_cls, raw->_data);
+    }
+
+    raw* clone_empty()
+    {
+        return ::create(_len);
+    }
+
+private:
+    BufferPool* _pool;
+    // 所属级别
+    uint32_t _cls;
+};
+
+BufferPool::BufferPool(uint32_t max_bytes) : RefCountable(), _max_bytes(max_bytes)
+{
+    atomic_set(&_hits, 0);
+    atomic_set(&_misses, 0);
+}
+
+BufferPool::~BufferPool()
+{
+    for (uint32_t i = 0; i < NUM_CLASSES; i++)
+    {
+        for (size_t j = 0; j < _classes[i]._free.size(); j++)
+        {
+            free(_classes[i]._free[j]);
+        }
+    }
+}
+
+raw* BufferPool::create(uint32_t len)
+{
+    if (len > (1U << MAX_SHIFT))
+    {
+        atomic_inc(&_misses);
+        return ::create(len);
+    }
+
+    return create_class(size_class(len), len);
+}
+
+raw* BufferPool::create_page_aligned(uint32_t len)
+{
+    if (len > (1U << MAX_SHIFT))
+    {
+        atomic_inc(&_misses);
+        return ::create_page_aligned(len);
+    }
+
+    // 不小于一页的级别都是页对齐的
+    return create_class(size_class(MAX(len, (uint32_t)PAGE_SIZE)), len);
+}
+
+raw* BufferPool::create_class(uint32_t cls, uint32_t len)
+{
+    char* chunk = NULL;
+    {
+        SpinLock::Locker locker(_classes[cls]._lock);
+        if (!_classes[cls]._free.empty())
+        {
+            chunk = _classes[cls]._free.back();
+            _classes[cls]._free.pop_back();
+        }
+    }
+
+    if (chunk)
+    {
+        atomic_inc(&_hits);
+    }
+    else
+    {
+        atomic_inc(&_misses);
+
+        size_t align = ((1U << (cls + MIN_SHIFT)) >= PAGE_SIZE) ? PAGE_SIZE : sizeof(size_t);
+        int r = posix_memalign((void**)(void*)&chunk, align, raw_pooled::chunk_size(cls));
+        if (r)
+        {
+            THROW_SYSCALL_EXCEPTION(NULL, r, "posix_memalign");
+        }
+    }
+
+    // 每个未归还的raw持有一个引用
+    inc();
+
+    return raw_pooled::create(chunk, len, this, cls);
+}
+
+void BufferPool::put(uint32_t cls, char* chunk)
+{
+    {
+        SpinLock::Locker locker(_classes[cls]._lock);
+        if ((_classes[cls]._free.size() << (cls + MIN_SHIFT)) < _max_bytes)
+        {
+            _classes[cls]._free.push_back(chunk);
+            chunk = NULL;
+        }
+    }
+
+    if (chunk)
+    {
+        free(chunk);
+    }
+
+    dec();
+}
+
 
 
 ptr::ptr(raw* r) : _raw(r), _off(0), _len(r->_len)
@@ -429,9 +561,8 @@ void ptr::release()
 {
     if (_raw)
     {
-        atomic_dec(&(_raw->_ref));
-        
-        if (0 == _raw->_ref)
+        // 多个线程同时释放时只有最后一个删除
+        if (atomic_dec_and_test(&(_raw->_ref)))
         {
             delete _raw;
         }
@@ -947,7 +1078,7 @@ void buffer::push_back(const ptr& p)
     }
     
     _ptrs.push_back(p);
-    _len + p.length();
+    _len += p.length();
 }
 
 
@@ -980,6 +1111,8 @@ uint32_t buffer::crc32(uint32_t crc) const
             }
         }
     }
+
+    return crc;
 }
 
 void buffer::claim(buffer& buf, unsigned int flags)
@@ -3,6 +3,7 @@
 
 Throttle::Throttle(const std::string& n, int64_t m) : _name(n), _max(m)
 {
+    atomic_set(&_count, 0);
 }
 
 Throttle::~Throttle()
@@ -163,3 +164,167 @@ void Throttle::reset()
     atomic_set(&_count, 0);
 }
 
+FairThrottle::FairThrottle(const std::string& n, int64_t m) : _name(n), _max(m), _count(0),
+            _active_weight(0), _waiters(0), _fair_waiters(0)
+{
+}
+
+int64_t FairThrottle::_share(const Account* a) const
+{
+    // 还未活跃的连接按加入后计算
+    uint64_t total = _active_weight + (_active(a) ? 0 : a->_weight);
+    if (0 == total)
+    {
+        return _max;
+    }
+
+    return _max * a->_weight / total;
+}
+
+bool FairThrottle::_can_take(const Account* a, int64_t c) const
+{
+    if (0 == _max)
+    {
+        return true;
+    }
+
+    // 单个请求超过总配额时,等其他请求全部释放后放行
+    if (_count + c > _max && 0 != _count)
+    {
+        return false;
+    }
+
+    // 最后一部分配额只留给占用少的连接,重载连接占满其余配额时轻载连接也不需要等待
+    int64_t reserve = _max / FAIR_THROTTLE_RESERVE_DIV;
+    if (_count + c > _max - reserve && a->_used + c > reserve && 0 != a->_used)
+    {
+        return false;
+    }
+
+    return _within_share(a, c) || 0 == _fair_waiters;
+}
+
+void FairThrottle::_update(Account* a, int64_t used, int waiting)
+{
+    bool was_active = _active(a);
+    __atomic_store_n(&a->_used, used, __ATOMIC_RELAXED);
+    a->_waiting = waiting;
+    bool is_active = _active(a);
+
+    if (!was_active && is_active)
+    {
+        _active_weight += a->_weight;
+    }
+    else if (was_active && !is_active)
+    {
+        _active_weight -= a->_weight;
+    }
+}
+
+bool FairThrottle::get(Account* a, int64_t c)
+{
+    Mutex::Locker locker(_lock);
+    if (_can_take(a, c))
+    {
+        _update(a, a->_used + c, a->_waiting);
+        _count += c;
+        return false;
+    }
+
+    _update(a, a->_used, a->_waiting + 1);
+    while (true)
+    {
+        // 份额随活跃连接变化,每次唤醒后重新判断
+        bool within = _within_share(a, c);
+        if (within)
+        {
+            _fair_waiters++;
+        }
+
+        _waiters++;
+        _cond.wait(_lock);
+        _waiters--;
+
+        if (within)
+        {
+            _fair_waiters--;
+        }
+
+        if (_can_take(a, c))
+        {
+            break;
+        }
+    }
+
+    _update(a, a->_used + c, a->_waiting - 1);
+    _count += c;
+
+    // 可能还有其他请求可以放行
+    if (_waiters)
+    {
+        _cond.broadcast();
+    }
+
+    return true;
+}
+
+bool FairThrottle::get_or_fail(Account* a, int64_t c)
+{
+    Mutex::Locker locker(_lock);
+    if (!_can_take(a, c))
+    {
+        return false;
+    }
+
+    _update(a, a->_used + c, a->_waiting);
+    _count += c;
+
+    return true;
+}
+
+void FairThrottle::put(Account* a, int64_t c)
+{
+    if (!c)
+    {
+        return;
+    }
+
+    Mutex::Locker locker(_lock);
+    _update(a, a->_used - c, a->_waiting);
+    _count -= c;
+
+    if (_waiters)
+    {
+        _cond.broadcast();
+    }
+}
+
+void FairThrottle::set_weight(Account* a, uint32_t weight)
+{
+    if (!weight)
+    {
+        weight = 1;
+    }
+
+    Mutex::Locker locker(_lock);
+    if (_active(a))
+    {
+        _active_weight = _active_weight - a->_weight + weight;
+    }
+
+    a->_weight = weight;
+    if (_waiters)
+    {
+        _cond.broadcast();
+    }
+}
+
+void FairThrottle::reset_max(int64_t m)
+{
+    Mutex::Locker locker(_lock);
+    _max = m;
+    if (_waiters)
+    {
+        _cond.broadcast();
+    }
+}
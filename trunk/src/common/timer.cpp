@@ -29,12 +29,12 @@ void Timer::shutdown()
 {
     if (_thread)
     {
+        _lock.lock();
         cancel_all_events();
         _stopping = true;
         _cond.signal();
         _lock.unlock();
         _thread->join();
-        _lock.lock();
         
         delete _thread;
         _thread = NULL;
@@ -82,8 +82,8 @@ void Timer::timer_thread()
         }
         else
         {
-            // 注意需要转成毫秒
-            _cond.timed_wait(_lock, (_schedule.begin()->first - now).to_msec());
+            // 注意需要转成毫秒,不足1毫秒时按1毫秒等待
+            _cond.timed_wait(_lock, MAX((_schedule.begin()->first - now).to_msec(), (uint64_t)1));
         }
 
         DEBUG_LOG("timer thread awake");
@@ -102,6 +102,8 @@ void Timer::add_event_after(int64_t seconds, Callback* cb)
 
 void Timer::add_event_at(utime_t when, Callback* cb)
 {
+    // 锁是递归的,回调函数中可以重新添加任务
+    Mutex::Locker locker(_lock);
     std::multimap<utime_t, Callback*>::value_type sval(when, cb);
     schedule_iter i = _schedule.insert(sval);
 
@@ -122,6 +124,7 @@ void Timer::add_event_at(utime_t when, Callback* cb)
 
 bool Timer::cancel_event(Callback* cb)
 {
+    Mutex::Locker locker(_lock);
     event_iter i = _events.find(cb);
     if (i == _events.end())
     {
@@ -141,6 +144,7 @@ bool Timer::cancel_event(Callback* cb)
 
 void Timer::cancel_all_events()
 {
+    Mutex::Locker locker(_lock);
     while (!_events.empty())
     {
         event_iter i = _events.begin();
@@ -3,23 +3,6 @@
 #include "socket.h"
 #include "simple_messenger.h"
 
-// 设置文件描述符旗标防止异常关闭
-static int set_close_on_exec(int fd)
-{
-    int flags = fcntl(fd, F_GETFD, 0);
-    if (flags < 0)
-    {
-        return errno;
-    }
-    
-    if (fcntl(fd, F_SETFD, flags | FD_CLOEXEC))
-    {
-        return errno;
-    }
-    
-    return 0;
-}
-
 
 int Accepter::create_socket(int* rd, int* wr)
 {
@@ -38,6 +21,132 @@ int Accepter::create_socket(int* rd, int* wr)
     return 0;
 }
 
+int Accepter::open_listeners(const entity_addr_t& addr, bool reuse_addr)
+{
+    int on = 1;
+    bool reuse_port = 1 < _num_listeners;
+
+    // 自动选择端口时,SO_REUSEPORT会使bind成功绑定到其他同样设置了该选项的进程的端口上
+    // 先用不带该选项的socket确认端口空闲
+    if (reuse_port && !reuse_addr)
+    {
+        int probe = ::socket(addr.get_family(), SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (0 > probe)
+        {
+            return -errno;
+        }
+
+        int rc = ::bind(probe, addr.get_sockaddr(), addr.get_sockaddr_len());
+        int r = -errno;
+        ::close(probe);
+        if (0 > rc)
+        {
+            return r;
+        }
+    }
+
+    for (unsigned i = 0; i < _num_listeners; i++)
+    {
+        // 监听socket为非阻塞,唤醒后accept到没有新连接为止
+        int fd = ::socket(addr.get_family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (0 > fd)
+        {
+            int r = -errno;
+            close_listeners();
+            return r;
+        }
+
+        _listen_fds.push_back(fd);
+
+        if ((reuse_addr && 0 > ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)))
+            || (reuse_port && 0 > ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))))
+        {
+            int r = -errno;
+            close_listeners();
+            return r;
+        }
+
+        // accept到的socket继承监听socket的缓冲大小,需在listen之前设置才能影响窗口扩大因子
+        int r = _msgr->apply_socket_buffers(fd);
+        if (0 > r)
+        {
+            close_listeners();
+            return r;
+        }
+
+        if (0 > ::bind(fd, addr.get_sockaddr(), addr.get_sockaddr_len()) || 0 > ::listen(fd, _backlog))
+        {
+            r = -errno;
+            close_listeners();
+            return r;
+        }
+    }
+
+    return 0;
+}
+
+void Accepter::close_listeners()
+{
+    for (size_t i = 0; i < _listen_fds.size(); i++)
+    {
+        ::close(_listen_fds[i]);
+    }
+
+    _listen_fds.clear();
+}
+
+// 在TCP监听地址对应的路径上监听unix socket
+int Accepter::bind_local(const entity_addr_t& addr)
+{
+    sockaddr_un sun;
+    if (!addr.get_local_path(sun, "sock", true))
+    {
+        return -EACCES;
+    }
+
+    close_local();
+
+    // 路径只由端口决定,其它IP上绑定了同一端口的进程可能正在使用
+    int r = unlink_stale_local_path(sun.sun_path);
+    if (0 > r)
+    {
+        return r;
+    }
+
+    _local_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (0 > _local_fd)
+    {
+        return -errno;
+    }
+
+    if (0 > ::bind(_local_fd, (sockaddr*)&sun, sizeof(sun)) || 0 > ::listen(_local_fd, _backlog))
+    {
+        r = -errno;
+        ::close(_local_fd);
+        _local_fd = -1;
+        return r;
+    }
+
+    _local_path = sun.sun_path;
+
+    return 0;
+}
+
+void Accepter::close_local()
+{
+    if (0 <= _local_fd)
+    {
+        ::close(_local_fd);
+        _local_fd = -1;
+    }
+
+    if (!_local_path.empty())
+    {
+        ::unlink(_local_path.c_str());
+        _local_path.clear();
+    }
+}
+
 int Accepter::bind(const entity_addr_t& bind_addr, const std::set<int>& avoid_ports)
 {
     int family;
@@ -56,24 +165,12 @@ int Accepter::bind(const entity_addr_t& bind_addr, const std::set<int>& avoid_po
         }
     }
 
-    // 创建一个socket用于监听
-    _listen_fd = ::socket(family, SOCK_STREAM, 0);
-    
-    if (0 > _listen_fd)
-    {
-        return -errno;
-    }
-
-    if (set_close_on_exec(_listen_fd))
-    {
-        ERROR_LOG("set close on exec flag failed!");
-    }
-  
     entity_addr_t listen_addr = bind_addr;
     listen_addr.set_family(family);
 
-    int rc = -1;
     int r = -1;
+    // 自动选择端口时已在该端口对应的路径上监听了unix socket
+    bool local_bound = false;
 
     // 尝试绑定3次
     for (int i = 0; i < 3; ++i)
@@ -85,20 +182,7 @@ int Accepter::bind(const entity_addr_t& bind_addr, const std::set<int>& avoid_po
 
         if (listen_addr.get_port())
         {
-            int on = 1;
-            rc = ::setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-            if (0 > rc)
-            {
-                r = -errno;
-                continue;
-            }
-
-            rc = ::bind(_listen_fd, listen_addr.get_sockaddr(), listen_addr.get_sockaddr_len());
-            if (0 > rc)
-            {
-                r = -errno;
-                continue;
-            }
+            r = open_listeners(listen_addr, true);
         }
         // 如果没有配置监听端口
         else
@@ -111,87 +195,79 @@ int Accepter::bind(const entity_addr_t& bind_addr, const std::set<int>& avoid_po
                 }
 
                 listen_addr.set_port(port);
-                rc = ::bind(_listen_fd, listen_addr.get_sockaddr(),
-                listen_addr.get_sockaddr_len());
-                if (0 == rc)
+                r = open_listeners(listen_addr, false);
+                // unix socket路径只由端口决定,已被其它IP上同端口的进程使用时换下一个端口
+                if (0 == r && listen_addr.is_local())
+                {
+                    r = bind_local(listen_addr);
+                    if (-EADDRINUSE == r)
+                    {
+                        close_listeners();
+                        continue;
+                    }
+
+                    local_bound = (0 == r);
+                    r = 0;
+                }
+
+                if (0 == r)
                 {
                     break;
                 }
             }
             
-            if (0 > rc)
+            if (0 > r)
             {
-                r = -errno;
                 listen_addr.set_port(0); 
-                continue;
             }
         }
 
-        if (0 == rc)
+        if (0 == r)
         {
             break;
         }
     }
 
     // 绑定端口失败
-    if (0 > rc)
+    if (0 > r)
     {
-        ::close(_listen_fd);
-        _listen_fd = -1;
         return r;
     }
     
     sockaddr_storage ss;
     socklen_t llen = sizeof(ss);
-    rc = getsockname(_listen_fd, (sockaddr*)&ss, &llen);
-    if (0 > rc)
+    if (0 > getsockname(_listen_fds[0], (sockaddr*)&ss, &llen))
     {
-        rc = -errno;
-        ::close(_listen_fd);
-        _listen_fd = -1;
-        return rc;
+        r = -errno;
+        close_listeners();
+        return r;
     }
     
     listen_addr.set_sockaddr((sockaddr*)&ss);
 
-    // 设置接收缓冲大小
-    int size = 4096;
-    rc = ::setsockopt(_listen_fd, SOL_SOCKET, SO_RCVBUF, (void*)&size, sizeof(size));
-    if (0 > rc)
-    {
-        rc = -errno;
-        ::close(_listen_fd);
-        _listen_fd = -1;
-        return rc;
-    }
-    
-    // 设置发送缓冲大小
-    rc = ::setsockopt(_listen_fd, SOL_SOCKET, SO_SNDBUF , (void*)&size, sizeof(size));
-    if (0 > rc)
-    {
-        rc = -errno;
-        ::close(_listen_fd);
-        _listen_fd = -1;
-        return rc;
-    }
-
-    // 开始监听
-    rc = ::listen(_listen_fd, 128);
-    if (0 > rc)
+    if (listen_addr.is_local() && !local_bound)
     {
-        rc = -errno;
-        ::close(_listen_fd);
-        _listen_fd = -1;
-        return rc;
+        r = bind_local(listen_addr);
+        // 私有目录不可用时只监听TCP,对端同样会改用TCP
+        if (-EACCES == r)
+        {
+            ERROR_LOG("local socket dir is not private, listen on tcp only");
+        }
+        else if (0 > r)
+        {
+            ERROR_LOG("bind local socket failed, errno %d", -r);
+            close_listeners();
+            return r;
+        }
     }
   
     _msgr->set_entity_addr(listen_addr);
     _msgr->init_local_connection();
 
-    rc = create_socket(&_shutdown_rd_fd, &_shutdown_wr_fd);
-    if (0 > rc)
+    r = create_socket(&_shutdown_rd_fd, &_shutdown_wr_fd);
+    if (0 > r)
     {
-        return rc;
+        return r;
     }
 
     return 0;
@@ -216,19 +292,35 @@ int Accepter::rebind(const std::set<int>& avoid_ports)
 
 int Accepter::start()
 {
-    DEBUG_LOG("Accepter start");
+    DEBUG_LOG("Accepter start, %u listeners", (uint32_t)_listen_fds.size());
+
+    _handoff.create();
+
+    for (size_t i = 0; i < _listen_fds.size(); i++)
+    {
+        _listeners.push_back(new Listener(this, _listen_fds[i]));
+    }
+
+    if (0 <= _local_fd)
+    {
+        _listeners.push_back(new Listener(this, _local_fd));
+    }
 
-    create();
+    for (size_t i = 0; i < _listeners.size(); i++)
+    {
+        _listeners[i]->create();
+    }
 
     return 0;
 }
 
-void Accepter::entry()
+void Accepter::listen_entry(int listen_fd)
 {
-    DEBUG_LOG("Accepter entry");
+    DEBUG_LOG("Accepter listen entry, fd %d", listen_fd);
     
     int errors = 0;
-    int ch;
+    bool local = (listen_fd == _local_fd);
+    std::vector<int> accepted;
 
     struct pollfd pfd[2];
     memset(pfd, 0, sizeof(pfd));
@@ -244,12 +336,13 @@ void Accepter::entry()
     // POLLHUP 对方文件描述符挂起
     // POLLNVAL 文件描述符不是一个打开的文件
 
-    pfd[0].fd = _listen_fd;
+    pfd[0].fd = listen_fd;
     pfd[0].events = POLLIN | POLLERR | POLLNVAL | POLLHUP;
+    // 所有监听线程共用一个管道,停止时写入的数据不读出,各线程都能被唤醒
     pfd[1].fd = _shutdown_rd_fd;
     pfd[1].events = POLLIN | POLLERR | POLLNVAL | POLLHUP;
     
-    while (!_done)
+    while (!_done && ACCEPTER_MAX_ERRORS >= errors)
     {
         int r = poll(pfd, 2, -1);
         if (0 > r)
@@ -270,14 +363,6 @@ void Accepter::entry()
         // 退出accepter
         if (pfd[1].revents & (POLLIN | POLLERR | POLLNVAL | POLLHUP))
         {
-            if (-1 == ::read(_shutdown_rd_fd, &ch, 1))
-            {
-                if (errno != EAGAIN)
-                {
-                    
-                }
-            }
-            
             break;
         }
         
@@ -287,39 +372,88 @@ void Accepter::entry()
             break;
         }
 
-        sockaddr_storage ss;
-        socklen_t len = sizeof(ss);
-        int fd = ::accept(_listen_fd, (sockaddr*)&ss, &len);
-        if (0 <= fd)
+        // 取完已完成握手的连接,连接风暴时减少poll的次数
+        for (int i = 0; i < ACCEPTER_BATCH; i++)
         {
-            sockaddr_in* addr_in = (sockaddr_in*)&ss;
-            INFO_LOG("accept %s:%d connect", inet_ntoa(addr_in->sin_addr), ntohs(addr_in->sin_port));
+            sockaddr_storage ss;
+            socklen_t len = sizeof(ss);
+            int fd = ::accept4(listen_fd, (sockaddr*)&ss, &len, SOCK_CLOEXEC);
+            if (0 > fd)
+            {
+                if (EINTR == errno || ECONNABORTED == errno)
+                {
+                    continue;
+                }
+
+                // 其他监听线程可能已经取走了连接
+                if (EAGAIN != errno && EWOULDBLOCK != errno)
+                {
+                    ERROR_LOG("accept failed, errno %d", errno);
+                    errors++;
+                }
 
-            // 防止异常关闭
-            if (set_close_on_exec(fd))
+                break;
+            }
+
+            if (local)
             {
-                ERROR_LOG("set close on exec flag failed while accept");
+                INFO_LOG("accept local connect");
             }
-            
+            else
+            {
+                sockaddr_in* addr_in = (sockaddr_in*)&ss;
+                INFO_LOG("accept %s:%d connect", inet_ntoa(addr_in->sin_addr), ntohs(addr_in->sin_port));
+            }
+
             errors = 0;
+            accepted.push_back(fd);
+        }
 
-            // 添加连接到msgr,此时socket状态为accepting
-            _msgr->add_accept_socket(fd);
+        if (!accepted.empty())
+        {
+            Mutex::Locker locker(_pending_lock);
+            _pending.insert(_pending.end(), accepted.begin(), accepted.end());
+            _pending_cond.signal();
+            accepted.clear();
         }
-        else
+    }
+}
+
+void Accepter::handoff_entry()
+{
+    std::vector<int> fds;
+
+    _pending_lock.lock();
+    while (!_done)
+    {
+        if (_pending.empty())
         {
-            if (++errors > 4)
-            {
-                break;
-            }
+            _pending_cond.wait(_pending_lock);
+            continue;
         }
+
+        fds.swap(_pending);
+        _pending_lock.unlock();
+
+        // 添加连接到msgr,此时socket状态为accepting
+        // 创建读线程及握手都不在监听线程中进行
+        for (size_t i = 0; i < fds.size(); i++)
+        {
+            _msgr->add_accept_socket(fds[i]);
+        }
+
+        fds.clear();
+        _pending_lock.lock();
     }
 
-    if (0 <= _shutdown_rd_fd)
+    // 停止时还未交出的连接直接关闭
+    for (size_t i = 0; i < _pending.size(); i++)
     {
-        ::close(_shutdown_rd_fd);
-        _shutdown_rd_fd = -1;
+        ::close(_pending[i]);
     }
+
+    _pending.clear();
+    _pending_lock.unlock();
 }
 
 void Accepter::stop()
@@ -341,19 +475,24 @@ void Accepter::stop()
     VOID_TEMP_FAILURE_RETRY(::close(_shutdown_wr_fd));
     _shutdown_wr_fd = -1;
 
-    if (is_started())
+    for (size_t i = 0; i < _listeners.size(); i++)
     {
-        join();
+        _listeners[i]->join();
+        delete _listeners[i];
     }
 
-    if (0 <= _listen_fd)
+    _listeners.clear();
+
+    if (_handoff.is_started())
     {
-        if (0 > ::close(_listen_fd))
-        {
-            // 
-        }
-        _listen_fd = -1;
+        _pending_lock.lock();
+        _pending_cond.signal();
+        _pending_lock.unlock();
+        _handoff.join();
     }
+
+    close_listeners();
+    close_local();
     
     if (0 <= _shutdown_rd_fd)
     {
@@ -366,5 +505,3 @@ void Accepter::stop()
     
     _done = false;
 }
-
-
@@ -0,0 +1,1709 @@
+#include <unistd.h>
+#include <limits.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "log.h"
+#include "async_messenger.h"
+#include "async/async_connection.h"
+
+// 单次sendmsg最多使用的iovec数
+static const int ASYNC_IOV_MAX = (IOV_MAX >= 1024 ? IOV_MAX / 4 : IOV_MAX);
+
+// 回调持有连接的引用,执行完后释放
+class AsyncConnection::HandleConnect : public Callback
+{
+public:
+    explicit HandleConnect(AsyncConnection* c) : _con(c) { _con->get(); }
+
+    virtual void finish(int r)
+    {
+        if (0 == r)
+        {
+            _con->do_connect();
+        }
+
+        _con->dec();
+    }
+
+private:
+    AsyncConnection* _con;
+};
+
+class AsyncConnection::HandleAccept : public Callback
+{
+public:
+    HandleAccept(AsyncConnection* c, int fd) : _con(c), _fd(fd) { _con->get(); }
+
+    virtual void finish(int r)
+    {
+        if (0 == r)
+        {
+            _con->do_accept(_fd);
+        }
+        else
+        {
+            ::close(_fd);
+        }
+
+        _con->dec();
+    }
+
+private:
+    AsyncConnection* _con;
+    int _fd;
+};
+
+class AsyncConnection::HandleWrite : public Callback
+{
+public:
+    explicit HandleWrite(AsyncConnection* c) : _con(c) { _con->get(); }
+
+    virtual void finish(int r)
+    {
+        {
+            Mutex::Locker locker(_con->_write_lock);
+            _con->_write_scheduled = false;
+        }
+
+        if (0 == r)
+        {
+            _con->handle_write();
+        }
+
+        _con->dec();
+    }
+
+private:
+    AsyncConnection* _con;
+};
+
+class AsyncConnection::HandleStop : public Callback
+{
+public:
+    HandleStop(AsyncConnection* c, bool queue_reset) : _con(c), _queue_reset(queue_reset) { _con->get(); }
+
+    virtual void finish(int r)
+    {
+        _con->stop(_queue_reset);
+        _con->dec();
+    }
+
+private:
+    AsyncConnection* _con;
+    bool _queue_reset;
+};
+
+// 会话被新连接重置,持有的是从messenger中摘下的引用
+class AsyncConnection::HandleReset : public Callback
+{
+public:
+    explicit HandleReset(AsyncConnection* c) : _con(c) {}
+
+    virtual void finish(int r)
+    {
+        _con->was_session_reset();
+        _con->stop(false);
+        _con->dec();
+    }
+
+private:
+    AsyncConnection* _con;
+};
+
+class AsyncConnection::HandleReplace : public Callback
+{
+public:
+    HandleReplace(AsyncConnection* c, int fd, const msg_connect& connect) : _con(c), _fd(fd), _connect(connect)
+    {
+        _con->get();
+    }
+
+    virtual void finish(int r)
+    {
+        if (0 == r)
+        {
+            _con->replace_fd(_fd, _connect);
+        }
+        else
+        {
+            ::close(_fd);
+        }
+
+        _con->dec();
+    }
+
+private:
+    AsyncConnection* _con;
+    int _fd;
+    msg_connect _connect;
+};
+
+// 释放messenger持有的引用,延迟到事件处理完之后执行
+class AsyncConnection::HandleRelease : public Callback
+{
+public:
+    explicit HandleRelease(AsyncConnection* c) : _con(c) {}
+
+    virtual void finish(int r)
+    {
+        _con->dec();
+    }
+
+private:
+    AsyncConnection* _con;
+};
+
+class AsyncConnection::HandleReconnect : public Callback
+{
+public:
+    explicit HandleReconnect(AsyncConnection* c) : _con(c) { _con->get(); }
+
+    virtual void finish(int r)
+    {
+        if (0 == r && STATE_NONE == _con->_state)
+        {
+            _con->do_connect();
+        }
+
+        _con->dec();
+    }
+
+private:
+    AsyncConnection* _con;
+};
+
+class AsyncConnection::HandleThrottle : public Callback
+{
+public:
+    explicit HandleThrottle(AsyncConnection* c) : _con(c) { _con->get(); }
+
+    virtual void finish(int r)
+    {
+        if (0 == r && _con->_throttle_scheduled)
+        {
+            _con->_throttle_scheduled = false;
+            _con->update_event();
+            _con->handle_read();
+        }
+
+        _con->dec();
+    }
+
+private:
+    AsyncConnection* _con;
+};
+
+
+AsyncConnection::AsyncConnection(AsyncMessenger* msgr, Worker* w)
+    : Connection(msgr), _async_msgr(msgr), _worker(w), _fd(-1), _state(STATE_NONE),
+      _conn_id(msgr->_dispatch_queue.get_id()), _connect_seq(0), _peer_global_seq(0),
+      _in_seq(0), _in_seq_acked(0), _state_offset(0), _tag(0), _message_size(0),
+      _throttle_stage(0), _throttle_scheduled(false), _want_write(false), _events(0),
+      _out_seq(0), _send_keepalive(false), _send_keepalive_ack(false), _write_scheduled(false),
+      _out_ofs(0)
+{
+    atomic_set(&_closed, 0);
+    memset(_banner, 0, sizeof(_banner));
+    memset(&_connect_msg, 0, sizeof(_connect_msg));
+    memset(&_connect_reply, 0, sizeof(_connect_reply));
+    memset(&_header, 0, sizeof(_header));
+    memset(&_footer, 0, sizeof(_footer));
+}
+
+AsyncConnection::~AsyncConnection()
+{
+    if (0 <= _fd)
+    {
+        ::close(_fd);
+    }
+
+    discard_out_queue();
+}
+
+void AsyncConnection::connect(const entity_addr_t& addr, int type)
+{
+    set_peer_addr(addr);
+    set_peer_type(type);
+    _policy = _async_msgr->get_policy(type);
+    _async_msgr->_dispatch_queue.set_dispatch_weight(this, _policy._dispatch_weight);
+
+    _worker->dispatch_external(new HandleConnect(this));
+}
+
+void AsyncConnection::accept(int fd)
+{
+    _worker->dispatch_external(new HandleAccept(this, fd));
+}
+
+void AsyncConnection::queue_stop(bool queue_reset)
+{
+    if (!_worker)
+    {
+        return;
+    }
+
+    atomic_set(&_closed, 1);
+    _worker->dispatch_external(new HandleStop(this, queue_reset));
+}
+
+bool AsyncConnection::is_connected()
+{
+    if (!_worker)
+    {
+        return true;
+    }
+
+    return !is_closed() && is_open_state();
+}
+
+int AsyncConnection::send_message(Message* m)
+{
+    return _async_msgr->send_message(m, this);
+}
+
+void AsyncConnection::send(Message* m)
+{
+    {
+        Mutex::Locker locker(_write_lock);
+        if (is_closed())
+        {
+            m->dec();
+            return;
+        }
+
+        _out_q.push_back(m);
+    }
+
+    schedule_write();
+}
+
+void AsyncConnection::send_keepalive()
+{
+    if (!_worker)
+    {
+        return;
+    }
+
+    {
+        Mutex::Locker locker(_write_lock);
+        _send_keepalive = true;
+    }
+
+    schedule_write();
+}
+
+void AsyncConnection::mark_disposable()
+{
+    Mutex::Locker locker(_write_lock);
+    _policy._lossy = true;
+}
+
+void AsyncConnection::mark_down()
+{
+    queue_stop(false);
+}
+
+void AsyncConnection::schedule_write()
+{
+    {
+        Mutex::Locker locker(_write_lock);
+        if (_write_scheduled)
+        {
+            return;
+        }
+
+        _write_scheduled = true;
+    }
+
+    _worker->dispatch_external(new HandleWrite(this));
+}
+
+void AsyncConnection::set_socket_options()
+{
+    // 禁用Nagle's Algorithm
+    int flag = 1;
+    if (0 > ::setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag)))
+    {
+        ERROR_LOG("set TCP_NODELAY failed, errno %d", errno);
+    }
+
+#ifdef SO_PRIORITY
+    int prio = _async_msgr->get_socket_priority();
+    if (0 <= prio)
+    {
+        if (0 > ::setsockopt(_fd, SOL_SOCKET, SO_PRIORITY, &prio, sizeof(prio)))
+        {
+            ERROR_LOG("set SO_PRIORITY failed, errno %d", errno);
+        }
+    }
+#endif
+}
+
+void AsyncConnection::update_event()
+{
+    if (0 > _fd)
+    {
+        return;
+    }
+
+    // 节流时暂停读,避免水平触发下不停回调
+    uint32_t events = EPOLLRDHUP;
+    if (!_throttle_scheduled)
+    {
+        events |= EPOLLIN;
+    }
+
+    if (_want_write)
+    {
+        events |= EPOLLOUT;
+    }
+
+    if (events == _events)
+    {
+        return;
+    }
+
+    int r = 0;
+    if (0 == _events)
+    {
+        r = _worker->add_event(_fd, this, events);
+    }
+    else
+    {
+        r = _worker->modify_event(_fd, this, events);
+    }
+
+    if (0 > r)
+    {
+        ERROR_LOG("update fd %d events failed, errno %d", _fd, -r);
+    }
+
+    _events = events;
+}
+
+void AsyncConnection::close_fd()
+{
+    if (0 <= _fd)
+    {
+        if (_events)
+        {
+            _worker->del_event(_fd);
+        }
+
+        ::close(_fd);
+        _fd = -1;
+    }
+
+    _events = 0;
+    _want_write = false;
+    _state_offset = 0;
+    _out_ptrs.clear();
+    _out_ofs = 0;
+}
+
+void AsyncConnection::do_connect()
+{
+    DEBUG_LOG("async connection connect, connect seq is %d", _connect_seq);
+
+    if (STATE_CLOSED == _state)
+    {
+        return;
+    }
+
+    close_fd();
+
+    _fd = ::socket(_peer_addr.get_family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (0 > _fd)
+    {
+        ERROR_LOG("create socket failed, errno %d", errno);
+        _state = STATE_CONNECTING;
+        fault();
+        return;
+    }
+
+    set_socket_options();
+
+    _state = STATE_CONNECTING;
+
+    int r = ::connect(_fd, _peer_addr.get_sockaddr(), _peer_addr.get_sockaddr_len());
+    if (0 > r && EINPROGRESS != errno)
+    {
+        ERROR_LOG("connect %s failed, errno %d", inet_ntoa(((sockaddr_in*)&_peer_addr._addr)->sin_addr), errno);
+
+        if (ECONNREFUSED == errno)
+        {
+            _async_msgr->_dispatch_queue.queue_refused(static_cast<Connection*>(get()), _conn_id);
+        }
+
+        fault();
+        return;
+    }
+
+    // 可写时说明连接完成
+    _want_write = true;
+    update_event();
+}
+
+void AsyncConnection::do_accept(int fd)
+{
+    DEBUG_LOG("async connection accept fd %d", fd);
+
+    _fd = fd;
+
+    if (_async_msgr->_dispatch_queue._stop)
+    {
+        stop(false);
+        return;
+    }
+
+    set_socket_options();
+
+    sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    if (0 > ::getpeername(_fd, (sockaddr*)&ss, &len))
+    {
+        stop(false);
+        return;
+    }
+
+    // 对端的实际地址,收到对端声明的地址后再修正
+    entity_addr_t peer_addr;
+    peer_addr.set_sockaddr((sockaddr*)&ss);
+    set_peer_addr(peer_addr);
+
+    // banner、自己的地址、对端地址可以一次发出
+    buffer addrs_buf;
+    ::encode(_async_msgr->get_entity_addr(), addrs_buf);
+    ::encode(peer_addr, addrs_buf);
+
+    append_out(MSGR_BANNER, strlen(MSGR_BANNER));
+    append_out(addrs_buf);
+
+    _state = STATE_ACCEPTING_BANNER;
+    update_event();
+
+    handle_write();
+}
+
+int AsyncConnection::read_until(char* buf, uint32_t len)
+{
+    while (_state_offset < len)
+    {
+        ssize_t r = ::recv(_fd, buf + _state_offset, len - _state_offset, MSG_DONTWAIT);
+        if (0 > r)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+            {
+                return 1;
+            }
+
+            return -1;
+        }
+
+        // 对端关闭
+        if (0 == r)
+        {
+            return -1;
+        }
+
+        _state_offset += r;
+    }
+
+    _state_offset = 0;
+
+    return 0;
+}
+
+void AsyncConnection::handle_read()
+{
+    if (STATE_CLOSED == _state || _throttle_scheduled)
+    {
+        return;
+    }
+
+    if (STATE_CONNECTING == _state)
+    {
+        handle_write();
+        return;
+    }
+
+    process();
+
+    // 回复ack及心跳应答
+    if (is_open_state())
+    {
+        handle_write();
+    }
+}
+
+void AsyncConnection::process()
+{
+    int r = 0;
+
+    while (true)
+    {
+        switch (_state)
+        {
+            case STATE_CONNECTING_BANNER:
+            {
+                r = read_until(_banner, strlen(MSGR_BANNER));
+                if (0 != r)
+                {
+                    break;
+                }
+
+                if (memcmp(_banner, MSGR_BANNER, strlen(MSGR_BANNER)))
+                {
+                    ERROR_LOG("connect read banner mismatch");
+                    r = -1;
+                    break;
+                }
+
+                _state = STATE_CONNECTING_ADDRS;
+                continue;
+            }
+            case STATE_CONNECTING_ADDRS:
+            {
+                r = read_until(_addrs, sizeof(_addrs));
+                if (0 != r)
+                {
+                    break;
+                }
+
+                entity_addr_t peer_addr;
+                entity_addr_t peer_addr_for_me;
+                try
+                {
+                    buffer bl;
+                    bl.append(_addrs, sizeof(_addrs));
+                    buffer::iterator p = bl.begin();
+                    // accept的时候先编的是对端自己的地址信息
+                    ::decode(peer_addr, p);
+                    ::decode(peer_addr_for_me, p);
+                }
+                catch (...)
+                {
+                    r = -1;
+                    break;
+                }
+
+                // 判断是否和发起connect的地址一样
+                if (_peer_addr != peer_addr)
+                {
+                    if (!peer_addr.is_blank_ip() || _peer_addr.get_port() != peer_addr.get_port())
+                    {
+                        ERROR_LOG("not same node");
+                        r = -1;
+                        break;
+                    }
+                }
+
+                buffer my_addr_buf;
+                ::encode(_async_msgr->get_entity_addr(), my_addr_buf);
+                append_out(my_addr_buf);
+
+                msg_connect connect;
+                connect.host_type = _async_msgr->get_entity()._name.type();
+                connect.global_seq = _async_msgr->get_global_seq();
+                connect.connect_seq = _connect_seq;
+                connect.protocol_version = 0;
+                connect.flags = 0;
+                if (_policy._lossy)
+                {
+                    connect.flags |= MSG_CONNECT_LOSSY;
+                }
+
+                append_out((char*)&connect, sizeof(connect));
+
+                _state = STATE_CONNECTING_REPLY;
+                handle_write();
+                continue;
+            }
+            case STATE_CONNECTING_REPLY:
+            {
+                r = read_until((char*)&_connect_reply, sizeof(_connect_reply));
+                if (0 != r)
+                {
+                    break;
+                }
+
+                if (0 > handle_connect_reply(_connect_reply))
+                {
+                    return;
+                }
+
+                continue;
+            }
+            case STATE_ACCEPTING_BANNER:
+            {
+                r = read_until(_banner, strlen(MSGR_BANNER));
+                if (0 != r)
+                {
+                    break;
+                }
+
+                if (memcmp(_banner, MSGR_BANNER, strlen(MSGR_BANNER)))
+                {
+                    ERROR_LOG("accept read banner mismatch");
+                    r = -1;
+                    break;
+                }
+
+                _state = STATE_ACCEPTING_ADDR;
+                continue;
+            }
+            case STATE_ACCEPTING_ADDR:
+            {
+                r = read_until(_addrs, sizeof(entity_addr_t));
+                if (0 != r)
+                {
+                    break;
+                }
+
+                entity_addr_t peer_addr;
+                try
+                {
+                    buffer bl;
+                    bl.append(_addrs, sizeof(entity_addr_t));
+                    buffer::iterator p = bl.begin();
+                    ::decode(peer_addr, p);
+                }
+                catch (...)
+                {
+                    r = -1;
+                    break;
+                }
+
+                // 对端没有绑定具体ip时,使用连接上来的ip
+                if (peer_addr.is_blank_ip())
+                {
+                    int port = peer_addr.get_port();
+                    peer_addr._addr = _peer_addr._addr;
+                    peer_addr.set_port(port);
+                }
+
+                set_peer_addr(peer_addr);
+
+                _state = STATE_ACCEPTING_CONNECT;
+                continue;
+            }
+            case STATE_ACCEPTING_CONNECT:
+            {
+                r = read_until((char*)&_connect_msg, sizeof(_connect_msg));
+                if (0 != r)
+                {
+                    break;
+                }
+
+                if (0 > handle_connect_msg(_connect_msg))
+                {
+                    return;
+                }
+
+                continue;
+            }
+            case STATE_OPEN:
+            {
+                r = read_until(&_tag, 1);
+                if (0 != r)
+                {
+                    break;
+                }
+
+                if (MSGR_TAG_KEEPALIVE == _tag)
+                {
+                    set_last_keepalive(clock_now());
+                }
+                else if (MSGR_TAG_KEEPALIVE2 == _tag)
+                {
+                    _state = STATE_OPEN_KEEPALIVE2;
+                }
+                else if (MSGR_TAG_KEEPALIVE2_ACK == _tag)
+                {
+                    _state = STATE_OPEN_KEEPALIVE2_ACK;
+                }
+                else if (MSGR_TAG_ACK == _tag)
+                {
+                    _state = STATE_OPEN_ACK;
+                }
+                else if (MSGR_TAG_MSG == _tag)
+                {
+                    _state = STATE_OPEN_MESSAGE_HEADER;
+                }
+                else if (MSGR_TAG_CLOSE == _tag)
+                {
+                    DEBUG_LOG("peer closed connection");
+                    stop(false);
+                    return;
+                }
+                else
+                {
+                    ERROR_LOG("bad tag %d", (int)_tag);
+                    r = -1;
+                    break;
+                }
+
+                continue;
+            }
+            case STATE_OPEN_KEEPALIVE2:
+            {
+                r = read_until((char*)&_keepalive_stamp, sizeof(_keepalive_stamp));
+                if (0 != r)
+                {
+                    break;
+                }
+
+                {
+                    Mutex::Locker locker(_write_lock);
+                    _send_keepalive_ack = true;
+                    _keepalive_ack_stamp = utime_t(_keepalive_stamp);
+                }
+
+                set_last_keepalive(clock_now());
+                _state = STATE_OPEN;
+                continue;
+            }
+            case STATE_OPEN_KEEPALIVE2_ACK:
+            {
+                r = read_until((char*)&_keepalive_stamp, sizeof(_keepalive_stamp));
+                if (0 != r)
+                {
+                    break;
+                }
+
+                set_last_keepalive_ack(utime_t(_keepalive_stamp));
+                _state = STATE_OPEN;
+                continue;
+            }
+            case STATE_OPEN_ACK:
+            {
+                r = read_until((char*)&_ack_seq, sizeof(_ack_seq));
+                if (0 != r)
+                {
+                    break;
+                }
+
+                handle_ack(_ack_seq);
+                _state = STATE_OPEN;
+                continue;
+            }
+            case STATE_OPEN_MESSAGE_HEADER:
+            {
+                r = read_until((char*)&_header, sizeof(_header));
+                if (0 != r)
+                {
+                    break;
+                }
+
+                if (_async_msgr->_crc_flag & MSG_CRC_HEADER)
+                {
+                    uint32_t header_crc = crc32c(0, (unsigned char*)&_header, sizeof(_header) - sizeof(_header.crc));
+                    if (header_crc != _header.crc)
+                    {
+                        ERROR_LOG("bad header crc");
+                        r = -1;
+                        break;
+                    }
+                }
+
+                _recv_stamp = clock_now();
+                _message_size = _header.front_len + _header.middle_len + _header.data_len;
+                _throttle_stage = 0;
+                _state = STATE_OPEN_MESSAGE_THROTTLE;
+                continue;
+            }
+            case STATE_OPEN_MESSAGE_THROTTLE:
+            {
+                // 不能阻塞worker线程,取不到时暂停读并定时重试
+                if (0 == _throttle_stage)
+                {
+                    if (_policy._throttler_messages && !_policy._throttler_messages->get_or_fail())
+                    {
+                        r = 1;
+                    }
+                    else
+                    {
+                        _throttle_stage = 1;
+                    }
+                }
+
+                if (1 == _throttle_stage)
+                {
+                    if (_message_size && _policy._throttler_bytes && !_policy._throttler_bytes->get_or_fail(_message_size))
+                    {
+                        r = 1;
+                    }
+                    else
+                    {
+                        _throttle_stage = 2;
+                    }
+                }
+
+                if (2 == _throttle_stage)
+                {
+                    if (!_async_msgr->_dispatch_queue.dispatch_throttle_get_or_fail(this, _message_size))
+                    {
+                        r = 1;
+                    }
+                    else
+                    {
+                        _throttle_stage = 3;
+                    }
+                }
+
+                if (3 != _throttle_stage)
+                {
+                    // config
+                    utime_t when = clock_now();
+                    when += 0.001;
+                    _throttle_scheduled = true;
+                    update_event();
+                    _worker->add_timer(when, new HandleThrottle(this));
+                    return;
+                }
+
+                _throttle_stamp = clock_now();
+
+                _front = _header.front_len ? ptr(_header.front_len) : ptr();
+                _middle = _header.middle_len ? ptr(_header.middle_len) : ptr();
+                _data = _header.data_len ? ptr(_header.data_len) : ptr();
+
+                _state = STATE_OPEN_MESSAGE_FRONT;
+                continue;
+            }
+            case STATE_OPEN_MESSAGE_FRONT:
+            {
+                if (_header.front_len)
+                {
+                    r = read_until(_front.c_str(), _header.front_len);
+                    if (0 != r)
+                    {
+                        break;
+                    }
+                }
+
+                _state = STATE_OPEN_MESSAGE_MIDDLE;
+                continue;
+            }
+            case STATE_OPEN_MESSAGE_MIDDLE:
+            {
+                if (_header.middle_len)
+                {
+                    r = read_until(_middle.c_str(), _header.middle_len);
+                    if (0 != r)
+                    {
+                        break;
+                    }
+                }
+
+                _state = STATE_OPEN_MESSAGE_DATA;
+                continue;
+            }
+            case STATE_OPEN_MESSAGE_DATA:
+            {
+                if (_header.data_len)
+                {
+                    r = read_until(_data.c_str(), _header.data_len);
+                    if (0 != r)
+                    {
+                        break;
+                    }
+                }
+
+                _state = STATE_OPEN_MESSAGE_FOOTER;
+                continue;
+            }
+            case STATE_OPEN_MESSAGE_FOOTER:
+            {
+                r = read_until((char*)&_footer, sizeof(_footer));
+                if (0 != r)
+                {
+                    break;
+                }
+
+                _state = STATE_OPEN;
+                handle_message();
+                continue;
+            }
+            default:
+            {
+                // 其他状态不处理读
+                return;
+            }
+        }
+
+        // 数据不足,等待下一次可读
+        if (0 < r)
+        {
+            return;
+        }
+
+        fault();
+        return;
+    }
+}
+
+void AsyncConnection::handle_message()
+{
+    // 发送端放弃了该消息
+    if (0 == (_footer.flags & MSG_FOOTER_COMPLETE))
+    {
+        release_throttle();
+        return;
+    }
+
+    buffer front, middle, data;
+    if (_header.front_len)
+    {
+        front.push_back(_front);
+    }
+
+    if (_header.middle_len)
+    {
+        middle.push_back(_middle);
+    }
+
+    if (_header.data_len)
+    {
+        data.push_back(_data);
+    }
+
+    _front = ptr();
+    _middle = ptr();
+    _data = ptr();
+
+    Message* m = decode_message(_async_msgr->_crc_flag, _header, _footer, front, middle, data);
+    if (!m)
+    {
+        ERROR_LOG("decode message type %d failed", _header.type);
+        release_throttle();
+        fault();
+        return;
+    }
+
+    // 节流已交给消息,由消息释放
+    _throttle_stage = 0;
+
+    m->set_byte_throttler(_policy._throttler_bytes);
+    m->set_message_throttler(_policy._throttler_messages);
+    m->set_dispatch_throttle_size(_message_size);
+    m->set_recv_stamp(_recv_stamp);
+    m->set_throttle_stamp(_throttle_stamp);
+    m->set_recv_complete_stamp(clock_now());
+
+    DispatchQueue& dq = _async_msgr->_dispatch_queue;
+
+    if (m->get_seq() <= _in_seq)
+    {
+        dq.dispatch_throttle_release(this, m->get_dispatch_throttle_size());
+        m->dec();
+        return;
+    }
+
+    if (m->get_seq() > _in_seq + 1)
+    {
+        ERROR_LOG("missed message? skipped from seq %lu to %lu", _in_seq, m->get_seq());
+    }
+
+    m->set_connection(static_cast<Connection*>(get()));
+
+    _in_seq = m->get_seq();
+
+    dq.fast_preprocess(m);
+
+    if (dq.can_fast_dispatch(m))
+    {
+        if (dq.has_fast_threads())
+        {
+            dq.queue_fast_dispatch(m, _conn_id);
+        }
+        else
+        {
+            dq.fast_dispatch(m);
+        }
+    }
+    else
+    {
+        dq.enqueue(m, m->get_priority(), _conn_id);
+    }
+}
+
+void AsyncConnection::release_throttle()
+{
+    if (1 <= _throttle_stage && _policy._throttler_messages)
+    {
+        _policy._throttler_messages->put();
+    }
+
+    if (2 <= _throttle_stage && _message_size && _policy._throttler_bytes)
+    {
+        _policy._throttler_bytes->put(_message_size);
+    }
+
+    if (3 <= _throttle_stage)
+    {
+        _async_msgr->_dispatch_queue.dispatch_throttle_release(this, _message_size);
+    }
+
+    _throttle_stage = 0;
+    _throttle_scheduled = false;
+    _front = ptr();
+    _middle = ptr();
+    _data = ptr();
+}
+
+int AsyncConnection::handle_connect_reply(msg_connect_reply& reply)
+{
+    if (MSGR_TAG_BADPROTOVER == reply.tag)
+    {
+        ERROR_LOG("connect protocol version mismatch");
+        fault();
+        return -1;
+    }
+
+    if (MSGR_TAG_RESETSESSION == reply.tag)
+    {
+        was_session_reset();
+        fault();
+        return -1;
+    }
+
+    if (MSGR_TAG_RETRY_GLOBAL == reply.tag)
+    {
+        _async_msgr->get_global_seq(reply.global_seq);
+        fault();
+        return -1;
+    }
+
+    if (MSGR_TAG_RETRY_SESSION == reply.tag)
+    {
+        _connect_seq = reply.connect_seq;
+        fault();
+        return -1;
+    }
+
+    if (MSGR_TAG_WAIT == reply.tag)
+    {
+        // 等待对端连接过来
+        close_fd();
+        _state = STATE_WAIT;
+        return -1;
+    }
+
+    if (MSGR_TAG_READY == reply.tag)
+    {
+        _peer_global_seq = reply.global_seq;
+        _policy._lossy = reply.flags & MSG_CONNECT_LOSSY;
+        _state = STATE_OPEN;
+        _connect_seq = _connect_seq + 1;
+        _backoff = utime_t();
+
+        _async_msgr->_dispatch_queue.queue_connect(static_cast<Connection*>(get()), _conn_id);
+        _async_msgr->ms_deliver_handle_fast_connect(static_cast<Connection*>(get()));
+
+        return 0;
+    }
+
+    fault();
+
+    return -1;
+}
+
+int AsyncConnection::handle_connect_msg(msg_connect& connect)
+{
+    Mutex::Locker locker(_async_msgr->_lock);
+
+    if (_async_msgr->_dispatch_queue._stop)
+    {
+        stop(false);
+        return -1;
+    }
+
+    set_peer_type(connect.host_type);
+    _policy = _async_msgr->get_policy(connect.host_type);
+    _async_msgr->_dispatch_queue.set_dispatch_weight(this, _policy._dispatch_weight);
+
+    msg_connect_reply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.protocol_version = MSGR_PROTOCOL_V1;
+
+    // 只支持v1,更高的版本以MSGR_TAG_READY回复即降级为v1
+    if (connect.protocol_version > MSGR_PROTOCOL_V2)
+    {
+        reply.tag = MSGR_TAG_BADPROTOVER;
+        append_out((char*)&reply, sizeof(reply));
+        flush();
+        stop(false);
+        return -1;
+    }
+
+    // 是否已有到该地址的连接
+    AsyncConnection* existing = _async_msgr->lookup_conn(_peer_addr);
+
+    if (existing && existing != this)
+    {
+        if (connect.global_seq < existing->_peer_global_seq)
+        {
+            // 过期的连接请求,已有连接建立得更晚
+            reply.tag = MSGR_TAG_RETRY_GLOBAL;
+            reply.global_seq = existing->_peer_global_seq;
+            append_out((char*)&reply, sizeof(reply));
+            flush();
+            stop(false);
+            return -1;
+        }
+        else if (existing->_policy._lossy || (0 == connect.connect_seq && 0 < existing->_connect_seq))
+        {
+            // lossy连接或者对端重启过,旧会话作废
+            DEBUG_LOG("reset existing connection");
+
+            _async_msgr->unregister_conn(existing);
+            existing->get_worker()->dispatch_external(new HandleReset(existing));
+        }
+        else if (connect.connect_seq < existing->_connect_seq)
+        {
+            reply.tag = MSGR_TAG_RETRY_SESSION;
+            reply.connect_seq = existing->_connect_seq;
+            append_out((char*)&reply, sizeof(reply));
+            flush();
+            stop(false);
+            return -1;
+        }
+        else if (existing->is_connecting() && !(_peer_addr < _async_msgr->get_entity_addr()) && !existing->_policy._server)
+        {
+            // 双方同时连接,地址大的一方等待
+            DEBUG_LOG("connect race, peer should wait");
+
+            reply.tag = MSGR_TAG_WAIT;
+            append_out((char*)&reply, sizeof(reply));
+            flush();
+            stop(false);
+            return -1;
+        }
+        else
+        {
+            // 由已有连接接管该fd,保留未确认的消息
+            DEBUG_LOG("replace existing connection");
+
+            int fd = _fd;
+            _worker->del_event(fd);
+            _events = 0;
+            _fd = -1;
+            existing->get_worker()->dispatch_external(new HandleReplace(existing, fd, connect));
+            stop(false);
+            return -1;
+        }
+    }
+    else if (0 < connect.connect_seq)
+    {
+        // 对端认为会话还在,但本地已经没有了
+        reply.tag = MSGR_TAG_RESETSESSION;
+        append_out((char*)&reply, sizeof(reply));
+        flush();
+        stop(false);
+        return -1;
+    }
+
+    open(connect);
+
+    return 0;
+}
+
+void AsyncConnection::open(const msg_connect& connect)
+{
+    DEBUG_LOG("async connection open");
+
+    _connect_seq = connect.connect_seq + 1;
+    _peer_global_seq = connect.global_seq;
+
+    msg_connect_reply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.tag = MSGR_TAG_READY;
+    reply.global_seq = _async_msgr->get_global_seq();
+    reply.connect_seq = _connect_seq;
+    reply.protocol_version = 0;
+    if (_policy._lossy)
+    {
+        reply.flags = reply.flags | MSG_CONNECT_LOSSY;
+    }
+
+    _async_msgr->register_conn(this);
+
+    _state = STATE_OPEN;
+    append_out((char*)&reply, sizeof(reply));
+
+    _async_msgr->_dispatch_queue.queue_accept(static_cast<Connection*>(get()), _conn_id);
+    _async_msgr->ms_deliver_handle_fast_accept(static_cast<Connection*>(get()));
+}
+
+void AsyncConnection::replace_fd(int fd, const msg_connect& connect)
+{
+    DEBUG_LOG("async connection replace fd %d with %d", _fd, fd);
+
+    if (STATE_CLOSED == _state)
+    {
+        ::close(fd);
+        return;
+    }
+
+    if (STATE_OPEN_MESSAGE_THROTTLE <= _state && STATE_OPEN_MESSAGE_FOOTER >= _state)
+    {
+        release_throttle();
+    }
+
+    close_fd();
+
+    _fd = fd;
+    _throttle_scheduled = false;
+
+    {
+        Mutex::Locker locker(_write_lock);
+        requeue_sent();
+    }
+
+    _connect_seq = connect.connect_seq + 1;
+    _peer_global_seq = connect.global_seq;
+    _backoff = utime_t();
+
+    msg_connect_reply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.tag = MSGR_TAG_READY;
+    reply.global_seq = _async_msgr->get_global_seq();
+    reply.connect_seq = _connect_seq;
+    reply.protocol_version = 0;
+    if (_policy._lossy)
+    {
+        reply.flags = reply.flags | MSG_CONNECT_LOSSY;
+    }
+
+    append_out((char*)&reply, sizeof(reply));
+
+    _state = STATE_OPEN;
+    update_event();
+
+    _async_msgr->_dispatch_queue.queue_accept(static_cast<Connection*>(get()), _conn_id);
+    _async_msgr->ms_deliver_handle_fast_accept(static_cast<Connection*>(get()));
+
+    handle_write();
+}
+
+void AsyncConnection::handle_write()
+{
+    if (STATE_CLOSED == _state)
+    {
+        return;
+    }
+
+    if (STATE_CONNECTING == _state)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (0 > ::getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len))
+        {
+            err = errno;
+        }
+
+        if (0 == err)
+        {
+            sockaddr_storage ss;
+            len = sizeof(ss);
+            if (0 > ::getpeername(_fd, (sockaddr*)&ss, &len))
+            {
+                // 连接还未完成
+                if (ENOTCONN == errno)
+                {
+                    return;
+                }
+
+                err = errno;
+            }
+        }
+
+        if (err)
+        {
+            ERROR_LOG("connect %s failed, errno %d", inet_ntoa(((sockaddr_in*)&_peer_addr._addr)->sin_addr), err);
+
+            if (ECONNREFUSED == err)
+            {
+                _async_msgr->_dispatch_queue.queue_refused(static_cast<Connection*>(get()), _conn_id);
+            }
+
+            fault();
+            return;
+        }
+
+        _want_write = false;
+        append_out(MSGR_BANNER, strlen(MSGR_BANNER));
+        _state = STATE_CONNECTING_BANNER;
+    }
+
+    if (STATE_STANDBY == _state)
+    {
+        bool queued = false;
+        {
+            Mutex::Locker locker(_write_lock);
+            queued = is_queued();
+        }
+
+        // 有消息需要发送时重新连接
+        if (queued && !_policy._server)
+        {
+            _connect_seq++;
+            do_connect();
+        }
+
+        return;
+    }
+
+    if (0 > _fd)
+    {
+        return;
+    }
+
+    if (is_open_state())
+    {
+        prepare_send();
+    }
+
+    int r = flush();
+    if (0 > r)
+    {
+        fault();
+        return;
+    }
+
+    _want_write = (0 < r);
+    update_event();
+}
+
+Message* AsyncConnection::get_next_outgoing()
+{
+    return _out_q.pop_front();
+}
+
+void AsyncConnection::append_out(const char* buf, uint32_t len)
+{
+    ptr p(len);
+    memcpy(p.c_str(), buf, len);
+    _out_ptrs.push_back(std::move(p));
+}
+
+void AsyncConnection::append_out(const buffer& bl)
+{
+    for (std::list<ptr>::const_iterator iter = bl.ptrs().begin(); iter != bl.ptrs().end(); ++iter)
+    {
+        if (iter->length())
+        {
+            _out_ptrs.push_back(*iter);
+        }
+    }
+}
+
+void AsyncConnection::prepare_send()
+{
+    Mutex::Locker locker(_write_lock);
+
+    if (_send_keepalive)
+    {
+        char tag = MSGR_TAG_KEEPALIVE;
+        append_out(&tag, 1);
+        _send_keepalive = false;
+    }
+
+    if (_send_keepalive_ack)
+    {
+        char buf[1 + sizeof(struct timespec)];
+        buf[0] = MSGR_TAG_KEEPALIVE2_ACK;
+        struct timespec ts;
+        _keepalive_ack_stamp.to_timespec(&ts);
+        memcpy(buf + 1, &ts, sizeof(ts));
+        append_out(buf, sizeof(buf));
+        _send_keepalive_ack = false;
+    }
+
+    if (_in_seq > _in_seq_acked)
+    {
+        char buf[1 + sizeof(le64)];
+        buf[0] = MSGR_TAG_ACK;
+        le64 s;
+        s = _in_seq;
+        memcpy(buf + 1, &s, sizeof(s));
+        append_out(buf, sizeof(buf));
+        _in_seq_acked = _in_seq;
+    }
+
+    Message* m = NULL;
+    while (NULL != (m = get_next_outgoing()))
+    {
+        m->set_seq(++_out_seq);
+        if (!_policy._lossy)
+        {
+            _sent.push_back(m);
+            m->get();
+        }
+
+        m->set_connection(this);
+
+        m->encode(_async_msgr->_crc_flag);
+
+        const msg_header& header = m->get_header();
+        const msg_footer& footer = m->get_footer();
+
+        char buf[1 + sizeof(msg_header)];
+        buf[0] = MSGR_TAG_MSG;
+        memcpy(buf + 1, &header, sizeof(header));
+        append_out(buf, sizeof(buf));
+
+        append_out(m->get_payload());
+        append_out(m->get_middle());
+        append_out(m->get_data());
+
+        append_out((char*)&footer, sizeof(footer));
+
+        m->dec();
+    }
+}
+
+int AsyncConnection::flush()
+{
+    struct iovec iov[ASYNC_IOV_MAX];
+
+    while (!_out_ptrs.empty())
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+
+        uint32_t ofs = _out_ofs;
+        for (std::deque<ptr>::iterator iter = _out_ptrs.begin();
+             iter != _out_ptrs.end() && (int)msg.msg_iovlen < ASYNC_IOV_MAX; ++iter)
+        {
+            iov[msg.msg_iovlen].iov_base = (void*)(iter->c_str() + ofs);
+            iov[msg.msg_iovlen].iov_len = iter->length() - ofs;
+            msg.msg_iovlen++;
+            ofs = 0;
+        }
+
+        ssize_t r = ::sendmsg(_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (0 > r)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+            {
+                return 1;
+            }
+
+            ERROR_LOG("sendmsg failed, errno %d", errno);
+            return -1;
+        }
+
+        // 释放已发送完的数据
+        uint32_t sent = r;
+        while (0 < sent)
+        {
+            uint32_t left = _out_ptrs.front().length() - _out_ofs;
+            if (sent < left)
+            {
+                _out_ofs += sent;
+                break;
+            }
+
+            sent -= left;
+            _out_ptrs.pop_front();
+            _out_ofs = 0;
+        }
+    }
+
+    return 0;
+}
+
+void AsyncConnection::handle_ack(uint64_t seq)
+{
+    Mutex::Locker locker(_write_lock);
+
+    while (!_sent.empty() && _sent.front()->get_seq() <= seq)
+    {
+        Message* m = _sent.front();
+        _sent.pop_front();
+        m->dec();
+    }
+}
+
+void AsyncConnection::requeue_sent()
+{
+    if (_sent.empty())
+    {
+        return;
+    }
+
+    while (!_sent.empty())
+    {
+        Message* m = _sent.back();
+        _sent.pop_back();
+        _out_q.push_front(m, MSG_PRIO_HIGHEST);
+        _out_seq--;
+    }
+}
+
+void AsyncConnection::discard_out_queue()
+{
+    Mutex::Locker locker(_write_lock);
+
+    for (std::list<Message*>::iterator iter = _sent.begin(); iter != _sent.end(); ++iter)
+    {
+        (*iter)->dec();
+    }
+
+    _sent.clear();
+
+    Message* m = NULL;
+    while ((m = _out_q.pop_front()))
+    {
+        m->dec();
+    }
+}
+
+void AsyncConnection::was_session_reset()
+{
+    _async_msgr->_dispatch_queue.discard_queue(_conn_id);
+
+    discard_out_queue();
+
+    _async_msgr->_dispatch_queue.queue_remote_reset(static_cast<Connection*>(get()), _conn_id);
+
+    _in_seq = 0;
+    _in_seq_acked = 0;
+    _connect_seq = 0;
+
+    Mutex::Locker locker(_write_lock);
+    _out_seq = 0;
+}
+
+void AsyncConnection::fault()
+{
+    DEBUG_LOG("async connection fault, current state is %d", _state);
+
+    if (STATE_CLOSED == _state)
+    {
+        return;
+    }
+
+    if (STATE_OPEN_MESSAGE_THROTTLE <= _state && STATE_OPEN_MESSAGE_FOOTER >= _state)
+    {
+        release_throttle();
+    }
+
+    close_fd();
+
+    // 握手阶段的被动连接直接关闭,等对端重连
+    if (STATE_ACCEPTING_BANNER <= _state && STATE_ACCEPTING_CONNECT >= _state)
+    {
+        stop(false);
+        return;
+    }
+
+    // lossy连接出错即关闭
+    if (_policy._lossy)
+    {
+        stop(true);
+        return;
+    }
+
+    bool queued = false;
+    {
+        Mutex::Locker locker(_write_lock);
+        requeue_sent();
+        queued = is_queued();
+    }
+
+    if (_policy._standby && !queued)
+    {
+        _state = STATE_STANDBY;
+        return;
+    }
+
+    utime_t delay;
+    if (!is_connecting())
+    {
+        if (_policy._server)
+        {
+            _state = STATE_STANDBY;
+            return;
+        }
+
+        // 连接断开后立即重连
+        _connect_seq++;
+        _backoff = utime_t();
+    }
+    else if (_backoff == utime_t())
+    {
+        _backoff.set_from_double(.2);
+    }
+    else
+    {
+        delay = _backoff;
+        _backoff += _backoff;
+        if (_backoff > 15.0)
+        {
+            _backoff.set_from_double(15.0);
+        }
+    }
+
+    _state = STATE_NONE;
+
+    utime_t when = clock_now();
+    when += delay;
+    _worker->add_timer(when, new HandleReconnect(this));
+}
+
+void AsyncConnection::stop(bool queue_reset)
+{
+    if (STATE_CLOSED == _state)
+    {
+        return;
+    }
+
+    DEBUG_LOG("async connection stop");
+
+    if (STATE_OPEN_MESSAGE_THROTTLE <= _state && STATE_OPEN_MESSAGE_FOOTER >= _state)
+    {
+        release_throttle();
+    }
+
+    _state = STATE_CLOSED;
+    atomic_set(&_closed, 1);
+
+    close_fd();
+
+    _async_msgr->_dispatch_queue.discard_queue(_conn_id);
+    discard_out_queue();
+
+    bool owned = false;
+    {
+        Mutex::Locker locker(_async_msgr->_lock);
+        owned = _async_msgr->unregister_conn(this);
+    }
+
+    if (queue_reset)
+    {
+        _async_msgr->_dispatch_queue.queue_reset(static_cast<Connection*>(get()), _conn_id);
+    }
+
+    atomic_dec(&(_worker->_references));
+
+    // 本轮事件可能还会访问该连接,延迟释放
+    if (owned)
+    {
+        _worker->dispatch_external(new HandleRelease(this));
+    }
+}
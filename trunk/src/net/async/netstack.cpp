@@ -0,0 +1,359 @@
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "async/netstack.h"
+#include "log.h"
+
+Worker::Worker(unsigned id) : _id(id), _epfd(-1), _notify_fd(-1), _done(false)
+{
+    atomic_set(&_references, 0);
+}
+
+Worker::~Worker()
+{
+    if (0 <= _epfd)
+    {
+        ::close(_epfd);
+        _epfd = -1;
+    }
+
+    if (0 <= _notify_fd)
+    {
+        ::close(_notify_fd);
+        _notify_fd = -1;
+    }
+}
+
+int Worker::init()
+{
+    _epfd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (0 > _epfd)
+    {
+        return -errno;
+    }
+
+    _notify_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (0 > _notify_fd)
+    {
+        return -errno;
+    }
+
+    struct epoll_event ee;
+    memset(&ee, 0, sizeof(ee));
+    ee.events = EPOLLIN;
+    // 唤醒事件的data.ptr为NULL
+    ee.data.ptr = NULL;
+    if (0 > ::epoll_ctl(_epfd, EPOLL_CTL_ADD, _notify_fd, &ee))
+    {
+        return -errno;
+    }
+
+    return 0;
+}
+
+int Worker::add_event(int fd, EventHandler* h, uint32_t events)
+{
+    struct epoll_event ee;
+    memset(&ee, 0, sizeof(ee));
+    ee.events = events;
+    ee.data.ptr = h;
+    if (0 > ::epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ee))
+    {
+        return -errno;
+    }
+
+    return 0;
+}
+
+int Worker::modify_event(int fd, EventHandler* h, uint32_t events)
+{
+    struct epoll_event ee;
+    memset(&ee, 0, sizeof(ee));
+    ee.events = events;
+    ee.data.ptr = h;
+    if (0 > ::epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ee))
+    {
+        return -errno;
+    }
+
+    return 0;
+}
+
+int Worker::del_event(int fd)
+{
+    struct epoll_event ee;
+    memset(&ee, 0, sizeof(ee));
+    if (0 > ::epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, &ee))
+    {
+        return -errno;
+    }
+
+    return 0;
+}
+
+void Worker::wakeup()
+{
+    uint64_t v = 1;
+    ssize_t r = ::write(_notify_fd, &v, sizeof(v));
+    (void)r;
+}
+
+void Worker::dispatch_external(Callback* cb)
+{
+    bool empty = false;
+    {
+        Mutex::Locker locker(_external_lock);
+        empty = _external_events.empty();
+        _external_events.push_back(cb);
+    }
+
+    // 队列之前不为空说明已经唤醒过了
+    if (empty)
+    {
+        wakeup();
+    }
+}
+
+void Worker::add_timer(utime_t when, Callback* cb)
+{
+    bool first = false;
+    {
+        Mutex::Locker locker(_external_lock);
+        std::multimap<utime_t, Callback*>::iterator iter = _timers.insert(std::make_pair(when, cb));
+        first = (iter == _timers.begin());
+    }
+
+    // 最早的定时器变化了,需要重新计算epoll_wait的超时时间
+    if (first && !in_thread())
+    {
+        wakeup();
+    }
+}
+
+void Worker::process_external()
+{
+    std::deque<Callback*> events;
+    {
+        Mutex::Locker locker(_external_lock);
+        events.swap(_external_events);
+    }
+
+    while (!events.empty())
+    {
+        Callback* cb = events.front();
+        events.pop_front();
+        cb->complete(0);
+    }
+}
+
+int Worker::process_timers()
+{
+    utime_t now = clock_now();
+    std::deque<Callback*> expired;
+    int timeout = -1;
+
+    {
+        Mutex::Locker locker(_external_lock);
+        while (!_timers.empty())
+        {
+            std::multimap<utime_t, Callback*>::iterator iter = _timers.begin();
+            if (iter->first > now)
+            {
+                break;
+            }
+
+            expired.push_back(iter->second);
+            _timers.erase(iter);
+        }
+    }
+
+    while (!expired.empty())
+    {
+        Callback* cb = expired.front();
+        expired.pop_front();
+        cb->complete(0);
+    }
+
+    Mutex::Locker locker(_external_lock);
+    if (!_timers.empty())
+    {
+        now = clock_now();
+        utime_t next = _timers.begin()->first;
+        timeout = (next > now) ? (int)((next - now).to_msec() + 1) : 0;
+    }
+
+    return timeout;
+}
+
+void Worker::entry()
+{
+    DEBUG_LOG("network worker %u start", _id);
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!_done)
+    {
+        int timeout = process_timers();
+
+        int n = ::epoll_wait(_epfd, events, MAX_EVENTS, timeout);
+        if (0 > n)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+
+            ERROR_LOG("network worker %u epoll_wait failed, errno %d", _id, errno);
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            EventHandler* h = (EventHandler*)events[i].data.ptr;
+            if (!h)
+            {
+                uint64_t v;
+                ssize_t r = ::read(_notify_fd, &v, sizeof(v));
+                (void)r;
+                continue;
+            }
+
+            // 出错时也交给读处理,由读处理发现错误
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+            {
+                h->handle_read();
+            }
+
+            if (events[i].events & EPOLLOUT)
+            {
+                h->handle_write();
+            }
+        }
+
+        process_external();
+    }
+
+    // 退出前执行剩余回调,回调内会释放其持有的引用,执行过程中可能投递新的回调
+    while (true)
+    {
+        {
+            Mutex::Locker locker(_external_lock);
+            if (_external_events.empty())
+            {
+                break;
+            }
+        }
+
+        process_external();
+    }
+
+    std::multimap<utime_t, Callback*> timers;
+    {
+        Mutex::Locker locker(_external_lock);
+        timers.swap(_timers);
+    }
+
+    for (std::multimap<utime_t, Callback*>::iterator iter = timers.begin(); iter != timers.end(); ++iter)
+    {
+        iter->second->complete(-ECANCELED);
+    }
+
+    DEBUG_LOG("network worker %u stop", _id);
+}
+
+void Worker::shutdown()
+{
+    _done = true;
+    wakeup();
+
+    if (is_started())
+    {
+        join();
+    }
+}
+
+
+NetworkStack::NetworkStack(unsigned num_workers) : _num_workers(num_workers)
+{
+    if (0 == _num_workers)
+    {
+        _num_workers = 1;
+    }
+
+    for (unsigned i = 0; i < _num_workers; i++)
+    {
+        _workers.push_back(new Worker(i));
+    }
+}
+
+NetworkStack::~NetworkStack()
+{
+    stop();
+
+    for (unsigned i = 0; i < _workers.size(); i++)
+    {
+        DELETE_P(_workers[i]);
+    }
+
+    _workers.clear();
+}
+
+int NetworkStack::start()
+{
+    Mutex::Locker locker(_lock);
+    if (_started)
+    {
+        return 0;
+    }
+
+    for (unsigned i = 0; i < _num_workers; i++)
+    {
+        int r = _workers[i]->init();
+        if (0 > r)
+        {
+            ERROR_LOG("network worker %u init failed, errno %d", i, -r);
+            return r;
+        }
+
+        _workers[i]->create();
+    }
+
+    _started = true;
+
+    return 0;
+}
+
+void NetworkStack::stop()
+{
+    Mutex::Locker locker(_lock);
+    if (!_started)
+    {
+        return;
+    }
+
+    for (unsigned i = 0; i < _num_workers; i++)
+    {
+        _workers[i]->shutdown();
+    }
+
+    _started = false;
+}
+
+Worker* NetworkStack::get_worker()
+{
+    Worker* worker = _workers[0];
+    long min_load = atomic_read(&(worker->_references));
+
+    for (unsigned i = 1; i < _num_workers; i++)
+    {
+        long load = atomic_read(&(_workers[i]->_references));
+        if (load < min_load)
+        {
+            min_load = load;
+            worker = _workers[i];
+        }
+    }
+
+    atomic_inc(&(worker->_references));
+
+    return worker;
+}
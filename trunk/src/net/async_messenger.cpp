@@ -1,18 +1,456 @@
+#include <unistd.h>
 #include "async_messenger.h"
 
-AsyncMessenger::AsyncMessenger(entity_name_t name, std :: string mname)
+void AsyncMessenger::Processor::handle_read()
+{
+    while (true)
+    {
+        sockaddr_storage ss;
+        socklen_t len = sizeof(ss);
+        int fd = ::accept4(_msgr->_listen_fd, (sockaddr*)&ss, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (0 > fd)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+
+            if (EAGAIN != errno && EWOULDBLOCK != errno)
+            {
+                ERROR_LOG("accept failed, errno %d", errno);
+            }
+
+            break;
+        }
+
+        _msgr->add_accept(fd);
+    }
+}
+
+
+AsyncMessenger::AsyncMessenger(entity_name_t name, std::string mname)
     : PolicyMessenger(name, mname),
+    _processor(this),
     _dispatch_queue(this, mname),
+    _lock(),
+    _stack(NULL),
+    _num_workers(ASYNC_MSGR_DEFAULT_WORKERS),
+    _did_bind(false),
+    _listen_fd(-1),
+    _global_seq(0),
+    _stopped(true),
+    _local_connection(NULL)
+{
+    _local_connection = new AsyncConnection(this, NULL);
+    init_local_connection();
+}
+
+AsyncMessenger::~AsyncMessenger()
+{
+    DELETE_P(_stack);
+
+    if (0 <= _listen_fd)
+    {
+        ::close(_listen_fd);
+        _listen_fd = -1;
+    }
+}
+
+void AsyncMessenger::set_worker_num(unsigned num)
+{
+    Mutex::Locker locker(_lock);
+    if (!_stack)
+    {
+        _num_workers = num;
+    }
+}
+
+void AsyncMessenger::ready()
+{
+    DEBUG_LOG("async messenger ready");
+
+    _dispatch_queue.start();
+
+    Mutex::Locker locker(_lock);
+    if (!_stack)
+    {
+        _stack = new NetworkStack(_num_workers);
+    }
+
+    _stack->start();
+
+    if (_did_bind)
+    {
+        // 监听fd固定由第一个worker处理
+        int r = _stack->get_worker(0)->add_event(_listen_fd, &_processor, EPOLLIN);
+        if (0 > r)
+        {
+            ERROR_LOG("add listen fd event failed, errno %d", -r);
+        }
+    }
+}
+
+int AsyncMessenger::bind(const entity_addr_t& bind_addr)
+{
+    {
+        Mutex::Locker locker(_lock);
+        if (_started)
+        {
+            return -1;
+        }
+    }
+
+    int family;
+    switch (bind_addr.get_family())
+    {
+        case AF_INET:
+        case AF_INET6:
+        {
+            family = bind_addr.get_family();
+            break;
+        }
+        default:
+        {
+            family = AF_INET;
+        }
+    }
+
+    _listen_fd = ::socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (0 > _listen_fd)
+    {
+        return -errno;
+    }
+
+    entity_addr_t listen_addr = bind_addr;
+    listen_addr.set_family(family);
+
+    int rc = -1;
+    if (listen_addr.get_port())
+    {
+        int on = 1;
+        rc = ::setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (0 == rc)
+        {
+            rc = ::bind(_listen_fd, listen_addr.get_sockaddr(), listen_addr.get_sockaddr_len());
+        }
+    }
+    // 如果没有配置监听端口
+    else
+    {
+        for (int port = 9000; port <= 9999; port++)
+        {
+            listen_addr.set_port(port);
+            rc = ::bind(_listen_fd, listen_addr.get_sockaddr(), listen_addr.get_sockaddr_len());
+            if (0 == rc)
+            {
+                break;
+            }
+        }
+    }
+
+    if (0 > rc)
+    {
+        rc = -errno;
+        ::close(_listen_fd);
+        _listen_fd = -1;
+        return rc;
+    }
+
+    sockaddr_storage ss;
+    socklen_t llen = sizeof(ss);
+    rc = ::getsockname(_listen_fd, (sockaddr*)&ss, &llen);
+    if (0 > rc)
+    {
+        rc = -errno;
+        ::close(_listen_fd);
+        _listen_fd = -1;
+        return rc;
+    }
+
+    listen_addr.set_sockaddr((sockaddr*)&ss);
+
+    // config
+    rc = ::listen(_listen_fd, 128);
+    if (0 > rc)
+    {
+        rc = -errno;
+        ::close(_listen_fd);
+        _listen_fd = -1;
+        return rc;
+    }
+
+    set_entity_addr(listen_addr);
+    init_local_connection();
+
+    _did_bind = true;
+
+    return 0;
+}
+
+int AsyncMessenger::start()
+{
+    DEBUG_LOG("async messenger start");
+
+    Mutex::Locker locker(_lock);
+
+    _started = true;
+    _stopped = false;
+
+    if (!_did_bind)
+    {
+        init_local_connection();
+    }
+
+    if (!_stack)
+    {
+        _stack = new NetworkStack(_num_workers);
+    }
+
+    return _stack->start();
+}
+
+int AsyncMessenger::shutdown()
+{
+    mark_down_all();
+
+    _local_connection->set_priv(NULL);
+
+    Mutex::Locker locker(_lock);
+    _stop_cond.signal();
+    _stopped = true;
+
+    return 0;
+}
+
+void AsyncMessenger::wait()
+{
+    {
+        Mutex::Locker locker(_lock);
+        if (!_started)
+        {
+            return;
+        }
+
+        if (!_stopped)
+        {
+            _stop_cond.wait(_lock);
+        }
+    }
+
+    if (_did_bind && _stack && _stack->is_started())
+    {
+        _stack->get_worker(0)->del_event(_listen_fd);
+    }
+
+    _dispatch_queue.shutdown();
+    if (_dispatch_queue.is_started())
+    {
+        _dispatch_queue.wait();
+        _dispatch_queue.discard_local();
+    }
+
+    mark_down_all();
+
+    // worker退出前会执行完所有已投递的关闭回调
+    if (_stack)
+    {
+        _stack->stop();
+    }
+
+    if (_did_bind)
+    {
+        ::close(_listen_fd);
+        _listen_fd = -1;
+        _did_bind = false;
+    }
+
+    Mutex::Locker locker(_lock);
+    _started = false;
+}
+
+void AsyncMessenger::add_accept(int fd)
+{
+    Worker* w = _stack->get_worker();
+    AsyncConnection* con = new AsyncConnection(this, w);
+
+    {
+        Mutex::Locker locker(_lock);
+        _accepting_conns.insert(con);
+    }
+
+    con->accept(fd);
+}
+
+AsyncConnection* AsyncMessenger::connect_rank(const entity_addr_t& addr, int type)
+{
+    DEBUG_LOG("AsyncMessenger connect_rank");
+
+    AsyncConnection* con = new AsyncConnection(this, _stack->get_worker());
+    con->connect(addr, type);
+    register_conn(con);
+
+    return con;
+}
+
+void AsyncMessenger::register_conn(AsyncConnection* con)
+{
+    std::map<entity_addr_t, AsyncConnection*>::iterator iter = _conns.find(con->get_peer_addr());
+    if (iter != _conns.end())
+    {
+        // 旧连接已经被标记关闭,等待其worker执行关闭
+        if (iter->second != con)
+        {
+            AsyncConnection* old = iter->second;
+            iter->second = con;
+            old->dec();
+        }
+    }
+    else
+    {
+        _conns[con->get_peer_addr()] = con;
+    }
+
+    _accepting_conns.erase(con);
+}
+
+bool AsyncMessenger::unregister_conn(AsyncConnection* con)
 {
-    std::string transport_type = "posix";
-    if (type.find("rdma") != std::string::npos)
+    std::map<entity_addr_t, AsyncConnection*>::iterator iter = _conns.find(con->get_peer_addr());
+    if (iter != _conns.end() && iter->second == con)
     {
-        transport_type = "rdma";
+        _conns.erase(iter);
+        return true;
     }
-    else if (type.find("dpdk") != std::string::npos)
+
+    return 0 < _accepting_conns.erase(con);
+}
+
+int AsyncMessenger::send_message(Message* m, const entity_inst_t& dest)
+{
+    DEBUG_LOG("AsyncMessenger send_message by entity");
+
+    m->get_header().src = get_entity_name();
+
+    if (!m->get_priority())
     {
-        transport_type = "dpdk";
+        m->set_priority(get_default_send_priority());
     }
 
-    
-}
\ No newline at end of file
+    if (dest._addr == entity_addr_t())
+    {
+        m->dec();
+        return -EINVAL;
+    }
+
+    Mutex::Locker locker(_lock);
+    submit_message(m, lookup_conn(dest._addr), dest._addr, dest._name.type());
+
+    return 0;
+}
+
+int AsyncMessenger::send_message(Message* m, Connection* con)
+{
+    DEBUG_LOG("AsyncMessenger send_message by connection");
+
+    m->get_header().src = get_entity_name();
+
+    if (!m->get_priority())
+    {
+        m->set_priority(get_default_send_priority());
+    }
+
+    submit_message(m, static_cast<AsyncConnection*>(con), con->get_peer_addr(), con->get_peer_type());
+
+    return 0;
+}
+
+void AsyncMessenger::submit_message(Message* m, AsyncConnection* con, const entity_addr_t& dest_addr, int dest_type)
+{
+    if (con == _local_connection || _entity._addr == dest_addr)
+    {
+        DEBUG_LOG("dest addr is local");
+
+        m->set_connection(static_cast<Connection*>(_local_connection->get()));
+        _dispatch_queue.local_delivery(m, m->get_priority());
+        return;
+    }
+
+    if (con)
+    {
+        // 连接已被关闭的消息直接丢弃
+        con->send(m);
+        return;
+    }
+
+    const Policy& policy = get_policy(dest_type);
+    if (policy._server)
+    {
+        m->dec();
+        return;
+    }
+
+    Mutex::Locker locker(_lock);
+    AsyncConnection* c = lookup_conn(dest_addr);
+    if (!c)
+    {
+        c = connect_rank(dest_addr, dest_type);
+    }
+
+    c->send(m);
+}
+
+Connection* AsyncMessenger::get_connection(const entity_inst_t& dest)
+{
+    Mutex::Locker locker(_lock);
+    if (_entity._addr == dest._addr)
+    {
+        return _local_connection;
+    }
+
+    AsyncConnection* con = lookup_conn(dest._addr);
+    if (!con)
+    {
+        con = connect_rank(dest._addr, dest._name.type());
+    }
+
+    return con;
+}
+
+void AsyncMessenger::mark_down(const entity_addr_t& addr)
+{
+    Mutex::Locker locker(_lock);
+    AsyncConnection* con = lookup_conn(addr);
+    if (con)
+    {
+        con->queue_stop(true);
+    }
+}
+
+void AsyncMessenger::mark_down_all()
+{
+    Mutex::Locker locker(_lock);
+    if (!_stack || !_stack->is_started())
+    {
+        return;
+    }
+
+    for (std::set<AsyncConnection*>::iterator iter = _accepting_conns.begin(); iter != _accepting_conns.end(); ++iter)
+    {
+        (*iter)->queue_stop(true);
+    }
+
+    for (std::map<entity_addr_t, AsyncConnection*>::iterator iter = _conns.begin(); iter != _conns.end(); ++iter)
+    {
+        if (!iter->second->is_closed())
+        {
+            iter->second->queue_stop(true);
+        }
+    }
+}
+
+void AsyncMessenger::init_local_connection()
+{
+    _local_connection->_peer_addr = _entity._addr;
+    _local_connection->_peer_type = _entity._name.type();
+    ms_deliver_handle_fast_connect(static_cast<Connection*>(_local_connection->get()));
+}
@@ -1,30 +1,187 @@
+#include <sched.h>
 #include "message.h"
 #include "dispatch_queue.h"
 #include "simple_messenger.h"
 
 double DispatchQueue::get_max_age(utime_t now) const
 {
-    Mutex::Locker locker(_lock);
-    if (_marrival.empty())
+    double age = 0;
+    for (std::vector<Shard*>::const_iterator iter = _shards.begin(); iter != _shards.end(); ++iter)
     {
-        return 0;
+        Mutex::Locker locker((*iter)->_lock);
+        if (!(*iter)->_marrival.empty())
+        {
+            age = MAX(age, (double)(now - (*iter)->_marrival.front()->get_recv_stamp()));
+        }
     }
-    else
+
+    return age;
+}
+
+int DispatchQueue::get_queue_len() const
+{
+    int len = 0;
+    for (std::vector<Shard*>::const_iterator iter = _shards.begin(); iter != _shards.end(); ++iter)
     {
-        return (now - _marrival.begin()->first);
+        Mutex::Locker locker((*iter)->_lock);
+        len += (*iter)->_mqueue.length();
     }
+
+    return len;
 }
 
-uint64_t DispatchQueue::pre_dispatch(Message* m)
+void DispatchQueue::set_num_threads(unsigned num)
+{
+    if (0 == num || is_started() || num == _shards.size() || 0 < get_queue_len())
+    {
+        return;
+    }
+
+    for (std::vector<Shard*>::iterator iter = _shards.begin(); iter != _shards.end(); ++iter)
+    {
+        DELETE_P(*iter);
+    }
+
+    _shards.clear();
+
+    for (unsigned i = 0; i < num; i++)
+    {
+        _shards.push_back(new Shard(this));
+    }
+}
+
+void DispatchQueue::set_fast_threads(unsigned num)
+{
+    if (is_started() || num == _fast_shards.size())
+    {
+        return;
+    }
+
+    for (std::vector<FastShard*>::iterator iter = _fast_shards.begin(); iter != _fast_shards.end(); ++iter)
+    {
+        DELETE_P(*iter);
+    }
+
+    _fast_shards.clear();
+
+    for (unsigned i = 0; i < num; i++)
+    {
+        _fast_shards.push_back(new FastShard(this));
+    }
+}
+
+void DispatchQueue::queue_fast_dispatch(std::vector<Message*>& ms, uint64_t id)
+{
+    if (ms.empty())
+    {
+        return;
+    }
+
+    FastShard* shard = _fast_shards[id % _fast_shards.size()];
+    shard->_lock.lock();
+    if (_stop)
+    {
+        shard->_lock.unlock();
+        for (std::vector<Message*>::iterator iter = ms.begin(); iter != ms.end(); ++iter)
+        {
+            dispatch_throttle_release((*iter)->get_connection(), (*iter)->get_dispatch_throttle_size());
+            (*iter)->dec();
+        }
+
+        ms.clear();
+        return;
+    }
+
+    // 队列不为空时转发线程还在处理上一批,不需要唤醒
+    bool wake = shard->_queue.empty();
+    for (std::vector<Message*>::iterator iter = ms.begin(); iter != ms.end(); ++iter)
+    {
+        FastItem item;
+        item._id = id;
+        item._msg = *iter;
+        shard->_queue.push_back(item);
+    }
+
+    if (wake)
+    {
+        shard->_cond.signal();
+    }
+
+    shard->_lock.unlock();
+    ms.clear();
+}
+
+void DispatchQueue::queue_fast_dispatch(Message* m, uint64_t id)
+{
+    std::vector<Message*> ms(1, m);
+    queue_fast_dispatch(ms, id);
+}
+
+void DispatchQueue::fast_entry(FastShard* shard)
+{
+    std::vector<FastItem> batch;
+
+    shard->_lock.lock();
+    while (true)
+    {
+        if (shard->_queue.empty())
+        {
+            if (_stop)
+            {
+                break;
+            }
+
+            shard->_cond.wait(shard->_lock);
+            continue;
+        }
+
+        // 整批取出,转发期间读线程可以继续提交
+        batch.swap(shard->_queue);
+        shard->_lock.unlock();
+
+        for (std::vector<FastItem>::iterator iter = batch.begin(); iter != batch.end(); ++iter)
+        {
+            Message* m = iter->_msg;
+            if (_stop)
+            {
+                dispatch_throttle_release(m->get_connection(), m->get_dispatch_throttle_size());
+                m->dec();
+            }
+            else
+            {
+                deliver(m, true);
+            }
+        }
+
+        batch.clear();
+        shard->_lock.lock();
+    }
+
+    shard->_lock.unlock();
+}
+
+uint64_t DispatchQueue::pre_dispatch(Message* m, Connection** con)
 {
     uint64_t msize = m->get_dispatch_throttle_size();
     m->set_dispatch_throttle_size(0);
+
+    *con = NULL;
+    if (msize)
+    {
+        *con = m->get_connection();
+        (*con)->get();
+    }
+
     return msize;
 }
 
-void DispatchQueue::post_dispatch(Message* m, uint64_t msize)
+void DispatchQueue::post_dispatch(Connection* con, uint64_t msize)
 {
-    dispatch_throttle_release(msize);
+    if (con)
+    {
+        dispatch_throttle_release(con, msize);
+        con->dec();
+    }
 }
 
 bool DispatchQueue::can_fast_dispatch(Message* m) const
@@ -32,11 +189,34 @@ bool DispatchQueue::can_fast_dispatch(Message* m) const
     return _msgr->ms_can_fast_dispatch(m);
 }
 
+void DispatchQueue::deliver(Message* m, bool fast)
+{
+    Connection* con;
+    uint64_t msize = pre_dispatch(m, &con);
+
+    MessageLatency::Sample sample;
+    bool sampled = _latency.start(m, &sample);
+
+    if (fast)
+    {
+        _msgr->ms_fast_dispatch(m);
+    }
+    else
+    {
+        _msgr->ms_deliver_dispatch(m);
+    }
+
+    if (sampled)
+    {
+        _latency.finish(sample);
+    }
+
+    post_dispatch(con, msize);
+}
+
 void DispatchQueue::fast_dispatch(Message* m)
 {
-    uint64_t msize = pre_dispatch(m);
-    _msgr->ms_fast_dispatch(m);
-    post_dispatch(m, msize);
+    deliver(m, true);
 }
 
 void DispatchQueue::fast_preprocess(Message* m)
@@ -46,92 +226,162 @@ void DispatchQueue::fast_preprocess(Message* m)
 
 void DispatchQueue::enqueue(Message* m, int priority, uint64_t id)
 {
-    Mutex::Locker locker(_lock);
-    add_arrival(m);
+    Shard* shard = get_shard(id);
+    Mutex::Locker locker(shard->_lock);
+    shard->add_arrival(m);
     if (priority >= MSG_PRIO_LOW)
     {
-        _mqueue.enqueue_strict(id, priority, QueueItem(m));
+        shard->_mqueue.enqueue_strict(id, priority, QueueItem(m));
     }
     else
     {
-        _mqueue.enqueue(id, priority, m->get_cost(), QueueItem(m));
+        shard->_mqueue.enqueue(id, priority, m->get_cost(), QueueItem(m));
     }
     
-    _cond.signal();
+    shard->_cond.signal();
 }
 
 void DispatchQueue::local_delivery(Message* m, int priority)
 {
     m->set_recv_stamp(clock_now());
-    Mutex::Locker locker(_local_delivery_lock);
-    if (_local_messages.empty())
+
+    LocalItem item;
+    item._msg = m;
+    item._priority = priority;
+    item._preprocessed = false;
+
+    // 内联模式下可以快速转发的消息不经过本地消息线程
+    if (_local_inline && !_stop)
+    {
+        fast_preprocess(m);
+        if (can_fast_dispatch(m))
+        {
+            fast_dispatch(m);
+            return;
+        }
+
+        item._preprocessed = true;
+    }
+
+    if (0 != atomic_read(&_local_overflow) || !_local_ring.push(item))
     {
+        Mutex::Locker locker(_local_delivery_lock);
+        _local_messages.push_back(item);
+        atomic_inc(&_local_overflow);
+    }
+
+    wake_local_delivery();
+}
+
+void DispatchQueue::wake_local_delivery()
+{
+    // 与本地消息线程设置_local_sleeping后检查队列的顺序对应,保证不会丢失唤醒
+    __sync_synchronize();
+    if (atomic_read(&_local_sleeping))
+    {
+        Mutex::Locker locker(_local_delivery_lock);
         _local_delivery_cond.signal();
     }
-    
-    _local_messages.push_back(std::make_pair(m, priority));
-    
-    return;
+}
+
+void DispatchQueue::deliver_local(LocalItem& item)
+{
+    Message* m = item._msg;
+    if (!item._preprocessed)
+    {
+        fast_preprocess(m);
+    }
+
+    if (can_fast_dispatch(m))
+    {
+        fast_dispatch(m);
+    }
+    else
+    {
+        enqueue(m, item._priority, 0);
+    }
 }
 
 void DispatchQueue::run_local_delivery()
 {
-    _local_delivery_lock.lock();
-    while (true)
+    LocalItem batch[DQ_LOCAL_BATCH];
+
+    while (!_stop_local_delivery)
     {
-        if (_stop_local_delivery)
+        int n = 0;
+        while (DQ_LOCAL_BATCH > n && _local_ring.pop(batch[n]))
         {
-            break;
+            n++;
         }
-        
-        if (_local_messages.empty())
+
+        if (n)
         {
-            _local_delivery_cond.wait(_local_delivery_lock);
+            for (int i = 0; i < n; i++)
+            {
+                deliver_local(batch[i]);
+            }
+
             continue;
         }
-        
-        std::pair<Message*, int> mp = _local_messages.front();
-        _local_messages.pop_front();
-        _local_delivery_lock.unlock();
-        Message* m = mp.first;
-        int priority = mp.second;
-        fast_preprocess(m);
-        if (can_fast_dispatch(m))
+
+        // 有生产者已占用位置但还未写完,需要等它发布后再处理暂存的消息,否则同一线程的消息可能乱序
+        if (!_local_ring.empty())
         {
-            fast_dispatch(m);
+            sched_yield();
+            continue;
         }
-        else
+
+        if (atomic_read(&_local_overflow))
         {
-            enqueue(m, priority, 0);
+            std::list<LocalItem> overflow;
+            _local_delivery_lock.lock();
+            overflow.swap(_local_messages);
+            atomic_set(&_local_overflow, 0);
+            _local_delivery_lock.unlock();
+
+            for (std::list<LocalItem>::iterator i = overflow.begin(); i != overflow.end(); ++i)
+            {
+                deliver_local(*i);
+            }
+
+            continue;
         }
+
         _local_delivery_lock.lock();
+        atomic_set(&_local_sleeping, 1);
+        __sync_synchronize();
+        if (!_stop_local_delivery && _local_ring.empty() && !atomic_read(&_local_overflow))
+        {
+            _local_delivery_cond.wait(_local_delivery_lock);
+        }
+
+        atomic_set(&_local_sleeping, 0);
+        _local_delivery_lock.unlock();
     }
-    
-    _local_delivery_lock.unlock();
 }
 
-void DispatchQueue::dispatch_throttle_release(uint64_t msize)
+void DispatchQueue::dispatch_throttle_release(Connection* con, uint64_t msize)
 {
     if (msize)
     {
-        _dispatch_throttler.put(msize);
+        _dispatch_throttler.put(&con->_dispatch_account, msize);
     }
 }
 
-void DispatchQueue::entry()
+void DispatchQueue::entry(Shard* shard)
 {
-    _lock.lock();
+    shard->_lock.lock();
     while (true)
     {
-        while (!_mqueue.empty())
+        while (!shard->_mqueue.empty())
         {
-            QueueItem item = _mqueue.dequeue();
+            QueueItem item = shard->_mqueue.dequeue();
             if (!item.is_code())
             {
-                remove_arrival(item.get_message());
+                shard->remove_arrival(item.get_message());
             }
             
-            _lock.unlock();
+            shard->_lock.unlock();
 
             if (item.is_code())
             {            
@@ -161,17 +411,16 @@ void DispatchQueue::entry()
                 Message* m = item.get_message();
                 if (_stop)
                 {
+                    dispatch_throttle_release(m->get_connection(), m->get_dispatch_throttle_size());
                     m->dec();
                 }
                 else
                 {
-                    uint64_t msize = pre_dispatch(m);
-                    _msgr->ms_deliver_dispatch(m);
-                    post_dispatch(m, msize);
+                    deliver(m, false);
                 }
             }
 
-            _lock.lock();
+            shard->_lock.lock();
         }
         
         if (_stop)
@@ -179,46 +428,96 @@ void DispatchQueue::entry()
             break;
         }
 
-        _cond.wait(_lock);
+        shard->_cond.wait(shard->_lock);
     }
     
-    _lock.unlock();
+    shard->_lock.unlock();
 }
 
 void DispatchQueue::discard_queue(uint64_t id)
 {
-    Mutex::Locker locker(_lock);
+    Shard* shard = get_shard(id);
+    Mutex::Locker locker(shard->_lock);
     std::list<QueueItem> removed;
-    _mqueue.remove_by_class(id, &removed);
+    shard->_mqueue.remove_by_class(id, &removed);
     for (std::list<QueueItem>::iterator i = removed.begin(); i != removed.end(); ++i)
     {
         Message* m = i->get_message();
-        remove_arrival(m);
-        dispatch_throttle_release(m->get_dispatch_throttle_size());
+        shard->remove_arrival(m);
+        dispatch_throttle_release(m->get_connection(), m->get_dispatch_throttle_size());
         m->dec();
     }
+
+    if (_fast_shards.empty())
+    {
+        return;
+    }
+
+    // 已被快速转发线程取出的消息照常转发
+    FastShard* fast = _fast_shards[id % _fast_shards.size()];
+    Mutex::Locker fast_locker(fast->_lock);
+    std::vector<FastItem>::iterator keep = fast->_queue.begin();
+    for (std::vector<FastItem>::iterator i = fast->_queue.begin(); i != fast->_queue.end(); ++i)
+    {
+        if (i->_id == id)
+        {
+            dispatch_throttle_release(i->_msg->get_connection(), i->_msg->get_dispatch_throttle_size());
+            i->_msg->dec();
+        }
+        else
+        {
+            *keep++ = *i;
+        }
+    }
+
+    fast->_queue.erase(keep, fast->_queue.end());
 }
 
 void DispatchQueue::start()
 {
-    _dispatch_thread.create();
+    for (std::vector<Shard*>::iterator iter = _shards.begin(); iter != _shards.end(); ++iter)
+    {
+        (*iter)->_dispatch_thread.create();
+    }
+
+    for (std::vector<FastShard*>::iterator iter = _fast_shards.begin(); iter != _fast_shards.end(); ++iter)
+    {
+        (*iter)->_fast_thread.create();
+    }
+
     _local_delivery_thread.create();
 }
 
 void DispatchQueue::wait()
 {
     _local_delivery_thread.join();
-    _dispatch_thread.join();
+
+    for (std::vector<Shard*>::iterator iter = _shards.begin(); iter != _shards.end(); ++iter)
+    {
+        (*iter)->_dispatch_thread.join();
+    }
+
+    for (std::vector<FastShard*>::iterator iter = _fast_shards.begin(); iter != _fast_shards.end(); ++iter)
+    {
+        (*iter)->_fast_thread.join();
+    }
 }
 
 void DispatchQueue::discard_local()
 {
-    for (std::list<std::pair<Message*, int> >::iterator i = _local_messages.begin(); i != _local_messages.end(); ++i)
+    LocalItem item;
+    while (_local_ring.pop(item))
+    {
+        item._msg->dec();
+    }
+
+    for (std::list<LocalItem>::iterator i = _local_messages.begin(); i != _local_messages.end(); ++i)
     {
-        i->first->dec();
+        i->_msg->dec();
     }
     
     _local_messages.clear();
+    atomic_set(&_local_overflow, 0);
 }
 
 void DispatchQueue::shutdown()
@@ -228,9 +527,18 @@ void DispatchQueue::shutdown()
     _local_delivery_cond.signal();
     _local_delivery_lock.unlock();
 
-    _lock.lock();
-    _stop = true;
-    _cond.signal();
-    _lock.unlock();
+    for (std::vector<Shard*>::iterator iter = _shards.begin(); iter != _shards.end(); ++iter)
+    {
+        Mutex::Locker locker((*iter)->_lock);
+        _stop = true;
+        (*iter)->_cond.signal();
+    }
+
+    for (std::vector<FastShard*>::iterator iter = _fast_shards.begin(); iter != _fast_shards.end(); ++iter)
+    {
+        Mutex::Locker locker((*iter)->_lock);
+        _stop = true;
+        (*iter)->_cond.signal();
+    }
 }
 
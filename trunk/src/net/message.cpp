@@ -1,7 +1,18 @@
 #include "message.h"
+#include "message_registry.h"
+#include "mping.h"
 
-void Message::encode(int crcflags)
+message_factory_t MessageRegistry::_factories[MSG_TYPE_MAX];
+
+REGISTER_MESSAGE(MPing, MSG_PING);
+
+void Message::encode_body(int crcflags)
 {
+    if (_body_crc_flags == crcflags)
+    {
+        return;
+    }
+
     if (empty_payload())
     {
         encode_payload();
@@ -16,7 +27,7 @@ void Message::encode(int crcflags)
             _header.compat_version = _header.version;
         }
     }
-    
+
     if (crcflags & MSG_CRC_HEADER)
     {
         calc_front_crc();
@@ -25,7 +36,19 @@ void Message::encode(int crcflags)
     _header.front_len = get_payload().length();
     _header.middle_len = get_middle().length();
     _header.data_len = get_data().length();
-    
+
+    if (crcflags & MSG_CRC_DATA)
+    {
+        calc_data_crc();
+    }
+
+    _body_crc_flags = crcflags;
+}
+
+void Message::encode(int crcflags)
+{
+    encode_body(crcflags);
+
     if (crcflags & MSG_CRC_HEADER)
     {
         calc_header_crc();
@@ -33,16 +56,22 @@ void Message::encode(int crcflags)
 
     _footer.flags = MSG_FOOTER_COMPLETE;
 
-    if (crcflags & MSG_CRC_DATA)
-    {
-        calc_data_crc();
-    }
-    else
+    if (!(crcflags & MSG_CRC_DATA))
     {
         _footer.flags = (unsigned)_footer.flags | MSG_FOOTER_NOCRC;
     }
 }
 
+SharedMessage::SharedMessage(Message* m, int crcflags) : Message(m->get_type()), _type_name(m->get_type_name())
+{
+    _header = m->get_header();
+    _footer = m->get_footer();
+    _payload = m->get_payload();
+    _middle = m->get_middle();
+    _data = m->get_data();
+    _body_crc_flags = crcflags;
+}
+
 Message* decode_message(int crcflags, msg_header& header, msg_footer& footer, buffer& front, buffer& middle, buffer& data)
 {
     if (crcflags & MSG_CRC_HEADER)
@@ -73,14 +102,11 @@ Message* decode_message(int crcflags, msg_header& header, msg_footer& footer, bu
         }
     }
 
-    Message* m = NULL;
-    int type = header.type;
-    switch (type)
+    // 未注册的类型返回NULL
+    Message* m = MessageRegistry::create(header.type);
+    if (!m)
     {
-        default:
-        {
-            return NULL;
-        }
+        return NULL;
     }
 
     if (m->get_header().version && m->get_header().version < header.compat_version)
@@ -0,0 +1,176 @@
+#include <string.h>
+#include "message_latency.h"
+
+void LatencyHistogram::clear()
+{
+    for (uint32_t i = 0; i < MSG_LATENCY_BUCKETS; i++)
+    {
+        __atomic_store_n(&_buckets[i], 0, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&_count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&_sum, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&_max, 0, __ATOMIC_RELAXED);
+}
+
+void LatencyHistogram::snapshot(LatencyHistogram* out) const
+{
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < MSG_LATENCY_BUCKETS; i++)
+    {
+        out->_buckets[i] = __atomic_load_n(&_buckets[i], __ATOMIC_RELAXED);
+        count += out->_buckets[i];
+    }
+
+    // 以桶的计数为准,百分位数不会超出范围
+    out->_count = count;
+    out->_sum = __atomic_load_n(&_sum, __ATOMIC_RELAXED);
+    out->_max = __atomic_load_n(&_max, __ATOMIC_RELAXED);
+}
+
+uint64_t LatencyHistogram::get_percentile(double p) const
+{
+    if (!_count)
+    {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(p * _count);
+    if (rank >= _count)
+    {
+        rank = _count - 1;
+    }
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < MSG_LATENCY_BUCKETS; i++)
+    {
+        seen += _buckets[i];
+        if (seen > rank)
+        {
+            uint64_t upper = bucket_upper(i) - 1;
+            return (upper < _max) ? upper : _max;
+        }
+    }
+
+    return _max;
+}
+
+const char* MessageLatencyStats::get_stage_name(int stage)
+{
+    switch (stage)
+    {
+        case STAGE_THROTTLE:
+            return "throttle";
+        case STAGE_READ:
+            return "read";
+        case STAGE_QUEUE:
+            return "queue";
+        case STAGE_DISPATCH:
+            return "dispatch";
+        case STAGE_TOTAL:
+            return "total";
+        default:
+            return "unknown";
+    }
+}
+
+__thread uint32_t MessageLatency::_tick = 0;
+
+MessageLatency::MessageLatency() : _sample_every(MSG_LATENCY_SAMPLE_EVERY)
+{
+    memset(_types, 0, sizeof(_types));
+}
+
+MessageLatency::~MessageLatency()
+{
+    for (uint32_t i = 0; i < MSG_TYPE_MAX; i++)
+    {
+        DELETE_P(_types[i]);
+    }
+}
+
+bool MessageLatency::prepare(Message* m, Sample* sample)
+{
+    uint32_t type = m->get_type();
+    if (MSG_TYPE_MAX <= type)
+    {
+        return false;
+    }
+
+    sample->_type = type;
+    sample->_recv_stamp = m->get_recv_stamp();
+    sample->_throttle_stamp = m->get_throttle_stamp();
+    sample->_recv_complete_stamp = m->get_recv_complete_stamp();
+    sample->_dispatch_stamp = clock_now();
+
+    return true;
+}
+
+void MessageLatency::finish(const Sample& sample)
+{
+    utime_t end = clock_now();
+    MessageLatencyStats* stats = get_stats(sample._type);
+
+    add(stats->_stages[MessageLatencyStats::STAGE_THROTTLE], sample._recv_stamp, sample._throttle_stamp);
+    add(stats->_stages[MessageLatencyStats::STAGE_READ], sample._throttle_stamp, sample._recv_complete_stamp);
+    // 本地消息没有读取阶段,从交给messenger开始计算排队时间
+    add(stats->_stages[MessageLatencyStats::STAGE_QUEUE],
+        sample._recv_complete_stamp.is_zero() ? sample._recv_stamp : sample._recv_complete_stamp,
+        sample._dispatch_stamp);
+    add(stats->_stages[MessageLatencyStats::STAGE_DISPATCH], sample._dispatch_stamp, end);
+    add(stats->_stages[MessageLatencyStats::STAGE_TOTAL], sample._recv_stamp, end);
+}
+
+MessageLatencyStats* MessageLatency::get_stats(uint32_t type)
+{
+    MessageLatencyStats* stats = __atomic_load_n(&_types[type], __ATOMIC_ACQUIRE);
+    if (stats)
+    {
+        return stats;
+    }
+
+    MessageLatencyStats* created = new MessageLatencyStats();
+    // 失败时stats被更新为其他线程已创建的统计
+    if (__atomic_compare_exchange_n(&_types[type], &stats, created, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        return created;
+    }
+
+    delete created;
+    return stats;
+}
+
+void MessageLatency::dump(std::map<uint32_t, MessageLatencyStats>& stats) const
+{
+    for (uint32_t i = 0; i < MSG_TYPE_MAX; i++)
+    {
+        MessageLatencyStats* s = __atomic_load_n(&_types[i], __ATOMIC_ACQUIRE);
+        if (!s)
+        {
+            continue;
+        }
+
+        MessageLatencyStats& out = stats[i];
+        for (int j = 0; j < MessageLatencyStats::STAGE_MAX; j++)
+        {
+            s->_stages[j].snapshot(&out._stages[j]);
+        }
+    }
+}
+
+void MessageLatency::reset()
+{
+    for (uint32_t i = 0; i < MSG_TYPE_MAX; i++)
+    {
+        MessageLatencyStats* s = __atomic_load_n(&_types[i], __ATOMIC_ACQUIRE);
+        if (!s)
+        {
+            continue;
+        }
+
+        for (int j = 0; j < MessageLatencyStats::STAGE_MAX; j++)
+        {
+            s->_stages[j].clear();
+        }
+    }
+}
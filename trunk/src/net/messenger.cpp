@@ -1,5 +1,8 @@
 #include "messenger.h"
 #include "simple_messenger.h"
+#include "async_messenger.h"
+#include "shm_messenger.h"
+#include "log.h"
 
 Messenger* Messenger::create(const std::string type, entity_name_t name, std::string lname)
 {
@@ -9,15 +12,161 @@ Messenger* Messenger::create(const std::string type, entity_name_t name, std::st
     }
     else if (type.find("async") != std::string::npos)
     {
-        // return new AsyncMessenger(cct, name, type, std::move(lname), nonce);
-        return NULL;
+        return new AsyncMessenger(name, std::move(lname));
+    }
+    else if (type == "shm")
+    {
+        return new ShmMessenger(name, std::move(lname));
     }
     
     return NULL;
 }
 
-int Messenger::get_default_crc_flags()
+int Messenger::send_messages(std::vector<Message*>& ms, const entity_inst_t& dest)
 {
+    int r = 0;
+    for (std::vector<Message*>::iterator iter = ms.begin(); iter != ms.end(); ++iter)
+    {
+        int rc = send_message(*iter, dest);
+        if (0 > rc)
+        {
+            r = rc;
+        }
+    }
+
+    ms.clear();
+
+    return r;
+}
+
+int Messenger::send_messages(std::vector<Message*>& ms, Connection* con)
+{
+    for (std::vector<Message*>::iterator iter = ms.begin(); iter != ms.end(); ++iter)
+    {
+        con->send_message(*iter);
+    }
+
+    ms.clear();
+
+    return 0;
+}
+
+void Messenger::prepare_multicast(Message* m)
+{
+    m->get_header().src = get_entity_name();
+
+    if (!m->get_priority())
+    {
+        m->set_priority(get_default_send_priority());
+    }
+
+    m->encode_body(_crc_flag);
+}
+
+Message* Messenger::decode_multicast(Message* m)
+{
+    msg_header header = m->get_header();
+    msg_footer footer = m->get_footer();
+    buffer front = m->get_payload();
+    buffer middle = m->get_middle();
+    buffer data = m->get_data();
+
+    // 本地消息不经过校验
+    Message* copy = decode_message(0, header, footer, front, middle, data);
+    if (!copy)
+    {
+        ERROR_LOG("multicast to local failed, type %d %s is not registered", m->get_type(), m->get_type_name());
+    }
+
+    return copy;
+}
 
+int Messenger::send_multicast(Message* m, const std::vector<entity_inst_t>& dests)
+{
+    prepare_multicast(m);
+
+    // 原消息留给本端,等其它对端的副本都创建后再转发
+    const entity_inst_t* local = NULL;
+    for (std::vector<entity_inst_t>::const_iterator iter = dests.begin(); iter != dests.end(); ++iter)
+    {
+        Message* copy = NULL;
+        if (iter->_addr != get_entity_addr())
+        {
+            copy = new SharedMessage(m, _crc_flag);
+        }
+        else if (!local)
+        {
+            local = &*iter;
+        }
+        else
+        {
+            // 本端重复出现时只能解码出新的消息
+            copy = decode_multicast(m);
+        }
+
+        if (copy)
+        {
+            send_message(copy, *iter);
+        }
+    }
+
+    if (local)
+    {
+        send_message(m, *local);
+    }
+    else
+    {
+        m->dec();
+    }
+
+    return 0;
+}
+
+int Messenger::send_multicast(Message* m, const std::vector<Connection*>& cons)
+{
+    prepare_multicast(m);
+
+    // 原消息留给本端,等其它对端的副本都创建后再转发
+    Connection* loopback = get_loopback_connection();
+    bool local = false;
+    for (std::vector<Connection*>::const_iterator iter = cons.begin(); iter != cons.end(); ++iter)
+    {
+        Message* copy = NULL;
+        if (*iter != loopback)
+        {
+            copy = new SharedMessage(m, _crc_flag);
+        }
+        else if (!local)
+        {
+            local = true;
+        }
+        else
+        {
+            // 本端重复出现时只能解码出新的消息
+            copy = decode_multicast(m);
+        }
+
+        if (copy)
+        {
+            (*iter)->send_message(copy);
+        }
+    }
+
+    if (local)
+    {
+        loopback->send_message(m);
+    }
+    else
+    {
+        m->dec();
+    }
+
+    return 0;
+}
+
+int Messenger::get_default_crc_flags()
+{
+    // config
+    return MSG_CRC_ALL;
 }
 
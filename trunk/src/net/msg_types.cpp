@@ -1,3 +1,6 @@
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "msg_types.h"
 
 const char * entity_type_name(int type)
@@ -10,3 +13,67 @@ const char * entity_type_name(int type)
     }
 }
 
+bool get_local_dir(char* dir, size_t len, bool create)
+{
+    int n = snprintf(dir, len, "%s/moth-%u", MSGR_LOCAL_SOCKET_DIR, (unsigned)geteuid());
+    if (0 > n || len <= (size_t)n)
+    {
+        return false;
+    }
+
+    if (create && 0 > ::mkdir(dir, S_IRWXU) && EEXIST != errno)
+    {
+        return false;
+    }
+
+    // 目录可能是其它用户预先创建的,不跟随符号链接
+    struct stat st;
+    if (0 > ::lstat(dir, &st))
+    {
+        return false;
+    }
+
+    return S_ISDIR(st.st_mode) && geteuid() == st.st_uid && 0 == (st.st_mode & (S_IRWXG | S_IRWXO));
+}
+
+int unlink_stale_local_path(const char* path)
+{
+    struct stat st;
+    if (0 > ::lstat(path, &st))
+    {
+        return (ENOENT == errno) ? 0 : -errno;
+    }
+
+    if (!S_ISSOCK(st.st_mode) || geteuid() != st.st_uid)
+    {
+        return -EEXIST;
+    }
+
+    // 能连上说明还有进程在该路径上监听
+    sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (0 > fd)
+    {
+        return -errno;
+    }
+
+    int rc = ::connect(fd, (sockaddr*)&sun, sizeof(sun));
+    int err = errno;
+    ::close(fd);
+
+    if (0 == rc)
+    {
+        return -EADDRINUSE;
+    }
+
+    if (ECONNREFUSED != err)
+    {
+        return -err;
+    }
+
+    return (0 > ::unlink(path) && ENOENT != errno) ? -errno : 0;
+}
@@ -0,0 +1,1455 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "log.h"
+#include "safe_io.h"
+#include "shm_messenger.h"
+
+ShmConnection::ShmConnection(ShmMessenger* msgr)
+    : Connection(msgr),
+    _reader_thread(this),
+    _writer_thread(this),
+    _shm_msgr(msgr),
+    _fd(-1),
+    _state(STATE_NONE),
+    _stop(false),
+    _done(false),
+    _tx(NULL),
+    _rx(NULL),
+    _writing(false),
+    _conn_id(msgr->_dispatch_queue.get_id()),
+    _out_seq(0),
+    _in_seq(0),
+    _iovcnt(0),
+    _iovlen(0),
+    _frame_off(0),
+    _frame_left(0)
+{
+    memset(&_header, 0, sizeof(_header));
+}
+
+ShmConnection::~ShmConnection()
+{
+    close_rings();
+
+    if (0 <= _fd)
+    {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+bool ShmConnection::is_connected()
+{
+    return STATE_OPEN == _state;
+}
+
+int ShmConnection::send_message(Message* m)
+{
+    return _shm_msgr->send_message(m, this);
+}
+
+void ShmConnection::mark_down()
+{
+    stop(false);
+}
+
+void ShmConnection::connect(const entity_addr_t& addr, int type)
+{
+    _peer_addr = addr;
+    _peer_type = type;
+    _policy = _shm_msgr->get_policy(type);
+    _shm_msgr->_dispatch_queue.set_dispatch_weight(this, _policy._dispatch_weight);
+    _state = STATE_CONNECTING;
+
+    _writer_thread.create();
+    _reader_thread.create();
+}
+
+void ShmConnection::accept(int fd)
+{
+    _fd = fd;
+    _state = STATE_ACCEPTING;
+
+    _writer_thread.create();
+    _reader_thread.create();
+}
+
+void ShmConnection::stop(bool queue_reset)
+{
+    // 先设置停止标志,让等待队列空间的写线程尽快退出
+    _stop = true;
+
+    {
+        Mutex::Locker locker(_write_lock);
+        if (STATE_CLOSED == _state)
+        {
+            return;
+        }
+
+        DEBUG_LOG("shm connection stop");
+
+        _state = STATE_CLOSED;
+        _write_cond.signal();
+
+        // 唤醒阻塞在握手中的读线程,同时通知对端
+        if (0 <= _fd)
+        {
+            ::shutdown(_fd, SHUT_RDWR);
+        }
+
+        if (_rx)
+        {
+            _rx->notify();
+        }
+    }
+
+    _shm_msgr->_dispatch_queue.discard_queue(_conn_id);
+
+    if (queue_reset)
+    {
+        _shm_msgr->_dispatch_queue.queue_reset(static_cast<Connection*>(get()), _conn_id);
+    }
+}
+
+void ShmConnection::join()
+{
+    if (_reader_thread.is_started())
+    {
+        _reader_thread.join();
+    }
+}
+
+void ShmConnection::fault()
+{
+    DEBUG_LOG("shm connection fault");
+
+    // lossy连接出错即关闭
+    stop(true);
+}
+
+void ShmConnection::reader()
+{
+    bool connecting = (STATE_CONNECTING == _state);
+    int r = connecting ? handshake_connect() : handshake_accept();
+    if (0 == r)
+    {
+        Mutex::Locker locker(_write_lock);
+        if (_stop)
+        {
+            r = -1;
+        }
+        else
+        {
+            _state = STATE_OPEN;
+            _write_cond.signal();
+        }
+    }
+
+    DispatchQueue& dq = _shm_msgr->_dispatch_queue;
+
+    if (0 > r)
+    {
+        ERROR_LOG("shm connection handshake failed, errno %d", errno);
+
+        if (connecting && !_stop)
+        {
+            dq.queue_refused(static_cast<Connection*>(get()), _conn_id);
+        }
+
+        stop(false);
+    }
+    else
+    {
+        if (connecting)
+        {
+            dq.queue_connect(static_cast<Connection*>(get()), _conn_id);
+            _shm_msgr->ms_deliver_handle_fast_connect(static_cast<Connection*>(get()));
+        }
+        else
+        {
+            dq.queue_accept(static_cast<Connection*>(get()), _conn_id);
+            _shm_msgr->ms_deliver_handle_fast_accept(static_cast<Connection*>(get()));
+        }
+
+        read_loop();
+    }
+
+    // 连接已关闭,等待写线程不再使用发送队列后再释放
+    if (_writer_thread.is_started())
+    {
+        _writer_thread.join();
+    }
+
+    close_rings();
+    _frame = ptr();
+    _record = ptr();
+
+    _done = true;
+}
+
+int ShmConnection::handshake_connect()
+{
+    sockaddr_un sun;
+    if (!_peer_addr.get_local_path(sun, "shm"))
+    {
+        return -1;
+    }
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (0 > fd)
+    {
+        return -1;
+    }
+
+    {
+        Mutex::Locker locker(_write_lock);
+        if (_stop)
+        {
+            ::close(fd);
+            return -1;
+        }
+
+        _fd = fd;
+    }
+
+    struct timeval tv;
+    tv.tv_sec = SHM_MSGR_HANDSHAKE_MS / 1000;
+    tv.tv_usec = (SHM_MSGR_HANDSHAKE_MS % 1000) * 1000;
+    ::setsockopt(_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ::setsockopt(_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (0 > ::connect(_fd, (sockaddr*)&sun, sizeof(sun)))
+    {
+        DEBUG_LOG("connect %s failed, errno %d", sun.sun_path, errno);
+        return -1;
+    }
+
+    shm_connect connect;
+    memset(&connect, 0, sizeof(connect));
+    connect.host_type = _shm_msgr->get_entity()._name.type();
+    connect.ring_size = SHM_MSGR_RING_SIZE;
+
+    int r = -1;
+    {
+        Mutex::Locker locker(_write_lock);
+        _tx = create_ring(_shm[0], connect.paths[0], sizeof(connect.paths[0]));
+        _rx = create_ring(_shm[1], connect.paths[1], sizeof(connect.paths[1]));
+    }
+
+    if (_tx && _rx)
+    {
+        buffer bl;
+        bl.append(MSGR_BANNER, strlen(MSGR_BANNER));
+        ::encode(_shm_msgr->get_entity_addr(), bl);
+        bl.append((char*)&connect, sizeof(connect));
+
+        // 对端打开共享内存后回复
+        char tag = 0;
+        if (0 == safe_write(_fd, bl.c_str(), bl.length()) && 0 == safe_read_exact(_fd, &tag, sizeof(tag))
+            && MSGR_TAG_READY == tag)
+        {
+            r = 0;
+        }
+    }
+
+    remove_rings(connect.paths);
+
+    return r;
+}
+
+int ShmConnection::handshake_accept()
+{
+    struct timeval tv;
+    tv.tv_sec = SHM_MSGR_HANDSHAKE_MS / 1000;
+    tv.tv_usec = (SHM_MSGR_HANDSHAKE_MS % 1000) * 1000;
+    ::setsockopt(_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ::setsockopt(_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    size_t banner_len = strlen(MSGR_BANNER);
+    char hello[banner_len + sizeof(entity_addr_t) + sizeof(shm_connect)];
+    if (0 != safe_read_exact(_fd, hello, sizeof(hello)))
+    {
+        return -1;
+    }
+
+    if (memcmp(hello, MSGR_BANNER, banner_len))
+    {
+        ERROR_LOG("shm connection banner mismatch");
+        return -1;
+    }
+
+    entity_addr_t peer_addr;
+    try
+    {
+        buffer bl;
+        bl.append(hello + banner_len, sizeof(entity_addr_t));
+        buffer::iterator p = bl.begin();
+        ::decode(peer_addr, p);
+    }
+    catch (...)
+    {
+        return -1;
+    }
+
+    shm_connect connect;
+    memcpy(&connect, hello + banner_len + sizeof(entity_addr_t), sizeof(connect));
+    connect.paths[0][sizeof(connect.paths[0]) - 1] = '\0';
+    connect.paths[1][sizeof(connect.paths[1]) - 1] = '\0';
+
+    _peer_addr = peer_addr;
+    _peer_type = connect.host_type;
+    _policy = _shm_msgr->get_policy(_peer_type);
+    _shm_msgr->_dispatch_queue.set_dispatch_weight(this, _policy._dispatch_weight);
+
+    {
+        Mutex::Locker locker(_write_lock);
+        // 主动方的发送方向是本端的接收方向
+        _rx = open_ring(_shm[1], connect.paths[0]);
+        _tx = open_ring(_shm[0], connect.paths[1]);
+    }
+
+    if (!_rx || !_tx)
+    {
+        ERROR_LOG("open shm ring failed");
+        return -1;
+    }
+
+    char tag = MSGR_TAG_READY;
+    if (0 != safe_write(_fd, &tag, sizeof(tag)))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+ShmQueue* ShmConnection::create_ring(ShareMemory& shm, char* path, size_t len)
+{
+    // ftok只用到了inode的低位,可能与已有的共享内存冲突,冲突时换一个临时文件
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(path, len, "%s/moth-shm-XXXXXX", MSGR_LOCAL_SOCKET_DIR);
+        int fd = ::mkstemp(path);
+        if (0 > fd)
+        {
+            break;
+        }
+
+        ::close(fd);
+
+        try
+        {
+            if (shm.create(path, SHM_MSGR_RING_SIZE))
+            {
+                shm.attach();
+                return new ShmQueue(&shm, ONE_READ_ONE_WRITE);
+            }
+        }
+        catch (...)
+        {
+            ERROR_LOG("create shm ring failed, errno %d", errno);
+
+            try
+            {
+                shm.close();
+            }
+            catch (...)
+            {
+            }
+
+            shm.detach();
+            ::unlink(path);
+            break;
+        }
+
+        ::unlink(path);
+    }
+
+    path[0] = '\0';
+
+    return NULL;
+}
+
+ShmQueue* ShmConnection::open_ring(ShareMemory& shm, const char* path)
+{
+    try
+    {
+        shm.open(path);
+        shm.attach();
+        return new ShmQueue(&shm, ONE_READ_ONE_WRITE);
+    }
+    catch (...)
+    {
+        shm.detach();
+    }
+
+    return NULL;
+}
+
+void ShmConnection::remove_rings(char paths[2][108])
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if ('\0' == paths[i][0])
+        {
+            continue;
+        }
+
+        try
+        {
+            _shm[i].close();
+        }
+        catch (...)
+        {
+        }
+
+        ::unlink(paths[i]);
+    }
+}
+
+void ShmConnection::close_rings()
+{
+    Mutex::Locker locker(_write_lock);
+
+    DELETE_P(_tx);
+    DELETE_P(_rx);
+
+    _shm[0].detach();
+    _shm[1].detach();
+}
+
+bool ShmConnection::peer_gone()
+{
+    // 握手之后对端不会再写unix socket,可读即对端已关闭
+    struct pollfd pfd;
+    pfd.fd = _fd;
+    pfd.events = POLLIN | POLLRDHUP;
+    pfd.revents = 0;
+
+    int r = ::poll(&pfd, 1, 0);
+    if (0 > r)
+    {
+        return EINTR != errno;
+    }
+
+    return 0 < r;
+}
+
+void ShmConnection::read_loop()
+{
+    _record = ptr(SHM_MSGR_RECORD_MAX);
+
+    int idle = 0;
+    while (!_stop)
+    {
+        // 消息剩余部分不小于一条记录时直接读到消息缓冲中,省去一次拷贝
+        char* dst = _record.c_str();
+        if (SHM_MSGR_RECORD_MAX <= _frame_left)
+        {
+            dst = _frame.c_str() + _frame_off;
+        }
+
+        int n = _rx->recv(dst);
+        if (0 < n)
+        {
+            idle = 0;
+            if (0 > handle_record(dst, n))
+            {
+                ERROR_LOG("shm connection bad record, len %d", n);
+                fault();
+                break;
+            }
+
+            continue;
+        }
+
+        if (SHM_MSGR_SPIN_ROUNDS > ++idle)
+        {
+            sched_yield();
+            continue;
+        }
+
+        _rx->wait(SHM_MSGR_WAIT_MS);
+
+        if (_rx->empty() && peer_gone())
+        {
+            fault();
+            break;
+        }
+    }
+}
+
+int ShmConnection::handle_record(const char* rec, uint32_t len)
+{
+    if (0 == _frame_left)
+    {
+        // 每个消息的第一条记录以消息头开始
+        if (sizeof(msg_header) > len)
+        {
+            return -1;
+        }
+
+        memcpy(&_header, rec, sizeof(_header));
+        rec += sizeof(_header);
+        len -= sizeof(_header);
+
+        _recv_stamp = clock_now();
+        _frame_left = _header.front_len + _header.middle_len + _header.data_len + sizeof(msg_footer);
+        _frame = ptr(_shm_msgr->_recv_pool->create(_frame_left));
+        _frame_off = 0;
+    }
+
+    if (len > _frame_left)
+    {
+        return -1;
+    }
+
+    char* dst = _frame.c_str() + _frame_off;
+    if (dst != rec)
+    {
+        memcpy(dst, rec, len);
+    }
+
+    _frame_off += len;
+    _frame_left -= len;
+
+    if (0 == _frame_left)
+    {
+        return handle_message();
+    }
+
+    return 0;
+}
+
+int ShmConnection::get_throttle(uint64_t size)
+{
+    Throttle* msgs = _policy._throttler_messages;
+    Throttle* bytes = size ? _policy._throttler_bytes : NULL;
+    DispatchQueue& dq = _shm_msgr->_dispatch_queue;
+
+    int stage = 0;
+    while (!_stop)
+    {
+        if (0 == stage)
+        {
+            if (msgs && !msgs->get_or_fail())
+            {
+                usleep(1000);
+                continue;
+            }
+
+            stage = 1;
+        }
+
+        if (1 == stage)
+        {
+            if (bytes && !bytes->get_or_fail(size))
+            {
+                usleep(1000);
+                continue;
+            }
+
+            stage = 2;
+        }
+
+        if (dq.dispatch_throttle_get_or_fail(this, size))
+        {
+            return 0;
+        }
+
+        usleep(1000);
+    }
+
+    if (1 <= stage && msgs)
+    {
+        msgs->put();
+    }
+
+    if (2 <= stage && bytes)
+    {
+        bytes->put(size);
+    }
+
+    return -1;
+}
+
+int ShmConnection::handle_message()
+{
+    uint32_t front_len = _header.front_len;
+    uint32_t middle_len = _header.middle_len;
+    uint32_t data_len = _header.data_len;
+
+    ptr frame = _frame;
+    _frame = ptr();
+
+    msg_footer footer;
+    memcpy(&footer, frame.c_str() + front_len + middle_len + data_len, sizeof(footer));
+
+    // 发送端放弃了该消息
+    if (0 == (footer.flags & MSG_FOOTER_COMPLETE))
+    {
+        return 0;
+    }
+
+    uint64_t size = (uint64_t)front_len + middle_len + data_len;
+    if (0 > get_throttle(size))
+    {
+        return 0;
+    }
+
+    utime_t throttle_stamp = clock_now();
+
+    buffer front, middle, data;
+    if (front_len)
+    {
+        front.push_back(ptr(frame, 0, front_len));
+    }
+
+    if (middle_len)
+    {
+        middle.push_back(ptr(frame, front_len, middle_len));
+    }
+
+    if (data_len)
+    {
+        data.push_back(ptr(frame, front_len + middle_len, data_len));
+    }
+
+    DispatchQueue& dq = _shm_msgr->_dispatch_queue;
+
+    Message* m = decode_message(_shm_msgr->_crc_flag, _header, footer, front, middle, data);
+    if (!m)
+    {
+        ERROR_LOG("decode message type %d failed", (uint32_t)_header.type);
+
+        if (_policy._throttler_messages)
+        {
+            _policy._throttler_messages->put();
+        }
+
+        if (size && _policy._throttler_bytes)
+        {
+            _policy._throttler_bytes->put(size);
+        }
+
+        dq.dispatch_throttle_release(this, size);
+        return -1;
+    }
+
+    m->set_byte_throttler(_policy._throttler_bytes);
+    m->set_message_throttler(_policy._throttler_messages);
+    m->set_dispatch_throttle_size(size);
+    m->set_recv_stamp(_recv_stamp);
+    m->set_throttle_stamp(throttle_stamp);
+    m->set_recv_complete_stamp(clock_now());
+
+    if (m->get_seq() <= _in_seq)
+    {
+        dq.dispatch_throttle_release(this, m->get_dispatch_throttle_size());
+        m->dec();
+        return 0;
+    }
+
+    if (m->get_seq() > _in_seq + 1)
+    {
+        ERROR_LOG("missed message? skipped from seq %lu to %lu", _in_seq, m->get_seq());
+    }
+
+    m->set_connection(static_cast<Connection*>(get()));
+
+    _in_seq = m->get_seq();
+
+    dq.fast_preprocess(m);
+
+    if (dq.can_fast_dispatch(m))
+    {
+        if (dq.has_fast_threads())
+        {
+            dq.queue_fast_dispatch(m, _conn_id);
+        }
+        else
+        {
+            dq.fast_dispatch(m);
+        }
+    }
+    else
+    {
+        dq.enqueue(m, m->get_priority(), _conn_id);
+    }
+
+    return 0;
+}
+
+void ShmConnection::send(Message* m)
+{
+    Mutex::Locker locker(_write_lock);
+
+    // 连接已被关闭的消息直接丢弃
+    if (STATE_CLOSED == _state)
+    {
+        m->dec();
+        return;
+    }
+
+    m->set_seq(++_out_seq);
+    m->set_connection(this);
+    m->encode(_shm_msgr->_crc_flag);
+
+    // 读端只会增加空间,整个消息放得下时直接写入不会等待
+    if (STATE_OPEN == _state && !_writing && _out_q.empty() && _tx->has_space(get_record_space(m)))
+    {
+        write_message(m);
+        m->dec();
+        return;
+    }
+
+    _out_q.push_back(m);
+    _write_cond.signal();
+}
+
+void ShmConnection::writer()
+{
+    _write_lock.lock();
+
+    while (STATE_CLOSED != _state)
+    {
+        if (STATE_OPEN != _state || _out_q.empty())
+        {
+            _write_cond.wait(_write_lock);
+            continue;
+        }
+
+        std::list<Message*> out;
+        out.swap(_out_q);
+        _writing = true;
+        _write_lock.unlock();
+
+        for (std::list<Message*>::iterator iter = out.begin(); iter != out.end(); ++iter)
+        {
+            if (!_stop)
+            {
+                write_message(*iter);
+            }
+
+            (*iter)->dec();
+        }
+
+        _write_lock.lock();
+        _writing = false;
+    }
+
+    // 连接关闭后未写入的消息直接丢弃
+    std::list<Message*> out;
+    out.swap(_out_q);
+    _write_lock.unlock();
+
+    for (std::list<Message*>::iterator iter = out.begin(); iter != out.end(); ++iter)
+    {
+        (*iter)->dec();
+    }
+}
+
+// 按push_segment的规则累计一个数据段,records为因写满而提交的记录数
+static void count_segment(uint32_t len, int& iovcnt, uint32_t& iovlen, uint32_t& records)
+{
+    while (0 < len)
+    {
+        if (SHM_MSGR_RECORD_IOV == iovcnt || SHM_MSGR_RECORD_MAX == iovlen)
+        {
+            records++;
+            iovcnt = 0;
+            iovlen = 0;
+        }
+
+        uint32_t n = MIN(len, SHM_MSGR_RECORD_MAX - iovlen);
+        iovcnt++;
+        iovlen += n;
+        len -= n;
+    }
+}
+
+uint32_t ShmConnection::get_record_space(Message* m)
+{
+    uint32_t records = 0;
+    int iovcnt = 0;
+    uint32_t iovlen = 0;
+    uint32_t total = sizeof(msg_header) + sizeof(msg_footer);
+
+    count_segment(sizeof(msg_header), iovcnt, iovlen, records);
+
+    const buffer* bls[3] = { &m->get_payload(), &m->get_middle(), &m->get_data() };
+    for (int i = 0; i < 3; i++)
+    {
+        for (std::list<ptr>::const_iterator iter = bls[i]->ptrs().begin(); iter != bls[i]->ptrs().end(); ++iter)
+        {
+            count_segment(iter->length(), iovcnt, iovlen, records);
+            total += iter->length();
+        }
+    }
+
+    count_segment(sizeof(msg_footer), iovcnt, iovlen, records);
+
+    // 最后一条记录的长度字段由has_space计入
+    return total + records * sizeof(uint32_t);
+}
+
+int ShmConnection::write_message(Message* m)
+{
+    // 与socket上的格式一致,消息头后依次是front、middle、data和footer
+    // 超过一条记录的部分拆成多条记录,记录之间不再重复消息头
+    if (0 > push_segment((const char*)&m->get_header(), sizeof(msg_header))
+        || 0 > push_buffer(m->get_payload())
+        || 0 > push_buffer(m->get_middle())
+        || 0 > push_buffer(m->get_data())
+        || 0 > push_segment((const char*)&m->get_footer(), sizeof(msg_footer))
+        || 0 > flush_record())
+    {
+        _iovcnt = 0;
+        _iovlen = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+int ShmConnection::push_segment(const char* p, uint32_t len)
+{
+    while (0 < len)
+    {
+        if (SHM_MSGR_RECORD_IOV == _iovcnt || SHM_MSGR_RECORD_MAX == _iovlen)
+        {
+            if (0 > flush_record())
+            {
+                return -1;
+            }
+        }
+
+        uint32_t n = MIN(len, SHM_MSGR_RECORD_MAX - _iovlen);
+        _iov[_iovcnt].iov_base = (void*)p;
+        _iov[_iovcnt].iov_len = n;
+        _iovcnt++;
+        _iovlen += n;
+
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int ShmConnection::push_buffer(const buffer& bl)
+{
+    for (std::list<ptr>::const_iterator iter = bl.ptrs().begin(); iter != bl.ptrs().end(); ++iter)
+    {
+        if (0 > push_segment(iter->c_str(), iter->length()))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int ShmConnection::flush_record()
+{
+    if (0 == _iovcnt)
+    {
+        return 0;
+    }
+
+    // 队列写满时唤醒对端读线程,等待其读走数据,只在写线程中发生
+    int spins = 0;
+    while (0 > _tx->sendv(_iov, _iovcnt))
+    {
+        if (_stop)
+        {
+            return -1;
+        }
+
+        _tx->notify();
+
+        if (SHM_MSGR_SPIN_ROUNDS > ++spins)
+        {
+            sched_yield();
+        }
+        else
+        {
+            usleep(100);
+        }
+    }
+
+    _tx->notify();
+
+    _iovcnt = 0;
+    _iovlen = 0;
+
+    return 0;
+}
+
+
+ShmMessenger::ShmMessenger(entity_name_t name, std::string mname)
+    : PolicyMessenger(name, mname),
+    _accepter(this),
+    _dispatch_queue(this, mname),
+    _lock(),
+    _recv_pool(new BufferPool()),
+    _did_bind(false),
+    _reserve_fd(-1),
+    _listen_fd(-1),
+    _shutdown_rd_fd(-1),
+    _shutdown_wr_fd(-1),
+    _stopped(true),
+    _local_connection(NULL)
+{
+    _local_connection = new ShmConnection(this);
+    _local_connection->_state = ShmConnection::STATE_OPEN;
+    init_local_connection();
+}
+
+ShmMessenger::~ShmMessenger()
+{
+    close_listen();
+
+    _local_connection->dec();
+
+    // 还有消息引用缓冲时,缓冲池在其全部释放后销毁
+    _recv_pool->dec();
+}
+
+void ShmMessenger::ready()
+{
+    DEBUG_LOG("shm messenger ready");
+
+    _dispatch_queue.start();
+
+    Mutex::Locker locker(_lock);
+    if (_did_bind && 0 > _shutdown_wr_fd)
+    {
+        int fds[2];
+        if (0 > ::pipe2(fds, O_CLOEXEC | O_NONBLOCK))
+        {
+            ERROR_LOG("create shutdown pipe failed, errno %d", errno);
+            return;
+        }
+
+        _shutdown_rd_fd = fds[0];
+        _shutdown_wr_fd = fds[1];
+        _accepter.create();
+    }
+}
+
+int ShmMessenger::bind(const entity_addr_t& bind_addr)
+{
+    {
+        Mutex::Locker locker(_lock);
+        if (_started)
+        {
+            return -1;
+        }
+    }
+
+    int family;
+    switch (bind_addr.get_family())
+    {
+        case AF_INET:
+        case AF_INET6:
+        {
+            family = bind_addr.get_family();
+            break;
+        }
+        default:
+        {
+            family = AF_INET;
+        }
+    }
+
+    // 只占用IP和端口,使地址在主机内唯一,不监听
+    _reserve_fd = ::socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (0 > _reserve_fd)
+    {
+        return -errno;
+    }
+
+    entity_addr_t listen_addr = bind_addr;
+    listen_addr.set_family(family);
+
+    int rc = -1;
+    if (listen_addr.get_port())
+    {
+        int on = 1;
+        rc = ::setsockopt(_reserve_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (0 == rc)
+        {
+            rc = ::bind(_reserve_fd, listen_addr.get_sockaddr(), listen_addr.get_sockaddr_len());
+        }
+    }
+    // 如果没有配置监听端口
+    else
+    {
+        for (int port = 9000; port <= 9999; port++)
+        {
+            listen_addr.set_port(port);
+            rc = ::bind(_reserve_fd, listen_addr.get_sockaddr(), listen_addr.get_sockaddr_len());
+            if (0 == rc)
+            {
+                break;
+            }
+        }
+    }
+
+    if (0 > rc)
+    {
+        rc = -errno;
+        close_listen();
+        return rc;
+    }
+
+    sockaddr_storage ss;
+    socklen_t llen = sizeof(ss);
+    rc = ::getsockname(_reserve_fd, (sockaddr*)&ss, &llen);
+    if (0 > rc)
+    {
+        rc = -errno;
+        close_listen();
+        return rc;
+    }
+
+    listen_addr.set_sockaddr((sockaddr*)&ss);
+
+    sockaddr_un sun;
+    if (!listen_addr.get_local_path(sun, "shm", true))
+    {
+        close_listen();
+        return -EACCES;
+    }
+
+    // 路径只由端口决定,其它IP上绑定了同一端口的进程可能正在使用
+    rc = unlink_stale_local_path(sun.sun_path);
+    if (0 > rc)
+    {
+        close_listen();
+        return rc;
+    }
+
+    _listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (0 > _listen_fd)
+    {
+        rc = -errno;
+        close_listen();
+        return rc;
+    }
+
+    rc = ::bind(_listen_fd, (sockaddr*)&sun, sizeof(sun));
+    if (0 == rc)
+    {
+        _listen_path = sun.sun_path;
+        // config
+        rc = ::listen(_listen_fd, 128);
+    }
+
+    if (0 > rc)
+    {
+        rc = -errno;
+        close_listen();
+        return rc;
+    }
+
+    set_entity_addr(listen_addr);
+    init_local_connection();
+
+    _did_bind = true;
+
+    return 0;
+}
+
+void ShmMessenger::close_listen()
+{
+    if (0 <= _listen_fd)
+    {
+        ::close(_listen_fd);
+        _listen_fd = -1;
+    }
+
+    if (!_listen_path.empty())
+    {
+        ::unlink(_listen_path.c_str());
+        _listen_path.clear();
+    }
+
+    if (0 <= _reserve_fd)
+    {
+        ::close(_reserve_fd);
+        _reserve_fd = -1;
+    }
+}
+
+int ShmMessenger::start()
+{
+    DEBUG_LOG("shm messenger start");
+
+    Mutex::Locker locker(_lock);
+
+    _started = true;
+    _stopped = false;
+
+    if (!_did_bind)
+    {
+        init_local_connection();
+    }
+
+    return 0;
+}
+
+int ShmMessenger::shutdown()
+{
+    mark_down_all();
+
+    _local_connection->set_priv(NULL);
+
+    Mutex::Locker locker(_lock);
+    _stop_cond.signal();
+    _stopped = true;
+
+    return 0;
+}
+
+void ShmMessenger::wait()
+{
+    {
+        Mutex::Locker locker(_lock);
+        if (!_started)
+        {
+            return;
+        }
+
+        if (!_stopped)
+        {
+            _stop_cond.wait(_lock);
+        }
+    }
+
+    stop_accepter();
+
+    _dispatch_queue.shutdown();
+    if (_dispatch_queue.is_started())
+    {
+        _dispatch_queue.wait();
+        _dispatch_queue.discard_local();
+    }
+
+    std::list<ShmConnection*> conns;
+    {
+        Mutex::Locker locker(_lock);
+        mark_down_all();
+
+        for (std::map<entity_addr_t, ShmConnection*>::iterator iter = _conns.begin(); iter != _conns.end(); ++iter)
+        {
+            conns.push_back(iter->second);
+        }
+
+        conns.insert(conns.end(), _accepted.begin(), _accepted.end());
+        conns.splice(conns.end(), _closed_conns);
+        _conns.clear();
+        _accepted.clear();
+    }
+
+    // 读线程可能正在回调dispatcher,不能持有_lock等待
+    for (std::list<ShmConnection*>::iterator iter = conns.begin(); iter != conns.end(); ++iter)
+    {
+        (*iter)->stop(false);
+        (*iter)->join();
+        (*iter)->dec();
+    }
+
+    if (_did_bind)
+    {
+        close_listen();
+        _did_bind = false;
+    }
+
+    Mutex::Locker locker(_lock);
+    _started = false;
+}
+
+void ShmMessenger::accept_entry()
+{
+    struct pollfd pfd[2];
+    pfd[0].fd = _listen_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = _shutdown_rd_fd;
+    pfd[1].events = POLLIN;
+
+    while (true)
+    {
+        pfd[0].revents = 0;
+        pfd[1].revents = 0;
+
+        int r = ::poll(pfd, 2, -1);
+        if (0 > r)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+
+            ERROR_LOG("poll failed, errno %d", errno);
+            break;
+        }
+
+        if (pfd[1].revents)
+        {
+            break;
+        }
+
+        if (pfd[0].revents & (POLLERR | POLLNVAL | POLLHUP))
+        {
+            break;
+        }
+
+        int fd = ::accept4(_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (0 > fd)
+        {
+            if (EINTR != errno && EAGAIN != errno)
+            {
+                ERROR_LOG("accept failed, errno %d", errno);
+            }
+
+            continue;
+        }
+
+        add_accept(fd);
+    }
+}
+
+void ShmMessenger::stop_accepter()
+{
+    if (0 > _shutdown_wr_fd)
+    {
+        return;
+    }
+
+    char ch = 0;
+    if (0 != safe_write(_shutdown_wr_fd, &ch, sizeof(ch)))
+    {
+        ERROR_LOG("write shutdown pipe failed");
+    }
+
+    _accepter.join();
+
+    ::close(_shutdown_rd_fd);
+    ::close(_shutdown_wr_fd);
+    _shutdown_rd_fd = -1;
+    _shutdown_wr_fd = -1;
+}
+
+void ShmMessenger::add_accept(int fd)
+{
+    ShmConnection* con = new ShmConnection(this);
+
+    Mutex::Locker locker(_lock);
+    reap_conns();
+    _accepted.insert(con);
+    con->accept(fd);
+}
+
+ShmConnection* ShmMessenger::connect_rank(const entity_addr_t& addr, int type)
+{
+    DEBUG_LOG("ShmMessenger connect_rank");
+
+    reap_conns();
+
+    ShmConnection* con = new ShmConnection(this);
+    con->connect(addr, type);
+
+    std::map<entity_addr_t, ShmConnection*>::iterator iter = _conns.find(addr);
+    if (iter != _conns.end())
+    {
+        // 旧连接已经关闭,等待其读线程退出后回收
+        _closed_conns.push_back(iter->second);
+        iter->second = con;
+    }
+    else
+    {
+        _conns[addr] = con;
+    }
+
+    return con;
+}
+
+void ShmMessenger::reap_conns()
+{
+    for (std::list<ShmConnection*>::iterator iter = _closed_conns.begin(); iter != _closed_conns.end();)
+    {
+        if ((*iter)->is_done())
+        {
+            (*iter)->join();
+            (*iter)->dec();
+            iter = _closed_conns.erase(iter);
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+
+    for (std::set<ShmConnection*>::iterator iter = _accepted.begin(); iter != _accepted.end();)
+    {
+        if ((*iter)->is_done())
+        {
+            (*iter)->join();
+            (*iter)->dec();
+            _accepted.erase(iter++);
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+}
+
+int ShmMessenger::send_message(Message* m, const entity_inst_t& dest)
+{
+    DEBUG_LOG("ShmMessenger send_message by entity");
+
+    m->get_header().src = get_entity_name();
+
+    if (!m->get_priority())
+    {
+        m->set_priority(get_default_send_priority());
+    }
+
+    if (dest._addr == entity_addr_t())
+    {
+        m->dec();
+        return -EINVAL;
+    }
+
+    ShmConnection* con = NULL;
+    {
+        Mutex::Locker locker(_lock);
+        con = lookup_conn(dest._addr);
+        if (con)
+        {
+            con->get();
+        }
+    }
+
+    submit_message(m, con, dest._addr, dest._name.type());
+
+    if (con)
+    {
+        con->dec();
+    }
+
+    return 0;
+}
+
+int ShmMessenger::send_message(Message* m, Connection* con)
+{
+    DEBUG_LOG("ShmMessenger send_message by connection");
+
+    m->get_header().src = get_entity_name();
+
+    if (!m->get_priority())
+    {
+        m->set_priority(get_default_send_priority());
+    }
+
+    submit_message(m, static_cast<ShmConnection*>(con), con->get_peer_addr(), con->get_peer_type());
+
+    return 0;
+}
+
+void ShmMessenger::submit_message(Message* m, ShmConnection* con, const entity_addr_t& dest_addr, int dest_type)
+{
+    if (con == _local_connection || _entity._addr == dest_addr)
+    {
+        DEBUG_LOG("dest addr is local");
+
+        m->set_connection(static_cast<Connection*>(_local_connection->get()));
+        _dispatch_queue.local_delivery(m, m->get_priority());
+        return;
+    }
+
+    if (con)
+    {
+        // 连接已被关闭的消息直接丢弃
+        con->send(m);
+        return;
+    }
+
+    const Policy& policy = get_policy(dest_type);
+    if (policy._server)
+    {
+        m->dec();
+        return;
+    }
+
+    {
+        Mutex::Locker locker(_lock);
+        con = lookup_conn(dest_addr);
+        if (!con)
+        {
+            con = connect_rank(dest_addr, dest_type);
+        }
+
+        con->get();
+    }
+
+    // 发送可能在调用线程中编码和写入共享内存,不持有_lock
+    con->send(m);
+    con->dec();
+}
+
+Connection* ShmMessenger::get_connection(const entity_inst_t& dest)
+{
+    Mutex::Locker locker(_lock);
+    if (_entity._addr == dest._addr)
+    {
+        return _local_connection;
+    }
+
+    ShmConnection* con = lookup_conn(dest._addr);
+    if (!con)
+    {
+        con = connect_rank(dest._addr, dest._name.type());
+    }
+
+    return con;
+}
+
+void ShmMessenger::mark_down(const entity_addr_t& addr)
+{
+    Mutex::Locker locker(_lock);
+    ShmConnection* con = lookup_conn(addr);
+    if (con)
+    {
+        con->stop(true);
+    }
+}
+
+void ShmMessenger::mark_down_all()
+{
+    Mutex::Locker locker(_lock);
+
+    for (std::set<ShmConnection*>::iterator iter = _accepted.begin(); iter != _accepted.end(); ++iter)
+    {
+        (*iter)->stop(true);
+    }
+
+    for (std::map<entity_addr_t, ShmConnection*>::iterator iter = _conns.begin(); iter != _conns.end(); ++iter)
+    {
+        iter->second->stop(true);
+    }
+}
+
+void ShmMessenger::init_local_connection()
+{
+    _local_connection->_peer_addr = _entity._addr;
+    _local_connection->_peer_type = _entity._name.type();
+    ms_deliver_handle_fast_connect(static_cast<Connection*>(_local_connection->get()));
+}
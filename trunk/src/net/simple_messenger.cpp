@@ -1,6 +1,20 @@
 #include "simple_messenger.h"
 #include "log.h"
 
+class SimpleMessenger::C_KeepaliveTick : public Callback
+{
+public:
+    explicit C_KeepaliveTick(SimpleMessenger* m) : _msgr(m) {}
+
+    virtual void finish(int r)
+    {
+        _msgr->keepalive_tick();
+    }
+
+private:
+    SimpleMessenger* _msgr;
+};
+
 SimpleMessenger::SimpleMessenger(entity_name_t name, std::string mname)
   : PolicyMessenger(name, mname),
     _accepter(this),
@@ -8,16 +22,29 @@ SimpleMessenger::SimpleMessenger(entity_name_t name, std::string mname)
     _reaper_thread(this),
     _lock(), _did_bind(false),
     _global_seq(0),
-    _dispatch_throttler(std::string("msgr_dispatch_throttler_") + mname),
     _reaper_started(false), _reaper_stop(false),
+    _batch_send(true),
+    _encode_on_submit(false),
+    _zerocopy_threshold(0),
+    _sock_rcvbuf(0), _sock_sndbuf(0),
+    _protocol_version(MSGR_PROTOCOL_V2),
+    _ack_delay_ms(SM_ACK_DELAY_MS),
+    _keepalive_interval_ms(SM_KEEPALIVE_INTERVAL_MS),
+    _recv_pool(new BufferPool()),
     _timeout(0),
     _local_connection(new SocketConnection(this))
 {
+    atomic_set(&_send_msgs, 0);
+    atomic_set(&_send_syscalls, 0);
+    atomic_set(&_zerocopy_sends, 0);
+    atomic_set(&_zerocopy_copied, 0);
     init_local_connection();
 }
 
 SimpleMessenger::~SimpleMessenger()
 {
+    // 还有消息引用缓冲时,缓冲池在其全部释放后销毁
+    _recv_pool->dec();
 }
 
 void SimpleMessenger::ready()
@@ -51,12 +78,7 @@ int SimpleMessenger::send_message(Message* m, const entity_inst_t& dest)
 {
     DEBUG_LOG("SimpleMessenger send_message by entity");
     
-    m->get_header().src = get_entity_name();
-
-    if (!m->get_priority())
-    {
-        m->set_priority(get_default_send_priority());
-    }
+    prepare_message(m);
 
     if (dest._addr == entity_addr_t())
     {
@@ -64,7 +86,9 @@ int SimpleMessenger::send_message(Message* m, const entity_inst_t& dest)
         return -EINVAL;
     }
 
-    Mutex::Locker locker(_lock);
+    encode_outgoing(m, dest._addr);
+
+    Mutex::Locker locker(get_peer_shard(dest._addr)._lock);
     Socket* sockt = lookup_socket(dest._addr);
     submit_message(m, (sockt ? static_cast<SocketConnection*>(sockt->_connection_state->get()) : NULL), dest._addr, dest._name.type(), true);
     
@@ -75,15 +99,68 @@ int SimpleMessenger::send_message(Message* m, Connection* con)
 {
     DEBUG_LOG("SimpleMessenger send_message by connection");
     
-    m->get_header().src = get_entity_name();
+    prepare_message(m);
+    encode_outgoing(m, con->get_peer_addr());
 
-    if (!m->get_priority())
+    submit_message(m, static_cast<SocketConnection*>(con), con->get_peer_addr(), con->get_peer_type(), false);
+    
+    return 0;
+}
+
+int SimpleMessenger::send_messages(std::vector<Message*>& ms, const entity_inst_t& dest)
+{
+    DEBUG_LOG("SimpleMessenger send_messages by entity");
+
+    for (std::vector<Message*>::iterator iter = ms.begin(); iter != ms.end(); ++iter)
     {
-        m->set_priority(get_default_send_priority());
+        prepare_message(*iter);
     }
 
-    submit_message(m, static_cast<SocketConnection*>(con), con->get_peer_addr(), con->get_peer_type(), false);
-    
+    if (dest._addr == entity_addr_t())
+    {
+        for (std::vector<Message*>::iterator iter = ms.begin(); iter != ms.end(); ++iter)
+        {
+            (*iter)->dec();
+        }
+
+        ms.clear();
+        return -EINVAL;
+    }
+
+    if (ms.empty())
+    {
+        return 0;
+    }
+
+    for (std::vector<Message*>::iterator iter = ms.begin(); iter != ms.end(); ++iter)
+    {
+        encode_outgoing(*iter, dest._addr);
+    }
+
+    Mutex::Locker locker(get_peer_shard(dest._addr)._lock);
+    Socket* sockt = lookup_socket(dest._addr);
+    submit_messages(ms, (sockt ? static_cast<SocketConnection*>(sockt->_connection_state->get()) : NULL), dest._addr, dest._name.type(), true);
+
+    return 0;
+}
+
+int SimpleMessenger::send_messages(std::vector<Message*>& ms, Connection* con)
+{
+    DEBUG_LOG("SimpleMessenger send_messages by connection");
+
+    for (std::vector<Message*>::iterator iter = ms.begin(); iter != ms.end(); ++iter)
+    {
+        prepare_message(*iter);
+        encode_outgoing(*iter, con->get_peer_addr());
+    }
+
+    if (ms.empty())
+    {
+        return 0;
+    }
+
+    submit_messages(ms, static_cast<SocketConnection*>(con), con->get_peer_addr(), con->get_peer_type(), false);
+
     return 0;
 }
 
@@ -143,10 +220,11 @@ void SimpleMessenger::reaper()
         }
         
         socket->_lock.unlock();
-        socket->unregister_socket();
         _sockets.erase(socket);
         
+        // 注销时需要获取分片锁,不能持有_lock
         _lock.unlock();
+        socket->unregister_socket();
         socket->join();
         _lock.lock();
 
@@ -228,25 +306,85 @@ int SimpleMessenger::start()
 
     _reaper_started = true;
     _reaper_thread.create();
+
+    if (_keepalive_interval_ms)
+    {
+        _keepalive_timer.init();
+        _keepalive_timer.add_event_at(clock_now() + utime_t(_keepalive_interval_ms / 1000,
+                    (_keepalive_interval_ms % 1000) * 1000000), new C_KeepaliveTick(this));
+    }
     
     return 0;
 }
 
+void SimpleMessenger::keepalive_tick()
+{
+    std::vector<Socket*> sockets;
+    {
+        Mutex::Locker locker(_lock);
+        sockets.reserve(_sockets.size());
+        for (std::set<Socket*>::iterator iter = _sockets.begin(); iter != _sockets.end(); ++iter)
+        {
+            (*iter)->get();
+            sockets.push_back(*iter);
+        }
+    }
+
+    // 只设置标记,由各连接的写线程发送
+    utime_t now = clock_now();
+    for (size_t i = 0; i < sockets.size(); i++)
+    {
+        Socket* socket = sockets[i];
+        socket->_lock.lock();
+        if (Socket::SOCKET_OPEN == socket->_state && !socket->_send_keepalive2)
+        {
+            socket->send_keepalive2(now);
+        }
+        socket->_lock.unlock();
+        socket->dec();
+    }
+
+    // 定时器回调中持有定时器的锁,可以直接添加下一次任务
+    _keepalive_timer.add_event_at(now + utime_t(_keepalive_interval_ms / 1000,
+                (_keepalive_interval_ms % 1000) * 1000000), new C_KeepaliveTick(this));
+}
+
 Socket* SimpleMessenger::add_accept_socket(int fd)
 {
     Mutex::Locker locker(_lock);
     Socket* socket = new Socket(this, Socket::SOCKET_ACCEPTING, NULL);
     socket->_fd = fd;
+    _sockets.insert(socket);
+
+    // 读线程启动后可能立即完成握手并从中移除,需先加入
+    {
+        Mutex::Locker locker(_accepting_lock);
+        _accepting_sockets.insert(socket);
+    }
+
     socket->_lock.lock();
     socket->start_reader();
     socket->_lock.unlock();
     
-    _sockets.insert(socket);
-    _accepting_sockets.insert(socket);
-    
     return socket;
 }
 
+int SimpleMessenger::apply_socket_buffers(int fd)
+{
+    // 显式设置后内核不再自动调整该方向的缓冲
+    if (_sock_rcvbuf && 0 > ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void*)&_sock_rcvbuf, sizeof(_sock_rcvbuf)))
+    {
+        return -errno;
+    }
+
+    if (_sock_sndbuf && 0 > ::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void*)&_sock_sndbuf, sizeof(_sock_sndbuf)))
+    {
+        return -errno;
+    }
+
+    return 0;
+}
+
 
 Socket* SimpleMessenger::connect_rank(const entity_addr_t& addr, int type, SocketConnection* con, Message* first)
 {
@@ -256,7 +394,9 @@ Socket* SimpleMessenger::connect_rank(const entity_addr_t& addr, int type, Socke
     socket->_lock.lock();
     socket->set_peer_type(type);
     socket->set_peer_addr(addr);
+    socket->_prefer_local = is_local_peer(addr);
     socket->_policy = get_policy(type);
+    _dispatch_queue.set_dispatch_weight(socket->_connection_state, socket->_policy._dispatch_weight);
     socket->start_writer();
     if (first)
     {
@@ -264,19 +404,31 @@ Socket* SimpleMessenger::connect_rank(const entity_addr_t& addr, int type, Socke
     }
     socket->_lock.unlock();
     socket->register_socket();
+
+    Mutex::Locker locker(_lock);
     _sockets.insert(socket);
 
     return socket;
 }
 
+bool SimpleMessenger::is_local_peer(const entity_addr_t& addr)
+{
+    if (!addr.is_local() || !_entity._addr.get_port())
+    {
+        return false;
+    }
+
+    return addr.is_loopback_ip() || addr.is_blank_ip() || addr.is_same_host(_entity._addr);
+}
+
 Connection* SimpleMessenger::get_connection(const entity_inst_t& dest)
 {
-    Mutex::Locker locker(_lock);
     if (_entity._addr == dest._addr)
     {
         return _local_connection;
     }
 
+    Mutex::Locker locker(get_peer_shard(dest._addr)._lock);
     while (true)
     {
         Socket* socket = lookup_socket(dest._addr);
@@ -298,26 +450,37 @@ Connection* SimpleMessenger::get_connection(const entity_inst_t& dest)
 
 void SimpleMessenger::submit_message(Message* m, SocketConnection* con, const entity_addr_t& dest_addr, int dest_type, bool already_locked)
 {
-    DEBUG_LOG("SimpleMessenger submit_message");
+    std::vector<Message*> ms(1, m);
+    submit_messages(ms, con, dest_addr, dest_type, already_locked);
+}
+
+void SimpleMessenger::submit_messages(std::vector<Message*>& ms, SocketConnection* con, const entity_addr_t& dest_addr, int dest_type, bool already_locked)
+{
+    DEBUG_LOG("SimpleMessenger submit_messages");
 
     if (con)
     {
         DEBUG_LOG("connection already exist");
-        
+
         Socket* socket = NULL;
-        bool ok = static_cast<SocketConnection*>(con)->try_get_socket(&socket);
+        bool ok = con->try_get_socket(&socket);
         if (!ok)
         {
-            m->dec();
+            for (std::vector<Message*>::iterator iter = ms.begin(); iter != ms.end(); ++iter)
+            {
+                (*iter)->dec();
+            }
+
+            ms.clear();
             return;
         }
-        
+
         while (socket && ok)
         {
             socket->_lock.lock();
             if (socket->_state != Socket::SOCKET_CLOSED)
             {
-                socket->send(m);
+                socket->send(ms);
                 socket->_lock.unlock();
                 socket->dec();
                 return;
@@ -329,7 +492,12 @@ void SimpleMessenger::submit_message(Message* m, SocketConnection* con, const en
             {
                 socket->dec();
                 current_socket->dec();
-                m->dec();
+                for (std::vector<Message*>::iterator iter = ms.begin(); iter != ms.end(); ++iter)
+                {
+                    (*iter)->dec();
+                }
+
+                ms.clear();
                 return;
             }
             else
@@ -343,27 +511,39 @@ void SimpleMessenger::submit_message(Message* m, SocketConnection* con, const en
     if (_entity._addr == dest_addr)
     {
         DEBUG_LOG("dest addr is local");
-        
-        m->set_connection(static_cast<Connection*>(_local_connection->get()));
-        _dispatch_queue.local_delivery(m, m->get_priority());
+
+        for (std::vector<Message*>::iterator iter = ms.begin(); iter != ms.end(); ++iter)
+        {
+            (*iter)->set_connection(static_cast<Connection*>(_local_connection->get()));
+            _dispatch_queue.local_delivery(*iter, (*iter)->get_priority());
+        }
+
+        ms.clear();
         return;
     }
 
     const Policy& policy = get_policy(dest_type);
     if (policy._server)
     {
-        m->dec();
+        for (std::vector<Message*>::iterator iter = ms.begin(); iter != ms.end(); ++iter)
+        {
+            (*iter)->dec();
+        }
+
+        ms.clear();
     }
     else
     {
         if (!already_locked)
         {
-            Mutex::Locker locker(_lock);
-            submit_message(m, con, dest_addr, dest_type, true);
+            Mutex::Locker locker(get_peer_shard(dest_addr)._lock);
+            submit_messages(ms, con, dest_addr, dest_type, true);
         }
         else
         {
-            connect_rank(dest_addr, dest_type, static_cast<SocketConnection*>(con), m);
+            Socket* socket = connect_rank(dest_addr, dest_type, con, NULL);
+            Mutex::Locker locker(socket->_lock);
+            socket->send(ms);
         }
     }
 }
@@ -408,6 +588,8 @@ void SimpleMessenger::wait()
         _did_bind = false;
     }
 
+    _keepalive_timer.shutdown();
+
     _dispatch_queue.shutdown();
     if (_dispatch_queue.is_started())
     {
@@ -417,81 +599,107 @@ void SimpleMessenger::wait()
 
     if (_reaper_started)
     {
-        Mutex::Locker locker(_lock);
-        _reaper_cond.signal();
-        _reaper_stop = true;
+        {
+            Mutex::Locker locker(_lock);
+            _reaper_cond.signal();
+            _reaper_stop = true;
+        }
 
+        // 回收线程需要_lock才能退出,不能持锁join
         _reaper_thread.join();
         _reaper_started = false;
     }
 
-    Mutex::Locker locker(_lock);
-    while (!_rank_socket.empty())
+    for (int i = 0; i < SM_PEER_SHARDS; i++)
     {
-        Socket* socket = _rank_socket.begin()->second;
-        socket->unregister_socket();
-        socket->_lock.lock();
-        socket->stop_and_wait();
-        SocketConnection* con = socket->_connection_state;
-        
-        if (con)
+        PeerShard& shard = _peer_shards[i];
+        Mutex::Locker locker(shard._lock);
+        while (!shard._rank_socket.empty())
         {
-            con->clear_socket(socket);
+            Socket* socket = shard._rank_socket.begin()->second;
+            socket->unregister_socket();
+            socket->_lock.lock();
+            socket->stop_and_wait();
+            SocketConnection* con = socket->_connection_state;
+            
+            if (con)
+            {
+                con->clear_socket(socket);
+            }
+            
+            socket->_lock.unlock();
         }
-        
-        socket->_lock.unlock();
     }
 
-    reaper();
-    while (!_sockets.empty())
     {
-        _reaper_cond.wait(_lock);
+        Mutex::Locker locker(_lock);
         reaper();
+        while (!_sockets.empty())
+        {
+            _reaper_cond.wait(_lock);
+            reaper();
+        }
     }
 
+    // 所有socket都已回收,不会再有延迟投递的消息
+    _delayed_delivery.shutdown();
+
+    Mutex::Locker locker(_lock);
     _started = false;
 }
 
 
 void SimpleMessenger::mark_down_all()
 {
-    Mutex::Locker locker(_lock);
-    for (std::set<Socket*>::iterator iter = _accepting_sockets.begin(); iter != _accepting_sockets.end(); ++iter)
     {
-        Socket* socket = *iter;
-        socket->_lock.lock();
-        socket->stop();
-        SocketConnection* con = socket->_connection_state;
-        if (con && con->clear_socket(socket))
+        // 持有_lock防止socket被回收
+        Mutex::Locker locker(_lock);
+        std::set<Socket*> accepting;
         {
-            _dispatch_queue.queue_reset(static_cast<Connection*>(con->get()));
+            Mutex::Locker locker(_accepting_lock);
+            accepting.swap(_accepting_sockets);
+        }
+
+        for (std::set<Socket*>::iterator iter = accepting.begin(); iter != accepting.end(); ++iter)
+        {
+            Socket* socket = *iter;
+            socket->_lock.lock();
+            socket->stop();
+            SocketConnection* con = socket->_connection_state;
+            if (con && con->clear_socket(socket))
+            {
+                _dispatch_queue.queue_reset(static_cast<Connection*>(con->get()), socket->_conn_id);
+            }
+            
+            socket->_lock.unlock();
         }
-        
-        socket->_lock.unlock();
     }
-    _accepting_sockets.clear();
 
-    while (!_rank_socket.empty())
+    for (int i = 0; i < SM_PEER_SHARDS; i++)
     {
-        // std::unordered_map<entity_addr_t, Socket*>::iterator iter = _rank_socket.begin();
-        std::map<entity_addr_t, Socket*>::iterator iter = _rank_socket.begin();
-        Socket* socket = iter->second;
-        _rank_socket.erase(iter);
-        socket->unregister_socket();
-        socket->_lock.lock();
-        socket->stop();
-        SocketConnection* con = socket->_connection_state;
-        if (con && con->clear_socket(socket))
+        PeerShard& shard = _peer_shards[i];
+        Mutex::Locker locker(shard._lock);
+        while (!shard._rank_socket.empty())
         {
-            _dispatch_queue.queue_reset(static_cast<Connection*>(con->get()));
+            std::unordered_map<entity_addr_t, Socket*>::iterator iter = shard._rank_socket.begin();
+            Socket* socket = iter->second;
+            shard._rank_socket.erase(iter);
+            socket->unregister_socket();
+            socket->_lock.lock();
+            socket->stop();
+            SocketConnection* con = socket->_connection_state;
+            if (con && con->clear_socket(socket))
+            {
+                _dispatch_queue.queue_reset(static_cast<Connection*>(con->get()), socket->_conn_id);
+            }
+            socket->_lock.unlock();
         }
-        socket->_lock.unlock();
     }
 }
 
 void SimpleMessenger::mark_down(const entity_addr_t& addr)
 {
-    Mutex::Locker locker(_lock);
+    Mutex::Locker locker(get_peer_shard(addr)._lock);
     Socket* socket = lookup_socket(addr);
     if (socket)
     {
@@ -503,7 +711,7 @@ void SimpleMessenger::mark_down(const entity_addr_t& addr)
             SocketConnection* con = socket->_connection_state;
             if (con && con->clear_socket(socket))
             {
-                _dispatch_queue.queue_reset(static_cast<Connection*>(con->get()));
+                _dispatch_queue.queue_reset(static_cast<Connection*>(con->get()), socket->_conn_id);
             }
         }
         socket->_lock.unlock();
@@ -520,7 +728,7 @@ void SimpleMessenger::mark_down(Connection* con)
         return;
     }
 
-    Mutex::Locker locker(_lock);
+    Mutex::Locker locker(get_peer_shard(con->get_peer_addr())._lock);
     Socket* socket = static_cast<SocketConnection*>(con)->get_socket();
     if (socket)
     {
@@ -8,17 +8,23 @@
 // SYS_NS_BEGIN
 
 #define SEQ_MASK  0x7fffffff
-#define BANNER "banner"
+#define BANNER MSGR_BANNER
+
+// 大消息时只预读下一个消息的tag和头部
+static const size_t SM_RECV_MIN_PREFETCH = 1 + sizeof(msg_header);
 
 Socket::Socket(SimpleMessenger* msgr, int st, SocketConnection* con)
-        : RefCountable(), _reader_thread(this), _writer_thread(this), _delay_thread(NULL), _msgr(msgr),
-        _conn_id(msgr->_dispatch_queue.get_id()), _recv_ofs(0), _recv_len(0), _fd(-1),
+        : RefCountable(), _reader_thread(this), _writer_thread(this), _delay_queue(NULL), _msgr(msgr),
+        _conn_id(msgr->_dispatch_queue.get_id()), _recv_ofs(0), _recv_len(0), _recv_msg_avg(0), _fd(-1),
         _port(0), _peer_type(-1), _lock(), _state(st), _connection_state(NULL), 
         _reader_running(false), _reader_needs_join(false), _reader_dispatching(false),
         _notify_on_dispatch_done(false), _writer_running(false), _in_q(&(msgr->_dispatch_queue)),
-        _send_keepalive(false), _send_keepalive_ack(false), _connect_seq(0), _peer_global_seq(0),
-        _out_seq(0), _in_seq(0), _in_seq_acked(0)
+        _send_keepalive(false), _send_keepalive2(false), _send_keepalive_ack(false), _connect_seq(0), _peer_global_seq(0),
+        _out_seq(0), _in_seq(0), _in_seq_acked(0), _zerocopy(false), _zc_next(0), _zc_done(0),
+        _prefer_local(false), _local(false), _protocol(MSGR_PROTOCOL_V1), _peer_v1(false), _in_frame_ack(0)
 {
+    atomic_set(&_state_closed, 0);
+
     if (con)
     {
         _connection_state = con;
@@ -40,7 +46,11 @@ Socket::Socket(SimpleMessenger* msgr, int st, SocketConnection* con)
 
 Socket::~Socket()
 {
-    DELETE_P(_delay_thread);
+    if (_delay_queue)
+    {
+        _msgr->_delayed_delivery.remove_queue(_delay_queue);
+        _delay_queue = NULL;
+    }
     DELETE_ARRAY(_recv_buf);
 }
 
@@ -66,19 +76,20 @@ void Socket::start_reader()
     _reader_thread.create();
 }
 
-void Socket::start_delay_thread()
+void Socket::start_delayed_delivery()
 {
-    if (!_delay_thread)
+    if (!_delay_queue && get_delivery_delay())
     {
-        uint32_t pos = std::string("").find(entity_type_name(_connection_state->_peer_type));
-        if (pos != std::string::npos)
-        {
-            _delay_thread = new DelayedDelivery(this);
-            _delay_thread->create();
-        }
+        _delay_queue = _msgr->_delayed_delivery.create_queue(this);
     }
 }
 
+uint32_t Socket::get_delivery_delay()
+{
+    std::map<int, uint32_t>::const_iterator iter = _msgr->_delay_peer_types.find(_connection_state->_peer_type);
+    return (iter == _msgr->_delay_peer_types.end()) ? 0 : iter->second;
+}
+
 void Socket::start_writer()
 {
     _writer_running = true;
@@ -102,23 +113,25 @@ void Socket::join_reader()
 
 void Socket::set_socket_options()
 {
+    int domain = AF_UNSPEC;
+    socklen_t dlen = sizeof(domain);
+    ::getsockopt(_fd, SOL_SOCKET, SO_DOMAIN, &domain, &dlen);
+    _local = (AF_UNIX == domain);
+
     // 禁用Nagle’s Algorithm
     int flag = 1;
-    int r = ::setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag));
+    int r = _local ? 0 : ::setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag));
     if (0 > r)
     {
         r = -errno;
     }
 
-    // 设置滑动窗口大小
-    /*
-    int size = 0;
-    int r = ::setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, (void*)&size, sizeof(size));
-    if (0 > r)
+    // 设置收发缓冲大小,主动连接时在connect之前设置才能影响窗口扩大因子
+    // accept到的socket已经继承了监听socket的设置
+    if (!_local && 0 > _msgr->apply_socket_buffers(_fd))
     {
-        r = -errno;
+        ERROR_LOG("set socket buffers failed, errno %d", errno);
     }
-    */
 
 
 #if defined(SO_NOSIGPIPE)
@@ -130,6 +143,25 @@ void Socket::set_socket_options()
     }
 #endif
 
+    // 新建的连接零拷贝序号从0开始,旧连接上未完成的通知不会再到达
+    release_zerocopy(true);
+    _zerocopy = false;
+    _zc_next = 0;
+    _zc_done = 0;
+    _zc_ranges.clear();
+#if defined(HAVE_MSG_ZEROCOPY)
+    // unix socket不支持MSG_ZEROCOPY
+    if (_msgr->_zerocopy_threshold && !_local)
+    {
+        int zc = 1;
+        _zerocopy = (0 == ::setsockopt(_fd, SOL_SOCKET, SO_ZEROCOPY, &zc, sizeof(zc)));
+        if (!_zerocopy)
+        {
+            ERROR_LOG("set SO_ZEROCOPY failed, errno %d", errno);
+        }
+    }
+#endif
+
 #ifdef SO_PRIORITY
     int prio = _msgr->get_socket_priority();
     if (0 <= prio)
@@ -177,7 +209,7 @@ void Socket::set_socket_options()
 #endif
 }
 
-int Socket::create_socket()
+int Socket::create_socket(int family)
 {
     // 已经打开了一个socket
     if (0 <= _fd)
@@ -185,7 +217,7 @@ int Socket::create_socket()
         close_socket();
     }
 
-    _fd = ::socket(_peer_addr.get_family(), SOCK_STREAM, 0);
+    _fd = ::socket(family, SOCK_STREAM, 0);
     if (0 > _fd)
     {
         return -1;
@@ -284,7 +316,8 @@ int Socket::accepting()
         ::decode(_peer_addr, it);
     }
 
-    if (_peer_addr.is_blank_ip())
+    // unix socket的对端没有IP和端口,保留对端自己的地址
+    if (_peer_addr.is_blank_ip() && !_local)
     {
         int port = _peer_addr.get_port();
         _peer_addr._addr = peer_addr._addr;
@@ -301,7 +334,8 @@ int Socket::accepting()
     }
 
     // _msgr->_lock.lock();
-    Mutex::Locker locker(_msgr->_lock);
+    // 同一对端的建连与替换在其分片锁内串行进行
+    Mutex::Locker locker(_msgr->get_peer_shard(_peer_addr)._lock);
     // _lock.lock();
     if (_msgr->_dispatch_queue._stop)
     {
@@ -321,23 +355,22 @@ int Socket::accepting()
 
     set_peer_type(connect.host_type);
     _policy = _msgr->get_policy(connect.host_type);
+    _in_q->set_dispatch_weight(_connection_state, _policy._dispatch_weight);
 
     memset(&connect_reply, 0, sizeof(connect_reply));
-    connect_reply.protocol_version = 0;
+    connect_reply.protocol_version = _msgr->_protocol_version;
     
     // _msgr->_lock.unlock();
 
-    if (connect.protocol_version != connect_reply.protocol_version)
+    // 低于本端的版本在open_socket中协商,只拒绝无法识别的版本
+    if (connect.protocol_version > MSGR_PROTOCOL_V2)
     {
         connect_reply.tag = MSGR_TAG_BADPROTOVER;
         // _lock.unlock();
-        rc = tcp_write((char*)&connect_reply, sizeof(connect_reply));
-        if (0 > rc)
-        {
-            // _lock.lock();
-            accept_fail();
-            return -1;
-        }
+        tcp_write((char*)&connect_reply, sizeof(connect_reply));
+        // _lock.lock();
+        accept_fail();
+        return -1;
     }
     
     // _lock.unlock();
@@ -420,13 +453,11 @@ int Socket::accepting()
             // _msgr->_lock.unlock();
 
             // _lock.unlock();
-            rc = tcp_write((char*)&connect_reply, sizeof(connect_reply));
-            if (0 > rc)
-            {
-                // _lock.lock();
-                accept_fail();                
-                return -1;
-            }
+            // 回复后由对端重新发起连接
+            tcp_write((char*)&connect_reply, sizeof(connect_reply));
+            // _lock.lock();
+            accept_fail();
+            return -1;
         }
 
         if (connect.connect_seq == existing->_connect_seq)
@@ -443,13 +474,11 @@ int Socket::accepting()
                 // _msgr->_lock.unlock();
 
                 // _lock.unlock();
-                rc = tcp_write((char*)&connect_reply, sizeof(connect_reply));
-                if (0 > rc)
-                {
-                    // _lock.lock();
-                    accept_fail();
-                    return -1;
-                }
+                // 回复后由对端重新发起连接
+                tcp_write((char*)&connect_reply, sizeof(connect_reply));
+                // _lock.lock();
+                accept_fail();
+                return -1;
             }
 
             if (_peer_addr < _msgr->_entity._addr || existing->_policy._server)
@@ -470,13 +499,11 @@ int Socket::accepting()
                 // existing->_lock.unlock();
                 // _msgr->_lock.unlock();
                 // _lock.unlock();
-                rc = tcp_write((char*)&connect_reply, sizeof(connect_reply));
-                if (0 > rc)
-                {
-                    // _lock.lock();
-                    accept_fail();                    
-                    return -1;
-                }
+                // 回复后由对端重新发起连接
+                tcp_write((char*)&connect_reply, sizeof(connect_reply));
+                // _lock.lock();
+                accept_fail();
+                return -1;
             }
 
             if (_policy._resetcheck && 0 == existing->_connect_seq)
@@ -488,13 +515,11 @@ int Socket::accepting()
                 // existing->_lock.unlock();
 
                 // _lock.unlock();
-                rc = tcp_write((char*)&connect_reply, sizeof(connect_reply));
-                if (0 > rc)
-                {
-                    // _lock.lock();
-                    accept_fail();                    
-                    return -1;
-                }
+                // 回复后由对端重新发起连接
+                tcp_write((char*)&connect_reply, sizeof(connect_reply));
+                // _lock.lock();
+                accept_fail();
+                return -1;
             }
         }
 
@@ -508,13 +533,11 @@ int Socket::accepting()
         connect_reply.tag = MSGR_TAG_RESETSESSION;
         
         // _lock.unlock();
-        rc = tcp_write((char*)&connect_reply, sizeof(connect_reply));
-        if (0 > rc)
-        {
-            // _lock.lock();
-            accept_fail();        
-            return -1;
-        }
+        // 回复后由对端重新发起连接
+        tcp_write((char*)&connect_reply, sizeof(connect_reply));
+        // _lock.lock();
+        accept_fail();
+        return -1;
     }
     else
     {
@@ -534,22 +557,22 @@ void Socket::replace_socket(Socket* other)
     {
         if (other->_connection_state->clear_socket(other))
         {
-            _msgr->_dispatch_queue.queue_reset(static_cast<Connection*>(other->_connection_state->get()));
+            _msgr->_dispatch_queue.queue_reset(static_cast<Connection*>(other->_connection_state->get()), other->_conn_id);
         }
     }
     else
     {
-        _msgr->_dispatch_queue.queue_reset(static_cast<Connection*>(_connection_state->get()));
+        _msgr->_dispatch_queue.queue_reset(static_cast<Connection*>(_connection_state->get()), _conn_id);
         _connection_state = other->_connection_state;
 
         _connection_state->reset_socket(this);
 
-        if (other->_delay_thread)
+        if (other->_delay_queue)
         {
-            other->_delay_thread->steal_for_socket(this);
-            _delay_thread = other->_delay_thread;
-            other->_delay_thread = NULL;
-            _delay_thread->flush();
+            _msgr->_delayed_delivery.steal_for_socket(other->_delay_queue, this);
+            _delay_queue = other->_delay_queue;
+            other->_delay_queue = NULL;
+            _msgr->_delayed_delivery.flush(_delay_queue);
         }
 
         uint64_t replaced_conn_id = _conn_id;
@@ -558,14 +581,12 @@ void Socket::replace_socket(Socket* other)
 
         _in_seq = _is_reset_from_peer ? 0 : other->_in_seq;
         _in_seq_acked = _in_seq;
+        _peer_v1 = other->_peer_v1;
 
         other->requeue_sent();
         _out_seq = other->_out_seq;
 
-        for (std::map<int, std::list<Message*> >::iterator iter = other->_out_q.begin(); iter != other->_out_q.end(); ++iter)
-        {
-            _out_q[iter->first].splice(_out_q[iter->first].begin(), iter->second);
-        }
+        _out_q.splice_front(other->_out_q);
     }
     
     other->stop_and_wait();
@@ -582,7 +603,12 @@ int Socket::open_socket(const msg_connect& connect)
     _peer_global_seq = connect.global_seq;
     _state = SOCKET_OPEN;
 
-    connect_reply.tag = MSGR_TAG_READY;
+    // v1的对端只认识MSGR_TAG_READY
+    uint32_t protocol = MIN(connect.protocol_version, _msgr->_protocol_version);
+    reset_frame_state(protocol);
+
+    connect_reply.tag = (MSGR_PROTOCOL_V2 == protocol) ? MSGR_TAG_FEATURES : MSGR_TAG_READY;
+    connect_reply.protocol_version = protocol;
     connect_reply.global_seq = _msgr->get_global_seq();
     connect_reply.connect_seq = _connect_seq;
     connect_reply.flags = 0;
@@ -591,7 +617,7 @@ int Socket::open_socket(const msg_connect& connect)
         connect_reply.flags = connect_reply.flags | MSG_CONNECT_LOSSY;
     }
 
-    _msgr->_dispatch_queue.queue_accept(static_cast<Connection*>(_connection_state->get()));
+    _msgr->_dispatch_queue.queue_accept(static_cast<Connection*>(_connection_state->get()), _conn_id);
     _msgr->ms_deliver_handle_fast_accept(static_cast<Connection*>(_connection_state->get()));
 
     if (_msgr->_dispatch_queue._stop)
@@ -601,7 +627,11 @@ int Socket::open_socket(const msg_connect& connect)
         return -1;
     }
     
-    _msgr->_accepting_sockets.erase(this);
+    {
+        Mutex::Locker locker(_msgr->_accepting_lock);
+        _msgr->_accepting_sockets.erase(this);
+    }
+
     register_socket();
 
     rc = tcp_write((char*)&connect_reply, sizeof(connect_reply));
@@ -619,7 +649,7 @@ int Socket::open_socket(const msg_connect& connect)
         start_writer();
     }
 
-    start_delay_thread();
+    start_delayed_delivery();
 
     return 0;
 }
@@ -634,8 +664,6 @@ int Socket::connecting()
 
     join_reader();
 
-    // _lock.unlock();
-
     int rc = 0;
     char banner[strlen(BANNER) + 1] = {0};
     buffer addrs_buf;
@@ -645,8 +673,12 @@ int Socket::connecting()
     entity_addr_t peer_addr_for_me;
     buffer my_addr_buf;
 
+    // 对端在本机时先尝试unix socket
+    sockaddr_un sun;
+    bool local = _prefer_local && _peer_addr.get_local_path(sun);
+
     // 打开一个socket
-    if (create_socket())
+    if (create_socket(local ? AF_UNIX : _peer_addr.get_family()))
     {
         connect_fail();
         return -1;
@@ -656,17 +688,46 @@ int Socket::connecting()
 
     set_socket_options();
 
-    rc = ::connect(_fd, (sockaddr*)&_peer_addr._addr, _peer_addr.addr_size());
+    // 连接过程中不持有锁,避免双方同时连接时accept线程阻塞在该锁上
+    _lock.unlock();
+
+    if (local)
+    {
+        rc = ::connect(_fd, (sockaddr*)&sun, sizeof(sun));
+        if (0 > rc)
+        {
+            // 对端没有在unix socket上监听,改用TCP
+            DEBUG_LOG("connect %s failed, errno %d, fall back to tcp", sun.sun_path, errno);
+
+            _lock.lock();
+            if (create_socket(_peer_addr.get_family()))
+            {
+                connect_fail();
+                return -1;
+            }
+
+            set_socket_options();
+            _lock.unlock();
+
+            local = false;
+        }
+    }
+
+    if (!local)
+    {
+        rc = ::connect(_fd, (sockaddr*)&_peer_addr._addr, _peer_addr.addr_size());
+    }
+
     if (0 > rc)
     {
         ERROR_LOG("connect %s faild", inet_ntoa(((sockaddr_in*)&_peer_addr._addr)->sin_addr));
         
         if (ECONNREFUSED == Error::code())
         {
-            _msgr->_dispatch_queue.queue_refused(static_cast<Connection*>(_connection_state->get()));
+            _msgr->_dispatch_queue.queue_refused(static_cast<Connection*>(_connection_state->get()), _conn_id);
         }
         
-        // _lock.lock();
+        _lock.lock();
 
         connect_fail();
 
@@ -676,14 +737,14 @@ int Socket::connecting()
     rc = tcp_read((char*)&banner, strlen(BANNER));
     if (0 > rc)
     {
-        // _lock.lock();
+        _lock.lock();
         connect_fail();
         return -1;
     }
     
     if (memcmp(banner, BANNER, strlen(BANNER)))
     {
-        // _lock.lock();
+        _lock.lock();
         connect_fail();
         return -1;
     }
@@ -694,7 +755,7 @@ int Socket::connecting()
     if (0 > rc)
     {
         ERROR_LOG("socket connect send banner failed");
-        // _lock.lock();
+        _lock.lock();
         connect_fail();
         return -1;
     }
@@ -713,7 +774,7 @@ int Socket::connecting()
     rc = tcp_read(addrs_buf.c_str(), addrs_buf.length());
     if (0 > rc)
     {
-        // _lock.lock();
+        _lock.lock();
         connect_fail();
         return -1;
     }
@@ -729,7 +790,7 @@ int Socket::connecting()
     }
     catch (...)
     {
-        // _lock.lock();
+        _lock.lock();
         connect_fail();
         return -1;
     }
@@ -747,7 +808,7 @@ int Socket::connecting()
         else
         {
             ERROR_LOG("not same node");
-            // _lock.lock();
+            _lock.lock();
             connect_fail();
             return -1;
         }
@@ -759,7 +820,7 @@ int Socket::connecting()
     rc = tcp_write(my_addr_buf.c_str(), my_addr_buf.length());
     if (0 > rc)
     {
-        // _lock.lock();
+        _lock.lock();
         connect_fail();
         return -1;
     }
@@ -768,7 +829,8 @@ int Socket::connecting()
     connect.host_type = _msgr->get_entity()._name.type();
     connect.global_seq = global_seq;
     connect.connect_seq = _connect_seq;
-    connect.protocol_version = 0;
+    // 对端曾拒绝过v2则直接使用v1
+    connect.protocol_version = _peer_v1 ? MSGR_PROTOCOL_V1 : _msgr->_protocol_version;
     connect.flags = 0;
 
     if (_policy._lossy)
@@ -779,7 +841,7 @@ int Socket::connecting()
     rc = tcp_write((char*)&connect, sizeof(connect));
     if (0 > rc)
     {
-        // _lock.lock();
+        _lock.lock();
         connect_fail();
         return -1;
     }
@@ -788,13 +850,28 @@ int Socket::connecting()
     rc = tcp_read((char*)&connect_reply, sizeof(connect_reply));
     if (0 > rc)
     {
-        // _lock.lock();
+        _lock.lock();
         connect_fail();
         return -1;
     }
 
+    _lock.lock();
+
+    // 连接期间socket已被替换或关闭
+    if (SOCKET_CONNECTING != _state)
+    {
+        return -1;
+    }
+
     if (MSGR_TAG_BADPROTOVER == connect_reply.tag)
     {
+        // 旧版本的对端不认识v2,下次重连时降级为v1
+        if (MSGR_PROTOCOL_V1 != connect.protocol_version)
+        {
+            DEBUG_LOG("peer rejected protocol %u, fall back to v1", (uint32_t)connect.protocol_version);
+            _peer_v1 = true;
+        }
+
         connect_fail();
         return -1;
     }
@@ -830,15 +907,25 @@ int Socket::connecting()
         return -1;
     }
 
-    if (MSGR_TAG_READY == connect_reply.tag)
+    if (MSGR_TAG_READY == connect_reply.tag || MSGR_TAG_FEATURES == connect_reply.tag)
     {
+        // MSGR_TAG_READY表示对端只支持v1
+        if (MSGR_TAG_FEATURES == connect_reply.tag)
+        {
+            reset_frame_state(MIN(connect_reply.protocol_version, connect.protocol_version));
+        }
+        else
+        {
+            reset_frame_state(MSGR_PROTOCOL_V1);
+        }
+
         _peer_global_seq = connect_reply.global_seq;
         _policy._lossy = connect_reply.flags & MSG_CONNECT_LOSSY;
         _state = SOCKET_OPEN;
         _connect_seq = _connect_seq + 1;
         
         _backoff = utime_t();
-        _msgr->_dispatch_queue.queue_connect(static_cast<Connection*>(_connection_state->get()));
+        _msgr->_dispatch_queue.queue_connect(static_cast<Connection*>(_connection_state->get()), _conn_id);
         _msgr->ms_deliver_handle_fast_connect(static_cast<Connection*>(_connection_state->get()));
   
         if (!_reader_running)
@@ -846,7 +933,7 @@ int Socket::connecting()
             start_reader();
         }
         
-        start_delay_thread();
+        start_delayed_delivery();
         
         return 0;
     }
@@ -859,20 +946,23 @@ int Socket::connecting()
 
 void Socket::register_socket()
 {
-    Socket* existing = _msgr->lookup_socket(_peer_addr);
-    _msgr->_rank_socket[_peer_addr] = this;
+    SimpleMessenger::PeerShard& shard = _msgr->get_peer_shard(_peer_addr);
+    Mutex::Locker locker(shard._lock);
+    shard._rank_socket[_peer_addr] = this;
 }
 
 void Socket::unregister_socket()
 {
-    // std::unordered_map<entity_addr_t, Socket*>::iterator iter = _msgr->_rank_socket.find(_peer_addr);
-    std::map<entity_addr_t, Socket*>::iterator iter = _msgr->_rank_socket.find(_peer_addr);
-    if (iter != _msgr->_rank_socket.end() && iter->second == this)
+    SimpleMessenger::PeerShard& shard = _msgr->get_peer_shard(_peer_addr);
+    Mutex::Locker locker(shard._lock);
+    std::unordered_map<entity_addr_t, Socket*>::iterator iter = shard._rank_socket.find(_peer_addr);
+    if (iter != shard._rank_socket.end() && iter->second == this)
     {
-        _msgr->_rank_socket.erase(iter);
+        shard._rank_socket.erase(iter);
     }
     else
     {
+        Mutex::Locker locker(_msgr->_accepting_lock);
         _msgr->_accepting_sockets.erase(this);
     }
 }
@@ -889,10 +979,11 @@ void Socket::join()
         _reader_thread.join();
     }
     
-    if (_delay_thread)
+    // 读写线程都已退出,不会再有新的延迟消息
+    if (_delay_queue)
     {
-        _delay_thread->stop();
-        _delay_thread->join();
+        _msgr->_delayed_delivery.remove_queue(_delay_queue);
+        _delay_queue = NULL;
     }
 }
 
@@ -903,40 +994,28 @@ void Socket::requeue_sent()
         return;
     }
 
-    std::list<Message*>& rq = _out_q[MSG_PRIO_HIGHEST];
     while (!_sent.empty())
     {
         Message* m = _sent.back();
         _sent.pop_back();
-        rq.push_front(m);
+        _out_q.push_front(m, MSG_PRIO_HIGHEST);
         _out_seq--;
     }
 }
 
 void Socket::discard_requeued_up_to(uint64_t seq)
 {
-    if (0 == _out_q.count(MSG_PRIO_HIGHEST))
-    {
-        return;
-    }
-    
-    std::list<Message*>& rq = _out_q[MSG_PRIO_HIGHEST];
-    while (!rq.empty())
+    Message* m = NULL;
+    while ((m = _out_q.front(MSG_PRIO_HIGHEST)))
     {
-        Message* m = rq.front();
         if (0 == m->get_seq() || m->get_seq() > seq)
         {
             break;
         }
+        _out_q.pop_front(MSG_PRIO_HIGHEST);
         m->dec();
-        rq.pop_front();
         _out_seq++;
     }
-    
-    if (rq.empty())
-    {
-        _out_q.erase(MSG_PRIO_HIGHEST);
-    }
 }
 
 void Socket::discard_out_queue()
@@ -948,15 +1027,13 @@ void Socket::discard_out_queue()
     
     _sent.clear();
     
-    for (std::map<int, std::list<Message*> >::iterator iter = _out_q.begin(); iter != _out_q.end(); ++iter)
+    Message* m = NULL;
+    while ((m = _out_q.pop_front()))
     {
-        for (std::list<Message*>::iterator r = iter->second.begin(); r != iter->second.end(); ++r)
-        {
-            (*r)->dec();
-        }
+        m->dec();
     }
-    
-    _out_q.clear();
+
+    release_zerocopy(true);
 }
 
 void Socket::fault(bool onread)
@@ -974,7 +1051,7 @@ void Socket::fault(bool onread)
     {
         if (_connection_state->clear_socket(this))
         {
-            _msgr->_dispatch_queue.queue_reset(static_cast<Connection*>(_connection_state->get()));
+            _msgr->_dispatch_queue.queue_reset(static_cast<Connection*>(_connection_state->get()), _conn_id);
         }
         
         return;
@@ -988,30 +1065,31 @@ void Socket::fault(bool onread)
         stop();
         bool cleared = _connection_state->clear_socket(this);
         
+        SimpleMessenger::PeerShard& shard = _msgr->get_peer_shard(_peer_addr);
         _lock.unlock();
-        _msgr->_lock.lock();
+        shard._lock.lock();
         _lock.lock();        
         unregister_socket();
-        _msgr->_lock.unlock();
+        shard._lock.unlock();
 
-        if (_delay_thread)
+        if (_delay_queue)
         {
-            _delay_thread->discard();
+            _msgr->_delayed_delivery.discard(_delay_queue);
         }
         
         _in_q->discard_queue(_conn_id);
         discard_out_queue();
         if (cleared)
         {
-            _msgr->_dispatch_queue.queue_reset(static_cast<Connection*>(_connection_state->get()));
+            _msgr->_dispatch_queue.queue_reset(static_cast<Connection*>(_connection_state->get()), _conn_id);
         }
         
         return;
     }
 
-    if (_delay_thread)
+    if (_delay_queue)
     {
-        _delay_thread->flush();
+        _msgr->_delayed_delivery.flush(_delay_queue);
     }
 
     requeue_sent();
@@ -1097,14 +1175,14 @@ void Socket::was_session_reset()
 {
     _in_q->discard_queue(_conn_id);
     
-    if (_delay_thread)
+    if (_delay_queue)
     {
-        _delay_thread->discard();
+        _msgr->_delayed_delivery.discard(_delay_queue);
     }
     
     discard_out_queue();
 
-    _msgr->_dispatch_queue.queue_remote_reset(static_cast<Connection*>(_connection_state->get()));
+    _msgr->_dispatch_queue.queue_remote_reset(static_cast<Connection*>(_connection_state->get()), _conn_id);
 
     _in_seq = 0;
     _connect_seq = 0;
@@ -1114,7 +1192,8 @@ void Socket::stop()
 {
     _state = SOCKET_CLOSED;
     atomic_set(&_state_closed, 1);
-    _cond.signal();
+    // 读写线程可能同时等待在_cond上,需全部唤醒
+    _cond.broadcast();
     shutdown_socket();
 }
 
@@ -1125,10 +1204,10 @@ void Socket::stop_and_wait()
         stop();
     }
   
-    if (_delay_thread)
+    if (_delay_queue)
     {
         _lock.unlock();
-        _delay_thread->stop_fast_dispatching();
+        _msgr->_delayed_delivery.stop_fast_dispatching(_delay_queue);
         _lock.lock();
     }
     
@@ -1153,6 +1232,7 @@ void Socket::reader()
     {
         if (_state == SOCKET_STANDBY)
         {
+            flush_fast_dispatch();
             _cond.wait(_lock);
             continue;
         }
@@ -1167,6 +1247,9 @@ void Socket::reader()
             continue;
         }
 
+        // 收到任何数据都说明对端存活
+        _connection_state->set_last_seen(clock_now());
+
         if (tag == MSGR_TAG_KEEPALIVE)
         {
             _lock.lock();
@@ -1205,7 +1288,10 @@ void Socket::reader()
             }
             else
             {
-                _connection_state->set_last_keepalive_ack(utime_t(t));
+                // 时间戳是本端发送keepalive2时的时间
+                utime_t stamp(t);
+                _connection_state->set_last_keepalive_ack(stamp);
+                _connection_state->update_rtt(clock_now() - stamp);
             }
             
             continue;
@@ -1233,6 +1319,17 @@ void Socket::reader()
             int r = read_message(&m);
 
             _lock.lock();
+
+            // v2帧中携带的确认
+            if (_in_frame_ack)
+            {
+                if (0 <= r && _state != SOCKET_CLOSED)
+                {
+                    handle_ack(_in_frame_ack);
+                }
+
+                _in_frame_ack = 0;
+            }
       
             if (!m)
             {
@@ -1246,15 +1343,17 @@ void Socket::reader()
 
             if (_state == SOCKET_CLOSED || _state == SOCKET_CONNECTING)
             {
-                _in_q->dispatch_throttle_release(m->get_dispatch_throttle_size());
+                _in_q->dispatch_throttle_release(_connection_state, m->get_dispatch_throttle_size());
                 m->dec();
                 continue;
             }
             
+            // 重复的消息直接丢弃
             if (m->get_seq() <= _in_seq)
             {
-                _in_q->dispatch_throttle_release(m->get_dispatch_throttle_size());
+                _in_q->dispatch_throttle_release(_connection_state, m->get_dispatch_throttle_size());
                 m->dec();
+                continue;
             }
             
             if (m->get_seq() > _in_seq + 1)
@@ -1264,20 +1363,37 @@ void Socket::reader()
 
             m->set_connection(static_cast<Connection*>(_connection_state->get()));
 
+            // 延迟确认时只在出现第一个未确认的消息或未确认的消息达到窗口时唤醒写线程
+            bool first_unacked = (_in_seq == _in_seq_acked);
             _in_seq = m->get_seq();
 
-            _cond.signal();
+            if (first_unacked)
+            {
+                uint32_t delay = _msgr->_ack_delay_ms;
+                _ack_deadline = clock_now() + utime_t(delay / 1000, (delay % 1000) * 1000000);
+                _cond.signal();
+            }
+            else if (!_msgr->_ack_delay_ms || _in_seq - _in_seq_acked >= SM_ACK_WINDOW)
+            {
+                _cond.signal();
+            }
       
             _in_q->fast_preprocess(m);
 
-            if (_delay_thread)
+            // 延迟队列只在配置了延迟的连接上创建,同一连接的消息都经过它以保持顺序
+            if (_delay_queue)
             {
-                utime_t release;                
-                _delay_thread->queue(release, m);
+                uint32_t delay = get_delivery_delay();
+                utime_t release = m->get_recv_stamp() + utime_t(delay / 1000, (delay % 1000) * 1000000);
+                _msgr->_delayed_delivery.queue(_delay_queue, release, m);
             }
             else
             {
-                if (_in_q->can_fast_dispatch(m))
+                if (_in_q->can_fast_dispatch(m) && _in_q->has_fast_threads())
+                {
+                    batch_fast_dispatch(m);
+                }
+                else if (_in_q->can_fast_dispatch(m))
                 {
                     _reader_dispatching = true;
                     _lock.unlock();
@@ -1319,11 +1435,40 @@ void Socket::reader()
         }
     }
     
+    flush_fast_dispatch();
     _reader_running = false;
     _reader_needs_join = true;
     unlock_maybe_reap();
 }
 
+void Socket::batch_fast_dispatch(Message* m)
+{
+    // 提交前替换socket的一方需要等待,与直接转发时相同
+    _reader_dispatching = true;
+    _fast_batch.push_back(m);
+    if (SM_FAST_DISPATCH_BATCH <= _fast_batch.size())
+    {
+        flush_fast_dispatch();
+    }
+}
+
+void Socket::flush_fast_dispatch()
+{
+    if (_fast_batch.empty())
+    {
+        return;
+    }
+
+    Mutex::Locker locker(_lock);
+    _in_q->queue_fast_dispatch(_fast_batch, _conn_id);
+    _reader_dispatching = false;
+    if (_state == SOCKET_CLOSED || _notify_on_dispatch_done)
+    {
+        _notify_on_dispatch_done = false;
+        _cond.signal();
+    }
+}
+
 void Socket::writer()
 {
     DEBUG_LOG("socket writer start");
@@ -1360,8 +1505,18 @@ void Socket::writer()
         }
 
         if (_state != SOCKET_CONNECTING && _state != SOCKET_WAIT && _state != SOCKET_STANDBY &&
-            (is_queued() || _in_seq > _in_seq_acked))
+            (is_queued() || ack_due(clock_now())))
         {
+            if (_msgr->_batch_send)
+            {
+                if (0 > write_batch())
+                {
+                    fault();
+                }
+
+                continue;
+            }
+
             if (_send_keepalive)
             {
                 int rc;
@@ -1377,12 +1532,26 @@ void Socket::writer()
                 }
                 _send_keepalive = false;
             }
+
+            if (_send_keepalive2)
+            {
+                utime_t t = _keepalive2_stamp;
+                _lock.unlock();
+                int rc = write_keepalive(MSGR_TAG_KEEPALIVE2, t);
+                _lock.lock();
+                if (0 > rc)
+                {
+                    fault();
+                    continue;
+                }
+                _send_keepalive2 = false;
+            }
             
             if (_send_keepalive_ack)
             {
                 utime_t t = _keepalive_ack_stamp;
                 _lock.unlock();
-                int rc = write_keepalive();
+                int rc = write_keepalive(MSGR_TAG_KEEPALIVE2_ACK, t);
                 _lock.lock();
                 if (0 > rc)
                 {
@@ -1392,18 +1561,20 @@ void Socket::writer()
                 _send_keepalive_ack = false;
             }
 
-            if (_in_seq > _in_seq_acked)
+            // 有消息要发送时确认随消息帧一起发送
+            uint64_t ack_seq = (_in_seq > _in_seq_acked) ? _in_seq : 0;
+            if (ack_seq && (_out_q.empty() || !can_piggyback_ack()))
             {
-                uint64_t send_seq = _in_seq;
                 _lock.unlock();
-                int rc = write_ack(send_seq);
+                int rc = write_ack(ack_seq);
                 _lock.lock();
                 if (0 > rc)
                 {
                     fault();
                     continue;
                 }
-                _in_seq_acked = send_seq;
+                _in_seq_acked = ack_seq;
+                ack_seq = 0;
             }
 
             Message* m = get_next_outgoing();
@@ -1434,11 +1605,25 @@ void Socket::writer()
                 buf.append(m->get_middle());
                 buf.append(m->get_data());
 
+                bool zerocopy = want_zerocopy(m);
+                uint32_t zc_seq = _zc_next;
+
                 _lock.unlock();
 
-                int rc = write_message(header, footer, buf);
+                int rc = write_message(header, footer, buf, zerocopy, ack_seq);
 
                 _lock.lock();
+                atomic_inc(&_msgr->_send_msgs);
+                if (0 <= rc && ack_seq > _in_seq_acked)
+                {
+                    _in_seq_acked = ack_seq;
+                }
+
+                if (zerocopy)
+                {
+                    hold_zerocopy(m, zc_seq);
+                }
+
                 if (0 > rc)
                 {
                     fault();
@@ -1448,6 +1633,14 @@ void Socket::writer()
             
             continue;
         }
+
+        // 有未到期的延迟确认时按到期时间等待
+        utime_t now = clock_now();
+        if (_state == SOCKET_OPEN && _in_seq > _in_seq_acked && now < _ack_deadline)
+        {
+            _cond.timed_wait(_lock, MAX((uint32_t)((_ack_deadline - now).to_msec()), 1u));
+            continue;
+        }
     
         _cond.wait(_lock);
     }
@@ -1462,9 +1655,9 @@ void Socket::unlock_maybe_reap()
     {
         shutdown_socket();
         _lock.unlock();
-        if (_delay_thread && _delay_thread->is_flushing())
+        if (_delay_queue && _msgr->_delayed_delivery.is_flushing(_delay_queue))
         {
-            _delay_thread->wait_for_flush();
+            _msgr->_delayed_delivery.wait_for_flush(_delay_queue);
         }
         _msgr->queue_reap(this);
     }
@@ -1474,106 +1667,558 @@ void Socket::unlock_maybe_reap()
     }
 }
 
-static void alloc_aligned_buffer(buffer& data, uint32_t len, uint32_t off)
+static void alloc_aligned_buffer(BufferPool* pool, buffer& data, uint32_t len, uint32_t off)
 {
     uint32_t left = len;
     if (off & ~PAGE_MASK)
     {
         uint32_t head = 0;
         head = MIN(PAGE_SIZE - (off & ~PAGE_MASK), left);
-        data.push_back(create(head));
+        data.push_back(pool->create(head));
         left -= head;
     }
     
     uint32_t middle = left & PAGE_MASK;
     if (0 < middle)
     {
-        data.push_back(create_page_aligned(middle));
+        data.push_back(pool->create_page_aligned(middle));
         left -= middle;
     }
     
     if (left)
     {
-        data.push_back(create(left));
+        data.push_back(pool->create(left));
     }
 }
 
-int Socket::read_message(Message** pm)
+// 变长整数编码,每字节低7位为数据,最高位表示后面还有字节
+static inline char* put_varint(char* p, uint64_t v)
 {
-    int ret = -1;
-  
-    msg_header header; 
-    msg_footer footer;
-    uint32_t header_crc = 0;
-
-    if (tcp_read((char*)&header, sizeof(header)) < 0)
-    {
-        return -1;
-    }
-    
-    if (_msgr->_crc_flag & MSG_CRC_HEADER)
+    while (0x80 <= v)
     {
-        header_crc = crc32c(0, (unsigned char *)&header, sizeof(header) - sizeof(header.crc));
+        *p++ = (char)(v | 0x80);
+        v >>= 7;
     }
 
-    if ((_msgr->_crc_flag & MSG_CRC_HEADER) && header_crc != header.crc)
+    *p++ = (char)v;
+
+    return p;
+}
+
+static inline bool get_varint(const char*& p, const char* end, uint64_t& v)
+{
+    v = 0;
+    for (int shift = 0; p < end && 64 > shift; shift += 7)
     {
-        return -1;
+        uint8_t c = *p++;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+        {
+            return true;
+        }
     }
 
-    buffer front, middle, data;
-    int front_len, middle_len;
-    uint32_t data_len, data_off;
-    int aborted;
-    Message* message;
-    utime_t recv_stamp = clock_now();
+    return false;
+}
 
-    if (_policy._throttler_messages)
+static inline char* put_le32(char* p, uint32_t v)
+{
+    le32 t;
+    t = v;
+    memcpy(p, &t, sizeof(t));
+
+    return p + sizeof(t);
+}
+
+static inline uint32_t get_le32(const char*& p)
+{
+    le32 t;
+    memcpy(&t, p, sizeof(t));
+    p += sizeof(t);
+
+    return t;
+}
+
+// v2帧中与连接状态无关的标志
+static uint8_t frame_flags(const msg_header& h, const msg_footer& f, int crc_flag)
+{
+    uint8_t flags = 0;
+    if (h.tid)
     {
-        _policy._throttler_messages->get();
+        flags |= MSG_FRAME_TID;
     }
 
-    uint64_t message_size = header.front_len + header.middle_len + header.data_len;
-    if (message_size)
+    if (h.middle_len)
     {
-        if (_policy._throttler_bytes)
-        {
-            _policy._throttler_bytes->get(message_size);
-        }
-        
-        _msgr->_dispatch_throttler.get(message_size);
+        flags |= MSG_FRAME_MIDDLE;
     }
 
-    utime_t throttle_stamp = clock_now();
-
-    front_len = header.front_len;
-    if (front_len)
+    if (h.data_len)
     {
-        ptr bp = create(front_len);
-        if (0 > tcp_read(bp.c_str(), front_len))
+        flags |= MSG_FRAME_DATA;
+        if (!(f.flags & MSG_FOOTER_NOCRC))
         {
-            goto out_dethrottle;
+            flags |= MSG_FRAME_DATA_CRC;
         }
-        
-        front.push_back(std::move(bp));
     }
 
-    middle_len = header.middle_len;
-    if (middle_len)
+    if (crc_flag & MSG_CRC_HEADER)
     {
-        ptr bp = create(middle_len);
-        if (0 > tcp_read(bp.c_str(), middle_len))
-        {
-            goto out_dethrottle;
-        }
-        
-        middle.push_back(std::move(bp));
+        flags |= MSG_FRAME_CRC;
     }
 
+    return flags;
+}
 
-    data_len = le32_to_cpu(header.data_len);
-    data_off = le32_to_cpu(header.data_off);
-    if (data_len)
+// v2帧尾部长度,由头部标志决定
+static uint32_t frame_tail_size(uint8_t flags)
+{
+    uint32_t len = 1;
+    if (flags & MSG_FRAME_CRC)
+    {
+        len += (flags & MSG_FRAME_MIDDLE) ? 8 : 4;
+    }
+
+    if (flags & MSG_FRAME_DATA_CRC)
+    {
+        len += 4;
+    }
+
+    return len;
+}
+
+void Socket::reset_frame_state(uint32_t protocol)
+{
+    _protocol = protocol;
+    _out_frame.reset();
+    _in_frame.reset();
+    _in_frame_ack = 0;
+}
+
+bool Socket::ack_due(const utime_t& now) const
+{
+    if (_in_seq <= _in_seq_acked)
+    {
+        return false;
+    }
+
+    return !_msgr->_ack_delay_ms || _in_seq - _in_seq_acked >= SM_ACK_WINDOW || now >= _ack_deadline;
+}
+
+uint32_t encode_frame_v2_head(frame_state& st, const msg_header& h, const msg_footer& f, int crc_flag, uint64_t ack, char* p)
+{
+    char* head = p;
+    uint8_t flags = frame_flags(h, f, crc_flag);
+    if (memcmp(&h.src, &st.last_src, sizeof(st.last_src)))
+    {
+        flags |= MSG_FRAME_SRC;
+        st.last_src = h.src;
+    }
+
+    if (ack)
+    {
+        flags |= MSG_FRAME_ACK;
+    }
+
+    *p++ = flags;
+
+    // 序号与上一个消息的差值,zigzag编码
+    int64_t delta = (int64_t)((uint64_t)h.seq - st.last_seq);
+    st.last_seq = h.seq;
+    p = put_varint(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+
+    if (flags & MSG_FRAME_TID)
+    {
+        p = put_varint(p, h.tid);
+    }
+
+    p = put_varint(p, h.type);
+    p = put_varint(p, h.priority);
+    p = put_varint(p, h.version);
+    p = put_varint(p, h.compat_version);
+    p = put_varint(p, h.front_len);
+
+    if (flags & MSG_FRAME_MIDDLE)
+    {
+        p = put_varint(p, h.middle_len);
+    }
+
+    if (flags & MSG_FRAME_DATA)
+    {
+        p = put_varint(p, h.data_len);
+        p = put_varint(p, h.data_off);
+    }
+
+    if (flags & MSG_FRAME_SRC)
+    {
+        *p++ = h.src.type;
+        p = put_varint(p, h.src.num);
+    }
+
+    // 确认序号与上一个帧携带的差值,zigzag编码
+    if (flags & MSG_FRAME_ACK)
+    {
+        int64_t ack_delta = (int64_t)(ack - st.last_ack);
+        st.last_ack = ack;
+        p = put_varint(p, ((uint64_t)ack_delta << 1) ^ (uint64_t)(ack_delta >> 63));
+    }
+
+    if (flags & MSG_FRAME_CRC)
+    {
+        p = put_le32(p, crc32c(0, (unsigned char*)head, p - head));
+    }
+
+    return p - head;
+}
+
+uint32_t Socket::encode_frame_head(const msg_header& h, const msg_footer& f, char* p, uint64_t ack)
+{
+    char* start = p;
+    *p++ = (char)MSGR_TAG_MSG;
+
+    if (MSGR_PROTOCOL_V2 != _protocol)
+    {
+        memcpy(p, &h, sizeof(h));
+        return 1 + sizeof(h);
+    }
+
+    // 第二个字节为头部长度
+    uint32_t len = encode_frame_v2_head(_out_frame, h, f, _msgr->_crc_flag, ack, p + 1);
+    *p = (char)len;
+
+    return p + 1 + len - start;
+}
+
+uint32_t Socket::encode_frame_tail(const msg_header& h, const msg_footer& f, char* p)
+{
+    if (MSGR_PROTOCOL_V2 != _protocol)
+    {
+        memcpy(p, &f, sizeof(f));
+        return sizeof(f);
+    }
+
+    char* start = p;
+    uint8_t flags = frame_flags(h, f, _msgr->_crc_flag);
+    *p++ = f.flags;
+
+    if (flags & MSG_FRAME_CRC)
+    {
+        p = put_le32(p, f.front_crc);
+        if (flags & MSG_FRAME_MIDDLE)
+        {
+            p = put_le32(p, f.middle_crc);
+        }
+    }
+
+    if (flags & MSG_FRAME_DATA_CRC)
+    {
+        p = put_le32(p, f.data_crc);
+    }
+
+    return p - start;
+}
+
+int decode_frame_v2_head(frame_state& st, const char* head, uint32_t len, int crc_flag, msg_header& h, uint8_t& flags, uint64_t& ack)
+{
+    if (0 == len)
+    {
+        return -1;
+    }
+
+    const char* p = head;
+    const char* end = head + len;
+    flags = *p++;
+
+    if (flags & MSG_FRAME_CRC)
+    {
+        if (len < 1 + sizeof(uint32_t))
+        {
+            return -1;
+        }
+
+        end -= sizeof(uint32_t);
+        const char* c = end;
+        if ((crc_flag & MSG_CRC_HEADER) && get_le32(c) != crc32c(0, (unsigned char*)head, end - head))
+        {
+            ERROR_LOG("frame head crc mismatch");
+            return -1;
+        }
+    }
+    else if (crc_flag & MSG_CRC_HEADER)
+    {
+        ERROR_LOG("frame head without crc");
+        return -1;
+    }
+
+    // 先在副本上解码,完整解出后才更新状态
+    frame_state next = st;
+    memset(&h, 0, sizeof(h));
+    ack = 0;
+
+    uint64_t v = 0;
+    if (!get_varint(p, end, v))
+    {
+        return -1;
+    }
+
+    next.last_seq += (uint64_t)((int64_t)(v >> 1) ^ -(int64_t)(v & 1));
+    h.seq = next.last_seq;
+
+    if ((flags & MSG_FRAME_TID) && !get_varint(p, end, v))
+    {
+        return -1;
+    }
+    h.tid = (flags & MSG_FRAME_TID) ? v : 0;
+
+    uint64_t type, prio, version, compat, front_len;
+    if (!get_varint(p, end, type) || !get_varint(p, end, prio) || !get_varint(p, end, version) ||
+        !get_varint(p, end, compat) || !get_varint(p, end, front_len))
+    {
+        return -1;
+    }
+
+    h.type = type;
+    h.priority = prio;
+    h.version = version;
+    h.compat_version = compat;
+    h.front_len = front_len;
+
+    if (flags & MSG_FRAME_MIDDLE)
+    {
+        if (!get_varint(p, end, v))
+        {
+            return -1;
+        }
+        h.middle_len = v;
+    }
+
+    if (flags & MSG_FRAME_DATA)
+    {
+        uint64_t off = 0;
+        if (!get_varint(p, end, v) || !get_varint(p, end, off))
+        {
+            return -1;
+        }
+        h.data_len = v;
+        h.data_off = off;
+    }
+
+    // 省略发送方时沿用上一个消息的
+    if (flags & MSG_FRAME_SRC)
+    {
+        if (p >= end)
+        {
+            return -1;
+        }
+
+        next.last_src.type = *p++;
+        if (!get_varint(p, end, v))
+        {
+            return -1;
+        }
+        next.last_src.num = v;
+    }
+    h.src = next.last_src;
+
+    if (flags & MSG_FRAME_ACK)
+    {
+        if (!get_varint(p, end, v))
+        {
+            return -1;
+        }
+
+        next.last_ack += (uint64_t)((int64_t)(v >> 1) ^ -(int64_t)(v & 1));
+        ack = next.last_ack;
+    }
+
+    if (p != end)
+    {
+        return -1;
+    }
+
+    st = next;
+
+    return 0;
+}
+
+int Socket::read_frame_head(msg_header& h, uint8_t& flags)
+{
+    uint8_t hlen = 0;
+    char head[SM_FRAME_HEAD_MAX];
+    if (0 > tcp_read((char*)&hlen, 1) || 0 == hlen || SM_FRAME_HEAD_MAX < hlen || 0 > tcp_read(head, hlen))
+    {
+        return -1;
+    }
+
+    uint64_t ack = 0;
+    if (0 > decode_frame_v2_head(_in_frame, head, hlen, _msgr->_crc_flag, h, flags, ack))
+    {
+        return -1;
+    }
+
+    if (flags & MSG_FRAME_ACK)
+    {
+        _in_frame_ack = ack;
+    }
+
+    return 0;
+}
+
+void Socket::decode_frame_tail(const char* p, uint8_t flags, msg_footer& f)
+{
+    memset(&f, 0, sizeof(f));
+    f.flags = *p++;
+
+    if (flags & MSG_FRAME_CRC)
+    {
+        f.front_crc = get_le32(p);
+        if (flags & MSG_FRAME_MIDDLE)
+        {
+            f.middle_crc = get_le32(p);
+        }
+    }
+
+    if (flags & MSG_FRAME_DATA_CRC)
+    {
+        f.data_crc = get_le32(p);
+    }
+}
+
+int Socket::read_message(Message** pm)
+{
+    int ret = -1;
+  
+    msg_header header; 
+    msg_footer footer;
+    uint32_t header_crc = 0;
+    uint8_t flags = 0;
+    // v1直接读入footer,v2读入frame_tail后解码
+    char frame_tail[SM_FRAME_TAIL_MAX];
+    char* tail = (char*)&footer;
+    uint32_t tail_len = sizeof(footer);
+
+    if (MSGR_PROTOCOL_V2 == _protocol)
+    {
+        if (0 > read_frame_head(header, flags))
+        {
+            return -1;
+        }
+
+        tail = frame_tail;
+        tail_len = frame_tail_size(flags);
+    }
+    else
+    {
+        if (tcp_read((char*)&header, sizeof(header)) < 0)
+        {
+            return -1;
+        }
+
+        if (_msgr->_crc_flag & MSG_CRC_HEADER)
+        {
+            header_crc = crc32c(0, (unsigned char *)&header, sizeof(header) - sizeof(header.crc));
+        }
+
+        if ((_msgr->_crc_flag & MSG_CRC_HEADER) && header_crc != header.crc)
+        {
+            return -1;
+        }
+    }
+
+    buffer front, middle, data;
+    int front_len, middle_len;
+    uint32_t data_len, data_off;
+    int aborted;
+    struct iovec iov[SM_RECV_IOV_MAX];
+    int iovcnt = 0;
+    bool rx_buffer = false;
+    Message* message;
+    utime_t recv_stamp = clock_now();
+
+    // 攒批中的消息占用的配额在转发后才归还,需要等待节流时先提交
+    if (_policy._throttler_messages && !_policy._throttler_messages->get_or_fail())
+    {
+        flush_fast_dispatch();
+        _policy._throttler_messages->get();
+    }
+
+    uint64_t message_size = header.front_len + header.middle_len + header.data_len;
+    if (message_size)
+    {
+        if (_policy._throttler_bytes && !_policy._throttler_bytes->get_or_fail(message_size))
+        {
+            flush_fast_dispatch();
+            _policy._throttler_bytes->get(message_size);
+        }
+
+        if (!_in_q->dispatch_throttle_get_or_fail(_connection_state, message_size))
+        {
+            flush_fast_dispatch();
+            _in_q->dispatch_throttle_get(_connection_state, message_size);
+        }
+    }
+
+    utime_t throttle_stamp = clock_now();
+
+    adjust_prefetch(message_size);
+
+    front_len = header.front_len;
+    middle_len = header.middle_len;
+    data_len = le32_to_cpu(header.data_len);
+    data_off = le32_to_cpu(header.data_off);
+
+    // front和middle共用一次分配
+    if (front_len + middle_len)
+    {
+        ptr bp = _msgr->_recv_pool->create(front_len + middle_len);
+        iov[iovcnt].iov_base = bp.c_str();
+        iov[iovcnt++].iov_len = front_len + middle_len;
+
+        if (front_len)
+        {
+            front.push_back(ptr(bp, 0, front_len));
+        }
+
+        if (middle_len)
+        {
+            middle.push_back(ptr(bp, front_len, middle_len));
+        }
+    }
+
+    if (data_len)
+    {
+        _connection_state->_lock.lock();
+        rx_buffer = _connection_state->_rx_buffers.count(header.tid);
+        _connection_state->_lock.unlock();
+    }
+
+    // 没有注册接收缓冲时,front、middle、data及footer通过分散读直接读入最终的缓冲
+    if (!rx_buffer)
+    {
+        if (data_len)
+        {
+            alloc_aligned_buffer(_msgr->_recv_pool, data, data_len, data_off);
+            for (std::list<ptr>::const_iterator it = data.ptrs().begin(); it != data.ptrs().end(); ++it)
+            {
+                iov[iovcnt].iov_base = (char*)it->c_str();
+                iov[iovcnt++].iov_len = it->length();
+            }
+        }
+
+        iov[iovcnt].iov_base = tail;
+        iov[iovcnt++].iov_len = tail_len;
+
+        if (0 > tcp_readv(iov, iovcnt))
+        {
+            goto out_dethrottle;
+        }
+    }
+    else if (iovcnt && 0 > tcp_readv(iov, iovcnt))
+    {
+        goto out_dethrottle;
+    }
+
+    if (rx_buffer)
     {
         uint32_t offset = 0;
         uint32_t left = data_len;
@@ -1610,7 +2255,7 @@ int Socket::read_message(Message** pm)
             {
                 if (!newbuf.length())
                 {
-                    alloc_aligned_buffer(newbuf, data_len, data_off);
+                    alloc_aligned_buffer(_msgr->_recv_pool, newbuf, data_len, data_off);
                     blp = newbuf.begin();
                     blp.advance(offset);
                 }
@@ -1636,10 +2281,15 @@ int Socket::read_message(Message** pm)
         }
     }
 
-    if (0 > tcp_read((char*)&footer, sizeof(footer)))
+    if (rx_buffer && 0 > tcp_read(tail, tail_len))
     {
         goto out_dethrottle;
     }
+
+    if (MSGR_PROTOCOL_V2 == _protocol)
+    {
+        decode_frame_tail(frame_tail, flags, footer);
+    }
   
     aborted = (footer.flags & MSG_FOOTER_COMPLETE) == 0;
 
@@ -1682,7 +2332,7 @@ out_dethrottle:
             _policy._throttler_bytes->put(message_size);
         }
 
-        _in_q->dispatch_throttle_release(message_size);
+        _in_q->dispatch_throttle_release(_connection_state, message_size);
     }
     
     return ret;
@@ -1720,131 +2370,445 @@ void Socket::restore_signal()
             TEMP_FAILURE_RETRY(sigtimedwait(&sigpipe_mask, NULL, &nowait));
         }
 
-        if (sigpipe_unblock)
-        {
-            pthread_sigmask(SIG_UNBLOCK, &sigpipe_mask, NULL);
-        }
+        if (sigpipe_unblock)
+        {
+            pthread_sigmask(SIG_UNBLOCK, &sigpipe_mask, NULL);
+        }
+    }
+#endif
+}
+
+int Socket::do_sendmsg(struct msghdr* msg, uint32_t len, bool more, bool zerocopy)
+{
+    suppress_signal();
+    while (0 < len)
+    {
+        int r;
+        int flags = (more ? MSG_MORE : 0);
+#if defined(MSG_NOSIGNAL)
+        flags |= MSG_NOSIGNAL;
+#endif
+#if defined(HAVE_MSG_ZEROCOPY)
+        if (zerocopy)
+        {
+            flags |= MSG_ZEROCOPY;
+        }
+#endif
+        r = ::sendmsg(_fd, msg, flags);
+        atomic_inc(&_msgr->_send_syscalls);
+        if (0 == r)
+        {
+        }
+        
+        if (0 > r)
+        {
+            // 锁定内存超过optmem限制时退化为普通发送
+            if (zerocopy && ENOBUFS == errno)
+            {
+                zerocopy = false;
+                continue;
+            }
+
+            r = -errno; 
+            restore_signal();
+            return r;
+        }
+
+        if (zerocopy)
+        {
+            _zc_next++;
+            atomic_inc(&_msgr->_zerocopy_sends);
+        }
+        
+        if (_state == SOCKET_CLOSED)
+        {
+            restore_signal();
+            return -EINTR;
+        }
+
+        len -= r;
+        if (0 == len)
+        {
+            break;
+        }
+    
+        while (0 < r)
+        {
+            if (msg->msg_iov[0].iov_len <= (size_t)r)
+            {
+                r -= msg->msg_iov[0].iov_len;
+                msg->msg_iov++;
+                msg->msg_iovlen--;
+            }
+            else
+            {
+                msg->msg_iov[0].iov_base = (char *)msg->msg_iov[0].iov_base + r;
+                msg->msg_iov[0].iov_len -= r;
+                break;
+            }
+        }
+    }
+    
+    restore_signal();
+    return 0;
+}
+
+int Socket::write_ack(uint64_t seq)
+{
+    char c = MSGR_TAG_ACK;
+    le64 s;
+    s = seq;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    struct iovec msgvec[2];
+    msgvec[0].iov_base = &c;
+    msgvec[0].iov_len = 1;
+    msgvec[1].iov_base = &s;
+    msgvec[1].iov_len = sizeof(s);
+    msg.msg_iov = msgvec;
+    msg.msg_iovlen = 2;
+  
+    if (0 > do_sendmsg(&msg, 1 + sizeof(s), true))
+    {
+        return -1;
+    }
+    
+    return 0;
+}
+
+int Socket::write_keepalive()
+{
+    char c = MSGR_TAG_KEEPALIVE;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    struct iovec msgvec[2];
+    msgvec[0].iov_base = &c;
+    msgvec[0].iov_len = 1;
+    msg.msg_iov = msgvec;
+    msg.msg_iovlen = 1;
+  
+    if (0 > do_sendmsg(&msg, 1))
+    {
+        return -1;
+    }
+    
+    return 0;
+}
+
+int Socket::write_keepalive(char tag, const utime_t& t)
+{
+    struct timespec ts;
+    t.to_timespec(&ts);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    struct iovec msgvec[2];
+    msgvec[0].iov_base = &tag;
+    msgvec[0].iov_len = 1;
+    msgvec[1].iov_base = &ts;
+    msgvec[1].iov_len = sizeof(ts);
+    msg.msg_iov = msgvec;
+    msg.msg_iovlen = 2;
+
+    if (0 > do_sendmsg(&msg, 1 + sizeof(ts)))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int Socket::write_batch()
+{
+    buffer bl;
+
+    if (_send_keepalive)
+    {
+        bl.append((char)MSGR_TAG_KEEPALIVE);
+        _send_keepalive = false;
+    }
+
+    if (_send_keepalive2)
+    {
+        struct timespec ts;
+        _keepalive2_stamp.to_timespec(&ts);
+        bl.append((char)MSGR_TAG_KEEPALIVE2);
+        bl.append((char*)&ts, sizeof(ts));
+        _send_keepalive2 = false;
+    }
+
+    if (_send_keepalive_ack)
+    {
+        struct timespec ts;
+        _keepalive_ack_stamp.to_timespec(&ts);
+        bl.append((char)MSGR_TAG_KEEPALIVE2_ACK);
+        bl.append((char*)&ts, sizeof(ts));
+        _send_keepalive_ack = false;
+    }
+
+    // v2时确认随本批第一个消息的帧发送,没有消息或v1时单独发送
+    uint64_t ack_seq = (_in_seq > _in_seq_acked) ? _in_seq : 0;
+    bool ack_placed = ack_seq && !(can_piggyback_ack() && !_out_q.empty());
+    if (ack_placed)
+    {
+        le64 s;
+        s = ack_seq;
+        bl.append((char)MSGR_TAG_ACK);
+        bl.append((char*)&s, sizeof(s));
+    }
+
+    // 按字节数及iovec数限制单批大小,每个消息的头尾会合并到相邻的ptr中
+    std::list<Message*> msgs;
+    // 需要零拷贝发送的大消息,单独发送且作为本批的最后一个
+    Message* zc_msg = NULL;
+    while (bl.length() < SM_BATCH_MAX_BYTES && (int)bl.get_num_buffers() < SM_IOV_MAX - 2)
+    {
+        Message* m = get_next_outgoing();
+        if (!m)
+        {
+            break;
+        }
+
+        m->set_seq(++_out_seq);
+        if (!_policy._lossy)
+        {
+            _sent.push_back(m);
+            m->get();
+        }
+
+        m->set_connection(static_cast<Connection*>(_connection_state->get()));
+
+        m->encode(_msgr->_crc_flag);
+
+        msgs.push_back(m);
+
+        if (want_zerocopy(m))
+        {
+            zc_msg = m;
+            break;
+        }
+
+        const msg_header& header = m->get_header();
+        const msg_footer& footer = m->get_footer();
+
+        char frame[SM_FRAME_HEAD_MAX];
+        bl.append(frame, encode_frame_head(header, footer, frame, ack_placed ? 0 : ack_seq));
+        ack_placed = true;
+        bl.append(m->get_payload());
+        bl.append(m->get_middle());
+        bl.append(m->get_data());
+        bl.append(frame, encode_frame_tail(header, footer, frame));
+    }
+
+    // 还有待发送的消息时,提示内核后面还有数据
+    bool more = !_out_q.empty();
+    uint32_t zc_seq = _zc_next;
+    buffer zc_buf;
+    if (zc_msg)
+    {
+        zc_buf = zc_msg->get_payload();
+        zc_buf.append(zc_msg->get_middle());
+        zc_buf.append(zc_msg->get_data());
+    }
+
+    _lock.unlock();
+
+    int rc = write_buffer(bl, more || zc_msg);
+    if (0 == rc && zc_msg)
+    {
+        rc = write_message(zc_msg->get_header(), zc_msg->get_footer(), zc_buf, true, ack_placed ? 0 : ack_seq);
+    }
+
+    _lock.lock();
+
+    atomic_add(msgs.size(), &_msgr->_send_msgs);
+
+    if (zc_msg)
+    {
+        hold_zerocopy(zc_msg, zc_seq);
+    }
+
+    while (!msgs.empty())
+    {
+        msgs.front()->dec();
+        msgs.pop_front();
+    }
+
+    if (0 > rc)
+    {
+        return rc;
+    }
+
+    if (ack_seq > _in_seq_acked)
+    {
+        _in_seq_acked = ack_seq;
+    }
+
+    return 0;
+}
+
+int Socket::write_buffer(const buffer& bl, bool more, bool zerocopy)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = _msgvec;
+    uint32_t msglen = 0;
+
+    for (std::list<ptr>::const_iterator it = bl.ptrs().begin(); it != bl.ptrs().end(); ++it)
+    {
+        if (0 == it->length())
+        {
+            continue;
+        }
+
+        if ((int)msg.msg_iovlen >= SM_IOV_MAX)
+        {
+            if (do_sendmsg(&msg, msglen, true, zerocopy))
+            {
+                return -1;
+            }
+
+            msg.msg_iov = _msgvec;
+            msg.msg_iovlen = 0;
+            msglen = 0;
+        }
+
+        _msgvec[msg.msg_iovlen].iov_base = (void*)it->c_str();
+        _msgvec[msg.msg_iovlen].iov_len = it->length();
+        msglen += it->length();
+        msg.msg_iovlen++;
+    }
+
+    if (0 < msglen && do_sendmsg(&msg, msglen, more, zerocopy))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+bool Socket::want_zerocopy(Message* m)
+{
+    return _zerocopy && m->get_payload().length() + m->get_middle().length() + m->get_data().length() >= _msgr->_zerocopy_threshold;
+}
+
+void Socket::hold_zerocopy(Message* m, uint32_t first_seq)
+{
+    // 没有成功的零拷贝发送,或已经全部完成
+    if (_zc_next == first_seq || (int32_t)(_zc_next - _zc_done) <= 0)
+    {
+        return;
     }
-#endif
+
+    m->get();
+    _zc_pending.push_back(std::make_pair(_zc_next - 1, m));
 }
 
-int Socket::do_sendmsg(struct msghdr* msg, uint32_t len, bool more)
+void Socket::reap_zerocopy()
 {
-    suppress_signal();
-    while (0 < len)
+#if defined(HAVE_MSG_ZEROCOPY)
+    Mutex::Locker locker(_lock);
+
+    while (true)
     {
-        int r;
-#if defined(MSG_NOSIGNAL)
-        r = ::sendmsg(_fd, msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
-#else
-        r = ::sendmsg(_fd, msg, (more ? MSG_MORE : 0));
-#endif
-        if (0 == r)
-        {
-        }
-        
-        if (0 > r)
-        {
-            r = -errno; 
-            restore_signal();
-            return r;
-        }
-        
-        if (_state == SOCKET_CLOSED)
-        {
-            restore_signal();
-            return -EINTR;
-        }
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
 
-        len -= r;
-        if (0 == len)
+        if (0 > ::recvmsg(_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT))
         {
             break;
         }
-    
-        while (0 < r)
+
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
         {
-            if (msg->msg_iov[0].iov_len <= (size_t)r)
+            if (!(SOL_IP == cm->cmsg_level && IP_RECVERR == cm->cmsg_type) &&
+                !(SOL_IPV6 == cm->cmsg_level && IPV6_RECVERR == cm->cmsg_type))
             {
-                r -= msg->msg_iov[0].iov_len;
-                msg->msg_iov++;
-                msg->msg_iovlen--;
+                continue;
             }
-            else
+
+            struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (0 != err->ee_errno || SO_EE_ORIGIN_ZEROCOPY != err->ee_origin)
             {
-                msg->msg_iov[0].iov_base = (char *)msg->msg_iov[0].iov_base + r;
-                msg->msg_iov[0].iov_len -= r;
-                break;
+                continue;
+            }
+
+            // 内核没能避免拷贝,例如发往本机的连接
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                atomic_inc(&_msgr->_zerocopy_copied);
+            }
+
+            // 通知中的[ee_info, ee_data]区间已完成
+            uint32_t& hi = _zc_ranges[err->ee_info];
+            if ((int32_t)(err->ee_data + 1 - hi) > 0)
+            {
+                hi = err->ee_data + 1;
             }
         }
     }
-    
-    restore_signal();
-    return 0;
-}
-
-int Socket::write_ack(uint64_t seq)
-{
-    char c = MSGR_TAG_ACK;
-    le64 s;
-    s = seq;
 
-    struct msghdr msg;
-    memset(&msg, 0, sizeof(msg));
-    struct iovec msgvec[2];
-    msgvec[0].iov_base = &c;
-    msgvec[0].iov_len = 1;
-    msgvec[1].iov_base = &s;
-    msgvec[1].iov_len = sizeof(s);
-    msg.msg_iov = msgvec;
-    msg.msg_iovlen = 2;
-  
-    if (0 > do_sendmsg(&msg, 1 + sizeof(s), true))
+    while (!_zc_ranges.empty() && (int32_t)(_zc_ranges.begin()->first - _zc_done) <= 0)
     {
-        return -1;
+        if ((int32_t)(_zc_ranges.begin()->second - _zc_done) > 0)
+        {
+            _zc_done = _zc_ranges.begin()->second;
+        }
+
+        _zc_ranges.erase(_zc_ranges.begin());
     }
-    
-    return 0;
+
+    release_zerocopy(false);
+#endif
 }
 
-int Socket::write_keepalive()
+void Socket::release_zerocopy(bool all)
 {
-    char c = MSGR_TAG_KEEPALIVE;
-
-    struct msghdr msg;
-    memset(&msg, 0, sizeof(msg));
-    struct iovec msgvec[2];
-    msgvec[0].iov_base = &c;
-    msgvec[0].iov_len = 1;
-    msg.msg_iov = msgvec;
-    msg.msg_iovlen = 1;
-  
-    if (0 > do_sendmsg(&msg, 1))
+    while (!_zc_pending.empty() && (all || (int32_t)(_zc_pending.front().first - _zc_done) < 0))
     {
-        return -1;
+        _zc_pending.front().second->dec();
+        _zc_pending.pop_front();
     }
-    
-    return 0;
 }
 
-int Socket::write_message(const msg_header& header, const msg_footer& footer, buffer& buf)
+int Socket::write_message(const msg_header& header, const msg_footer& footer, buffer& buf, bool zerocopy, uint64_t ack)
 {
     int ret = 0;
+    char head_frame[SM_FRAME_HEAD_MAX];
+    char tail_frame[SM_FRAME_TAIL_MAX];
+    uint32_t head_len = encode_frame_head(header, footer, head_frame, ack);
+    uint32_t tail_len = encode_frame_tail(header, footer, tail_frame);
+
+    if (zerocopy)
+    {
+        // 头尾可能在发送完成前被修改,拷贝发送
+        buffer head;
+        head.append(head_frame, head_len);
+
+        buffer tail;
+        tail.append(tail_frame, tail_len);
+
+        if (write_buffer(head, true) || write_buffer(buf, true, true) || write_buffer(tail, false))
+        {
+            return -1;
+        }
+
+        return 0;
+    }
     
     struct msghdr msg;
     memset(&msg, 0, sizeof(msg));
     msg.msg_iov = _msgvec;
     int msglen = 0;
   
-    char tag = MSGR_TAG_MSG;
-    _msgvec[msg.msg_iovlen].iov_base = &tag;
-    _msgvec[msg.msg_iovlen].iov_len = 1;
-    msglen++;
-    msg.msg_iovlen++;
-
-    _msgvec[msg.msg_iovlen].iov_base = (char*)&header;
-    _msgvec[msg.msg_iovlen].iov_len = sizeof(header);
-    msglen += sizeof(header);
+    _msgvec[msg.msg_iovlen].iov_base = head_frame;
+    _msgvec[msg.msg_iovlen].iov_len = head_len;
+    msglen += head_len;
     msg.msg_iovlen++;
 
     std::list<ptr>::const_iterator it = buf.ptrs().begin();
@@ -1893,9 +2857,9 @@ int Socket::write_message(const msg_header& header, const msg_footer& footer, bu
         }
     }
 
-    _msgvec[msg.msg_iovlen].iov_base = (void*)&footer;
-    _msgvec[msg.msg_iovlen].iov_len = sizeof(footer);
-    msglen += sizeof(footer);
+    _msgvec[msg.msg_iovlen].iov_base = tail_frame;
+    _msgvec[msg.msg_iovlen].iov_len = tail_len;
+    msglen += tail_len;
     msg.msg_iovlen++;
 
     if (do_sendmsg(&msg, msglen))
@@ -1961,6 +2925,9 @@ int Socket::tcp_read_wait()
         return 0;
     }
 
+    // 即将阻塞,先提交攒批的消息
+    flush_fast_dispatch();
+
     int r = poll(&pfd, 1, _msgr->_timeout);
     if (0 > r)
     {
@@ -1972,6 +2939,22 @@ int Socket::tcp_read_wait()
         return -EAGAIN;
     }
 
+    // 零拷贝发送完成的通知位于错误队列,会以POLLERR唤醒
+    if (_zerocopy && (pfd.revents & POLLERR) && !(pfd.revents & (POLLHUP | POLLNVAL)))
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (0 == ::getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len) && 0 == err)
+        {
+            reap_zerocopy();
+            pfd.revents &= ~POLLERR;
+            if (!(pfd.revents & POLLIN))
+            {
+                return tcp_read_wait();
+            }
+        }
+    }
+
     evmask = POLLERR | POLLHUP | POLLNVAL;
 #if defined(__linux__)
     evmask |= POLLRDHUP;
@@ -1989,6 +2972,88 @@ int Socket::tcp_read_wait()
     return 0;
 }
 
+int Socket::tcp_readv(struct iovec* iov, int cnt)
+{
+    if (0 > _fd)
+    {
+        return -EINVAL;
+    }
+
+    // 先取走预读缓冲中已有的数据
+    while (0 < cnt && has_pending_data())
+    {
+        size_t n = MIN(_recv_len - _recv_ofs, iov->iov_len);
+        memcpy(iov->iov_base, _recv_buf + _recv_ofs, n);
+        _recv_ofs += n;
+        iov->iov_base = (char*)iov->iov_base + n;
+        iov->iov_len -= n;
+        if (0 == iov->iov_len)
+        {
+            iov++;
+            cnt--;
+        }
+    }
+
+    struct iovec vec[SM_RECV_IOV_MAX];
+    while (0 < cnt)
+    {
+        if (0 > tcp_read_wait())
+        {
+            return -1;
+        }
+
+        // 预读缓冲已取空,附加在末尾接收下一个消息的数据
+        recv_reset();
+        memcpy(vec, iov, cnt * sizeof(struct iovec));
+        vec[cnt].iov_base = _recv_buf;
+        vec[cnt].iov_len = _recv_max_prefetch;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vec;
+        msg.msg_iovlen = cnt + 1;
+
+        ssize_t got = ::recvmsg(_fd, &msg, MSG_DONTWAIT);
+        if (0 > got)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+
+            return -1;
+        }
+
+        if (0 == got)
+        {
+            return -1;
+        }
+
+        while (0 < cnt && 0 < got)
+        {
+            size_t n = MIN((size_t)got, iov->iov_len);
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+            got -= n;
+            if (0 == iov->iov_len)
+            {
+                iov++;
+                cnt--;
+            }
+        }
+
+        _recv_len = got;
+    }
+
+    return 0;
+}
+
+void Socket::adjust_prefetch(uint64_t msg_size)
+{
+    _recv_msg_avg = (_recv_msg_avg * 7 + msg_size) / 8;
+    _recv_max_prefetch = (_recv_msg_avg > IO_BUFFER_MAX / 2) ? SM_RECV_MIN_PREFETCH : IO_BUFFER_MAX;
+}
+
 ssize_t Socket::do_recv(char* buf, size_t len, int flags)
 {
 again:
@@ -2129,90 +3194,212 @@ int Socket::tcp_write(const char* buf, uint32_t len)
     return 0;
 }
 
-void Socket::DelayedDelivery::discard()
+DelayedDelivery::Queue* DelayedDelivery::create_queue(Socket* s)
 {
-    Mutex::Locker locker(_delay_lock);
-    while (!_delay_queue.empty())
+    Mutex::Locker locker(_lock);
+    if (!_started)
     {
-        Message* m = _delay_queue.front().second;
-        _socket->_in_q->dispatch_throttle_release(m->get_dispatch_throttle_size());
-        m->dec();
-        _delay_queue.pop_front();
+        _started = true;
+        _stop = false;
+        create();
+    }
+
+    return new Queue(s);
+}
+
+void DelayedDelivery::remove_queue(Queue* q)
+{
+    Mutex::Locker locker(_lock);
+    q->_stopped = true;
+    while (q->_active)
+    {
+        _cond.wait(_lock);
+    }
+
+    unschedule(q);
+    discard_messages(q);
+    delete q;
+}
+
+void DelayedDelivery::queue(Queue* q, const utime_t& release, Message* m)
+{
+    Mutex::Locker locker(_lock);
+    q->_messages.push_back(std::make_pair(release, m));
+    if (1 == q->_messages.size())
+    {
+        schedule(q);
+    }
+}
+
+void DelayedDelivery::discard(Queue* q)
+{
+    Mutex::Locker locker(_lock);
+    unschedule(q);
+    discard_messages(q);
+}
+
+void DelayedDelivery::flush(Queue* q)
+{
+    Mutex::Locker locker(_lock);
+    q->_flush_count = q->_messages.size();
+    schedule(q);
+}
+
+bool DelayedDelivery::is_flushing(Queue* q)
+{
+    Mutex::Locker locker(_lock);
+    return q->_flush_count > 0 || q->_active;
+}
+
+void DelayedDelivery::wait_for_flush(Queue* q)
+{
+    Mutex::Locker locker(_lock);
+    while (q->_flush_count > 0 || q->_active)
+    {
+        _cond.wait(_lock);
     }
 }
 
-void Socket::DelayedDelivery::flush()
+void DelayedDelivery::steal_for_socket(Queue* q, Socket* s)
 {
-    Mutex::Locker locker(_delay_lock);
-    _flush_count = _delay_queue.size();
-    _delay_cond.signal();
+    Mutex::Locker locker(_lock);
+    q->_socket = s;
+    q->_stop_fast_dispatching = false;
 }
 
-void Socket::DelayedDelivery::entry()
+void DelayedDelivery::stop_fast_dispatching(Queue* q)
 {
-    Mutex::Locker locker(_delay_lock);
+    Mutex::Locker locker(_lock);
+    q->_stop_fast_dispatching = true;
+    while (q->_active)
+    {
+        _cond.wait(_lock);
+    }
+}
+
+void DelayedDelivery::shutdown()
+{
+    _lock.lock();
+    if (!_started)
+    {
+        _lock.unlock();
+        return;
+    }
+
+    _stop = true;
+    _cond.broadcast();
+    _lock.unlock();
+
+    join();
+
+    Mutex::Locker locker(_lock);
+    _started = false;
+}
+
+void DelayedDelivery::schedule(Queue* q)
+{
+    unschedule(q);
+    if (q->_messages.empty() || q->_stopped || q->_active)
+    {
+        return;
+    }
+
+    // 需要立即投递的队列排在最前面
+    utime_t when = q->_flush_count ? utime_t() : q->_messages.front().first;
+    q->_sched = _schedule.insert(std::make_pair(when, q));
+    q->_scheduled = true;
+    if (q->_sched == _schedule.begin())
+    {
+        _cond.broadcast();
+    }
+}
+
+void DelayedDelivery::unschedule(Queue* q)
+{
+    if (q->_scheduled)
+    {
+        _schedule.erase(q->_sched);
+        q->_scheduled = false;
+    }
+}
+
+void DelayedDelivery::discard_messages(Queue* q)
+{
+    while (!q->_messages.empty())
+    {
+        Message* m = q->_messages.front().second;
+        q->_socket->_in_q->dispatch_throttle_release(m->get_connection(), m->get_dispatch_throttle_size());
+        m->dec();
+        q->_messages.pop_front();
+    }
+
+    q->_flush_count = 0;
+    _cond.broadcast();
+}
+
+void DelayedDelivery::entry()
+{
+    Mutex::Locker locker(_lock);
 
-    while (!_stop_delayed_delivery)
+    while (!_stop)
     {
-        if (_delay_queue.empty())
+        if (_schedule.empty())
         {
-            _delay_cond.wait(_delay_lock);
+            _cond.wait(_lock);
             continue;
         }
-        
-        utime_t release = _delay_queue.front().first;
-        Message* m = _delay_queue.front().second;
-        // config
-        // 配置延迟发送的消息类型
-        // 如果还没有到发送时间则线程挂起一段时间
-        std::string delay_msg_type = "";
-        if (!_flush_count && (release > clock_now() && (delay_msg_type.empty() || m->get_type_name() == delay_msg_type)))
-        {
-            _delay_cond.timed_wait(_delay_lock, release.to_msec());
+
+        // 如果还没有到投递时间则线程挂起一段时间
+        utime_t release = _schedule.begin()->first;
+        utime_t now = clock_now();
+        if (release > now)
+        {
+            _cond.timed_wait(_lock, MAX((release - now).to_msec(), (uint64_t)1));
             continue;
         }
-        
-        _delay_queue.pop_front();
-        
-        if (0 < _flush_count)
+
+        // 投递期间队列不在调度表中,同一连接的消息按顺序投递
+        Queue* q = _schedule.begin()->second;
+        unschedule(q);
+
+        Message* m = q->_messages.front().second;
+        q->_messages.pop_front();
+        if (0 < q->_flush_count)
         {
-            --_flush_count;
-            _active_flush = true;
+            --q->_flush_count;
         }
-        
-        if (_socket->_in_q->can_fast_dispatch(m))
+
+        q->_active = true;
+        Socket* s = q->_socket;
+        if (s->_in_q->can_fast_dispatch(m))
         {
-            if (!_stop_fast_dispatching_flag)
+            if (!q->_stop_fast_dispatching && s->_in_q->has_fast_threads())
             {
-                _delay_dispatching = true;
-                _delay_lock.unlock();
-                _socket->_in_q->fast_dispatch(m);
-                _delay_lock.lock();
-                _delay_dispatching = false;
-                if (_stop_fast_dispatching_flag)
-                {
-                    // 唤醒其他挂起的线程
-                    _delay_cond.signal();
-                    _delay_lock.unlock();
-                    _delay_lock.lock();
-                }
+                // 交给该连接的快速转发线程,不占用调度线程
+                s->_in_q->queue_fast_dispatch(m, s->_conn_id);
+            }
+            else if (!q->_stop_fast_dispatching)
+            {
+                _lock.unlock();
+                s->_in_q->fast_dispatch(m);
+                _lock.lock();
+            }
+            else
+            {
+                s->_in_q->dispatch_throttle_release(m->get_connection(), m->get_dispatch_throttle_size());
+                m->dec();
             }
         }
         else
         {
-            _socket->_in_q->enqueue(m, m->get_priority(), _socket->_conn_id);
+            s->_in_q->enqueue(m, m->get_priority(), s->_conn_id);
         }
-        
-        _active_flush = false;
-    }
-}
 
-void Socket::DelayedDelivery::stop_fast_dispatching()
-{
-    Mutex::Locker locker(_delay_lock);
-    _stop_fast_dispatching_flag = true;
-    while (_delay_dispatching)
-        _delay_cond.wait(_delay_lock);
+        q->_active = false;
+        // 唤醒等待投递完成的线程
+        _cond.broadcast();
+        schedule(q);
+    }
 }
 
 // SYS_NS_END
@@ -4,9 +4,9 @@ SpinLock::SpinLock() throw (SysCallException)
 {
     int r = 0;
 #ifdef HAVE_PTHREAD_SPINLOCK
-    r = pthread_spin_init(_lock, PTHREAD_PROCESS_PRIVATE);
-else
-    r = pthread_mutex_init(_lock, NULL);
+    r = pthread_spin_init(&_lock, PTHREAD_PROCESS_PRIVATE);
+#else
+    r = pthread_mutex_init(&_lock, NULL);
 #endif
 
     if (0 != r) 
@@ -19,9 +19,9 @@ else
 SpinLock::~SpinLock() throw ()
 {
 #ifdef HAVE_PTHREAD_SPINLOCK
-    pthread_spin_destroy(_lock);
-else
-    pthread_mutex_destroy(_lock);
+    pthread_spin_destroy(&_lock);
+#else
+    pthread_mutex_destroy(&_lock);
 #endif
 }
 
@@ -29,9 +29,9 @@ void SpinLock::lock() const throw (SysCallException)
 {
     int r = 0;
 #ifdef HAVE_PTHREAD_SPINLOCK
-    r = pthread_spin_lock(_lock);
-else
-    r = pthread_mutex_lock(_lock);
+    r = pthread_spin_lock(&_lock);
+#else
+    r = pthread_mutex_lock(&_lock);
 #endif
 
     if (0 != r) 
@@ -45,9 +45,9 @@ void SpinLock::unlock() const throw (SysCallException)
 {
     int r = 0;
 #ifdef HAVE_PTHREAD_SPINLOCK
-    r = pthread_spin_unlock(_lock);
-else
-    r = pthread_mutex_unlock(_lock);
+    r = pthread_spin_unlock(&_lock);
+#else
+    r = pthread_mutex_unlock(&_lock);
 #endif
 
     if (0 != r) 
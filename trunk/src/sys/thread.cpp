@@ -6,7 +6,7 @@
 
 Thread::Thread() throw (Exception, SysCallException)
     // 创建一个递归锁
-    : _lock(true), _stop(false), _state(state_sleeping), _stack_size(0)
+    : _lock(true), _stop(false), _state(state_sleeping), _thread(0), _stack_size(0)
 {
     int r = pthread_attr_init(&_attr);
     if (0 != r)